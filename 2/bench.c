@@ -0,0 +1,218 @@
+/*
+ *File: bench.c
+ *Compares the two ways of counting words with several threads:
+ *  shared  every thread increments one sharded ConcurrentHashTable
+ *  merge   every thread fills its own HashTable, which are then merged
+ *The input file is read into memory and split into one chunk per thread at
+ *word boundaries, so only tokenizing and counting are timed. For every thread
+ *count the wall time, the peak tracked memory and the number of distinct words
+ *are printed.
+ *
+ *usage: bench file [threads ...] (8, 16 and 32 threads by default)
+ */
+
+#include "counter.h"
+#include "fw.h"
+#include "hash.h"
+#include "memory.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define BYTES_PER_MEGABYTE (1024.0 * 1024.0)
+
+/* One chunk of the input, counted by one thread */
+typedef struct {
+  const char *buffer;
+  size_t length;
+  Counter *counter;
+} Chunk;
+
+char *read_whole_file(char *path, size_t *length) {
+  FILE *file = fopen(path, "rb");
+  char *buffer;
+  long size;
+
+  if (file == NULL || fseek(file, 0, SEEK_END) == -1 ||
+      (size = ftell(file)) == -1 || fseek(file, 0, SEEK_SET) == -1) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  if (!(buffer = (char *)malloc(size > 0 ? size : 1))) {
+    perror("failed malloc when reading input");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fread(buffer, 1, size, file) != (size_t)size) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  fclose(file);
+  *length = size;
+  return buffer;
+}
+
+double now(void) {
+  struct timeval time;
+
+  gettimeofday(&time, NULL);
+  return time.tv_sec + time.tv_usec / 1e6;
+}
+
+void split_chunks(const char *buffer, size_t length, Chunk *chunks,
+                  int num_chunks) {
+  /*Splits the buffer into chunks of about the same size, never inside a word */
+  size_t start = 0;
+  size_t end;
+  int i;
+
+  for (i = 0; i < num_chunks; i++) {
+    end = i == num_chunks - 1 ? length : length / num_chunks * (i + 1);
+    if (end < start) {
+      end = start;
+    }
+
+    while (end < length && isalpha((unsigned char)buffer[end])) {
+      end++;
+    }
+
+    chunks[i].buffer = buffer + start;
+    chunks[i].length = end - start;
+    start = end;
+  }
+}
+
+void *count_chunk(void *arg) {
+  Chunk *chunk = (Chunk *)arg;
+
+  extract_words_from_buffer(chunk->buffer, chunk->length, chunk->counter);
+  return NULL;
+}
+
+void run_threads(Chunk *chunks, int num_threads) {
+  pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+  int i;
+
+  if (threads == NULL) {
+    perror("failed malloc when creating threads");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, count_chunk, &chunks[i]) != 0) {
+      perror("failed to create thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  free(threads);
+}
+
+void merge_hash_table(HashTable **into, HashTable *from) {
+  Entry *current;
+  unsigned int i;
+  int value;
+
+  for (i = 0; i < from->size; i++) {
+    for (current = from->entries[i]; current != NULL;
+         current = current->next) {
+      value = hash_table_get(*into, current->key);
+      hash_table_add(into, current->key,
+                     value == -1 ? current->value : value + current->value);
+    }
+  }
+}
+
+void report(int num_threads, const char *approach, double start,
+            unsigned int distinct) {
+  printf("%7d %-6s %9.3f %9.1f %9u\n", num_threads, approach, now() - start,
+         memory_peak() / BYTES_PER_MEGABYTE, distinct);
+}
+
+void bench_shared(const char *buffer, size_t length, int num_threads) {
+  Chunk *chunks = (Chunk *)malloc(sizeof(Chunk) * num_threads);
+  Counter *counter;
+  double start;
+  int i;
+
+  memory_reset_peak();
+  start = now();
+
+  counter = create_counter(COUNTER_CONCURRENT);
+  split_chunks(buffer, length, chunks, num_threads);
+  for (i = 0; i < num_threads; i++) {
+    chunks[i].counter = counter;
+  }
+
+  run_threads(chunks, num_threads);
+  report(num_threads, "shared", start, counter_num_entries(counter));
+
+  free_counter(counter);
+  free(chunks);
+}
+
+void bench_merge(const char *buffer, size_t length, int num_threads) {
+  Chunk *chunks = (Chunk *)malloc(sizeof(Chunk) * num_threads);
+  double start;
+  int i;
+
+  memory_reset_peak();
+  start = now();
+
+  split_chunks(buffer, length, chunks, num_threads);
+  for (i = 0; i < num_threads; i++) {
+    chunks[i].counter = create_counter(COUNTER_HASH);
+  }
+
+  run_threads(chunks, num_threads);
+
+  for (i = 1; i < num_threads; i++) {
+    merge_hash_table(&chunks[0].counter->table, chunks[i].counter->table);
+    free_counter(chunks[i].counter);
+  }
+
+  report(num_threads, "merge", start, counter_num_entries(chunks[0].counter));
+
+  free_counter(chunks[0].counter);
+  free(chunks);
+}
+
+int main(int argc, char *argv[]) {
+  int default_threads[] = {8, 16, 32};
+  size_t length;
+  char *buffer;
+  int num_threads;
+  int i;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: bench file [threads ...]\n");
+    return 1;
+  }
+
+  buffer = read_whole_file(argv[1], &length);
+
+  printf("threads approach  seconds   peak MB  distinct\n");
+
+  for (i = 0; i < (argc > 2 ? argc - 2 : 3); i++) {
+    num_threads = argc > 2 ? atoi(argv[i + 2]) : default_threads[i];
+    if (num_threads < 1) {
+      fprintf(stderr, "bench: invalid thread count %s\n", argv[i + 2]);
+      return 1;
+    }
+
+    bench_shared(buffer, length, num_threads);
+    bench_merge(buffer, length, num_threads);
+  }
+
+  free(buffer);
+  return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ *File: concurrent_hash.c
+ *This file contains the implementation of a sharded hash table which is shared
+ *by every tokenizer thread. A key always maps to the same shard, and a shard
+ *is only ever touched with its spinlock held, so each shard behaves exactly
+ *like a single threaded HashTable (including its resizing).
+ *
+ *The spinlock backs off with sched_yield, since there may be more threads
+ *than cores and a preempted lock holder would otherwise be spun on for a
+ *whole time slice.
+ */
+
+#include "concurrent_hash.h"
+#include "hash.h"
+#include "memory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPINS_BEFORE_YIELD 64
+
+extern int sched_yield(void);
+
+void shard_lock(HashShard *shard) {
+  int spins = 0;
+
+  while (__atomic_exchange_n(&shard->state.lock, 1, __ATOMIC_ACQUIRE)) {
+    /* Wait on a plain load so the cache line is not written while spinning */
+    while (__atomic_load_n(&shard->state.lock, __ATOMIC_RELAXED)) {
+      if (++spins == SPINS_BEFORE_YIELD) {
+        sched_yield();
+        spins = 0;
+      }
+    }
+  }
+}
+
+void shard_unlock(HashShard *shard) {
+  __atomic_store_n(&shard->state.lock, 0, __ATOMIC_RELEASE);
+}
+
+HashShard *find_shard(ConcurrentHashTable *table, char *key) {
+  unsigned long hash = hash_string(key);
+
+  return &table->shards[(hash ^ (hash >> 16)) & (table->num_shards - 1)];
+}
+
+ConcurrentHashTable *create_concurrent_hash_table(unsigned int shard_bits,
+                                                  unsigned int size) {
+  /*
+   *Creates a table of 2^shard_bits shards, which together start with about
+   *size buckets.
+   */
+  ConcurrentHashTable *table;
+  unsigned int shard_size;
+  unsigned int i;
+
+  if (!(table = (ConcurrentHashTable *)tracked_malloc(
+            sizeof(ConcurrentHashTable)))) {
+    perror("failed malloc when creating ConcurrentHashTable");
+    exit(EXIT_FAILURE);
+  }
+
+  table->num_shards = 1u << shard_bits;
+  shard_size = next_prime_number(size >> shard_bits);
+
+  if (!(table->shards = (HashShard *)tracked_aligned_calloc(
+            table->num_shards, sizeof(HashShard), CACHE_LINE_SIZE))) {
+    perror("failed calloc when creating shards");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < table->num_shards; i++) {
+    table->shards[i].state.lock = 0;
+    table->shards[i].state.table = create_hash_table(shard_size);
+  }
+
+  return table;
+}
+
+int concurrent_hash_table_increment(ConcurrentHashTable *table, char *key) {
+  /*Adds one to the count of key and returns the new count */
+  HashShard *shard = find_shard(table, key);
+  int value;
+
+  shard_lock(shard);
+  value = hash_table_increment(&shard->state.table, key);
+  shard_unlock(shard);
+
+  return value;
+}
+
+int concurrent_hash_table_get(ConcurrentHashTable *table, char *key) {
+  /*Returns -1 if not found */
+  HashShard *shard = find_shard(table, key);
+  int value;
+
+  shard_lock(shard);
+  value = hash_table_get(shard->state.table, key);
+  shard_unlock(shard);
+
+  return value;
+}
+
+unsigned int concurrent_hash_table_num_entries(ConcurrentHashTable *table) {
+  /*
+   *Each shard is locked while it is counted, as another thread may be
+   *resizing (and so freeing) its table.
+   */
+  unsigned int num_entries = 0;
+  unsigned int i;
+
+  for (i = 0; i < table->num_shards; i++) {
+    shard_lock(&table->shards[i]);
+    num_entries += table->shards[i].state.table->num_entries;
+    shard_unlock(&table->shards[i]);
+  }
+
+  return num_entries;
+}
+
+int concurrent_hash_table_top_n(ConcurrentHashTable *table, int n,
+                                const char *prefix, Entry **top_n) {
+  /*
+   *Stores copies of the n highest counted keys starting with prefix (every
+   *key when prefix is NULL) into top_n, sorted like get_top_n_entries.
+   *Returns the number stored. The table is left untouched.
+   */
+  size_t prefix_length = prefix == NULL ? 0 : strlen(prefix);
+  Entry *current;
+  unsigned int i;
+  unsigned int j;
+  int size = 0;
+
+  for (i = 0; i < table->num_shards; i++) {
+    for (j = 0; j < table->shards[i].state.table->size; j++) {
+      for (current = table->shards[i].state.table->entries[j]; current != NULL;
+           current = current->next) {
+        if (prefix == NULL ||
+            strncmp(current->key, prefix, prefix_length) == 0) {
+          top_n_offer(top_n, &size, n, current->key, current->value);
+        }
+      }
+    }
+  }
+
+  qsort(top_n, size, sizeof(Entry *), compare_entries_descending);
+  return size;
+}
+
+unsigned int concurrent_hash_table_prune(ConcurrentHashTable *table,
+                                         int threshold) {
+  /*Removes every entry whose value is at most threshold */
+  unsigned int removed = 0;
+  unsigned int i;
+
+  for (i = 0; i < table->num_shards; i++) {
+    removed += hash_table_prune(table->shards[i].state.table, threshold);
+  }
+
+  return removed;
+}
+
+Entry **concurrent_hash_table_sorted_entries(ConcurrentHashTable *table) {
+  /*
+   *Returns an array of every entry in the table sorted by key.
+   *The entries still belong to the table.
+   **/
+  unsigned int num_entries = concurrent_hash_table_num_entries(table);
+  Entry **sorted;
+  Entry *current;
+  unsigned int count = 0;
+  unsigned int i;
+  unsigned int j;
+
+  sorted = (Entry **)tracked_malloc(sizeof(Entry *) *
+                                    (num_entries > 0 ? num_entries : 1));
+  if (sorted == NULL) {
+    perror("failed malloc in concurrent_hash_table_sorted_entries");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < table->num_shards; i++) {
+    for (j = 0; j < table->shards[i].state.table->size; j++) {
+      for (current = table->shards[i].state.table->entries[j]; current != NULL;
+           current = current->next) {
+        sorted[count++] = current;
+      }
+    }
+  }
+
+  qsort(sorted, count, sizeof(Entry *), compare_entry_keys);
+  return sorted;
+}
+
+void free_concurrent_hash_table(ConcurrentHashTable *table) {
+  unsigned int i;
+
+  for (i = 0; i < table->num_shards; i++) {
+    free_hash_table(table->shards[i].state.table);
+  }
+
+  tracked_free(table->shards);
+  tracked_free(table);
+}
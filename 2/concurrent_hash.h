@@ -0,0 +1,54 @@
+/*
+ * concurrent_hash.h
+ *
+ * This header file contains the declarations of a hash table that many threads
+ * can increment at the same time. The keys are split into 2^k shards by their
+ * hash, and every shard is an ordinary HashTable guarded by its own spinlock,
+ * so threads only wait for each other when they hit the same shard. Shards are
+ * padded to a cache line to keep their locks from sharing one.
+ *
+ * Only the increment and get operations may run concurrently; the remaining
+ * functions expect every writer to be finished.
+ */
+
+#ifndef CONCURRENT_HASH_H
+#define CONCURRENT_HASH_H
+
+#include "hash.h"
+
+#define CONCURRENT_SHARD_BITS 6
+#define CACHE_LINE_SIZE 64
+
+/* The lock and table of a shard */
+typedef struct ShardState {
+  int lock;
+  HashTable *table;
+} ShardState;
+
+/* Structure definition for HashShard, a whole cache line whatever the
+ * padding of ShardState, allocated on a line boundary */
+typedef union HashShard {
+  ShardState state;
+  char line[CACHE_LINE_SIZE];
+} HashShard;
+
+/* Structure definition for ConcurrentHashTable */
+typedef struct ConcurrentHashTable {
+  unsigned int num_shards;
+  HashShard *shards;
+} ConcurrentHashTable;
+
+/* Function prototypes */
+ConcurrentHashTable *create_concurrent_hash_table(unsigned int shard_bits,
+                                                  unsigned int size);
+int concurrent_hash_table_increment(ConcurrentHashTable *table, char *key);
+int concurrent_hash_table_get(ConcurrentHashTable *table, char *key);
+unsigned int concurrent_hash_table_num_entries(ConcurrentHashTable *table);
+int concurrent_hash_table_top_n(ConcurrentHashTable *table, int n,
+                                const char *prefix, Entry **top_n);
+unsigned int concurrent_hash_table_prune(ConcurrentHashTable *table,
+                                         int threshold);
+Entry **concurrent_hash_table_sorted_entries(ConcurrentHashTable *table);
+void free_concurrent_hash_table(ConcurrentHashTable *table);
+
+#endif
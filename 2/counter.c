@@ -0,0 +1,394 @@
+/*
+ *File: counter.c
+ *This file contains the implementation of the word counter used by fw.
+ *Every operation is dispatched to the backend chosen when the counter was
+ *created: the hash table (the default) or the trie, which can answer
+ *prefix-constrained top n queries without scanning every key. The concurrent
+ *backend is the only one that several threads may increment at once.
+ *
+ *When a memory limit is set, the tracked memory is checked after every
+ *increment. Spilled runs are written as "word count" lines sorted by word, so
+ *the final counts are produced by a k-way merge that sums equal words.
+ */
+
+#include "concurrent_hash.h"
+#include "counter.h"
+#include "fw.h"
+#include "hash.h"
+#include "memory.h"
+#include "trie.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BYTES_PER_MEGABYTE (1024.0 * 1024.0)
+
+void create_backend(Counter *counter) {
+  if (counter->type == COUNTER_TRIE) {
+    counter->trie = create_trie();
+  } else if (counter->type == COUNTER_CONCURRENT) {
+    counter->shared = create_concurrent_hash_table(CONCURRENT_SHARD_BITS,
+                                                   COUNTER_HASH_STARTING_SIZE);
+  } else {
+    counter->table = create_hash_table(COUNTER_HASH_STARTING_SIZE);
+  }
+}
+
+void free_backend(Counter *counter) {
+  if (counter->type == COUNTER_TRIE) {
+    free_trie(counter->trie);
+  } else if (counter->type == COUNTER_CONCURRENT) {
+    free_concurrent_hash_table(counter->shared);
+  } else {
+    free_hash_table(counter->table);
+  }
+
+  counter->trie = NULL;
+  counter->table = NULL;
+  counter->shared = NULL;
+}
+
+Counter *create_counter(CounterType type) {
+  Counter *counter;
+
+  if (!(counter = (Counter *)tracked_malloc(sizeof(Counter)))) {
+    perror("failed malloc when creating Counter");
+    exit(EXIT_FAILURE);
+  }
+
+  counter->type = type;
+  counter->table = NULL;
+  counter->trie = NULL;
+  counter->shared = NULL;
+  counter->memory_limit = 0;
+  counter->strategy = LIMIT_ABORT;
+  counter->stopped = false;
+  counter->error_bound = 0;
+  counter->runs = NULL;
+  counter->num_runs = 0;
+  counter->words_counted = 0;
+  counter->report_memory = false;
+
+  create_backend(counter);
+
+  return counter;
+}
+
+void counter_set_limit(Counter *counter, size_t memory_limit,
+                       LimitStrategy strategy) {
+  /*A memory_limit of 0 disables the limit */
+  counter->memory_limit = memory_limit;
+  counter->strategy = strategy;
+}
+
+int counter_increment(Counter *counter, char *word) {
+  /*Adds one to the count of word and returns the new count */
+  unsigned long words_counted;
+  int value;
+
+  if (counter->type == COUNTER_TRIE) {
+    value = trie_increment(counter->trie, word);
+  } else if (counter->type == COUNTER_CONCURRENT) {
+    value = concurrent_hash_table_increment(counter->shared, word);
+  } else {
+    value = hash_table_increment(&counter->table, word);
+  }
+
+  words_counted = __sync_add_and_fetch(&counter->words_counted, 1);
+
+  if (counter->report_memory && words_counted % COUNTER_REPORT_INTERVAL == 0) {
+    counter_report_memory(counter);
+  }
+
+  if (counter->memory_limit > 0 && memory_in_use() > counter->memory_limit) {
+    counter_enforce_limit(counter);
+  }
+
+  return value;
+}
+
+int counter_get(Counter *counter, char *word) {
+  /*Returns -1 if the word was never counted */
+  if (counter->type == COUNTER_TRIE) {
+    return trie_get(counter->trie, word);
+  }
+
+  if (counter->type == COUNTER_CONCURRENT) {
+    return concurrent_hash_table_get(counter->shared, word);
+  }
+
+  return hash_table_get(counter->table, word);
+}
+
+unsigned int counter_num_entries(Counter *counter) {
+  if (counter->type == COUNTER_TRIE) {
+    return counter->trie->num_entries;
+  }
+
+  if (counter->type == COUNTER_CONCURRENT) {
+    return concurrent_hash_table_num_entries(counter->shared);
+  }
+
+  return counter->table->num_entries;
+}
+
+bool counter_stopped(Counter *counter) {
+  /*
+   * Returns whether counting stopped at the memory limit. The counting thread
+   * sets it while other threads poll it, like the totals of memory.c.
+   */
+  return __atomic_load_n(&counter->stopped, __ATOMIC_RELAXED);
+}
+
+void counter_enforce_limit(Counter *counter) {
+  /*
+   *Called once the tracked memory is over the limit. Falls back to stopping
+   *when the chosen strategy can not bring the usage back under the limit.
+   */
+  if (counter_stopped(counter)) {
+    return;
+  }
+
+  if (counter->strategy == LIMIT_SPILL) {
+    counter_spill(counter);
+  } else if (counter->strategy == LIMIT_APPROXIMATE) {
+    counter_prune(counter);
+  }
+
+  if (memory_in_use() > counter->memory_limit) {
+    __atomic_store_n(&counter->stopped, true, __ATOMIC_RELAXED);
+  }
+}
+
+void write_run_entry(const char *key, int count, void *arg) {
+  fprintf((FILE *)arg, "%s %d\n", key, count);
+}
+
+void counter_spill(Counter *counter) {
+  /*
+   *Writes every counted word to a new temporary run, sorted by word, and
+   *starts over with an empty backend.
+   */
+  unsigned int num_entries = counter_num_entries(counter);
+  FILE *run;
+  Entry **sorted;
+  unsigned int i;
+
+  if (num_entries == 0) {
+    return;
+  }
+
+  if ((run = tmpfile()) == NULL) {
+    perror("failed to create a spill file");
+    exit(EXIT_FAILURE);
+  }
+
+  if (counter->type == COUNTER_TRIE) {
+    trie_visit(counter->trie, write_run_entry, run);
+  } else {
+    sorted = counter->type == COUNTER_CONCURRENT
+                 ? concurrent_hash_table_sorted_entries(counter->shared)
+                 : hash_table_sorted_entries(counter->table);
+    for (i = 0; i < num_entries; i++) {
+      write_run_entry(sorted[i]->key, sorted[i]->value, run);
+    }
+    tracked_free(sorted);
+  }
+
+  if (fflush(run) == EOF || ferror(run)) {
+    perror("failed to write a spill file");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!(counter->runs = (FILE **)tracked_realloc(
+            counter->runs, sizeof(FILE *) * (counter->num_runs + 1)))) {
+    perror("failed realloc when adding a spill file");
+    exit(EXIT_FAILURE);
+  }
+
+  counter->runs[counter->num_runs++] = run;
+
+  free_backend(counter);
+  create_backend(counter);
+}
+
+bool counter_prune(Counter *counter) {
+  /*
+   *Drops the rarest words until the tracked memory is back under three
+   *quarters of the limit, doubling the threshold on every pass. A word may
+   *lose up to the threshold every time it is dropped, so the thresholds add
+   *up to the error bound of every count. Returns false if nothing is left to
+   *drop.
+   */
+  size_t target = counter->memory_limit / 4 * 3;
+  int threshold = 1;
+
+  while (memory_in_use() > target && counter_num_entries(counter) > 0) {
+    if (counter->type == COUNTER_TRIE) {
+      trie_prune(counter->trie, threshold);
+    } else if (counter->type == COUNTER_CONCURRENT) {
+      concurrent_hash_table_prune(counter->shared, threshold);
+    } else {
+      hash_table_prune(counter->table, threshold);
+    }
+
+    counter->error_bound += threshold;
+    threshold *= 2;
+  }
+
+  return memory_in_use() <= target;
+}
+
+void counter_report_memory(Counter *counter) {
+  /*
+   *Prints the memory used by the counter to stderr, so the memory needed for
+   *a given number of distinct words can be estimated.
+   */
+  unsigned int entries = counter_num_entries(counter);
+  size_t in_use = memory_in_use();
+
+  fprintf(stderr,
+          "fw: %lu words, %u distinct, %.1f MB tracked (peak %.1f MB), "
+          "%.1f MB resident, %.1f bytes per key\n",
+          __atomic_load_n(&counter->words_counted, __ATOMIC_RELAXED), entries,
+          in_use / BYTES_PER_MEGABYTE, memory_peak() / BYTES_PER_MEGABYTE,
+          memory_rss() / BYTES_PER_MEGABYTE,
+          entries > 0 ? (double)in_use / entries : 0.0);
+}
+
+bool read_run_entry(FILE *run, char **word, int *count) {
+  /*Reads the next "word count" line of a run, false at the end of it */
+  tracked_free(*word);
+
+  if ((*word = read_next_word_lower(run)) == NULL) {
+    return false;
+  }
+
+  if (fscanf(run, " %d", count) != 1) {
+    fprintf(stderr, "fw: corrupted spill file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  return true;
+}
+
+Entry **merge_runs(Counter *counter, int n, char *prefix,
+                   unsigned int *total_words) {
+  /*
+   *Merges every spilled run, summing the counts of equal words, and returns
+   *the n most frequent words starting with prefix.
+   */
+  char **words;
+  int *counts;
+  Entry **top_n;
+  char *smallest;
+  size_t prefix_length = prefix == NULL ? 0 : strlen(prefix);
+  int size = 0;
+  int total;
+  int i;
+
+  words = (char **)tracked_calloc(counter->num_runs, sizeof(char *));
+  counts = (int *)tracked_calloc(counter->num_runs, sizeof(int));
+  top_n = (Entry **)tracked_calloc(n > 0 ? n : 1, sizeof(Entry *));
+  if (words == NULL || counts == NULL || top_n == NULL) {
+    perror("failed calloc when merging spill files");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < counter->num_runs; i++) {
+    rewind(counter->runs[i]);
+    read_run_entry(counter->runs[i], &words[i], &counts[i]);
+  }
+
+  *total_words = 0;
+
+  for (;;) {
+    smallest = NULL;
+    for (i = 0; i < counter->num_runs; i++) {
+      if (words[i] != NULL &&
+          (smallest == NULL || strcmp(words[i], smallest) < 0)) {
+        smallest = words[i];
+      }
+    }
+
+    if (smallest == NULL) {
+      break;
+    }
+
+    smallest = tracked_strdup(smallest);
+    total = 0;
+
+    for (i = 0; i < counter->num_runs; i++) {
+      if (words[i] != NULL && strcmp(words[i], smallest) == 0) {
+        total += counts[i];
+        read_run_entry(counter->runs[i], &words[i], &counts[i]);
+      }
+    }
+
+    (*total_words)++;
+    if (prefix == NULL || strncmp(smallest, prefix, prefix_length) == 0) {
+      top_n_offer(top_n, &size, n, smallest, total);
+    }
+
+    tracked_free(smallest);
+  }
+
+  qsort(top_n, size, sizeof(Entry *), compare_entries_descending);
+
+  tracked_free(words);
+  tracked_free(counts);
+  return top_n;
+}
+
+Entry **counter_top_n(Counter *counter, int n, char *prefix,
+                      unsigned int *total_words) {
+  /*
+   *Returns the n most frequent words starting with prefix (every word when
+   *prefix is NULL) and stores the number of distinct words counted into
+   *total_words. Unused slots are NULL.
+   *THIS FUNCTION WILL MUTATE A HASH TABLE COUNTER.
+   **/
+  Entry **top_n;
+
+  if (counter->num_runs > 0) {
+    counter_spill(counter);
+    return merge_runs(counter, n, prefix, total_words);
+  }
+
+  *total_words = counter_num_entries(counter);
+
+  if (counter->type == COUNTER_HASH) {
+    /* The hash table has to drop every other key to answer the query */
+    if (prefix != NULL) {
+      hash_table_retain_prefix(counter->table, prefix);
+    }
+
+    return get_top_n_entries(n, counter->table);
+  }
+
+  if (!(top_n = (Entry **)tracked_calloc(n > 0 ? n : 1, sizeof(Entry *)))) {
+    perror("failed calloc in counter_top_n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (counter->type == COUNTER_CONCURRENT) {
+    concurrent_hash_table_top_n(counter->shared, n, prefix, top_n);
+  } else {
+    trie_top_n(counter->trie, n, prefix, top_n);
+  }
+
+  return top_n;
+}
+
+void free_counter(Counter *counter) {
+  int i;
+
+  free_backend(counter);
+
+  for (i = 0; i < counter->num_runs; i++) {
+    fclose(counter->runs[i]);
+  }
+
+  tracked_free(counter->runs);
+  tracked_free(counter);
+}
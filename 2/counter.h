@@ -0,0 +1,66 @@
+/*
+ * counter.h
+ *
+ * This header file contains the declarations of the word counter used by fw.
+ * A counter wraps one of the available backends (the hash table or the
+ * path-compressed trie) behind a single interface, so the rest of fw does not
+ * need to know which one was selected on the command line. The concurrent
+ * backend (a sharded hash table) may be incremented by several threads at
+ * once.
+ *
+ * A counter may also be given a memory budget. When the tracked memory goes
+ * over the budget the counter either stops counting (keeping a partial
+ * result), spills its contents to sorted temporary runs that are merged at the
+ * end, or drops its rarest words and keeps counting approximately.
+ */
+
+#ifndef COUNTER_H
+#define COUNTER_H
+
+#include "concurrent_hash.h"
+#include "hash.h"
+#include "trie.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define COUNTER_HASH_STARTING_SIZE 5381
+#define COUNTER_REPORT_INTERVAL (1 << 20)
+
+typedef enum { COUNTER_HASH, COUNTER_TRIE, COUNTER_CONCURRENT } CounterType;
+
+typedef enum { LIMIT_ABORT, LIMIT_SPILL, LIMIT_APPROXIMATE } LimitStrategy;
+
+/* Structure definition for Counter */
+typedef struct Counter {
+  CounterType type;
+  HashTable *table;
+  Trie *trie;
+  ConcurrentHashTable *shared;
+  size_t memory_limit;
+  LimitStrategy strategy;
+  bool stopped; /* read with counter_stopped, from any thread */
+  int error_bound;
+  FILE **runs;
+  int num_runs;
+  unsigned long words_counted;
+  bool report_memory;
+} Counter;
+
+/* Function prototypes */
+Counter *create_counter(CounterType type);
+void counter_set_limit(Counter *counter, size_t memory_limit,
+                       LimitStrategy strategy);
+int counter_increment(Counter *counter, char *word);
+int counter_get(Counter *counter, char *word);
+unsigned int counter_num_entries(Counter *counter);
+bool counter_stopped(Counter *counter);
+void counter_enforce_limit(Counter *counter);
+void counter_spill(Counter *counter);
+bool counter_prune(Counter *counter);
+void counter_report_memory(Counter *counter);
+Entry **counter_top_n(Counter *counter, int n, char *prefix,
+                      unsigned int *total_words);
+void free_counter(Counter *counter);
+
+#endif
@@ -0,0 +1,923 @@
+/*
+ * File: decompress.c
+ * Detects compressed inputs by their magic bytes and exposes the decompressed
+ * contents as a FILE stream that the tokenizer can read like any other file.
+ * Nothing is written to disk: the decompressed bytes travel through a pipe.
+ * Files written by hencode (project 3), in any of its formats, are decoded
+ * in-process on a separate thread, while gzip, bzip2, xz and zstd inputs are
+ * handed to the matching system decompressor running as a child process. In
+ * both cases decoding overlaps with counting.
+ * hencode files are read with the bit reader and lookup tables of hdecode
+ * (bitreader.h), and their headers and frames parsed by format.c, so only
+ * the checks telling a hencode file from text live here.
+ */
+
+#include "adaptive.h"
+#include "bitreader.h"
+#include "decompress.h"
+#include "format.h"
+#include "huffman.h"
+#include "lz.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "preset.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern FILE *fdopen(int fd, const char *mode);
+extern int fcntl(int fd, int cmd, ...);
+extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+extern ssize_t splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+                      size_t len, unsigned int flags);
+
+#define DECODE_WRITE_SIZE 8192
+#define LEGACY_RECORD_SIZE 5
+#define LEGACY_VERSION 0
+
+/* A hencode file whose header has been read, and the pipe it decodes into.
+ * br is left at the payload (at the first frame of framed and LZ files).
+ * Canonical and legacy files (version LEGACY_VERSION) are decoded with
+ * table, context files with contexts, and the frames of framed files each
+ * with a table of their own. */
+typedef struct {
+  int input_fd;
+  int output_fd;
+  BitReader *br;
+  int version;
+  uint64_t num_bytes;
+  DecodeTable table;
+  ContextTables contexts;
+  FramedHeader layout;
+  int window_log;
+  int status;
+} HencodeJob;
+
+/* Returns the name of the system decompressor used for the given type. */
+const char *decompressor_name(CompressionType type) {
+  switch (type) {
+  case COMPRESSION_GZIP:
+    return "gzip";
+  case COMPRESSION_BZIP2:
+    return "bzip2";
+  case COMPRESSION_XZ:
+    return "xz";
+  case COMPRESSION_ZSTD:
+    return "zstd";
+  default:
+    return NULL;
+  }
+}
+
+/* Returns the number of codes, and stores the length of the shortest and of
+ * the longest one. Returns -1 if several codes are not a complete prefix
+ * code, which hencode never writes. */
+int measure_codes(HuffmanCode codes[], int *min_length, int *max_length) {
+  unsigned long kraft_sum = 0;
+  int num_codes = 0;
+  int i;
+
+  *min_length = CANONICAL_MAX_LENGTH;
+  *max_length = 0;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (codes[i].length == 0) {
+      continue;
+    }
+
+    kraft_sum += 1UL << (CANONICAL_MAX_LENGTH - codes[i].length);
+    *min_length = codes[i].length < *min_length ? codes[i].length : *min_length;
+    *max_length = codes[i].length > *max_length ? codes[i].length : *max_length;
+    num_codes++;
+  }
+
+  if (num_codes > 1 && kraft_sum != 1UL << CANONICAL_MAX_LENGTH) {
+    return -1;
+  }
+
+  /* A lone code takes no bits */
+  if (num_codes == 1) {
+    *min_length = 0;
+    *max_length = 0;
+  }
+
+  return num_codes;
+}
+
+/* Checks that a payload of payload_size bytes can hold num_bytes codes of
+ * lengths from min_length to max_length bits */
+int check_payload_size(uint64_t num_bytes, int min_length, int max_length,
+                       off_t payload_size) {
+  if (payload_size < (off_t)((num_bytes * min_length + 7) / 8) ||
+      payload_size > (off_t)((num_bytes * max_length + 7) / 8)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Builds the decode table of codes into table, exiting if memory runs out
+ * like every other allocation of fw. Returns -1 if the codes can not be
+ * decoded. */
+int build_decode_table(DecodeTable *table, HuffmanCode codes[]) {
+  int status = decode_table_build(table, codes);
+
+  if (status == DECODE_ERROR_MEMORY) {
+    perror("failed malloc when building hencode decode table");
+    exit(EXIT_FAILURE);
+  }
+
+  return status;
+}
+
+/* Reads a legacy hencode header (a frequency table, see format.h) from the
+ * next header_size bytes of header into the table of job. Returns the header
+ * length, or -1 if the file is not a valid legacy hencode file. A header is
+ * only accepted if its symbols are strictly increasing, every frequency is
+ * positive, and the payload size implied by the resulting tree matches the
+ * size of the file exactly, as nothing else tells such a file from text. */
+int read_legacy_header(HencodeJob *job, const uint8_t *header,
+                       size_t header_size, off_t file_size) {
+  unsigned int frequency_table[HUFFMAN_SYMBOLS] = {0};
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  HuffmanTree tree;
+  HuffmanNode *root;
+  const uint8_t *record;
+  unsigned int frequency;
+  uint64_t bits = 0;
+  int header_length;
+  int previous = -1;
+  int i;
+
+  header_length = 1 + (header[0] + 1) * LEGACY_RECORD_SIZE;
+  if (header_size < (size_t)header_length || file_size < header_length) {
+    return -1;
+  }
+
+  job->num_bytes = 0;
+  for (i = 0; i <= header[0]; i++) {
+    record = header + 1 + i * LEGACY_RECORD_SIZE;
+    memcpy(&frequency, record + 1, sizeof(unsigned int));
+    frequency = ntohl(frequency);
+
+    if (record[0] <= previous || frequency == 0) {
+      return -1;
+    }
+
+    previous = record[0];
+    frequency_table[record[0]] = frequency;
+    job->num_bytes += frequency;
+  }
+
+  /* The tree sums the counts in an int, so hencode never writes more */
+  if (job->num_bytes > INT_MAX) {
+    return -1;
+  }
+
+  memset(codes, 0, sizeof(codes));
+  root = build_huffman_tree(&tree, frequency_table);
+  store_huffman_codes(codes, root, 0, 0);
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    bits += (uint64_t)frequency_table[i] * codes[i].length;
+  }
+
+  /* A lone byte has an empty code, mark it as present */
+  if (root->left == NULL && root->right == NULL) {
+    codes[root->key].length = 1;
+  }
+
+  if (file_size - header_length != (off_t)((bits + 7) / 8) ||
+      build_decode_table(&job->table, codes) == -1) {
+    return -1;
+  }
+
+  return header_length;
+}
+
+/* Reads a canonical (version 1) hencode header from the header_size bytes of
+ * header into the table and size of job. Returns the header length, or -1 if
+ * the file is not a valid canonical hencode file, whose lengths must form a
+ * complete prefix code and whose payload must be as long as num_bytes codes
+ * of those lengths can be. */
+int read_canonical_header(HencodeJob *job, const uint8_t *header,
+                          size_t header_size, off_t file_size) {
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  size_t offset = HUFF_MAGIC_LENGTH + 1;
+  int size_length;
+  int lengths_size;
+  int min_length;
+  int max_length;
+
+  if ((size_length = get_size(header + offset, header_size - offset,
+                              &job->num_bytes)) == -1) {
+    return -1;
+  }
+
+  offset += size_length;
+  if ((lengths_size = unpack_code_lengths(header + offset,
+                                          header_size - offset, codes)) ==
+          -1 ||
+      measure_codes(codes, &min_length, &max_length) == -1) {
+    return -1;
+  }
+
+  offset += lengths_size;
+  if (check_payload_size(job->num_bytes, min_length, max_length,
+                         file_size - (off_t)offset) == -1 ||
+      build_decode_table(&job->table, codes) == -1) {
+    return -1;
+  }
+
+  return (int)offset;
+}
+
+/* Reads a preset (version 8) hencode header from the header_size bytes of
+ * header into the table and size of job, building the table of the preset it
+ * names. Returns the header length, or -1 if the file is not a valid preset
+ * hencode file: its preset must be one built into fw, with the code lengths
+ * the file was coded with, and its payload as long as num_bytes codes of
+ * those lengths can be. */
+int read_preset_header(HencodeJob *job, const uint8_t *header,
+                       size_t header_size, off_t file_size) {
+  size_t offset = HUFF_MAGIC_LENGTH + 1 + 1 + 4;
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  int size_length;
+  int min_length;
+  int max_length;
+  int id;
+
+  if (header_size < PRESET_HEADER_FIXED ||
+      (size_length = get_size(header + offset, header_size - offset,
+                              &job->num_bytes)) == -1) {
+    return -1;
+  }
+
+  id = header[HUFF_MAGIC_LENGTH + 1];
+  if (id >= num_presets ||
+      get_u32(header + HUFF_MAGIC_LENGTH + 2) != presets[id].check) {
+    return -1;
+  }
+
+  /* The table of the preset is shared, so job gets a copy of its own */
+  offset += size_length;
+  memcpy(codes, presets[id].table.codes, sizeof(codes));
+  if (measure_codes(codes, &min_length, &max_length) == -1 ||
+      check_payload_size(job->num_bytes, min_length, max_length,
+                         file_size - (off_t)offset) == -1 ||
+      build_decode_table(&job->table, codes) == -1) {
+    return -1;
+  }
+
+  return (int)offset;
+}
+
+/* Reads a framed (version 2 to 4) hencode header from the header_size bytes
+ * of header into the layout of job, and checks the index trailer at the end
+ * of the file. Returns the header length, or -1 if the file is not a valid
+ * framed hencode file. */
+int read_framed_header(HencodeJob *job, const uint8_t *header,
+                       size_t header_size, off_t file_size) {
+  uint8_t trailer[INDEX_TRAILER_SIZE];
+  off_t index_offset;
+
+  if (parse_framed_header(header, header_size, &job->layout) == -1 ||
+      file_size < INDEX_TRAILER_SIZE ||
+      pread(job->input_fd, trailer, INDEX_TRAILER_SIZE,
+            file_size - INDEX_TRAILER_SIZE) != INDEX_TRAILER_SIZE ||
+      check_index_trailer(&job->layout, trailer, file_size, &index_offset) ==
+          -1) {
+    return -1;
+  }
+
+  return (int)job->layout.header_size;
+}
+
+/* Reads a context (version 6) hencode header from the header_size bytes of
+ * header into the tables and size of job. Returns the header length, or -1
+ * if the file is not a valid context hencode file, whose payload must be as
+ * long as num_bytes codes of its lengths can be. */
+int read_context_header(HencodeJob *job, const uint8_t *header,
+                        size_t header_size, off_t file_size) {
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  size_t offset = HUFF_MAGIC_LENGTH + 1;
+  const uint8_t *map;
+  int shortest = CANONICAL_MAX_LENGTH;
+  int longest = 0;
+  int min_length;
+  int max_length;
+  int size_length;
+  int lengths_size;
+  int num_tables;
+  int status;
+  int i;
+
+  /* The tables and the map follow the size, which may be escaped */
+  if ((size_length = get_size(header + offset, header_size - offset,
+                              &job->num_bytes)) == -1 ||
+      header_size < CONTEXT_HEADER_FIXED - 4 + (size_t)size_length) {
+    return -1;
+  }
+
+  offset += size_length;
+  num_tables = header[offset] + 1;
+  map = header + offset + 1;
+  offset += 1 + HUFF_CONTEXTS;
+  for (i = 0; i < HUFF_CONTEXTS; i++) {
+    if (map[i] >= num_tables) {
+      return -1;
+    }
+  }
+
+  if (context_tables_init(&job->contexts, num_tables, map) != 0) {
+    perror("failed malloc when building hencode decode tables");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < num_tables; i++) {
+    if ((lengths_size = unpack_code_lengths(header + offset,
+                                            header_size - offset, codes)) ==
+            -1 ||
+        measure_codes(codes, &min_length, &max_length) == -1 ||
+        (status = context_tables_add(&job->contexts, i, codes)) == -1) {
+      return -1;
+    }
+
+    if (status == DECODE_ERROR_MEMORY) {
+      perror("failed malloc when building hencode decode tables");
+      exit(EXIT_FAILURE);
+    }
+
+    offset += lengths_size;
+    shortest = min_length < shortest ? min_length : shortest;
+    longest = max_length > longest ? max_length : longest;
+  }
+
+  if (check_payload_size(job->num_bytes, shortest, longest,
+                         file_size - (off_t)offset) == -1) {
+    return -1;
+  }
+
+  return (int)offset;
+}
+
+/* Frees what reading the header of job allocated */
+void free_hencode_job(HencodeJob *job) {
+  decode_table_free(&job->table);
+  context_tables_free(&job->contexts);
+  tracked_free(job->br);
+}
+
+/* Reads the header of the hencode file at the current position of fd, of
+ * file_size bytes, into job, leaving its reader at the payload. Returns -1
+ * if the file is not a valid hencode file, in which case job holds nothing
+ * to free. */
+int read_hencode_job(HencodeJob *job, int fd, off_t file_size) {
+  const uint8_t *header;
+  size_t header_size;
+  int header_length = -1;
+
+  job->input_fd = fd;
+  job->version = LEGACY_VERSION;
+  job->num_bytes = 0;
+  job->table.entries = NULL;
+  job->contexts.merged.entries = NULL;
+  job->window_log = 0;
+  job->status = 0;
+
+  if (!(job->br = (BitReader *)tracked_malloc(sizeof(BitReader)))) {
+    perror("failed malloc when reading hencode header");
+    exit(EXIT_FAILURE);
+  }
+  bitreader_init(job->br, fd, pipeline_read);
+
+  /* Every header fits in the buffer of the reader */
+  header_size = bitreader_peek(job->br, &header, CONTEXT_HEADER_MAX);
+  if (header_size > HUFF_MAGIC_LENGTH &&
+      memcmp(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH) == 0) {
+    job->version = header[HUFF_MAGIC_LENGTH];
+  }
+
+  switch (job->version) {
+  case LEGACY_VERSION:
+    if (header_size > 0) {
+      header_length = read_legacy_header(job, header, header_size, file_size);
+    }
+    break;
+  case HUFF_VERSION_CANONICAL:
+    header_length = read_canonical_header(job, header, header_size, file_size);
+    break;
+  case HUFF_VERSION_FRAMED:
+  case HUFF_VERSION_SEEKABLE:
+  case HUFF_VERSION_INTERLEAVED:
+    header_length = read_framed_header(job, header, header_size, file_size);
+    break;
+  case HUFF_VERSION_ADAPTIVE:
+    header_length = ADAPTIVE_HEADER_SIZE;
+    break;
+  case HUFF_VERSION_CONTEXT:
+    header_length = read_context_header(job, header, header_size, file_size);
+    break;
+  case HUFF_VERSION_LZ:
+    if (header_size >= LZ_HEADER_SIZE &&
+        header[HUFF_MAGIC_LENGTH + 1] >= LZ_MIN_WINDOW_LOG &&
+        header[HUFF_MAGIC_LENGTH + 1] <= LZ_MAX_WINDOW_LOG) {
+      job->window_log = header[HUFF_MAGIC_LENGTH + 1];
+      header_length = LZ_HEADER_SIZE;
+    }
+    break;
+  case HUFF_VERSION_PRESET:
+    header_length = read_preset_header(job, header, header_size, file_size);
+    break;
+  }
+
+  if (header_length == -1) {
+    free_hencode_job(job);
+    return -1;
+  }
+
+  bitreader_consume(job->br, header_length);
+  return 0;
+}
+
+CompressionType detect_compression(int fd) {
+  /*
+   * Inspects the magic bytes at the start of fd and returns the compression
+   * format. The file offset is restored to the start of the file. Files with
+   * the hencode magic but a version newer than fw knows are unsupported,
+   * rather than read as text.
+   */
+  unsigned char magic[MAGIC_MAX];
+  CompressionType type = COMPRESSION_NONE;
+  struct stat file_stat;
+  HencodeJob job;
+  ssize_t length;
+
+  length = read(fd, magic, MAGIC_MAX);
+
+  if (length >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+    type = COMPRESSION_GZIP;
+  } else if (length >= 3 && memcmp(magic, "BZh", 3) == 0) {
+    type = COMPRESSION_BZIP2;
+  } else if (length >= 6 && memcmp(magic, "\xfd" "7zXZ\0", 6) == 0) {
+    type = COMPRESSION_XZ;
+  } else if (length >= 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0) {
+    type = COMPRESSION_ZSTD;
+  } else if (length >= HUFF_MAGIC_LENGTH + 1 &&
+             memcmp(magic, HUFF_MAGIC, HUFF_MAGIC_LENGTH) == 0 &&
+             (magic[HUFF_MAGIC_LENGTH] < HUFF_VERSION_CANONICAL ||
+              magic[HUFF_MAGIC_LENGTH] > HUFF_VERSION_PRESET)) {
+    type = COMPRESSION_UNSUPPORTED;
+  } else if (length > 0 && fstat(fd, &file_stat) == 0 &&
+             lseek(fd, 0, SEEK_SET) == 0 &&
+             read_hencode_job(&job, fd, file_stat.st_size) != -1) {
+    type = COMPRESSION_HENCODE;
+    free_hencode_job(&job);
+  }
+
+  if (lseek(fd, 0, SEEK_SET) == -1) {
+    return COMPRESSION_NONE;
+  }
+
+  return type;
+}
+
+/* Writes length bytes to fd, returning -1 on failure. */
+int write_all(int fd, const uint8_t *buffer, size_t length) {
+  ssize_t written;
+
+  while (length > 0) {
+    written = write(fd, buffer, length);
+    if (written <= 0) {
+      return -1;
+    }
+
+    buffer += written;
+    length -= written;
+  }
+
+  return 0;
+}
+
+/* Decodes the num_bytes bytes of a canonical or legacy payload into the pipe
+ * with the table of job. Returns -1 on failure. */
+int decode_hencode_payload(HencodeJob *job) {
+  uint8_t write_buffer[DECODE_WRITE_SIZE];
+  uint64_t remaining = job->num_bytes;
+  size_t length;
+
+  while (remaining > 0) {
+    length = remaining > DECODE_WRITE_SIZE ? DECODE_WRITE_SIZE : remaining;
+    if (bitreader_decode(job->br, &job->table, write_buffer, length) == -1 ||
+        write_all(job->output_fd, write_buffer, length) == -1) {
+      return -1;
+    }
+    remaining -= length;
+  }
+
+  return 0;
+}
+
+/* Decodes the payload of an adaptive (version 5) file into the pipe, updating
+ * the tree after every byte like hencode did, up to the end symbol. Returns -1
+ * on failure. */
+int decode_adaptive_payload(HencodeJob *job) {
+  uint8_t write_buffer[DECODE_WRITE_SIZE];
+  size_t write_offset = 0;
+  AdaptiveTree tree;
+  int position;
+  int symbol;
+
+  adaptive_init(&tree);
+  for (;;) {
+    position = ADAPTIVE_ROOT;
+    while (tree.nodes[position].symbol == ADAPTIVE_INTERNAL) {
+      position = tree.nodes[position].child[bitreader_read_bits(job->br, 1)];
+    }
+
+    /* The 0-node is followed by a symbol not seen yet */
+    symbol = tree.nodes[position].symbol;
+    if (symbol == ADAPTIVE_ZERO_NODE) {
+      symbol = (int)bitreader_read_bits(job->br, ADAPTIVE_SYMBOL_BITS);
+      if (symbol > ADAPTIVE_END || tree.leaf[symbol] != -1) {
+        return -1;
+      }
+    }
+
+    /* Bits past the end of the input read as zeros */
+    if (job->br->bit_count < 0) {
+      return -1;
+    }
+
+    if (symbol == ADAPTIVE_END) {
+      return write_all(job->output_fd, write_buffer, write_offset);
+    }
+
+    write_buffer[write_offset++] = (uint8_t)symbol;
+    if (write_offset == DECODE_WRITE_SIZE) {
+      if (write_all(job->output_fd, write_buffer, write_offset) == -1) {
+        return -1;
+      }
+      write_offset = 0;
+    }
+    adaptive_update(&tree, symbol);
+  }
+}
+
+/* Decodes the payload of a context (version 6) file into the pipe, every
+ * byte with the table of the byte before it. Returns -1 on failure. */
+int decode_context_payload(HencodeJob *job) {
+  uint8_t write_buffer[DECODE_WRITE_SIZE];
+  uint64_t remaining = job->num_bytes;
+  uint8_t previous = 0;
+  size_t length;
+
+  while (remaining > 0) {
+    length = remaining > DECODE_WRITE_SIZE ? DECODE_WRITE_SIZE : remaining;
+    if (bitreader_decode_context(job->br, &job->contexts, write_buffer, length,
+                                 &previous) == -1 ||
+        write_all(job->output_fd, write_buffer, length) == -1) {
+      return -1;
+    }
+    remaining -= length;
+  }
+
+  return 0;
+}
+
+/* Decodes the frames of an LZ (version 7) file into the pipe, every block
+ * from the window of blocks before it. Returns -1 on failure. */
+int decode_lz_payload(HencodeJob *job) {
+  LzDecoder *decoder = (LzDecoder *)tracked_malloc(sizeof(LzDecoder));
+  uint8_t *frame = (uint8_t *)tracked_malloc(LZ_FRAME_BOUND(LZ_BLOCK_SIZE));
+  const uint8_t *block;
+  size_t num_bytes;
+  size_t frame_size;
+  int status = -1;
+
+  if (decoder == NULL || frame == NULL) {
+    perror("failed malloc when decoding hencode frames");
+    exit(EXIT_FAILURE);
+  }
+
+  lz_decoder_init(decoder, job->window_log);
+  while (bitreader_read_bytes(job->br, frame, FRAME_HEADER_FIXED) ==
+         FRAME_HEADER_FIXED) {
+    num_bytes = get_u32(frame);
+    frame_size = get_u32(frame + 4);
+    if (num_bytes == 0) {
+      status = 0;
+      break;
+    }
+
+    if (frame_size > LZ_FRAME_BOUND(LZ_BLOCK_SIZE) ||
+        bitreader_read_bytes(job->br, frame, frame_size) != frame_size ||
+        (block = lz_decode_frame(decoder, frame, frame_size, num_bytes)) ==
+            NULL ||
+        write_all(job->output_fd, block, num_bytes) == -1) {
+      break;
+    }
+  }
+
+  lz_decoder_free(decoder);
+  tracked_free(decoder);
+  tracked_free(frame);
+  return status;
+}
+
+/* Copies the num_bytes bytes of a stored frame from the input into the pipe.
+ * The bytes the reader already holds are written from its buffer, and the
+ * rest spliced from the input where the system allows it. Returns -1 on
+ * failure. */
+int copy_stored_payload(HencodeJob *job, size_t num_bytes) {
+  uint8_t buffer[DECODE_WRITE_SIZE];
+  const uint8_t *buffered;
+  size_t length = bitreader_peek(job->br, &buffered, 0);
+  bool spliced = true;
+  ssize_t copied;
+
+  length = length < num_bytes ? length : num_bytes;
+  if (write_all(job->output_fd, buffered, length) == -1) {
+    return -1;
+  }
+  bitreader_consume(job->br, length);
+  num_bytes -= length;
+
+  while (num_bytes > 0) {
+    copied = spliced ? splice(job->input_fd, NULL, job->output_fd, NULL,
+                              num_bytes, 0)
+                     : read(job->input_fd, buffer,
+                            num_bytes > DECODE_WRITE_SIZE ? DECODE_WRITE_SIZE
+                                                          : num_bytes);
+    if (copied == -1 && spliced) {
+      spliced = false;
+      continue;
+    }
+    if (copied <= 0 ||
+        (!spliced && write_all(job->output_fd, buffer, copied) == -1)) {
+      return -1;
+    }
+    num_bytes -= copied;
+  }
+
+  return 0;
+}
+
+/* Decodes the frames of a framed (version 2 to 4) file into the pipe as they
+ * come, each read whole and decoded by decode_frame_bytes like hdecode does
+ * for inputs that can not seek. Returns -1 on failure. */
+int decode_framed_payload(HencodeJob *job) {
+  size_t block_size = job->layout.block_size;
+  uint8_t *buffer = (uint8_t *)tracked_malloc(FRAME_BOUND(block_size));
+  uint8_t *output = (uint8_t *)tracked_malloc(block_size);
+  const uint8_t *bytes;
+  size_t available;
+  size_t length;
+  bool partial = false;
+  int lengths_size;
+  int status = -1;
+  Frame frame;
+
+  if (buffer == NULL || output == NULL) {
+    perror("failed malloc when decoding hencode frames");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    available = bitreader_peek(job->br, &bytes,
+                               FRAME_HEADER_FIXED + CODE_LENGTHS_FIXED);
+    if (available < FRAME_END_SIZE) {
+      break;
+    }
+
+    if ((length = get_u32(bytes)) == 0) {
+      status = 0;
+      break;
+    }
+
+    /* Only the last frame may hold part of a block */
+    if (partial || length > block_size ||
+        available < FRAME_HEADER_FIXED + CODE_LENGTHS_FIXED) {
+      break;
+    }
+    partial = length != block_size;
+
+    /* Stored frames are copied without going through memory */
+    if (stored_lengths(bytes + FRAME_HEADER_FIXED)) {
+      if (get_u32(bytes + 4) != length) {
+        break;
+      }
+      bitreader_consume(job->br, FRAME_HEADER_FIXED + CODE_LENGTHS_FIXED);
+      if (copy_stored_payload(job, length) == -1) {
+        break;
+      }
+      continue;
+    }
+
+    if ((lengths_size = code_lengths_size(bytes + FRAME_HEADER_FIXED)) == -1) {
+      break;
+    }
+
+    length = FRAME_HEADER_FIXED + lengths_size + get_u32(bytes + 4);
+    if (length > FRAME_BOUND(block_size) ||
+        bitreader_read_bytes(job->br, buffer, length) != length ||
+        parse_frame(buffer, length, &job->layout, &frame) == -1 ||
+        decode_frame_bytes(&frame, 0, 0, output, frame.num_bytes) == -1 ||
+        write_all(job->output_fd, output, frame.num_bytes) == -1) {
+      break;
+    }
+  }
+
+  tracked_free(buffer);
+  tracked_free(output);
+  return status;
+}
+
+/* Thread body which decodes a hencode payload, or every frame of a framed
+ * file, into the pipe. */
+void *hencode_decode_thread(void *arg) {
+  HencodeJob *job = (HencodeJob *)arg;
+
+  switch (job->version) {
+  case HUFF_VERSION_FRAMED:
+  case HUFF_VERSION_SEEKABLE:
+  case HUFF_VERSION_INTERLEAVED:
+    job->status = decode_framed_payload(job);
+    break;
+  case HUFF_VERSION_ADAPTIVE:
+    job->status = decode_adaptive_payload(job);
+    break;
+  case HUFF_VERSION_CONTEXT:
+    job->status = decode_context_payload(job);
+    break;
+  case HUFF_VERSION_LZ:
+    job->status = decode_lz_payload(job);
+    break;
+  default:
+    job->status = decode_hencode_payload(job);
+  }
+
+  close(job->output_fd);
+  return NULL;
+}
+
+/* Starts the hencode decoding thread writing into output_fd. */
+int start_hencode_thread(DecompressStream *ds, int output_fd) {
+  HencodeJob *job;
+  struct stat file_stat;
+
+  if (!(job = (HencodeJob *)tracked_malloc(sizeof(HencodeJob)))) {
+    perror("failed malloc when starting hencode decoder");
+    exit(EXIT_FAILURE);
+  }
+
+  if (fstat(ds->input_fd, &file_stat) == -1 ||
+      lseek(ds->input_fd, 0, SEEK_SET) == -1 ||
+      read_hencode_job(job, ds->input_fd, file_stat.st_size) == -1) {
+    tracked_free(job);
+    return -1;
+  }
+
+  job->output_fd = output_fd;
+  ds->job = job;
+
+  if (pthread_create(&ds->thread, NULL, hencode_decode_thread, job) != 0) {
+    free_hencode_job(job);
+    tracked_free(job);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Held while a pipe is made and marked close-on-exec and while a
+ * decompressor is forked, so no child of another thread inherits a pipe
+ * before it is marked. */
+static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Creates the pipe of a stream with both ends closed on exec, so the
+ * decompressors of other streams do not keep its write end open. Returns -1
+ * on failure. */
+int open_decompression_pipe(int pipe_fds[2]) {
+  int res = 0;
+
+  pthread_mutex_lock(&pipe_lock);
+  if (pipe(pipe_fds) == -1) {
+    res = -1;
+  } else if (fcntl(pipe_fds[0], F_SETFD, FD_CLOEXEC) == -1 ||
+             fcntl(pipe_fds[1], F_SETFD, FD_CLOEXEC) == -1) {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    res = -1;
+  }
+  pthread_mutex_unlock(&pipe_lock);
+
+  return res;
+}
+
+/* Starts the system decompressor for ds->type writing into output_fd. */
+int start_decompressor_process(DecompressStream *ds, int read_fd,
+                               int output_fd) {
+  const char *name = decompressor_name(ds->type);
+
+  pthread_mutex_lock(&pipe_lock);
+  ds->child = fork();
+  if (ds->child != 0) {
+    pthread_mutex_unlock(&pipe_lock);
+  }
+
+  if (ds->child == -1) {
+    return -1;
+  }
+
+  if (ds->child == 0) {
+    close(read_fd);
+    if (dup2(ds->input_fd, STDIN_FILENO) == -1 ||
+        dup2(output_fd, STDOUT_FILENO) == -1) {
+      perror("dup2");
+      _exit(127);
+    }
+    close(output_fd);
+    execlp(name, name, "-dc", (char *)NULL);
+    perror(name);
+    _exit(127);
+  }
+
+  return 0;
+}
+
+FILE *decompress_open(DecompressStream *ds, int fd, CompressionType type) {
+  /*
+   * Starts decoding fd in the background and returns a stream producing the
+   * decompressed bytes. Returns NULL if the decoder could not be started.
+   * The stream must be released with decompress_close.
+   */
+  int pipe_fds[2];
+  int res;
+
+  ds->type = type;
+  ds->input_fd = fd;
+  ds->child = -1;
+  ds->job = NULL;
+  ds->stream = NULL;
+
+  if (open_decompression_pipe(pipe_fds) == -1) {
+    perror("failed to create decompression pipe");
+    return NULL;
+  }
+
+  /* The write end belongs to the decoding thread once it runs, and to the
+   * child alone once it is forked */
+  if (type == COMPRESSION_HENCODE) {
+    res = start_hencode_thread(ds, pipe_fds[1]);
+    if (res == -1) {
+      close(pipe_fds[1]);
+    }
+  } else {
+    res = start_decompressor_process(ds, pipe_fds[0], pipe_fds[1]);
+    close(pipe_fds[1]);
+  }
+
+  if (res == -1) {
+    close(pipe_fds[0]);
+    return NULL;
+  }
+
+  ds->stream = fdopen(pipe_fds[0], "r");
+  return ds->stream;
+}
+
+int decompress_close(DecompressStream *ds) {
+  /*
+   * Closes the decompressed stream and waits for the decoder to finish.
+   * Returns 0 if the input was decoded successfully and -1 otherwise.
+   */
+  HencodeJob *job;
+  int status = 0;
+  int wait_status;
+
+  fclose(ds->stream);
+
+  if (ds->type == COMPRESSION_HENCODE) {
+    if (pthread_join(ds->thread, (void **)NULL) != 0) {
+      return -1;
+    }
+    job = (HencodeJob *)ds->job;
+    status = job->status;
+    free_hencode_job(job);
+    tracked_free(job);
+  } else if (ds->child > 0) {
+    if (waitpid(ds->child, &wait_status, 0) == -1 ||
+        !WIFEXITED(wait_status) || WEXITSTATUS(wait_status) != 0) {
+      status = -1;
+    }
+  }
+
+  return status;
+}
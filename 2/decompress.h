@@ -0,0 +1,44 @@
+/*
+ * File: decompress.h
+ * This header file contains the declarations used to read compressed inputs
+ * without first decompressing them to disk. Inputs are recognized by their
+ * magic bytes and decoded into a pipe by a separate thread (for files written
+ * by hencode) or a child process (for gzip, bzip2, xz and zstd), so the
+ * tokenizer can read the decompressed words while decoding is still going on.
+ */
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define MAGIC_MAX 6
+
+typedef enum {
+  COMPRESSION_NONE,
+  COMPRESSION_GZIP,
+  COMPRESSION_BZIP2,
+  COMPRESSION_XZ,
+  COMPRESSION_ZSTD,
+  COMPRESSION_HENCODE,
+  COMPRESSION_UNSUPPORTED /* a hencode version fw cannot decode */
+} CompressionType;
+
+/* Structure definition for an open decompression stream */
+typedef struct {
+  CompressionType type;
+  int input_fd;
+  pid_t child;
+  pthread_t thread;
+  void *job;
+  FILE *stream;
+} DecompressStream;
+
+/* Function prototypes */
+CompressionType detect_compression(int fd);
+FILE *decompress_open(DecompressStream *ds, int fd, CompressionType type);
+int decompress_close(DecompressStream *ds);
+
+#endif
@@ -3,19 +3,27 @@
 * File: fw.c
 * Handles the command line interface of fw, along with the retrieval
 * and display of the top n words.
-* The program uses a hash table to store the frequency of each word.
+* The program uses a counter (a hash table, or optionally a trie) to
+* store the frequency of each word.
 * The program performs the following tasks:
 * Parses command-line arguments to get the number of words to display and the
 file paths.
 * Reads words from the files, converting them to lowercase.
-* Extracts words from the files and updates their frequency in a hash table.
-* Retrieves the top n entries from the hash table.
+* Extracts words from the files and updates their frequency in the counter.
+* Retrieves the top n entries from the counter.
 * Displays the top n entries and their frequencies.
 */
 
+#include "counter.h"
+#include "decompress.h"
+#include "fw.h"
 #include "hash.h"
+#include "memory.h"
 #include <ctype.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,12 +31,18 @@ file paths.
 #include <sys/stat.h>
 #include <unistd.h>
 
-extern int getopt(int argc, char *const argv[], const char *optstring);
-extern char *optarg;
-extern int optind;
+extern FILE *fdopen(int fd, const char *mode);
 
 #define WORD_HUNK 100
 
+/* Paths shared by the threads of extract_words_from_paths */
+typedef struct {
+  char **paths;
+  int num_paths;
+  int next_path;
+  Counter *counter;
+} PathQueue;
+
 bool is_valid_number(char *param) {
   /*
    * This function ensures that a given string is a valid number.
@@ -44,34 +58,118 @@ bool is_valid_number(char *param) {
   return true;
 }
 
-void set_arguments(int argc, char *argv[], int *number_of_words, char ***paths,
-                   int *num_paths) {
+void usage(void) {
+  fprintf(stderr, "usage: fw [-n num] [-j threads] [--counter hash|trie] "
+                  "[--prefix prefix] "
+                  "[--tar archive [--tar-prefix prefix]] "
+                  "[--max-memory size [--on-limit abort|spill|approx]] "
+                  "[--memory-report] [file 1 [file 2 ...] ]\n");
+  exit(1);
+}
+
+void set_arguments(int argc, char *argv[], Flags *flags) {
 
   /*
    * This function retrieves the number of words expected and the paths
-   * the user wants parsed and sets the corresponding parameters accordingly.
+   * the user wants parsed and sets the corresponding flags accordingly.
    */
   int opt;
-
-  while ((opt = getopt(argc, argv, "n:")) != -1) {
+  struct option long_options[] = {{"tar", required_argument, NULL, 't'},
+                                  {"tar-prefix", required_argument, NULL, 'p'},
+                                  {"counter", required_argument, NULL, 'c'},
+                                  {"prefix", required_argument, NULL, 'w'},
+                                  {"max-memory", required_argument, NULL, 'm'},
+                                  {"on-limit", required_argument, NULL, 'l'},
+                                  {"memory-report", no_argument, NULL, 'r'},
+                                  {"threads", required_argument, NULL, 'j'},
+                                  {NULL, 0, NULL, 0}};
+
+  flags->number_of_words = 10;
+  flags->tar_path = NULL;
+  flags->tar_prefix = NULL;
+  flags->counter_type = COUNTER_HASH;
+  flags->word_prefix = NULL;
+  flags->memory_limit = 0;
+  flags->limit_strategy = LIMIT_ABORT;
+  flags->memory_report = false;
+  flags->num_threads = 1;
+
+  while ((opt = getopt_long(argc, argv, "n:j:", long_options, NULL)) != -1) {
     switch (opt) {
     case 'n':
       if (!is_valid_number(optarg)) {
-        fprintf(stderr, "usage: fw [-n num] [file 1 [file 2 ...] ]\n");
-        exit(1);
+        usage();
+      }
+
+      flags->number_of_words = atoi(optarg);
+      break;
+    case 't':
+      flags->tar_path = optarg;
+      break;
+    case 'p':
+      flags->tar_prefix = optarg;
+      break;
+    case 'c':
+      if (strcmp(optarg, "hash") == 0) {
+        flags->counter_type = COUNTER_HASH;
+      } else if (strcmp(optarg, "trie") == 0) {
+        flags->counter_type = COUNTER_TRIE;
+      } else {
+        usage();
+      }
+      break;
+    case 'w':
+      flags->word_prefix = optarg;
+      break;
+    case 'm':
+      if (parse_memory_size(optarg, &flags->memory_limit) == -1 ||
+          flags->memory_limit == 0) {
+        usage();
+      }
+      break;
+    case 'l':
+      if (strcmp(optarg, "abort") == 0) {
+        flags->limit_strategy = LIMIT_ABORT;
+      } else if (strcmp(optarg, "spill") == 0) {
+        flags->limit_strategy = LIMIT_SPILL;
+      } else if (strcmp(optarg, "approx") == 0) {
+        flags->limit_strategy = LIMIT_APPROXIMATE;
+      } else {
+        usage();
+      }
+      break;
+    case 'r':
+      flags->memory_report = true;
+      break;
+    case 'j':
+      if (!is_valid_number(optarg) || atoi(optarg) < 1) {
+        usage();
       }
 
-      *number_of_words = atoi(optarg);
+      flags->num_threads = atoi(optarg);
       break;
     default:
-      fprintf(stderr, "usage: fw [-n num] [file 1 [file 2 ...] ]\n");
-      exit(1);
+      usage();
+    }
+  }
+
+  if (flags->tar_prefix != NULL && flags->tar_path == NULL) {
+    usage();
+  }
+
+  /* Threads share one sharded hash table, which can only stop at the limit */
+  if (flags->num_threads > 1) {
+    if (flags->counter_type == COUNTER_TRIE ||
+        flags->limit_strategy != LIMIT_ABORT) {
+      usage();
     }
+
+    flags->counter_type = COUNTER_CONCURRENT;
   }
 
   /*Need to support list of files */
-  *num_paths = argc - optind;
-  *paths = &argv[optind];
+  flags->num_paths = argc - optind;
+  flags->paths = &argv[optind];
 }
 
 /*
@@ -106,7 +204,7 @@ char *read_next_word_lower(FILE *file) {
 
     /* If reserved size is equal to length, reallocate memory */
     if (reservedSize == length) {
-      if (!(word = (char *)realloc(word, sizeof(char) *
+      if (!(word = (char *)tracked_realloc(word, sizeof(char) *
                                              (reservedSize += WORD_HUNK)))) {
         perror("failed realloc when loading word");
         exit(EXIT_FAILURE);
@@ -122,7 +220,8 @@ char *read_next_word_lower(FILE *file) {
 
   /* Reallocate memory for null terminator if necessary */
   if (length == reservedSize) {
-    if (!(word = (char *)realloc(word, sizeof(char) * (reservedSize + 1)))) {
+    if (!(word = (char *)tracked_realloc(word, sizeof(char) *
+                                                   (reservedSize + 1)))) {
       perror("failed to realloc when allocating memory for null terminator");
       exit(EXIT_FAILURE);
     }
@@ -133,36 +232,117 @@ char *read_next_word_lower(FILE *file) {
   return word;
 }
 
-void extract_words_from_file(char *file_name, HashTable **table) {
+void count_words_from_stream(FILE *file, Counter *counter) {
   /*
-   * Parses a file and stores all of its words into a HashTable.
+   * Reads every word of a stream and increments its count in the Counter.
    */
-  FILE *file;
   char *word;
-  int value;
 
-  file = fopen(file_name, "r");
+  while (!counter_stopped(counter) &&
+         (word = read_next_word_lower(file)) != NULL) {
+    counter_increment(counter, word);
+    tracked_free(word);
+  }
+}
+
+void extract_words_from_buffer(const char *buffer, size_t length,
+                               Counter *counter) {
+  /*
+   * Tokenizes a buffer in memory, such as a member of a mapped archive, and
+   * stores its words into the Counter. Words are split the same way as
+   * read_next_word_lower splits them.
+   */
+  char *word = NULL;
+  size_t word_length = 0;
+  size_t reserved_size = 0;
+  size_t i;
+  int character;
+
+  for (i = 0; i <= length; i++) {
+    character = i < length ? (unsigned char)buffer[i] : EOF;
+
+    if (character != EOF && isalpha(character)) {
+      /* Leave room for the null terminator */
+      if (word_length + 1 >= reserved_size) {
+        if (!(word = (char *)tracked_realloc(word, sizeof(char) *
+                                               (reserved_size += WORD_HUNK)))) {
+          perror("failed realloc when loading word from buffer");
+          exit(EXIT_FAILURE);
+        }
+      }
+
+      word[word_length++] = tolower(character);
+      continue;
+    }
+
+    if (word_length > 0) {
+      /* Checked once per word, as the counter only stops on an increment */
+      if (counter_stopped(counter)) {
+        break;
+      }
+
+      word[word_length] = '\0';
+      counter_increment(counter, word);
+      word_length = 0;
+    }
+  }
+
+  tracked_free(word);
+}
+
+void extract_words_from_file(char *file_name, Counter *counter) {
+  /*
+   * Parses a file and stores all of its words into a Counter.
+   * Compressed files are decoded on the fly and their contents are counted
+   * instead of the compressed bytes.
+   */
+  FILE *file;
+  DecompressStream stream;
+  CompressionType type;
+  int fd;
+
+  fd = open(file_name, O_RDONLY);
 
-  if (file == NULL) {
+  if (fd == -1) {
     fprintf(stderr, "%s: failed to open file\n", file_name);
     return;
   }
 
-  while ((word = read_next_word_lower(file)) != NULL) {
-    value = hash_table_get(*table, word);
+  type = detect_compression(fd);
 
-    if (value == -1) {
-      hash_table_add(table, word, 1);
-      free(word);
-      continue;
+  if (type == COMPRESSION_NONE) {
+    if ((file = fdopen(fd, "r")) == NULL) {
+      fprintf(stderr, "%s: failed to open file\n", file_name);
+      close(fd);
+      return;
     }
 
-    hash_table_add(table, word, value + 1);
-    free(word);
+    count_words_from_stream(file, counter);
+    fclose(file);
+    return;
+  }
+
+  if (type == COMPRESSION_UNSUPPORTED) {
+    fprintf(stderr, "%s: unsupported hencode version\n", file_name);
+    close(fd);
+    return;
+  }
+
+  if ((file = decompress_open(&stream, fd, type)) == NULL) {
+    fprintf(stderr, "%s: failed to start decompression\n", file_name);
+    close(fd);
+    return;
+  }
+
+  count_words_from_stream(file, counter);
+
+  /* Stopping early makes the decoder fail on a closed pipe */
+  if (decompress_close(&stream) == -1 && !counter_stopped(counter)) {
+    fprintf(stderr, "%s: decompression failed, counts may be incomplete\n",
+            file_name);
   }
 
-  fclose(file);
-  return;
+  close(fd);
 }
 
 Entry **get_top_n_entries(int n, HashTable *table) {
@@ -175,8 +355,8 @@ Entry **get_top_n_entries(int n, HashTable *table) {
   Entry *current;
   int i;
 
-  if (!(top_n = (Entry **)malloc(sizeof(Entry *) * n))) {
-    perror("failed malloc in get_top_n_entries");
+  if (!(top_n = (Entry **)tracked_calloc(n > 0 ? n : 1, sizeof(Entry *)))) {
+    perror("failed calloc in get_top_n_entries");
     exit(EXIT_FAILURE);
   }
 
@@ -215,38 +395,22 @@ void display_top_n_entries(int n, int total_words, Entry **top_n_entries) {
       break;
 
     printf("%9d %s\n", entry->value, entry->key);
-    free(entry->key);
-    free(entry);
+    tracked_free(entry->key);
+    tracked_free(entry);
   }
 }
 
-void extract_words_from_stdin(HashTable **table) {
+void extract_words_from_stdin(Counter *counter) {
   /*
-   *  Stores the words extracted into stdin into HashTable parameter.
+   *  Stores the words extracted into stdin into the Counter parameter.
    */
 
-  char *word;
-  int value;
-
-  while ((word = read_next_word_lower(stdin)) != NULL) {
-    value = hash_table_get(*table, word);
-
-    if (value == -1) {
-      hash_table_add(table, word, 1);
-      free(word);
-      continue;
-    }
-
-    hash_table_add(table, word, value + 1);
-    free(word);
-  }
-
-  return;
+  count_words_from_stream(stdin, counter);
 }
 
-void extract_words_from_path(char *path, HashTable **table) {
+void extract_words_from_path(char *path, Counter *counter) {
   /*
-   * Calls extract_words_from_path if the specified path is a file.
+   * Calls extract_words_from_file if the specified path is a file.
    *  Directries will be skipped, and outputted as such.
    *  Files will be processed if possible.
    */
@@ -260,8 +424,66 @@ void extract_words_from_path(char *path, HashTable **table) {
 
   if (S_ISREG(path_stat.st_mode)) {
     /*treat as file */
-    extract_words_from_file(path, table);
+    extract_words_from_file(path, counter);
   } else if (S_ISDIR(path_stat.st_mode)) {
     fprintf(stderr, "%s: is a directory not a file\n", path);
   }
 }
+
+void *extract_words_worker(void *arg) {
+  PathQueue *queue = (PathQueue *)arg;
+  int index;
+
+  while (!counter_stopped(queue->counter) &&
+         (index = __sync_fetch_and_add(&queue->next_path, 1)) <
+             queue->num_paths) {
+    extract_words_from_path(queue->paths[index], queue->counter);
+  }
+
+  return NULL;
+}
+
+void extract_words_from_paths(char **paths, int num_paths, int num_threads,
+                              Counter *counter) {
+  /*
+   * Counts every path into the Counter. With more than one thread, the paths
+   * are handed out one at a time to threads which all increment the same
+   * (concurrent) Counter.
+   */
+  PathQueue queue;
+  pthread_t *threads;
+  int i;
+
+  queue.paths = paths;
+  queue.num_paths = num_paths;
+  queue.next_path = 0;
+  queue.counter = counter;
+
+  if (num_threads > num_paths) {
+    num_threads = num_paths;
+  }
+
+  if (num_threads <= 1) {
+    extract_words_worker(&queue);
+    return;
+  }
+
+  if (!(threads = (pthread_t *)tracked_malloc(sizeof(pthread_t) *
+                                              num_threads))) {
+    perror("failed malloc when creating threads");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, extract_words_worker, &queue) != 0) {
+      perror("failed to create thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  tracked_free(threads);
+}
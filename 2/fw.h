@@ -4,25 +4,47 @@
  * for the functions implemented in fw.c, which handles the command line
  * interface of fw, along with the retrieval and display of the top n words.
  * The program uses a positived-valued hash table to store the frequency of each
- * word.
+ * word. Compressed inputs are decoded on the fly (see decompress.h).
  */
 
 #ifndef FW_H
 #define FW_H
 
+#include "counter.h"
 #include "hash.h"
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
+/* Parsed command line flags */
+typedef struct {
+  int number_of_words;
+  char **paths;
+  int num_paths;
+  char *tar_path;
+  char *tar_prefix;
+  CounterType counter_type;
+  char *word_prefix;
+  size_t memory_limit;
+  LimitStrategy limit_strategy;
+  bool memory_report;
+  int num_threads;
+} Flags;
+
 /* Function prototypes */
 bool is_valid_number(char *param);
-void set_arguments(int argc, char *argv[], int *number_of_words, char ***paths,
-                   int *num_paths);
+void usage(void);
+void set_arguments(int argc, char *argv[], Flags *flags);
 char *read_next_word_lower(FILE *file);
-void extract_words_from_file(char *file_name, HashTable **table);
+void count_words_from_stream(FILE *file, Counter *counter);
+void extract_words_from_buffer(const char *buffer, size_t length,
+                               Counter *counter);
+void extract_words_from_file(char *file_name, Counter *counter);
 Entry **get_top_n_entries(int n, HashTable *table);
 void display_top_n_entries(int n, int total_words, Entry **top_n_entries);
-void extract_words_from_stdin(HashTable **table);
-void extract_words_from_path(char *path, HashTable **table);
+void extract_words_from_stdin(Counter *counter);
+void extract_words_from_path(char *path, Counter *counter);
+void extract_words_from_paths(char **paths, int num_paths, int num_threads,
+                              Counter *counter);
 
 #endif
@@ -8,13 +8,12 @@
  */
 
 #include "hash.h"
+#include "memory.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-extern char *strdup(const char *string);
-
 unsigned long hash_string(char *key) {
   unsigned long hash = 5381;
   int c;
@@ -94,12 +93,12 @@ void hash_table_add(HashTable **ptr_table, char *key, int value) {
 
   /*Add the first entry */
   if (currentEntry == NULL) {
-    if (!(newEntry = (Entry *)malloc(sizeof(Entry)))) {
+    if (!(newEntry = (Entry *)tracked_malloc(sizeof(Entry)))) {
       perror("failed malloc in hash_table_add when adding first entry");
       exit(EXIT_FAILURE);
     }
 
-    newEntry->key = strdup(key);
+    newEntry->key = tracked_strdup(key);
     newEntry->value = value;
     newEntry->next = NULL;
 
@@ -121,7 +120,7 @@ void hash_table_add(HashTable **ptr_table, char *key, int value) {
     currentEntry = currentEntry->next;
   }
 
-  if (!(newEntry = (Entry *)malloc(sizeof(Entry)))) {
+  if (!(newEntry = (Entry *)tracked_malloc(sizeof(Entry)))) {
     perror(
         "failed malloc in hash_table_add when appending to end of linked list");
     exit(EXIT_FAILURE);
@@ -129,7 +128,7 @@ void hash_table_add(HashTable **ptr_table, char *key, int value) {
 
   /*Create new element and append to end of linked list. */
 
-  newEntry->key = strdup(key);
+  newEntry->key = tracked_strdup(key);
   newEntry->value = value;
   newEntry->next = NULL;
 
@@ -141,10 +140,32 @@ void hash_table_add(HashTable **ptr_table, char *key, int value) {
   }
 }
 
+int hash_table_increment(HashTable **ptr_table, char *key) {
+  /*
+   *Adds one to the value of key, adding it with a value of 1 if missing.
+   *Returns the new value. The pointer may be modified during this call.
+   */
+
+  Entry *currentEntry;
+
+  currentEntry = (*ptr_table)->entries[hash_string(key) % (*ptr_table)->size];
+
+  while (currentEntry != NULL) {
+    if (strcmp(currentEntry->key, key) == 0) {
+      return ++currentEntry->value;
+    }
+
+    currentEntry = currentEntry->next;
+  }
+
+  hash_table_add(ptr_table, key, 1);
+  return 1;
+}
+
 HashTable *create_hash_table(unsigned int size) {
   HashTable *table;
 
-  if (!(table = (HashTable *)malloc(sizeof(HashTable)))) {
+  if (!(table = (HashTable *)tracked_malloc(sizeof(HashTable)))) {
     perror("failed malloc when creating HashTable");
     exit(EXIT_FAILURE);
   }
@@ -152,7 +173,7 @@ HashTable *create_hash_table(unsigned int size) {
   table->size = size;
   table->num_entries = 0;
 
-  if (!(table->entries = (Entry **)calloc(size, sizeof(Entry *)))) {
+  if (!(table->entries = (Entry **)tracked_calloc(size, sizeof(Entry *)))) {
     perror("failed malloc when creting entry pointers for table");
     exit(EXIT_FAILURE);
   }
@@ -180,13 +201,13 @@ void resize_hash_table(HashTable **table) {
       hash_table_add(&new_table, current->key, current->value);
       temp = current;
       current = current->next;
-      free(temp->key);
-      free(temp);
+      tracked_free(temp->key);
+      tracked_free(temp);
     }
   }
 
-  free((*table)->entries);
-  free(*table);
+  tracked_free((*table)->entries);
+  tracked_free(*table);
 
   *table = new_table;
 }
@@ -223,10 +244,10 @@ void hash_table_remove(HashTable *table, char *key) {
 
   /*The head is the item. */
   if (strcmp(current->key, key) == 0) {
-    free(current->key);
+    tracked_free(current->key);
     table->entries[index] = current->next;
     table->num_entries--;
-    free(current);
+    tracked_free(current);
     return;
   }
 
@@ -236,9 +257,9 @@ void hash_table_remove(HashTable *table, char *key) {
   while (current) {
     /*If item found, set previous next to current next */
     if (strcmp(current->key, key) == 0) {
-      free(current->key);
+      tracked_free(current->key);
       previous->next = current->next;
-      free(current);
+      tracked_free(current);
       table->num_entries--;
       return;
     }
@@ -262,6 +283,10 @@ int compare_entries(Entry *a, Entry *b) {
   return strcmp(a->key, b->key);
 }
 
+int compare_entry_keys(const void *a, const void *b) {
+  return strcmp((*(Entry **)a)->key, (*(Entry **)b)->key);
+}
+
 Entry *get_max_entry(HashTable *table) {
   /*
    *Returns a copy of the max-valued entry.
@@ -284,12 +309,12 @@ Entry *get_max_entry(HashTable *table) {
   }
 
   if (max_entry != NULL) {
-    if (!(entry_copy = (Entry *)malloc(sizeof(Entry)))) {
+    if (!(entry_copy = (Entry *)tracked_malloc(sizeof(Entry)))) {
       perror("failed malloc in get_max_entry");
       exit(EXIT_FAILURE);
     }
 
-    entry_copy->key = strdup(max_entry->key);
+    entry_copy->key = tracked_strdup(max_entry->key);
     entry_copy->value = max_entry->value;
     entry_copy->next = NULL;
   }
@@ -298,6 +323,184 @@ Entry *get_max_entry(HashTable *table) {
   return entry_copy;
 }
 
+void heap_sift_down(Entry **heap, int size, int index) {
+  /*Restores the min heap ordering (by compare_entries) below index */
+  int smallest;
+  int child;
+  Entry *temp;
+
+  for (;;) {
+    smallest = index;
+    child = index * 2 + 1;
+
+    if (child < size && compare_entries(heap[child], heap[smallest]) < 0) {
+      smallest = child;
+    }
+    if (child + 1 < size &&
+        compare_entries(heap[child + 1], heap[smallest]) < 0) {
+      smallest = child + 1;
+    }
+    if (smallest == index) {
+      return;
+    }
+
+    temp = heap[index];
+    heap[index] = heap[smallest];
+    heap[smallest] = temp;
+    index = smallest;
+  }
+}
+
+void heap_sift_up(Entry **heap, int index) {
+  Entry *temp;
+  int parent;
+
+  while (index > 0) {
+    parent = (index - 1) / 2;
+    if (compare_entries(heap[index], heap[parent]) >= 0) {
+      return;
+    }
+
+    temp = heap[index];
+    heap[index] = heap[parent];
+    heap[parent] = temp;
+    index = parent;
+  }
+}
+
+void top_n_offer(Entry **heap, int *size, int capacity, const char *key,
+                 int value) {
+  /*
+   *Offers a copy of (key, value) to a min heap holding the best capacity
+   *entries seen so far, evicting the smallest entry when it is full.
+   **/
+
+  Entry *entry;
+  Entry *min;
+
+  if (capacity <= 0) {
+    return;
+  }
+
+  if (*size == capacity) {
+    min = heap[0];
+    if (value < min->value ||
+        (value == min->value && strcmp(key, min->key) < 0)) {
+      return;
+    }
+  }
+
+  if (!(entry = (Entry *)tracked_malloc(sizeof(Entry)))) {
+    perror("failed malloc in top_n_offer");
+    exit(EXIT_FAILURE);
+  }
+
+  entry->key = tracked_strdup(key);
+  entry->value = value;
+  entry->next = NULL;
+
+  if (*size < capacity) {
+    heap[*size] = entry;
+    heap_sift_up(heap, (*size)++);
+    return;
+  }
+
+  tracked_free(heap[0]->key);
+  tracked_free(heap[0]);
+  heap[0] = entry;
+  heap_sift_down(heap, *size, 0);
+}
+
+int compare_entries_descending(const void *a, const void *b) {
+  return compare_entries(*(Entry **)b, *(Entry **)a);
+}
+
+void hash_table_retain_prefix(HashTable *table, const char *prefix) {
+  /*
+   *Removes every entry whose key does not start with prefix.
+   **/
+
+  size_t prefix_length = strlen(prefix);
+  unsigned int i;
+  Entry **link;
+  Entry *current;
+
+  for (i = 0; i < table->size; i++) {
+    link = &table->entries[i];
+    while ((current = *link) != NULL) {
+      if (strncmp(current->key, prefix, prefix_length) == 0) {
+        link = &current->next;
+        continue;
+      }
+
+      *link = current->next;
+      tracked_free(current->key);
+      tracked_free(current);
+      table->num_entries--;
+    }
+  }
+}
+
+unsigned int hash_table_prune(HashTable *table, int threshold) {
+  /*
+   *Removes every entry whose value is at most threshold.
+   *Returns the number of entries removed.
+   **/
+
+  unsigned int removed = 0;
+  unsigned int i;
+  Entry **link;
+  Entry *current;
+
+  for (i = 0; i < table->size; i++) {
+    link = &table->entries[i];
+    while ((current = *link) != NULL) {
+      if (current->value > threshold) {
+        link = &current->next;
+        continue;
+      }
+
+      *link = current->next;
+      tracked_free(current->key);
+      tracked_free(current);
+      table->num_entries--;
+      removed++;
+    }
+  }
+
+  return removed;
+}
+
+Entry **hash_table_sorted_entries(HashTable *table) {
+  /*
+   *Returns an array of every entry in the table sorted by key.
+   *The entries still belong to the table.
+   **/
+
+  Entry **sorted;
+  Entry *current;
+  unsigned int i;
+  unsigned int count = 0;
+
+  sorted = (Entry **)tracked_malloc(sizeof(Entry *) *
+                                    (table->num_entries > 0 ? table->num_entries
+                                                            : 1));
+  if (sorted == NULL) {
+    perror("failed malloc in hash_table_sorted_entries");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < table->size; i++) {
+    for (current = table->entries[i]; current != NULL;
+         current = current->next) {
+      sorted[count++] = current;
+    }
+  }
+
+  qsort(sorted, count, sizeof(Entry *), compare_entry_keys);
+  return sorted;
+}
+
 void free_hash_table(HashTable *table) {
   unsigned int i;
   Entry *current;
@@ -308,11 +511,11 @@ void free_hash_table(HashTable *table) {
     while (current != NULL) {
       temp = current;
       current = current->next;
-      free(temp->key);
-      free(temp);
+      tracked_free(temp->key);
+      tracked_free(temp);
     }
   }
 
-  free(table->entries);
-  free(table);
+  tracked_free(table->entries);
+  tracked_free(table);
 }
@@ -33,6 +33,7 @@ typedef struct HashTable {
 /* Function prototypes */
 HashTable *create_hash_table(unsigned int size);
 void hash_table_add(HashTable **table, char *key, int value);
+int hash_table_increment(HashTable **table, char *key);
 int hash_table_get(HashTable *table, char *key);
 unsigned long hash_string(char *key);
 bool is_prime(int num);
@@ -41,6 +42,16 @@ void resize_hash_table(HashTable **table);
 void free_hash_table(HashTable *table);
 void print_hash_table(HashTable *table);
 void hash_table_remove(HashTable *table, char *key);
+int compare_entries(Entry *a, Entry *b);
+int compare_entries_descending(const void *a, const void *b);
+int compare_entry_keys(const void *a, const void *b);
 Entry *get_max_entry(HashTable *table);
+void heap_sift_down(Entry **heap, int size, int index);
+void heap_sift_up(Entry **heap, int index);
+void top_n_offer(Entry **heap, int *size, int capacity, const char *key,
+                 int value);
+void hash_table_retain_prefix(HashTable *table, const char *prefix);
+unsigned int hash_table_prune(HashTable *table, int threshold);
+Entry **hash_table_sorted_entries(HashTable *table);
 
 #endif
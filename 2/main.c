@@ -1,47 +1,68 @@
+#include "counter.h"
 #include "fw.h"
 #include "hash.h"
+#include "memory.h"
+#include "tar.h"
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 
-#define HASH_STARTING_SIZE 5381
-
 int main(int argc, char *argv[]) {
-  int number_of_words = 10;
-  int num_paths;
-  int total_words;
-  int i;
-  char **paths;
-  HashTable *table;
+  Flags flags;
+  unsigned int total_words;
+  Counter *counter;
   Entry **top_n_entries;
+  bool stopped;
 
   /* Set command line arguments */
-  set_arguments(argc, argv, &number_of_words, &paths, &num_paths);
+  set_arguments(argc, argv, &flags);
+
+  /* A decoder writing to a counter that stopped early must not kill fw */
+  signal(SIGPIPE, SIG_IGN);
 
-  /* Create and initialize the hash table */
-  table = create_hash_table(HASH_STARTING_SIZE);
+  /* Create and initialize the counter backend */
+  counter = create_counter(flags.counter_type);
+  counter_set_limit(counter, flags.memory_limit, flags.limit_strategy);
+  counter->report_memory = flags.memory_report;
+
+  /* Process the archive, standard input or file paths */
+  if (flags.tar_path != NULL) {
+    extract_words_from_tar(flags.tar_path, flags.tar_prefix, counter);
+  }
 
-  /* Process standard input or file paths */
-  if (num_paths == 0) {
-    extract_words_from_stdin(&table);
+  if (flags.num_paths == 0 && flags.tar_path == NULL) {
+    extract_words_from_stdin(counter);
   } else {
-    for (i = 0; i < num_paths; i++) {
-      extract_words_from_path(paths[i], &table);
-    }
+    extract_words_from_paths(flags.paths, flags.num_paths, flags.num_threads,
+                             counter);
   }
 
-  /* Calculate the total number of words in the table */
-  total_words = table->num_entries;
+  if (flags.memory_report) {
+    counter_report_memory(counter);
+  }
+
+  stopped = counter_stopped(counter);
+  if (stopped) {
+    fprintf(stderr, "fw: memory limit of %lu bytes reached, the counts below "
+                    "are partial\n",
+            (unsigned long)flags.memory_limit);
+  } else if (counter->error_bound > 0) {
+    fprintf(stderr, "fw: memory limit reached, counts may be up to %d too "
+                    "low\n",
+            counter->error_bound);
+  }
 
-  /* Get the top n entries */
-  top_n_entries = get_top_n_entries(number_of_words, table);
+  /* Get the top n entries, optionally only those starting with a prefix */
+  top_n_entries = counter_top_n(counter, flags.number_of_words,
+                                flags.word_prefix, &total_words);
 
   /* Display the top n entries */
-  display_top_n_entries(number_of_words, total_words, top_n_entries);
+  display_top_n_entries(flags.number_of_words, total_words, top_n_entries);
 
   /* Free allocated memory */
-  free_hash_table(table);
-  free(top_n_entries);
+  free_counter(counter);
+  tracked_free(top_n_entries);
 
   /* Exit the program */
-  return 0;
+  return stopped ? 1 : 0;
 }
@@ -0,0 +1,187 @@
+/*
+ *File: memory.c
+ *This file contains the accounting allocator used by fw.
+ *Allocations are forwarded to malloc and the usable size of every block is
+ *added to (or, when freed, removed from) a running total, which also tracks
+ *its peak. Pointers returned by these functions must be released with
+ *tracked_free or tracked_realloc to keep the totals accurate.
+ */
+
+#include "memory.h"
+#include <ctype.h>
+#include <errno.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STATM_PATH "/proc/self/statm"
+
+extern int posix_memalign(void **ptr, size_t alignment, size_t size);
+
+static size_t bytes_in_use = 0;
+static size_t bytes_peak = 0;
+
+void memory_account(size_t size) {
+  size_t total = __sync_add_and_fetch(&bytes_in_use, size);
+  size_t peak;
+
+  /* Raise the peak unless another thread already raised it further */
+  while ((peak = __atomic_load_n(&bytes_peak, __ATOMIC_RELAXED)) < total &&
+         !__sync_bool_compare_and_swap(&bytes_peak, peak, total))
+    ;
+  /*do nothing */
+}
+
+void *tracked_malloc(size_t size) {
+  void *ptr = malloc(size);
+
+  if (ptr != NULL) {
+    memory_account(malloc_usable_size(ptr));
+  }
+
+  return ptr;
+}
+
+void *tracked_calloc(size_t count, size_t size) {
+  void *ptr = calloc(count, size);
+
+  if (ptr != NULL) {
+    memory_account(malloc_usable_size(ptr));
+  }
+
+  return ptr;
+}
+
+void *tracked_aligned_calloc(size_t count, size_t size, size_t alignment) {
+  /*
+   * Like tracked_calloc, but the block starts on a multiple of alignment (a
+   * power of two multiple of sizeof(void *)). It must not be passed to
+   * tracked_realloc, which would lose the alignment.
+   */
+  void *ptr;
+
+  if (size != 0 && count > (size_t)-1 / size) {
+    return NULL;
+  }
+
+  if (posix_memalign(&ptr, alignment, count * size) != 0) {
+    return NULL;
+  }
+
+  memset(ptr, 0, count * size);
+  memory_account(malloc_usable_size(ptr));
+  return ptr;
+}
+
+void *tracked_realloc(void *ptr, size_t size) {
+  size_t old_size = ptr == NULL ? 0 : malloc_usable_size(ptr);
+  void *new_ptr = realloc(ptr, size);
+
+  if (new_ptr != NULL) {
+    __sync_sub_and_fetch(&bytes_in_use, old_size);
+    memory_account(malloc_usable_size(new_ptr));
+  }
+
+  return new_ptr;
+}
+
+char *tracked_strdup(const char *string) {
+  size_t length = strlen(string) + 1;
+  char *copy = (char *)tracked_malloc(length);
+
+  if (copy != NULL) {
+    memcpy(copy, string, length);
+  }
+
+  return copy;
+}
+
+void tracked_free(void *ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+
+  __sync_sub_and_fetch(&bytes_in_use, malloc_usable_size(ptr));
+  free(ptr);
+}
+
+size_t memory_in_use(void) {
+  return __atomic_load_n(&bytes_in_use, __ATOMIC_RELAXED);
+}
+
+size_t memory_peak(void) {
+  return __atomic_load_n(&bytes_peak, __ATOMIC_RELAXED);
+}
+
+void memory_reset_peak(void) { bytes_peak = bytes_in_use; }
+
+size_t memory_rss(void) {
+  /*
+   *Returns the resident set size of the process in bytes, or 0 if it can
+   *not be determined.
+   */
+  FILE *statm = fopen(STATM_PATH, "r");
+  unsigned long pages;
+  unsigned long resident;
+
+  if (statm == NULL) {
+    return 0;
+  }
+
+  if (fscanf(statm, "%lu %lu", &pages, &resident) != 2) {
+    resident = 0;
+  }
+
+  fclose(statm);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+int parse_memory_size(const char *string, size_t *size) {
+  /*
+   *Parses a size such as 512, 64K, 100M or 2G into bytes.
+   *Returns 0 on success and -1 if the string is not a valid size or does
+   *not fit in a size_t.
+   */
+  char *end;
+  unsigned long value;
+  size_t multiplier = 1;
+
+  errno = 0;
+  value = strtoul(string, &end, 10);
+
+  if (end == string || !isdigit((unsigned char)string[0]) ||
+      errno == ERANGE) {
+    return -1;
+  }
+
+  switch (toupper((unsigned char)*end)) {
+  case 'G':
+    multiplier *= 1024;
+    /* fall through */
+  case 'M':
+    multiplier *= 1024;
+    /* fall through */
+  case 'K':
+    multiplier *= 1024;
+    end++;
+    break;
+  case '\0':
+    break;
+  default:
+    return -1;
+  }
+
+  if (*end != '\0' &&
+      !(toupper((unsigned char)*end) == 'B' && end[1] == '\0')) {
+    return -1;
+  }
+
+  if (value > (size_t)-1 / multiplier) {
+    return -1;
+  }
+
+  *size = (size_t)value * multiplier;
+  return 0;
+}
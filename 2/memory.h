@@ -0,0 +1,29 @@
+/*
+ * memory.h
+ *
+ * This header file contains the declarations of the accounting allocator used
+ * by fw. Every tracked allocation adds the usable size reported by the
+ * allocator to a global total, so fw always knows how many bytes its counters
+ * hold and can react before the machine runs out of memory. The totals are
+ * updated atomically, so tracked memory may be used from several threads.
+ */
+
+#ifndef MEMORY_H
+#define MEMORY_H
+
+#include <stddef.h>
+
+/* Function prototypes */
+void *tracked_malloc(size_t size);
+void *tracked_calloc(size_t count, size_t size);
+void *tracked_aligned_calloc(size_t count, size_t size, size_t alignment);
+void *tracked_realloc(void *ptr, size_t size);
+char *tracked_strdup(const char *string);
+void tracked_free(void *ptr);
+size_t memory_in_use(void);
+size_t memory_peak(void);
+void memory_reset_peak(void);
+size_t memory_rss(void);
+int parse_memory_size(const char *string, size_t *size);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+ * File: tar.c
+ * Counts the words of the regular files inside a ustar archive without
+ * extracting them. The archive is mapped read-only, the 512-byte headers are
+ * walked in order, and the contents of every regular member (optionally only
+ * those whose path starts with a prefix) are tokenized straight from the
+ * mapping. Padding and non-regular members are skipped.
+ */
+
+#include "tar.h"
+#include "counter.h"
+#include "fw.h"
+#include "hash.h"
+#include "header.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern size_t strnlen(const char *string, size_t max_length);
+
+#define OCTAL_BASE 8
+#define CHKSUM_OFFSET 148
+#define CHKSUM_LENGTH 8
+
+/* Returns true if every byte of the block is zero */
+bool is_zero_block(const unsigned char *block) {
+  int i;
+
+  for (i = 0; i < TAR_BLOCK; i++) {
+    if (block[i] != 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/* Parses a NUL or space terminated octal field. */
+long parse_octal(const unsigned char *field, size_t length) {
+  long value = 0;
+  size_t i = 0;
+
+  while (i < length && field[i] == ' ') {
+    i++;
+  }
+
+  for (; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+    value = value * OCTAL_BASE + (field[i] - '0');
+  }
+
+  return value;
+}
+
+/* Returns true if the header has the ustar magic and a matching checksum */
+bool is_valid_tar_header(const TarHeader *header) {
+  const unsigned char *bytes = (const unsigned char *)header;
+  long sum = 0;
+  int i;
+
+  if (memcmp(header->magic, "ustar", 5) != 0) {
+    return false;
+  }
+
+  /* The checksum field itself is summed as if it were all spaces */
+  for (i = 0; i < TAR_BLOCK; i++) {
+    if (i >= CHKSUM_OFFSET && i < CHKSUM_OFFSET + CHKSUM_LENGTH) {
+      sum += ' ';
+    } else {
+      sum += bytes[i];
+    }
+  }
+
+  return sum == parse_octal(header->chksum, sizeof(header->chksum));
+}
+
+/* Returns the size of a member, supporting the GNU base-256 extension, or
+ * -1 if it does not fit in a long */
+long tar_member_size(const TarHeader *header) {
+  long size = 0;
+  size_t i;
+
+  if (header->size[0] & 0x80) {
+    size = header->size[0] & 0x7f;
+    for (i = 1; i < sizeof(header->size); i++) {
+      if (size > LONG_MAX >> 8) {
+        return -1;
+      }
+      size = (size << 8) | header->size[i];
+    }
+    return size;
+  }
+
+  return parse_octal(header->size, sizeof(header->size));
+}
+
+/* Joins the prefix and name fields of a header into full_name, which must
+ * hold TAR_NAME_MAX bytes. */
+void tar_member_name(const TarHeader *header, char *full_name) {
+  int prefix_length = strnlen((const char *)header->prefix,
+                              sizeof(header->prefix));
+  int name_length = strnlen((const char *)header->name, sizeof(header->name));
+
+  if (prefix_length > 0) {
+    sprintf(full_name, "%.*s/%.*s", prefix_length, header->prefix, name_length,
+            header->name);
+  } else {
+    sprintf(full_name, "%.*s", name_length, header->name);
+  }
+}
+
+int extract_words_from_tar(char *path, char *prefix, Counter *counter) {
+  /*
+   * Tokenizes every regular member of the archive at path into counter.
+   * Members are only counted if their path begins with prefix (when prefix
+   * is not NULL). Returns the number of members counted or -1 on error.
+   */
+  struct stat archive_stat;
+  unsigned char *archive;
+  const TarHeader *header;
+  char name[TAR_NAME_MAX];
+  size_t offset = 0;
+  size_t prefix_length = prefix == NULL ? 0 : strlen(prefix);
+  long size;
+  int counted = 0;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    perror(path);
+    return -1;
+  }
+
+  if (fstat(fd, &archive_stat) == -1) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+
+  if (archive_stat.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+
+  archive = (unsigned char *)mmap(NULL, archive_stat.st_size, PROT_READ,
+                                  MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (archive == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+
+  while (offset + TAR_BLOCK <= (size_t)archive_stat.st_size &&
+         !counter_stopped(counter)) {
+    header = (const TarHeader *)(archive + offset);
+
+    /* The archive ends with zero blocks */
+    if (is_zero_block(archive + offset)) {
+      break;
+    }
+
+    if (!is_valid_tar_header(header)) {
+      fprintf(stderr, "%s: invalid tar header at offset %lu\n", path,
+              (unsigned long)offset);
+      counted = -1;
+      break;
+    }
+
+    size = tar_member_size(header);
+    offset += TAR_BLOCK;
+
+    if (size < 0 || offset + size > (size_t)archive_stat.st_size) {
+      fprintf(stderr, "%s: truncated archive\n", path);
+      counted = -1;
+      break;
+    }
+
+    /* Only regular files have contents worth counting */
+    if (header->typeflag == '0' || header->typeflag == '\0') {
+      tar_member_name(header, name);
+
+      if (prefix == NULL || strncmp(name, prefix, prefix_length) == 0) {
+        extract_words_from_buffer((const char *)archive + offset, size,
+                                  counter);
+        counted++;
+      }
+    }
+
+    /* Skip the contents and the padding up to the next header */
+    offset += (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+  }
+
+  munmap(archive, archive_stat.st_size);
+  return counted;
+}
@@ -0,0 +1,29 @@
+/*
+ * File: tar.h
+ * This header file contains the declarations used to count the words of the
+ * regular files stored inside a ustar archive (the format written by mytar in
+ * project 4) without extracting them. The archive is mapped into memory and
+ * every member is tokenized in place.
+ */
+
+#ifndef TAR_H
+#define TAR_H
+
+#include "counter.h"
+#include "header.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TAR_BLOCK 512
+/* The prefix, the '/' joining it to the name, the name and the NUL */
+#define TAR_NAME_MAX                                                           \
+  (sizeof(((TarHeader *)0)->prefix) + 1 + sizeof(((TarHeader *)0)->name) + 1)
+
+/* Function prototypes */
+bool is_valid_tar_header(const TarHeader *header);
+bool is_zero_block(const unsigned char *block);
+long tar_member_size(const TarHeader *header);
+void tar_member_name(const TarHeader *header, char *full_name);
+int extract_words_from_tar(char *path, char *prefix, Counter *counter);
+
+#endif
@@ -5,9 +5,18 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "concurrent_hash.h"
+#include "counter.h"
+#include "decompress.h"
 #include "fw.h"
 #include "hash.h"
+#include "memory.h"
+#include "tar.h"
 #include "test.h"
+#include "trie.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 void test_hash() {
   assert(hash_string("") == 5381);
@@ -140,18 +149,485 @@ void test_hash_resize() {
 
 void test_extract_words_from_file() {
   char *path = "files/test_fw.txt";
+  Counter *counter = create_counter(COUNTER_HASH);
+
+  extract_words_from_path(path, counter);
+
+  assert(counter_get(counter, "hello") == 1);
+
+  assert(counter_get(counter, "devin") == 1);
+  assert(counter_get(counter, "my") == 2);
+
+  free_counter(counter);
+}
+
+void test_detect_compression() {
+  char *paths[] = {"files/test_fw.txt",      "files/test_fw.txt.gz",
+                   "files/test_fw.txt.huff", "files/test_fw.txt.hf",
+                   "files/test_fw.txt.hf2",  "files/test_fw.txt.hf3",
+                   "files/test_fw.txt.hf4",  "files/test_fw.txt.hf5",
+                   "files/test_fw.txt.hf6",  "files/test_fw.txt.hf7",
+                   "files/test_fw.txt.hf8",  "files/test_fw.txt.hf9"};
+  CompressionType types[] = {
+      COMPRESSION_NONE,    COMPRESSION_GZIP,    COMPRESSION_HENCODE,
+      COMPRESSION_HENCODE, COMPRESSION_HENCODE, COMPRESSION_HENCODE,
+      COMPRESSION_HENCODE, COMPRESSION_HENCODE, COMPRESSION_HENCODE,
+      COMPRESSION_HENCODE, COMPRESSION_HENCODE, COMPRESSION_UNSUPPORTED};
+  int fd;
+  int i;
+
+  /* Detection leaves the file at its start for the decoder */
+  for (i = 0; i < (int)(sizeof(paths) / sizeof(paths[0])); i++) {
+    fd = open(paths[i], O_RDONLY);
+    assert(detect_compression(fd) == types[i]);
+    assert(lseek(fd, 0, SEEK_CUR) == 0);
+    close(fd);
+  }
+}
+
+void test_extract_words_from_compressed_file() {
+  char *paths[] = {"files/test_fw.txt.huff", "files/test_fw.txt.hf",
+                   "files/test_fw.txt.hf2", "files/test_fw.txt.hf3",
+                   "files/test_fw.txt.hf4", "files/test_fw.txt.hf5",
+                   "files/test_fw.txt.hf6", "files/test_fw.txt.hf7",
+                   "files/test_fw.txt.hf8", "files/test_fw.txt.stored.hf3",
+                   "files/test_fw.txt.wide.hf", "files/test_fw.txt.wide.hf6",
+                   "files/test_fw.txt.gz"};
+  Counter *counter;
+  int i;
+
+  for (i = 0; i < (int)(sizeof(paths) / sizeof(paths[0])); i++) {
+    counter = create_counter(COUNTER_HASH);
+
+    extract_words_from_path(paths[i], counter);
+
+    assert(counter_num_entries(counter) == 7);
+    assert(counter_get(counter, "hello") == 1);
+    assert(counter_get(counter, "devin") == 1);
+    assert(counter_get(counter, "my") == 2);
+
+    free_counter(counter);
+  }
+
+  /* A file of an unknown hencode version is not read as text */
+  counter = create_counter(COUNTER_HASH);
+  extract_words_from_path("files/test_fw.txt.hf9", counter);
+  assert(counter_num_entries(counter) == 0);
+  free_counter(counter);
+}
+
+void test_extract_words_from_buffer() {
+  char *text = "Hello my-MY friend";
+  Counter *counter = create_counter(COUNTER_HASH);
+
+  /* The final word is cut by the length, not by a separator */
+  extract_words_from_buffer(text, strlen(text) - 3, counter);
+
+  assert(counter_num_entries(counter) == 3);
+  assert(counter_get(counter, "hello") == 1);
+  assert(counter_get(counter, "my") == 2);
+  assert(counter_get(counter, "fri") == 1);
+
+  free_counter(counter);
+}
+
+void test_extract_words_from_tar() {
+  Counter *counter = create_counter(COUNTER_HASH);
+  char path[TAR_NAME_MAX];
+  int i;
+
+  assert(extract_words_from_tar("files/test_fw.tar", NULL, counter) == 1);
+  assert(counter_get(counter, "hello") == 1);
+  assert(counter_get(counter, "my") == 2);
+  free_counter(counter);
+
+  /* Members outside of the prefix are skipped */
+  counter = create_counter(COUNTER_HASH);
+  assert(extract_words_from_tar("files/test_fw.tar", "logs/", counter) == 0);
+  assert(counter_num_entries(counter) == 0);
+  free_counter(counter);
+
+  /* A member with the longest prefix (155 bytes) and name (100 bytes, not
+   * terminated), matched on the whole joined path */
+  memset(path, 'd', 155);
+  for (i = 30; i < 155; i += 31) {
+    path[i] = '/';
+  }
+  path[154] = 'x';
+  path[155] = '/';
+  memset(path + 156, 'n', 100);
+  path[256] = '\0';
+  assert(strlen(path) == TAR_NAME_MAX - 1);
+
+  counter = create_counter(COUNTER_HASH);
+  assert(extract_words_from_tar("files/test_fw_long.tar", path, counter) == 1);
+  assert(counter_get(counter, "words") == 1);
+  free_counter(counter);
+}
+
+void test_tar_member_size() {
+  TarHeader header;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.size, "00000001750", 11);
+  assert(tar_member_size(&header) == 1000);
+
+  /* Base-256 sizes are accepted up to what a long holds */
+  memset(header.size, 0, sizeof(header.size));
+  header.size[0] = 0x80;
+  header.size[sizeof(header.size) - 1] = 0x10;
+  assert(tar_member_size(&header) == 16);
+
+  memset(header.size, 0xFF, sizeof(header.size));
+  assert(tar_member_size(&header) == -1);
+}
+
+void test_trie_increment_get() {
+  Trie *trie = create_trie();
+
+  assert(trie_increment(trie, "error") == 1);
+  assert(trie_increment(trie, "err") == 1);
+  assert(trie_increment(trie, "errno") == 1);
+  assert(trie_increment(trie, "error") == 2);
+  assert(trie_increment(trie, "e") == 1);
+
+  assert(trie->num_entries == 4);
+  assert(trie_get(trie, "error") == 2);
+  assert(trie_get(trie, "err") == 1);
+  assert(trie_get(trie, "errno") == 1);
+  assert(trie_get(trie, "e") == 1);
+
+  /* Prefixes of keys that were never counted are not found */
+  assert(trie_get(trie, "er") == -1);
+  assert(trie_get(trie, "errors") == -1);
+  assert(trie_get(trie, "") == -1);
+
+  assert(trie->root->max_count == 2);
+
+  free_trie(trie);
+}
+
+void test_trie_long_key() {
+  char key[700];
+  Trie *trie = create_trie();
+
+  /* Keys longer than an inline prefix are split across nodes */
+  memset(key, 'a', sizeof(key) - 1);
+  key[sizeof(key) - 1] = '\0';
+
+  assert(trie_increment(trie, key) == 1);
+  assert(trie_increment(trie, key) == 2);
+  key[400] = '\0';
+  assert(trie_get(trie, key) == -1);
+  assert(trie_increment(trie, key) == 1);
+  assert(trie->num_entries == 2);
+
+  free_trie(trie);
+}
+
+void check_ascending_key(const char *key, int count, void *arg) {
+  int *last = (int *)arg;
+
+  assert((unsigned char)key[0] > *last && count > 0);
+  *last = (unsigned char)key[0];
+}
+
+void test_trie_node_classes() {
+  char key[2] = {0, 0};
+  Trie *trie = create_trie();
+  Entry *top_n[1];
+  int last = 0;
+  int i;
+
+  /* The root moves through every node class as its fanout grows */
+  for (i = 1; i < TRIE_FANOUT_MAX; i++) {
+    key[0] = (char)i;
+    trie_increment(trie, key);
+    if (i % 50 == 0) {
+      trie_increment(trie, key);
+    }
+
+    if (i == TRIE_NODE4) {
+      assert(trie->root->capacity == TRIE_NODE4);
+    } else if (i == TRIE_NODE4 + 1 || i == TRIE_NODE16) {
+      assert(trie->root->capacity == TRIE_NODE16);
+    } else if (i == TRIE_NODE16 + 1 || i == TRIE_NODE48) {
+      assert(trie->root->capacity == TRIE_NODE48);
+    } else if (i == TRIE_NODE48 + 1) {
+      assert(trie->root->capacity == TRIE_NODE256);
+    }
+  }
+
+  for (i = 1; i < TRIE_FANOUT_MAX; i++) {
+    key[0] = (char)i;
+    assert(trie_get(trie, key) == (i % 50 == 0 ? 2 : 1));
+  }
+
+  trie_visit(trie, check_ascending_key, &last);
+  assert(last == TRIE_FANOUT_MAX - 1);
+
+  /* Pruning shrinks the root into the smallest class holding the rest */
+  trie_prune(trie, 1);
+  assert(trie->num_entries == 5);
+  assert(trie->root->capacity == TRIE_NODE16);
+
+  key[0] = (char)200;
+  assert(trie_get(trie, key) == 2);
+  key[0] = (char)201;
+  assert(trie_get(trie, key) == -1);
+
+  assert(trie_top_n(trie, 1, NULL, top_n) == 1 && top_n[0]->value == 2);
+  tracked_free(top_n[0]->key);
+  tracked_free(top_n[0]);
+
+  free_trie(trie);
+}
+
+void test_trie_top_n() {
+  Trie *trie = create_trie();
+  Entry *top_n[3];
+  int i;
+
+  trie_increment(trie, "errno");
+  trie_increment(trie, "error");
+  trie_increment(trie, "error");
+  trie_increment(trie, "err");
+  trie_increment(trie, "warn");
+  trie_increment(trie, "warn");
+  trie_increment(trie, "warn");
+
+  /* Ties are broken the same way as get_max_entry */
+  assert(trie_top_n(trie, 3, NULL, top_n) == 3);
+  assert(strcmp(top_n[0]->key, "warn") == 0 && top_n[0]->value == 3);
+  assert(strcmp(top_n[1]->key, "error") == 0 && top_n[1]->value == 2);
+  assert(strcmp(top_n[2]->key, "errno") == 0 && top_n[2]->value == 1);
+
+  for (i = 0; i < 3; i++) {
+    tracked_free(top_n[i]->key);
+    tracked_free(top_n[i]);
+  }
+
+  /* The prefix may end inside a compressed node */
+  assert(trie_top_n(trie, 3, "erro", top_n) == 1);
+  assert(strcmp(top_n[0]->key, "error") == 0);
+  tracked_free(top_n[0]->key);
+  tracked_free(top_n[0]);
+
+  assert(trie_top_n(trie, 3, "x", top_n) == 0);
+
+  free_trie(trie);
+}
+
+void test_counter_top_n_prefix() {
+  CounterType types[] = {COUNTER_HASH, COUNTER_TRIE};
+  Counter *counter;
+  Entry **top_n;
+  unsigned int total_words;
+  int i;
+
+  for (i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++) {
+    counter = create_counter(types[i]);
+    extract_words_from_path("files/test_fw.txt", counter);
+
+    top_n = counter_top_n(counter, 5, "m", &total_words);
+
+    assert(total_words == 7);
+    assert(strcmp(top_n[0]->key, "my") == 0 && top_n[0]->value == 2);
+    assert(top_n[1] == NULL);
+
+    tracked_free(top_n[0]->key);
+    tracked_free(top_n[0]);
+    tracked_free(top_n);
+    free_counter(counter);
+  }
+}
+
+void test_counter_spill() {
+  CounterType types[] = {COUNTER_HASH, COUNTER_TRIE};
+  Counter *counter;
+  Entry **top_n;
+  unsigned int total_words;
+  int i;
+  int j;
+
+  for (i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++) {
+    counter = create_counter(types[i]);
+    extract_words_from_path("files/test_fw.txt", counter);
+    counter_spill(counter);
+    assert(counter->num_runs == 1 && counter_num_entries(counter) == 0);
+
+    extract_words_from_path("files/test_fw.txt", counter);
+    counter_increment(counter, "zebra");
+
+    top_n = counter_top_n(counter, 3, NULL, &total_words);
+
+    assert(total_words == 8);
+    assert(strcmp(top_n[0]->key, "my") == 0 && top_n[0]->value == 4);
+    assert(strcmp(top_n[1]->key, "is") == 0 && top_n[1]->value == 4);
+    assert(strcmp(top_n[2]->key, "what") == 0 && top_n[2]->value == 2);
+
+    for (j = 0; j < 3; j++) {
+      tracked_free(top_n[j]->key);
+      tracked_free(top_n[j]);
+    }
+    tracked_free(top_n);
+    free_counter(counter);
+  }
+}
+
+void test_counter_memory_limit() {
+  Counter *counter = create_counter(COUNTER_HASH);
+  Entry **top_n;
+  unsigned int total_words;
+
+  /* Any word goes over a one byte limit, so counting stops at once */
+  counter_set_limit(counter, 1, LIMIT_ABORT);
+  extract_words_from_path("files/test_fw.txt", counter);
+
+  assert(counter_stopped(counter));
+  assert(counter->words_counted == 1);
+
+  top_n = counter_top_n(counter, 1, NULL, &total_words);
+  assert(total_words == 1 && strcmp(top_n[0]->key, "hello") == 0);
+
+  tracked_free(top_n[0]->key);
+  tracked_free(top_n[0]);
+  tracked_free(top_n);
+  free_counter(counter);
+}
+
+void test_hash_table_prune() {
   HashTable *table = create_hash_table(11);
+  Entry **sorted;
 
-  extract_words_from_path(path, &table);
+  hash_table_add(&table, "yeet", 1);
+  hash_table_add(&table, "meat", 2);
+  hash_table_add(&table, "sheet", 3);
+  hash_table_add(&table, "feet", 1);
 
-  assert(hash_table_get(table, "hello") == 1);
+  assert(hash_table_prune(table, 1) == 2);
+  assert(table->num_entries == 2);
+  assert(hash_table_get(table, "yeet") == -1);
 
-  assert(hash_table_get(table, "devin") == 1);
-  assert(hash_table_get(table, "my") == 2);
+  sorted = hash_table_sorted_entries(table);
+  assert(strcmp(sorted[0]->key, "meat") == 0);
+  assert(strcmp(sorted[1]->key, "sheet") == 0);
 
+  tracked_free(sorted);
   free_hash_table(table);
 }
 
+void test_trie_prune() {
+  Trie *trie = create_trie();
+
+  trie_increment(trie, "test");
+  trie_increment(trie, "tested");
+  trie_increment(trie, "tested");
+  trie_increment(trie, "tester");
+  trie_increment(trie, "team");
+
+  trie_prune(trie, 1);
+
+  assert(trie->num_entries == 1);
+  assert(trie_get(trie, "tested") == 2);
+  assert(trie_get(trie, "test") == -1);
+  assert(trie_get(trie, "tester") == -1);
+
+  trie_increment(trie, "tester");
+  assert(trie_get(trie, "tester") == 1);
+  assert(trie_get(trie, "tested") == 2);
+
+  free_trie(trie);
+}
+
+void test_parse_memory_size() {
+  size_t size;
+
+  assert(parse_memory_size("512", &size) == 0 && size == 512);
+  assert(parse_memory_size("64K", &size) == 0 && size == 64 * 1024);
+  assert(parse_memory_size("100MB", &size) == 0 &&
+         size == 100 * 1024 * 1024);
+  assert(parse_memory_size("2g", &size) == 0 &&
+         size == 2UL * 1024 * 1024 * 1024);
+  assert(parse_memory_size("", &size) == -1);
+  assert(parse_memory_size("-1M", &size) == -1);
+  assert(parse_memory_size("12X", &size) == -1);
+  assert(parse_memory_size("12KBB", &size) == -1);
+  assert(parse_memory_size("99999999999G", &size) == -1);
+  assert(parse_memory_size("99999999999999999999", &size) == -1);
+}
+
+void test_tracked_memory() {
+  size_t before = memory_in_use();
+  char *block = (char *)tracked_malloc(1000);
+
+  assert(memory_in_use() >= before + 1000);
+  assert(memory_peak() >= memory_in_use());
+
+  block = (char *)tracked_realloc(block, 4000);
+  assert(memory_in_use() >= before + 4000);
+
+  tracked_free(block);
+  assert(memory_in_use() == before);
+}
+
+void *increment_shared_keys(void *arg) {
+  char key[2] = {0, 0};
+  int i;
+
+  for (i = 0; i < 26 * 1000; i++) {
+    key[0] = 'a' + i % 26;
+    concurrent_hash_table_increment((ConcurrentHashTable *)arg, key);
+  }
+
+  return NULL;
+}
+
+void test_concurrent_hash_table() {
+  ConcurrentHashTable *table = create_concurrent_hash_table(2, 11);
+  pthread_t threads[4];
+  Entry *top_n[3];
+  int i;
+
+  assert(table->num_shards == 4);
+
+  /* Every shard fills a cache line of its own */
+  assert(sizeof(HashShard) == CACHE_LINE_SIZE);
+  assert((size_t)table->shards % CACHE_LINE_SIZE == 0);
+
+  assert(concurrent_hash_table_increment(table, "yeet") == 1);
+  assert(concurrent_hash_table_increment(table, "yeet") == 2);
+  assert(concurrent_hash_table_get(table, "yeet") == 2);
+  assert(concurrent_hash_table_get(table, "meat") == -1);
+  assert(concurrent_hash_table_prune(table, 2) == 1);
+
+  /* Every thread increments the same keys, none of the increments is lost */
+  for (i = 0; i < 4; i++) {
+    pthread_create(&threads[i], NULL, increment_shared_keys, table);
+  }
+  for (i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  assert(concurrent_hash_table_num_entries(table) == 26);
+  assert(concurrent_hash_table_get(table, "q") == 4000);
+
+  concurrent_hash_table_increment(table, "z");
+  concurrent_hash_table_increment(table, "y");
+  concurrent_hash_table_increment(table, "z");
+
+  assert(concurrent_hash_table_top_n(table, 3, NULL, top_n) == 3);
+  assert(strcmp(top_n[0]->key, "z") == 0 && top_n[0]->value == 4002);
+  assert(strcmp(top_n[1]->key, "y") == 0 && top_n[1]->value == 4001);
+  assert(top_n[2]->value == 4000);
+
+  for (i = 0; i < 3; i++) {
+    tracked_free(top_n[i]->key);
+    tracked_free(top_n[i]);
+  }
+  free_concurrent_hash_table(table);
+}
+
 void test_get_max_entry() {
   HashTable *table = create_hash_table(11);
   Entry *max_entry;
@@ -170,8 +646,8 @@ void test_get_max_entry() {
   hash_table_remove(table, "street");
   assert(max_entry->value == 5);
 
-  free(max_entry->key);
-  free(max_entry);
+  tracked_free(max_entry->key);
+  tracked_free(max_entry);
   free_hash_table(table);
 }
 
@@ -200,15 +676,25 @@ void test_get_top_n_entries() {
   free_hash_table(table);
   for (i = 0; i < 5; i++) {
 
-    free(top_5_entries[i]->key);
-    free(top_5_entries[i]);
+    tracked_free(top_5_entries[i]->key);
+    tracked_free(top_5_entries[i]);
   }
 
-  free(top_5_entries);
+  tracked_free(top_5_entries);
 }
 
 void test_fw() {
   test_extract_words_from_file();
+  test_detect_compression();
+  test_extract_words_from_compressed_file();
+  test_extract_words_from_buffer();
+  test_extract_words_from_tar();
+  test_tar_member_size();
+  test_counter_top_n_prefix();
+  test_counter_spill();
+  test_counter_memory_limit();
+  test_parse_memory_size();
+  test_tracked_memory();
   test_get_top_n_entries();
 }
 
@@ -219,10 +705,21 @@ void test_hash_map() {
   test_hash_resize();
   test_hash_remove();
   test_get_max_entry();
+  test_hash_table_prune();
+  test_concurrent_hash_table();
+}
+
+void test_trie() {
+  test_trie_increment_get();
+  test_trie_long_key();
+  test_trie_node_classes();
+  test_trie_top_n();
+  test_trie_prune();
 }
 
 int main(void) {
   test_hash_map();
+  test_trie();
   test_fw();
   return 0;
 }
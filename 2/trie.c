@@ -0,0 +1,710 @@
+/*
+ *File: trie.c
+ *This file contains the implementation of a path-compressed trie which counts
+ *string keys. Chains of single-child nodes are collapsed into a prefix stored
+ *inline in the node, and each node keeps the way to its children in the same
+ *allocation, using the Node4, Node16, Node48 or Node256 layout described in
+ *trie.h as its fanout grows.
+ *
+ *Each node caches the maximum count of its subtree, so top n queries (which
+ *may be limited to keys with a given prefix) prune every subtree whose best
+ *count cannot enter the result.
+ */
+
+#include "trie.h"
+#include "hash.h"
+#include "memory.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define POINTER_ALIGN(n) (((n) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+#define KEY_HUNK 64
+
+/* State shared by the recursive top n search */
+typedef struct {
+  Entry **heap;
+  int size;
+  int capacity;
+  char *key;
+  size_t key_length;
+  size_t key_capacity;
+} TrieSearch;
+
+unsigned char *node_prefix(TrieNode *node) {
+  return (unsigned char *)(node + 1);
+}
+
+unsigned char *node_keys(TrieNode *node) {
+  return node_prefix(node) + node->prefix_length;
+}
+
+size_t node_keys_size(int capacity) {
+  /*
+   *Returns the size of the bytes leading to the children: one branch byte
+   *per child in the sorted classes, an index of every byte in a Node48 and
+   *nothing in a Node256, whose children are indexed by the byte itself.
+   */
+  if (capacity <= TRIE_NODE16) {
+    return capacity;
+  }
+
+  return capacity == TRIE_NODE48 ? TRIE_FANOUT_MAX : 0;
+}
+
+TrieNode **node_children(TrieNode *node) {
+  return (TrieNode **)((unsigned char *)node +
+                       POINTER_ALIGN(sizeof(TrieNode) + node->prefix_length +
+                                     node_keys_size(node->capacity)));
+}
+
+size_t trie_node_size(int prefix_length, int capacity) {
+  return POINTER_ALIGN(sizeof(TrieNode) + prefix_length +
+                       node_keys_size(capacity)) +
+         capacity * sizeof(TrieNode *);
+}
+
+int grow_capacity(int capacity) {
+  /*
+   *Returns the child capacity following capacity. Leaves have no room for
+   *children and small nodes double until they are a Node4, after which the
+   *node moves through the larger classes.
+   */
+  if (capacity < TRIE_NODE4) {
+    return capacity == 0 ? 1 : capacity * 2;
+  }
+
+  if (capacity == TRIE_NODE4) {
+    return TRIE_NODE16;
+  }
+
+  return capacity == TRIE_NODE16 ? TRIE_NODE48 : TRIE_NODE256;
+}
+
+TrieNode *create_trie_node(const unsigned char *prefix, int prefix_length,
+                           int capacity) {
+  TrieNode *node;
+  TrieNode **children;
+  int i;
+
+  node = (TrieNode *)tracked_malloc(trie_node_size(prefix_length, capacity));
+
+  if (node == NULL) {
+    perror("failed malloc when creating TrieNode");
+    exit(EXIT_FAILURE);
+  }
+
+  node->count = 0;
+  node->max_count = 0;
+  node->num_children = 0;
+  node->capacity = capacity;
+  node->prefix_length = prefix_length;
+  memcpy(node_prefix(node), prefix, prefix_length);
+
+  /* Unused branch bytes are compared too in a Node16, the indexed classes
+   * tell empty slots apart by a zero index or a NULL child */
+  memset(node_keys(node), 0, node_keys_size(capacity));
+
+  if (capacity > TRIE_NODE16) {
+    children = node_children(node);
+    for (i = 0; i < capacity; i++) {
+      children[i] = NULL;
+    }
+  }
+
+  return node;
+}
+
+#ifdef __SSE2__
+int find_key16(const unsigned char *keys, unsigned char byte, int num_keys) {
+  /*
+   *Compares byte against the 16 branch bytes of a Node16 at once.
+   *Returns the index of the match among the first num_keys, or -1.
+   */
+  __m128i matches = _mm_cmpeq_epi8(_mm_set1_epi8((char)byte),
+                                   _mm_loadu_si128((const __m128i *)keys));
+  int mask = _mm_movemask_epi8(matches) & ((1 << num_keys) - 1);
+
+  return mask == 0 ? -1 : __builtin_ctz(mask);
+}
+#endif
+
+TrieNode **find_child(TrieNode *node, unsigned char byte) {
+  /*
+   *Returns the slot holding the child reached by byte, or NULL if there is
+   *none.
+   */
+  unsigned char *keys = node_keys(node);
+  TrieNode **children = node_children(node);
+  int i;
+
+  if (node->capacity == TRIE_NODE256) {
+    return children[byte] == NULL ? NULL : &children[byte];
+  }
+
+  if (node->capacity == TRIE_NODE48) {
+    return keys[byte] == 0 ? NULL : &children[keys[byte] - 1];
+  }
+
+#ifdef __SSE2__
+  if (node->capacity == TRIE_NODE16) {
+    i = find_key16(keys, byte, node->num_children);
+    return i == -1 ? NULL : &children[i];
+  }
+#endif
+
+  for (i = 0; i < node->num_children && keys[i] < byte; i++)
+    ;
+  /*do nothing */
+
+  return i < node->num_children && keys[i] == byte ? &children[i] : NULL;
+}
+
+TrieNode **next_child(TrieNode *node, int *cursor, unsigned char *byte) {
+  /*
+   *Returns the slot of the next child in ascending byte order, storing its
+   *byte, or NULL once every child was seen. *cursor must start at 0.
+   */
+  unsigned char *keys = node_keys(node);
+  TrieNode **children = node_children(node);
+  int i = *cursor;
+
+  if (node->capacity <= TRIE_NODE16) {
+    if (i >= node->num_children) {
+      return NULL;
+    }
+
+    *cursor = i + 1;
+    *byte = keys[i];
+    return &children[i];
+  }
+
+  for (; i < TRIE_FANOUT_MAX; i++) {
+    if (node->capacity == TRIE_NODE48 ? keys[i] != 0 : children[i] != NULL) {
+      *cursor = i + 1;
+      *byte = (unsigned char)i;
+      return node->capacity == TRIE_NODE48 ? &children[keys[i] - 1]
+                                           : &children[i];
+    }
+  }
+
+  *cursor = i;
+  return NULL;
+}
+
+void place_child(TrieNode *node, unsigned char byte, TrieNode *child) {
+  /*
+   *Adds child under byte to a node which has room for it.
+   */
+  unsigned char *keys = node_keys(node);
+  TrieNode **children = node_children(node);
+  int i;
+
+  if (node->capacity == TRIE_NODE256) {
+    children[byte] = child;
+  } else if (node->capacity == TRIE_NODE48) {
+    for (i = 0; children[i] != NULL; i++)
+      ;
+    /*do nothing */
+
+    keys[byte] = i + 1;
+    children[i] = child;
+  } else {
+    for (i = 0; i < node->num_children && keys[i] < byte; i++)
+      ;
+    /*do nothing */
+
+    memmove(keys + i + 1, keys + i, node->num_children - i);
+    memmove(children + i + 1, children + i,
+            (node->num_children - i) * sizeof(TrieNode *));
+    keys[i] = byte;
+    children[i] = child;
+  }
+
+  node->num_children++;
+}
+
+void remove_child(TrieNode *node, int *cursor, unsigned char byte) {
+  /*
+   *Removes the child under byte, which next_child just returned, leaving
+   **cursor on the child that followed it.
+   */
+  unsigned char *keys = node_keys(node);
+  TrieNode **children = node_children(node);
+  int i;
+
+  if (node->capacity == TRIE_NODE256) {
+    children[byte] = NULL;
+  } else if (node->capacity == TRIE_NODE48) {
+    children[keys[byte] - 1] = NULL;
+    keys[byte] = 0;
+  } else {
+    i = --*cursor;
+    memmove(keys + i, keys + i + 1, node->num_children - i - 1);
+    memmove(children + i, children + i + 1,
+            (node->num_children - i - 1) * sizeof(TrieNode *));
+  }
+
+  node->num_children--;
+}
+
+TrieNode *resize_trie_node(TrieNode *node, const unsigned char *prefix,
+                           int prefix_length, int capacity) {
+  /*
+   *Moves a node into a new allocation with a different prefix or child
+   *capacity, converting between node classes as needed. The prefix may
+   *point into the old node, which is freed.
+   */
+  TrieNode *new_node = create_trie_node(prefix, prefix_length, capacity);
+  TrieNode **slot;
+  unsigned char byte;
+  int cursor = 0;
+
+  new_node->count = node->count;
+  new_node->max_count = node->max_count;
+
+  while ((slot = next_child(node, &cursor, &byte)) != NULL) {
+    place_child(new_node, byte, *slot);
+  }
+
+  tracked_free(node);
+  return new_node;
+}
+
+TrieNode *insert_child(TrieNode *node, unsigned char byte, TrieNode *child) {
+  /*
+   *Inserts child under byte, growing the node if needed.
+   *Returns the address of the node, which may have moved.
+   */
+  if (node->num_children == node->capacity) {
+    node = resize_trie_node(node, node_prefix(node), node->prefix_length,
+                            grow_capacity(node->capacity));
+  }
+
+  place_child(node, byte, child);
+
+  return node;
+}
+
+TrieNode *shrink_trie_node(TrieNode *node) {
+  /*
+   *Moves a Node48 or Node256 which lost children into the smallest class
+   *holding them. Returns the address of the node, which may have moved.
+   */
+  int capacity = 0;
+
+  while (capacity < node->num_children) {
+    capacity = grow_capacity(capacity);
+  }
+
+  if (node->capacity <= TRIE_NODE16 || capacity >= node->capacity) {
+    return node;
+  }
+
+  return resize_trie_node(node, node_prefix(node), node->prefix_length,
+                          capacity);
+}
+
+TrieNode *split_trie_node(TrieNode **slot, int matched) {
+  /*
+   *Splits the prefix of *slot after matched bytes, placing a new parent
+   *holding the shared bytes in the slot. Returns the new parent.
+   */
+  TrieNode *node = *slot;
+  TrieNode *parent;
+  unsigned char byte = node_prefix(node)[matched];
+
+  parent = create_trie_node(node_prefix(node), matched, 2);
+  node = resize_trie_node(node, node_prefix(node) + matched + 1,
+                          node->prefix_length - matched - 1, node->capacity);
+
+  parent->max_count = node->max_count;
+  parent = insert_child(parent, byte, node);
+
+  *slot = parent;
+  return parent;
+}
+
+Trie *create_trie(void) {
+  Trie *trie;
+
+  if (!(trie = (Trie *)tracked_malloc(sizeof(Trie)))) {
+    perror("failed malloc when creating Trie");
+    exit(EXIT_FAILURE);
+  }
+
+  trie->root = create_trie_node((const unsigned char *)"", 0, 0);
+  trie->num_entries = 0;
+  trie->path = NULL;
+  trie->path_capacity = 0;
+
+  return trie;
+}
+
+void trie_push_path(Trie *trie, size_t depth, TrieNode *node) {
+  if (depth == trie->path_capacity) {
+    trie->path_capacity = trie->path_capacity == 0 ? KEY_HUNK
+                                                   : trie->path_capacity * 2;
+    if (!(trie->path = (TrieNode **)tracked_realloc(
+              trie->path, trie->path_capacity * sizeof(TrieNode *)))) {
+      perror("failed realloc when growing trie path");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  trie->path[depth] = node;
+}
+
+int trie_increment(Trie *trie, const char *key) {
+  /*
+   *Adds one to the count of key, inserting it if needed.
+   *Returns the new count.
+   */
+  const unsigned char *rest = (const unsigned char *)key;
+  size_t rest_length = strlen(key);
+  size_t child_length;
+  size_t depth = 0;
+  size_t i;
+  TrieNode **slot = &trie->root;
+  TrieNode **child_slot;
+  TrieNode *node;
+  TrieNode *child;
+  int matched;
+  int count;
+
+  for (;;) {
+    node = *slot;
+
+    /* Match the compressed prefix, splitting it on a mismatch */
+    for (matched = 0; matched < node->prefix_length &&
+                      (size_t)matched < rest_length &&
+                      node_prefix(node)[matched] == rest[matched];
+         matched++)
+      ;
+
+    if (matched < node->prefix_length) {
+      node = split_trie_node(slot, matched);
+    }
+
+    rest += matched;
+    rest_length -= matched;
+    trie_push_path(trie, depth++, node);
+
+    if (rest_length == 0) {
+      break;
+    }
+
+    child_slot = find_child(node, rest[0]);
+
+    /* Hang the rest of the key below a new leaf */
+    if (child_slot == NULL) {
+      child_length = rest_length - 1 > TRIE_PREFIX_MAX ? TRIE_PREFIX_MAX
+                                                       : rest_length - 1;
+      child = create_trie_node(rest + 1, child_length,
+                               rest_length - 1 > child_length ? 1 : 0);
+      node = insert_child(node, rest[0], child);
+      *slot = node;
+      trie->path[depth - 1] = node;
+      child_slot = find_child(node, rest[0]);
+    }
+
+    slot = child_slot;
+    rest++;
+    rest_length--;
+  }
+
+  if (node->count == 0) {
+    trie->num_entries++;
+  }
+
+  count = ++node->count;
+
+  for (i = 0; i < depth; i++) {
+    if (trie->path[i]->max_count < count) {
+      trie->path[i]->max_count = count;
+    }
+  }
+
+  return count;
+}
+
+int trie_get(Trie *trie, const char *key) {
+  /*Returns -1 if not found, matching hash_table_get */
+  const unsigned char *rest = (const unsigned char *)key;
+  size_t rest_length = strlen(key);
+  TrieNode *node = trie->root;
+  TrieNode **slot;
+
+  for (;;) {
+    if (rest_length < node->prefix_length ||
+        memcmp(node_prefix(node), rest, node->prefix_length) != 0) {
+      return -1;
+    }
+
+    rest += node->prefix_length;
+    rest_length -= node->prefix_length;
+
+    if (rest_length == 0) {
+      return node->count > 0 ? node->count : -1;
+    }
+
+    if ((slot = find_child(node, rest[0])) == NULL) {
+      return -1;
+    }
+
+    node = *slot;
+    rest++;
+    rest_length--;
+  }
+}
+
+void search_append(TrieSearch *search, const unsigned char *bytes,
+                   size_t length) {
+  if (search->key_length + length + 1 > search->key_capacity) {
+    search->key_capacity = search->key_length + length + 1 + KEY_HUNK;
+    if (!(search->key = (char *)tracked_realloc(search->key,
+                                                search->key_capacity))) {
+      perror("failed realloc when building trie key");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  memcpy(search->key + search->key_length, bytes, length);
+  search->key_length += length;
+  search->key[search->key_length] = '\0';
+}
+
+void search_consider(TrieSearch *search, int count) {
+  /*Offers the current key to the bounded heap of results */
+  top_n_offer(search->heap, &search->size, search->capacity, search->key,
+              count);
+}
+
+bool search_can_skip(TrieSearch *search, TrieNode *node) {
+  return search->size == search->capacity &&
+         node->max_count < search->heap[0]->value;
+}
+
+void search_subtree(TrieSearch *search, TrieNode *node) {
+  size_t key_length = search->key_length;
+  TrieNode **slot;
+  unsigned char byte;
+  int cursor = 0;
+
+  search_append(search, node_prefix(node), node->prefix_length);
+
+  if (node->count > 0) {
+    search_consider(search, node->count);
+  }
+
+  while ((slot = next_child(node, &cursor, &byte)) != NULL) {
+    if (search_can_skip(search, *slot)) {
+      continue;
+    }
+
+    search_append(search, &byte, 1);
+    search_subtree(search, *slot);
+    search->key_length--;
+    search->key[search->key_length] = '\0';
+  }
+
+  search->key_length = key_length;
+  search->key[key_length] = '\0';
+}
+
+int trie_top_n(Trie *trie, int n, const char *prefix, Entry **top_n) {
+  /*
+   *Stores copies of the n highest counted keys starting with prefix into
+   *top_n, sorted like get_top_n_entries. Returns the number stored.
+   */
+  const unsigned char *rest =
+      (const unsigned char *)(prefix == NULL ? "" : prefix);
+  size_t rest_length = strlen((const char *)rest);
+  size_t shared;
+  TrieNode *node = trie->root;
+  TrieNode **slot;
+  TrieSearch search;
+
+  search.heap = top_n;
+  search.size = 0;
+  search.capacity = n;
+  search.key = NULL;
+  search.key_length = 0;
+  search.key_capacity = 0;
+  search_append(&search, (const unsigned char *)"", 0);
+
+  if (n <= 0) {
+    tracked_free(search.key);
+    return 0;
+  }
+
+  /* Walk down to the subtree holding every key with the prefix */
+  for (;;) {
+    shared =
+        rest_length < node->prefix_length ? rest_length : node->prefix_length;
+
+    if (memcmp(node_prefix(node), rest, shared) != 0) {
+      node = NULL;
+      break;
+    }
+
+    if (rest_length <= node->prefix_length) {
+      break;
+    }
+
+    search_append(&search, node_prefix(node), node->prefix_length);
+    rest += node->prefix_length;
+    rest_length -= node->prefix_length;
+
+    if ((slot = find_child(node, rest[0])) == NULL) {
+      node = NULL;
+      break;
+    }
+
+    search_append(&search, rest, 1);
+    node = *slot;
+    rest++;
+    rest_length--;
+  }
+
+  if (node != NULL) {
+    search_subtree(&search, node);
+  }
+
+  qsort(top_n, search.size, sizeof(Entry *), compare_entries_descending);
+
+  tracked_free(search.key);
+  return search.size;
+}
+
+void visit_subtree(TrieSearch *search, TrieNode *node,
+                   void (*visit)(const char *key, int count, void *arg),
+                   void *arg) {
+  size_t key_length = search->key_length;
+  TrieNode **slot;
+  unsigned char byte;
+  int cursor = 0;
+
+  search_append(search, node_prefix(node), node->prefix_length);
+
+  if (node->count > 0) {
+    visit(search->key, node->count, arg);
+  }
+
+  while ((slot = next_child(node, &cursor, &byte)) != NULL) {
+    search_append(search, &byte, 1);
+    visit_subtree(search, *slot, visit, arg);
+    search->key_length--;
+  }
+
+  search->key_length = key_length;
+  search->key[key_length] = '\0';
+}
+
+void trie_visit(Trie *trie,
+                void (*visit)(const char *key, int count, void *arg),
+                void *arg) {
+  /*
+   *Calls visit for every key in the trie, in ascending strcmp order.
+   */
+  TrieSearch search;
+
+  search.key = NULL;
+  search.key_length = 0;
+  search.key_capacity = 0;
+  search_append(&search, (const unsigned char *)"", 0);
+
+  visit_subtree(&search, trie->root, visit, arg);
+
+  tracked_free(search.key);
+}
+
+TrieNode *prune_subtree(Trie *trie, TrieNode *node, int threshold,
+                        bool is_root) {
+  /*
+   *Drops the counts of at most threshold below node, freeing nodes that no
+   *longer lead to a key, merging single-child chains back into one node and
+   *shrinking nodes into the smallest class holding their children.
+   *Returns the node that now takes its place, or NULL if it was freed.
+   */
+  unsigned char merged[TRIE_PREFIX_MAX * 2 + 1];
+  TrieNode **slot;
+  TrieNode *child;
+  unsigned char byte;
+  int merged_length;
+  int cursor = 0;
+
+  if (node->count > 0 && node->count <= threshold) {
+    node->count = 0;
+    trie->num_entries--;
+  }
+
+  node->max_count = node->count;
+
+  while ((slot = next_child(node, &cursor, &byte)) != NULL) {
+    if ((child = prune_subtree(trie, *slot, threshold, false)) == NULL) {
+      remove_child(node, &cursor, byte);
+      continue;
+    }
+
+    if (child->max_count > node->max_count) {
+      node->max_count = child->max_count;
+    }
+
+    *slot = child;
+  }
+
+  if (is_root || node->count > 0 || node->num_children > 1) {
+    return shrink_trie_node(node);
+  }
+
+  if (node->num_children == 0) {
+    tracked_free(node);
+    return NULL;
+  }
+
+  cursor = 0;
+  child = *next_child(node, &cursor, &byte);
+  merged_length = node->prefix_length + 1 + child->prefix_length;
+
+  if (merged_length > TRIE_PREFIX_MAX) {
+    return shrink_trie_node(node);
+  }
+
+  memcpy(merged, node_prefix(node), node->prefix_length);
+  merged[node->prefix_length] = byte;
+  memcpy(merged + node->prefix_length + 1, node_prefix(child),
+         child->prefix_length);
+
+  tracked_free(node);
+  return resize_trie_node(child, merged, merged_length, child->capacity);
+}
+
+void trie_prune(Trie *trie, int threshold) {
+  /*
+   *Removes every key counted at most threshold times.
+   */
+  trie->root = prune_subtree(trie, trie->root, threshold, true);
+}
+
+void free_trie_node(TrieNode *node) {
+  TrieNode **slot;
+  unsigned char byte;
+  int cursor = 0;
+
+  while ((slot = next_child(node, &cursor, &byte)) != NULL) {
+    free_trie_node(*slot);
+  }
+
+  tracked_free(node);
+}
+
+void free_trie(Trie *trie) {
+  free_trie_node(trie->root);
+  tracked_free(trie->path);
+  tracked_free(trie);
+}
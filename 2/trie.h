@@ -0,0 +1,70 @@
+/*
+ * trie.h
+ *
+ * This header file contains the declarations of a path-compressed trie used as
+ * an alternative word counter to the hash table. Each node stores a compressed
+ * path (the bytes shared by every key below it) and its children in one
+ * allocation, laid out by one of four adaptive classes chosen from its child
+ * capacity:
+ *
+ *   Node4    up to 4 sorted branch bytes, scanned in order. Leaves have no
+ *            room for children and small nodes double up to 4.
+ *   Node16   16 sorted branch bytes, compared at once with SSE2 when built
+ *            for it.
+ *   Node48   a 256 byte index from a branch byte to one of 48 children.
+ *   Node256  256 children indexed by the branch byte.
+ *
+ * A node moves to the next class when it fills up, and back to the smallest
+ * class holding its children when pruning empties it. Keys are never copied
+ * into separate strings.
+ *
+ * Every node caches the largest count found in its subtree, which lets
+ * prefix-constrained top n queries skip whole subtrees that cannot contribute.
+ */
+
+#ifndef TRIE_H
+#define TRIE_H
+
+#include "hash.h"
+#include <stddef.h>
+
+#define TRIE_PREFIX_MAX 255
+#define TRIE_FANOUT_MAX 256
+
+/* Child capacities of the node classes */
+#define TRIE_NODE4 4
+#define TRIE_NODE16 16
+#define TRIE_NODE48 48
+#define TRIE_NODE256 TRIE_FANOUT_MAX
+
+/* Structure definition for TrieNode. The node is followed in memory by its
+ * prefix bytes, the branch bytes or index of its class and (pointer aligned)
+ * its children. */
+typedef struct TrieNode {
+  int count;
+  int max_count;
+  unsigned short num_children;
+  unsigned short capacity;
+  unsigned char prefix_length;
+} TrieNode;
+
+/* Structure definition for Trie */
+typedef struct Trie {
+  TrieNode *root;
+  unsigned int num_entries;
+  TrieNode **path;
+  size_t path_capacity;
+} Trie;
+
+/* Function prototypes */
+Trie *create_trie(void);
+int trie_increment(Trie *trie, const char *key);
+int trie_get(Trie *trie, const char *key);
+int trie_top_n(Trie *trie, int n, const char *prefix, Entry **top_n);
+void trie_visit(Trie *trie,
+                void (*visit)(const char *key, int count, void *arg),
+                void *arg);
+void trie_prune(Trie *trie, int threshold);
+void free_trie(Trie *trie);
+
+#endif
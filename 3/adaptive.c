@@ -0,0 +1,187 @@
+/*
+ * adaptive.c
+ * Adaptive Huffman coding with Vitter's algorithm (Algorithm V). Nodes are
+ * numbered so that weights never decrease with the number and, among nodes of
+ * equal weight (a block), leaves come before internal nodes; the root holds
+ * the highest number. Coding a symbol increments the weights on its path,
+ * sliding each node past the block that would otherwise break that order.
+ * Symbols not seen yet are coded as the 0-node (a leaf of weight 0) followed
+ * by the symbol itself, and then split off the 0-node.
+ */
+#include "adaptive.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define IS_LEAF(tree, position)                                                \
+  ((tree)->nodes[position].symbol != ADAPTIVE_INTERNAL)
+
+/* Points the children (or the symbol) of the node at position back at it */
+void adopt_node(AdaptiveTree *tree, int position) {
+  AdaptiveNode *node = &tree->nodes[position];
+
+  if (node->symbol == ADAPTIVE_INTERNAL) {
+    tree->nodes[node->child[0]].parent = (short)position;
+    tree->nodes[node->child[1]].parent = (short)position;
+  } else if (node->symbol == ADAPTIVE_ZERO_NODE) {
+    tree->zero_node = position;
+  } else {
+    tree->leaf[node->symbol] = (short)position;
+  }
+}
+
+/* Exchanges the nodes at two positions, neither an ancestor of the other */
+void swap_nodes(AdaptiveTree *tree, int first, int second) {
+  AdaptiveNode node = tree->nodes[first];
+
+  node.parent = tree->nodes[second].parent;
+  tree->nodes[second].parent = tree->nodes[first].parent;
+  tree->nodes[first] = tree->nodes[second];
+  tree->nodes[second] = node;
+  adopt_node(tree, first);
+  adopt_node(tree, second);
+}
+
+/* Moves the node at position past the block after its own, which it joins by
+ * the increment: internal nodes of its weight after a leaf, leaves of the
+ * next weight after an internal node. Increments its weight and returns the
+ * next node to increment: the new parent of a leaf, the former parent of an
+ * internal node. */
+int slide_and_increment(AdaptiveTree *tree, int position) {
+  unsigned long weight = tree->nodes[position].weight;
+  bool leaf = IS_LEAF(tree, position);
+  int parent = tree->nodes[position].parent;
+  AdaptiveNode node;
+  int last = position;
+  short slot_parent;
+  int i;
+
+  /* Mostly the next node is heavier already, and nothing moves */
+  if (position == ADAPTIVE_ROOT ||
+      tree->nodes[position + 1].weight > weight + 1 ||
+      (tree->nodes[position + 1].weight == weight + 1 &&
+       !IS_LEAF(tree, position + 1))) {
+    tree->nodes[position].weight++;
+    return parent;
+  }
+
+  node = tree->nodes[position];
+  while (last < ADAPTIVE_ROOT &&
+         (leaf ? !IS_LEAF(tree, last + 1) &&
+                     tree->nodes[last + 1].weight == weight
+               : IS_LEAF(tree, last + 1) &&
+                     tree->nodes[last + 1].weight == weight + 1)) {
+    last++;
+  }
+
+  if (last != position) {
+    for (i = position; i < last; i++) {
+      slot_parent = tree->nodes[i].parent;
+      tree->nodes[i] = tree->nodes[i + 1];
+      tree->nodes[i].parent = slot_parent;
+    }
+
+    node.parent = tree->nodes[last].parent;
+    tree->nodes[last] = node;
+    for (i = position; i <= last; i++) {
+      adopt_node(tree, i);
+    }
+  }
+
+  /* The node that was the parent moved down if it was slid past */
+  if (parent > position && parent <= last) {
+    parent--;
+  }
+
+  tree->nodes[last].weight++;
+  return leaf ? tree->nodes[last].parent : parent;
+}
+
+/* Starts with a tree holding only the 0-node */
+void adaptive_init(AdaptiveTree *tree) {
+  int i;
+
+  for (i = 0; i < ADAPTIVE_SYMBOLS; i++) {
+    tree->leaf[i] = -1;
+  }
+
+  tree->nodes[ADAPTIVE_ROOT].weight = 0;
+  tree->nodes[ADAPTIVE_ROOT].parent = -1;
+  tree->nodes[ADAPTIVE_ROOT].symbol = ADAPTIVE_ZERO_NODE;
+  tree->zero_node = ADAPTIVE_ROOT;
+}
+
+/* Stores the code of symbol into code, the last bit in the lowest bit of
+ * code[0], and returns its length. A new symbol is coded as the 0-node and
+ * its ADAPTIVE_SYMBOL_BITS bits. */
+int adaptive_code(const AdaptiveTree *tree, int symbol, uint64_t code[]) {
+  int position = tree->leaf[symbol];
+  int length = 0;
+  int parent;
+
+  memset(code, 0, sizeof(uint64_t) * ADAPTIVE_CODE_WORDS);
+  if (position == -1) {
+    code[0] = (uint64_t)symbol;
+    length = ADAPTIVE_SYMBOL_BITS;
+    position = tree->zero_node;
+  }
+
+  for (; (parent = tree->nodes[position].parent) != -1; position = parent) {
+    if (tree->nodes[parent].child[1] == position) {
+      code[length / 64] |= (uint64_t)1 << (length % 64);
+    }
+    length++;
+  }
+
+  return length;
+}
+
+/* Counts one more symbol, keeping the tree a Huffman tree of the counts */
+void adaptive_update(AdaptiveTree *tree, int symbol) {
+  int position = tree->leaf[symbol];
+  int leader = position;
+  int leaf_to_increment = -1;
+  AdaptiveNode *node;
+
+  if (position == -1) {
+    /* The 0-node becomes the parent of the symbol and of a new 0-node */
+    position = tree->zero_node;
+    node = &tree->nodes[position];
+    node->symbol = ADAPTIVE_INTERNAL;
+    node->child[0] = (short)(position - 2);
+    node->child[1] = (short)(position - 1);
+
+    tree->nodes[position - 1].weight = 0;
+    tree->nodes[position - 1].parent = (short)position;
+    tree->nodes[position - 1].symbol = (short)symbol;
+    tree->nodes[position - 2].weight = 0;
+    tree->nodes[position - 2].parent = (short)position;
+    tree->nodes[position - 2].symbol = ADAPTIVE_ZERO_NODE;
+    tree->leaf[symbol] = (short)(position - 1);
+    tree->zero_node = position - 2;
+    leaf_to_increment = position - 1;
+  } else {
+    while (leader < ADAPTIVE_ROOT && IS_LEAF(tree, leader + 1) &&
+           tree->nodes[leader + 1].weight == tree->nodes[position].weight) {
+      leader++;
+    }
+    if (leader != position) {
+      swap_nodes(tree, position, leader);
+      position = leader;
+    }
+
+    /* Its parent would join the leaf's block, so the leaf goes last */
+    if (tree->nodes[position].parent ==
+        tree->nodes[tree->zero_node].parent) {
+      leaf_to_increment = position;
+      position = tree->nodes[position].parent;
+    }
+  }
+
+  while (position != -1) {
+    position = slide_and_increment(tree, position);
+  }
+
+  if (leaf_to_increment != -1) {
+    slide_and_increment(tree, leaf_to_increment);
+  }
+}
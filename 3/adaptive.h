@@ -0,0 +1,51 @@
+#ifndef ADAPTIVE_H
+#define ADAPTIVE_H
+
+/*
+ * adaptive.h
+ * The code tree of adaptive (version 5) files, kept up to date with Vitter's
+ * algorithm as symbols are coded. Nodes live in one array indexed by their
+ * number in Vitter's implicit order, so a node moves by swapping array
+ * entries and no node is ever allocated.
+ */
+
+#include <stdint.h>
+
+/* The bytes, then ADAPTIVE_END which ends the payload */
+#define ADAPTIVE_SYMBOLS 257
+#define ADAPTIVE_END 256
+/* Bits of a symbol sent after the code of the 0-node, on its first use */
+#define ADAPTIVE_SYMBOL_BITS 9
+
+/* Every symbol and the 0-node as leaves, and the internal nodes above them */
+#define ADAPTIVE_MAX_NODES (2 * (ADAPTIVE_SYMBOLS + 1) - 1)
+#define ADAPTIVE_ROOT (ADAPTIVE_MAX_NODES - 1)
+
+/* Symbols of nodes other than the symbol leaves */
+#define ADAPTIVE_INTERNAL -1
+#define ADAPTIVE_ZERO_NODE -2
+
+/* Words of the longest code: a path through every internal node, then a new
+ * symbol */
+#define ADAPTIVE_CODE_WORDS                                                    \
+  ((ADAPTIVE_SYMBOLS + ADAPTIVE_SYMBOL_BITS + 63) / 64)
+
+/* The weight, children and symbol belong to the node at a position, and move
+ * with it; the parent belongs to the position. */
+typedef struct {
+  unsigned long weight;
+  short parent;
+  short child[2];
+  short symbol;
+} AdaptiveNode;
+
+typedef struct {
+  AdaptiveNode nodes[ADAPTIVE_MAX_NODES];
+  short leaf[ADAPTIVE_SYMBOLS];
+  int zero_node;
+} AdaptiveTree;
+
+void adaptive_init(AdaptiveTree *tree);
+int adaptive_code(const AdaptiveTree *tree, int symbol, uint64_t code[]);
+void adaptive_update(AdaptiveTree *tree, int symbol);
+#endif
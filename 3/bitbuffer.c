@@ -0,0 +1,72 @@
+/*
+ * bitbuffer.c
+ * Writes codes straight into a buffer in memory, for libhuff and the block
+ * coders of hencode.c. Unlike bitwriter.c it never touches a file descriptor,
+ * so it needs neither pipeline.c nor anything that exits.
+ */
+#include "bitbuffer.h"
+#include "format.h"
+
+/* Writes the code of every byte of source into destination, most significant
+ * bit first, and pads the last byte with zeros. Codes must be at most
+ * BITBUFFER_WORD_BITS bits long. Returns the bytes written. */
+size_t bitbuffer_encode(const uint8_t *source, size_t length,
+                        HuffmanCode codes[], uint8_t *destination) {
+  uint8_t *out = destination;
+  const HuffmanCode *code;
+  uint64_t accumulator = 0;
+  int bit_count = 0;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    code = &codes[source[i]];
+    accumulator = accumulator << code->length | code->bits;
+    bit_count += code->length;
+
+    if (bit_count >= BITBUFFER_WORD_BITS) {
+      bit_count -= BITBUFFER_WORD_BITS;
+      put_u32(out, (uint32_t)(accumulator >> bit_count));
+      out += 4;
+    }
+  }
+
+  while (bit_count > 0) {
+    *out++ = bit_count >= 8 ? (uint8_t)(accumulator >> (bit_count - 8))
+                            : (uint8_t)(accumulator << (8 - bit_count));
+    bit_count -= 8;
+  }
+
+  return out - destination;
+}
+
+void bitbuffer_init(BitBuffer *bb, uint8_t *destination) {
+  bb->out = destination;
+  bb->accumulator = 0;
+  bb->bit_count = 0;
+}
+
+/* Writes the low length bits of bits (at most 32), moving whole words out to
+ * the buffer */
+void bitbuffer_write_bits(BitBuffer *bb, uint32_t bits, int length) {
+  bb->accumulator = bb->accumulator << length | bits;
+  bb->bit_count += length;
+
+  if (bb->bit_count >= BITBUFFER_WORD_BITS) {
+    bb->bit_count -= BITBUFFER_WORD_BITS;
+    put_u32(bb->out, (uint32_t)(bb->accumulator >> bb->bit_count));
+    bb->out += 4;
+  }
+}
+
+/* Writes the bits left, padding the last byte with zeros, and returns the
+ * end of the bits written */
+uint8_t *bitbuffer_flush(BitBuffer *bb) {
+  while (bb->bit_count > 0) {
+    *bb->out++ = bb->bit_count >= 8
+                     ? (uint8_t)(bb->accumulator >> (bb->bit_count - 8))
+                     : (uint8_t)(bb->accumulator << (8 - bb->bit_count));
+    bb->bit_count -= 8;
+  }
+
+  return bb->out;
+}
@@ -0,0 +1,23 @@
+#ifndef BITBUFFER_H
+#define BITBUFFER_H
+
+#include "huffman.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Whole words of this many bits are moved from the accumulator to the buffer */
+#define BITBUFFER_WORD_BITS 32
+
+/* Bits written straight into a caller's buffer */
+typedef struct {
+  uint8_t *out;
+  uint64_t accumulator;
+  int bit_count;
+} BitBuffer;
+
+size_t bitbuffer_encode(const uint8_t *source, size_t length,
+                        HuffmanCode codes[], uint8_t *destination);
+void bitbuffer_init(BitBuffer *bb, uint8_t *destination);
+void bitbuffer_write_bits(BitBuffer *bb, uint32_t bits, int length);
+uint8_t *bitbuffer_flush(BitBuffer *bb);
+#endif
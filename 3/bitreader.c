@@ -0,0 +1,830 @@
+/*
+ * bitreader.c
+ * This file abstracts the bitreading process required by hdecode.c and fw
+ * Bits are kept most significant first in a 64-bit buffer which is refilled
+ * several bytes at a time, so a whole code can always be peeked at once.
+ * Codes are decoded with lookup tables: the next DECODE_ROOT_BITS bits index
+ * the root table, whose entry either gives the symbol and its code length, or
+ * links to a smaller table indexed by the bits that follow (for long codes).
+ */
+#include "bitreader.h"
+#include "huffman.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Layout of a table entry: the code length consumed at this level (or the
+ * bits of the linked table) in the low 5 bits, the link, pair and single
+ * flags, then the symbol (or the offset of the linked table). Root entries
+ * whose bits hold two whole codes are pairs, which also store the second
+ * symbol and the length of the first code. The only code of a table is
+ * single, and takes no bits. An entry of 0 is an invalid code. */
+#define ENTRY_LENGTH_MASK 0x1F
+#define ENTRY_LINK 0x20
+#define ENTRY_PAIR 0x40
+#define ENTRY_SINGLE 0x80
+#define ENTRY_VALUE_SHIFT 8
+#define ENTRY_SECOND_SHIFT 16
+#define ENTRY_FIRST_LENGTH_SHIFT 24
+/* Entries of context tables resolving a symbol hold the table that decodes
+ * the symbol after it from this bit */
+#define ENTRY_NEXT_SHIFT 16
+
+typedef struct {
+  uint64_t left_aligned;
+  int symbol;
+  int length;
+} SortedCode;
+
+/* Initialize the BitReader structure to read source_fd with read_source, which
+ * returns like read(2): pipeline_read for the programs, so libhuff, which
+ * only reads buffers, does not need pipeline.c */
+void bitreader_init(BitReader *br, int source_fd, ReadSource read_source) {
+  br->input = br->buffer;
+  br->buffer_position = 0;
+  br->buffer_length = 0;
+  br->source_fd = source_fd;
+  br->read_source = read_source;
+  br->bits = 0;
+  br->bit_count = 0;
+  br->end_of_input = false;
+}
+
+/* Initialize the BitReader structure to read the length bytes of input */
+void bitreader_init_buffer(BitReader *br, const uint8_t *input, size_t length) {
+  br->input = input;
+  br->buffer_position = 0;
+  br->buffer_length = length;
+  br->source_fd = -1;
+  br->read_source = NULL;
+  br->bits = 0;
+  br->bit_count = 0;
+  br->end_of_input = true;
+}
+
+/* Reads the next chunk of the source into the buffer */
+void bitreader_read_buffer(BitReader *br) {
+  ssize_t bytes_read =
+      br->read_source(br->source_fd, br->buffer, BITREADER_BUFFER_SIZE);
+
+  if (bytes_read == -1) {
+    perror("Failed to read input file when decoding");
+    exit(EXIT_FAILURE);
+  }
+
+  br->input = br->buffer;
+  br->buffer_position = 0;
+  br->buffer_length = bytes_read;
+  br->end_of_input = bytes_read == 0;
+}
+
+/* Tops the bit buffer up to at least DECODE_MAX_CODE_LENGTH bits, unless the
+ * input ends first. Bits past the end of the input read as zeros. */
+void bitreader_refill(BitReader *br) {
+  const uint8_t *next;
+  uint64_t word;
+  int advance;
+  int i;
+
+  /* Fast path: load eight bytes and keep the whole bytes that fit */
+  if (br->bit_count >= 0 && br->bit_count <= DECODE_MAX_CODE_LENGTH &&
+      br->buffer_length - br->buffer_position >= sizeof(uint64_t)) {
+    next = br->input + br->buffer_position;
+    word = 0;
+    for (i = 0; i < (int)sizeof(uint64_t); i++) {
+      word = (word << 8) | next[i];
+    }
+
+    br->bits |= word >> br->bit_count;
+    advance = (63 - br->bit_count) >> 3;
+    br->buffer_position += advance;
+    br->bit_count += advance * 8;
+    return;
+  }
+
+  while (br->bit_count <= DECODE_MAX_CODE_LENGTH) {
+    if (br->buffer_position == br->buffer_length) {
+      if (br->end_of_input) {
+        return;
+      }
+
+      bitreader_read_buffer(br);
+      if (br->end_of_input) {
+        return;
+      }
+    }
+
+    br->bits |= (uint64_t)br->input[br->buffer_position++]
+                << (56 - br->bit_count);
+    br->bit_count += 8;
+  }
+}
+
+/* Makes at least count bytes (at most BITREADER_BUFFER_SIZE) of the input
+ * available at *bytes, unless the input ends first, and returns how many are.
+ * Reads bytes as they come, before any bits are taken, so headers can be
+ * parsed from inputs that can not seek. */
+size_t bitreader_peek(BitReader *br, const uint8_t **bytes, size_t count) {
+  size_t available = br->buffer_length - br->buffer_position;
+  ssize_t bytes_read;
+
+  if (available < count && br->source_fd != -1 && !br->end_of_input) {
+    memmove(br->buffer, br->input + br->buffer_position, available);
+    br->input = br->buffer;
+    br->buffer_position = 0;
+    br->buffer_length = available;
+
+    while (br->buffer_length < count) {
+      bytes_read =
+          br->read_source(br->source_fd, br->buffer + br->buffer_length,
+                          BITREADER_BUFFER_SIZE - br->buffer_length);
+      if (bytes_read == -1) {
+        perror("Failed to read input file when decoding");
+        exit(EXIT_FAILURE);
+      }
+
+      if (bytes_read == 0) {
+        br->end_of_input = true;
+        break;
+      }
+      br->buffer_length += bytes_read;
+    }
+  }
+
+  *bytes = br->input + br->buffer_position;
+  return br->buffer_length - br->buffer_position;
+}
+
+/* Moves past count bytes returned by bitreader_peek */
+void bitreader_consume(BitReader *br, size_t count) {
+  br->buffer_position += count;
+}
+
+/* Copies the next count bytes of the input into out. Returns the bytes
+ * copied, fewer only if the input ends first. */
+size_t bitreader_read_bytes(BitReader *br, uint8_t *out, size_t count) {
+  const uint8_t *bytes;
+  size_t available;
+  size_t total = 0;
+
+  while (total < count && (available = bitreader_peek(br, &bytes, 1)) > 0) {
+    available = available < count - total ? available : count - total;
+    memcpy(out + total, bytes, available);
+    bitreader_consume(br, available);
+    total += available;
+  }
+
+  return total;
+}
+
+/* Takes the next count bits (at most 32) as a number, the first one most
+ * significant */
+uint32_t bitreader_read_bits(BitReader *br, int count) {
+  uint32_t value;
+
+  if (count == 0) {
+    return 0;
+  }
+
+  if (br->bit_count < count) {
+    bitreader_refill(br);
+  }
+
+  value = (uint32_t)(br->bits >> (64 - count));
+  br->bits <<= count;
+  br->bit_count -= count;
+  return value;
+}
+
+/* Drops the next count bits, at most 8 */
+void bitreader_skip_bits(BitReader *br, int count) {
+  bitreader_refill(br);
+  br->bits <<= count;
+  br->bit_count -= count;
+}
+
+int compare_sorted_codes(const void *a, const void *b) {
+  const SortedCode *first = (const SortedCode *)a;
+  const SortedCode *second = (const SortedCode *)b;
+
+  if (first->left_aligned != second->left_aligned) {
+    return first->left_aligned < second->left_aligned ? -1 : 1;
+  }
+  return first->length - second->length;
+}
+
+/* Appends a zeroed table of the given number of entries and stores its
+ * offset into offset. Returns DECODE_ERROR_MEMORY if the table can not grow,
+ * leaving it as it was. */
+int decode_table_grow(DecodeTable *table, size_t entries, size_t *offset) {
+  size_t capacity = table->capacity;
+  uint32_t *grown;
+
+  if (table->size + entries > capacity) {
+    while (table->size + entries > capacity) {
+      capacity = capacity == 0 ? entries : capacity * 2;
+    }
+
+    grown = (uint32_t *)realloc(table->entries, sizeof(uint32_t) * capacity);
+    if (grown == NULL) {
+      return DECODE_ERROR_MEMORY;
+    }
+    table->entries = grown;
+    table->capacity = capacity;
+  }
+
+  *offset = table->size;
+  memset(table->entries + *offset, 0, sizeof(uint32_t) * entries);
+  table->size += entries;
+  return 0;
+}
+
+/* Builds the table for codes (sorted, all sharing their first consumed bits)
+ * indexed by their next bits bits. Stores its offset into offset and returns
+ * -1 if the codes are not a prefix code, or DECODE_ERROR_MEMORY. */
+int build_level(DecodeTable *table, SortedCode *codes, int num_codes,
+                int consumed, int bits, size_t *offset) {
+  size_t level;
+  size_t sub_table;
+  uint32_t entry;
+  int remaining;
+  int index;
+  int sub_bits;
+  int status;
+  int i = 0;
+  int j;
+  int k;
+
+  if (decode_table_grow(table, (size_t)1 << bits, &level) != 0) {
+    return DECODE_ERROR_MEMORY;
+  }
+
+  while (i < num_codes) {
+    remaining = codes[i].length - consumed;
+    index = (int)((codes[i].left_aligned << consumed) >> (64 - bits));
+
+    /* The code ends in this table and fills every entry it prefixes */
+    if (remaining <= bits) {
+      entry = (uint32_t)remaining |
+              ((uint32_t)codes[i].symbol << ENTRY_VALUE_SHIFT);
+
+      for (k = 0; k < 1 << (bits - remaining); k++) {
+        if (table->entries[level + index + k] != 0) {
+          return -1;
+        }
+        table->entries[level + index + k] = entry;
+      }
+
+      i++;
+      continue;
+    }
+
+    /* Longer codes sharing this entry go to a second level table */
+    sub_bits = 0;
+    for (j = i; j < num_codes; j++) {
+      if ((int)((codes[j].left_aligned << consumed) >> (64 - bits)) != index) {
+        break;
+      }
+      if (codes[j].length - consumed <= bits) {
+        return -1;
+      }
+      if (codes[j].length - consumed - bits > sub_bits) {
+        sub_bits = codes[j].length - consumed - bits;
+      }
+    }
+
+    if (table->entries[level + index] != 0) {
+      return -1;
+    }
+
+    sub_bits = sub_bits < DECODE_SUB_BITS ? sub_bits : DECODE_SUB_BITS;
+    if ((status = build_level(table, codes + i, j - i, consumed + bits,
+                              sub_bits, &sub_table)) != 0) {
+      return status;
+    }
+
+    table->entries[level + index] =
+        (uint32_t)sub_bits | ENTRY_LINK |
+        ((uint32_t)sub_table << ENTRY_VALUE_SHIFT);
+    i = j;
+  }
+
+  *offset = level;
+  return 0;
+}
+
+/* Turns every root entry whose code is followed by a second whole code within
+ * the same DECODE_ROOT_BITS bits into a pair, so both decode in one lookup */
+void add_symbol_pairs(DecodeTable *table) {
+  uint32_t singles[1 << DECODE_ROOT_BITS];
+  uint32_t first;
+  uint32_t second;
+  int first_length;
+  int second_length;
+  int i;
+
+  memcpy(singles, table->entries, sizeof(singles));
+
+  for (i = 0; i < 1 << DECODE_ROOT_BITS; i++) {
+    first = singles[i];
+    first_length = first & ENTRY_LENGTH_MASK;
+    if (first == 0 || (first & ENTRY_LINK) ||
+        first_length >= DECODE_ROOT_BITS) {
+      continue;
+    }
+
+    second = singles[(i << first_length) & ((1 << DECODE_ROOT_BITS) - 1)];
+    second_length = second & ENTRY_LENGTH_MASK;
+    if (second == 0 || (second & ENTRY_LINK) ||
+        first_length + second_length > DECODE_ROOT_BITS) {
+      continue;
+    }
+
+    table->entries[i] =
+        (uint32_t)(first_length + second_length) | ENTRY_PAIR |
+        (first & ~(uint32_t)ENTRY_LENGTH_MASK) |
+        ((second >> ENTRY_VALUE_SHIFT) << ENTRY_SECOND_SHIFT) |
+        ((uint32_t)first_length << ENTRY_FIRST_LENGTH_SHIFT);
+  }
+}
+
+/* Builds the decode table of a set of codes. A single code decodes without
+ * taking any bits. Returns -1 if the codes are longer than
+ * DECODE_MAX_CODE_LENGTH bits or are not a prefix code, and
+ * DECODE_ERROR_MEMORY if the table can not be allocated. The table must be
+ * freed either way. */
+int decode_table_build(DecodeTable *table, HuffmanCode codes[]) {
+  SortedCode sorted[HUFFMAN_SYMBOLS];
+  int num_codes = 0;
+  size_t root;
+  int status;
+  int i;
+
+  table->entries = NULL;
+  table->size = 0;
+  table->capacity = 0;
+  table->max_length = 0;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (codes[i].length == 0) {
+      continue;
+    }
+    if (codes[i].length > DECODE_MAX_CODE_LENGTH) {
+      return -1;
+    }
+
+    if (codes[i].length > table->max_length) {
+      table->max_length = codes[i].length;
+    }
+
+    sorted[num_codes].left_aligned = codes[i].bits << (64 - codes[i].length);
+    sorted[num_codes].symbol = i;
+    sorted[num_codes].length = codes[i].length;
+    num_codes++;
+  }
+
+  if (num_codes == 1) {
+    if (decode_table_grow(table, (size_t)1 << DECODE_ROOT_BITS, &root) != 0) {
+      return DECODE_ERROR_MEMORY;
+    }
+    for (i = 0; i < 1 << DECODE_ROOT_BITS; i++) {
+      table->entries[root + i] =
+          ENTRY_SINGLE | (uint32_t)sorted[0].symbol << ENTRY_VALUE_SHIFT;
+    }
+    table->max_length = 0;
+    return 0;
+  }
+
+  qsort(sorted, num_codes, sizeof(SortedCode), compare_sorted_codes);
+
+  if ((status = build_level(table, sorted, num_codes, 0, DECODE_ROOT_BITS,
+                            &root)) != 0) {
+    return status;
+  }
+
+  add_symbol_pairs(table);
+  return 0;
+}
+
+void decode_table_free(DecodeTable *table) {
+  free(table->entries);
+  table->entries = NULL;
+}
+
+/* Decodes count symbols into out. Returns -1 on an invalid code or if the
+ * input ends before count symbols are decoded. */
+int bitreader_decode(BitReader *br, const DecodeTable *table, uint8_t *out,
+                     size_t count) {
+  const uint32_t *entries = table->entries;
+  int refill_below = table->max_length > DECODE_ROOT_BITS ? table->max_length
+                                                          : DECODE_ROOT_BITS;
+  uint64_t bits = br->bits;
+  int bit_count = br->bit_count;
+  uint32_t entry;
+  int level_bits;
+  int length;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    /* Refill only when the longest code might not be in the buffer */
+    if (bit_count < refill_below) {
+      br->bits = bits;
+      br->bit_count = bit_count;
+      bitreader_refill(br);
+      bits = br->bits;
+      bit_count = br->bit_count;
+    }
+
+    entry = entries[bits >> (64 - DECODE_ROOT_BITS)];
+    level_bits = DECODE_ROOT_BITS;
+
+    if (entry & ENTRY_PAIR) {
+      out[i] = (uint8_t)(entry >> ENTRY_VALUE_SHIFT);
+
+      /* Only the first symbol is wanted when count is reached */
+      if (i + 1 == count) {
+        length = entry >> ENTRY_FIRST_LENGTH_SHIFT;
+      } else {
+        out[++i] = (uint8_t)(entry >> ENTRY_SECOND_SHIFT);
+        length = entry & ENTRY_LENGTH_MASK;
+      }
+
+      bits <<= length;
+      bit_count -= length;
+      continue;
+    }
+
+    while (entry & ENTRY_LINK) {
+      bits <<= level_bits;
+      bit_count -= level_bits;
+      level_bits = entry & ENTRY_LENGTH_MASK;
+      entry = entries[(entry >> ENTRY_VALUE_SHIFT) +
+                      (size_t)(bits >> (64 - level_bits))];
+    }
+
+    if (entry == 0) {
+      return -1;
+    }
+
+    length = entry & ENTRY_LENGTH_MASK;
+    bits <<= length;
+    bit_count -= length;
+    out[i] = (uint8_t)(entry >> ENTRY_VALUE_SHIFT);
+  }
+
+  br->bits = bits;
+  br->bit_count = bit_count;
+
+  /* Zero bits read past the end of the input */
+  return bit_count < 0 ? -1 : 0;
+}
+
+/* Starts the tables of a context file with num_tables root tables, table
+ * map[byte] decoding the symbols that follow byte. Returns
+ * DECODE_ERROR_MEMORY if they can not be allocated; the tables must be freed
+ * either way. */
+int context_tables_init(ContextTables *tables, int num_tables,
+                        const uint8_t map[]) {
+  size_t root;
+
+  tables->merged.entries = NULL;
+  tables->merged.size = 0;
+  tables->merged.capacity = 0;
+  tables->merged.max_length = 0;
+  memcpy(tables->map, map, sizeof(tables->map));
+  return decode_table_grow(&tables->merged,
+                           (size_t)num_tables << DECODE_ROOT_BITS, &root);
+}
+
+/* Adds the table of the given index, built from codes, to tables. Pairs are
+ * split back, as the second code of a pair belongs to the table of the first
+ * symbol. Returns -1 or DECODE_ERROR_MEMORY like decode_table_build. */
+int context_tables_add(ContextTables *tables, int index, HuffmanCode codes[]) {
+  DecodeTable table;
+  size_t levels;
+  size_t position;
+  uint32_t entry;
+  uint32_t symbol;
+  int length;
+  int status;
+  size_t i;
+
+  if ((status = decode_table_build(&table, codes)) != 0) {
+    decode_table_free(&table);
+    return status;
+  }
+
+  /* The second level tables follow those already added */
+  if (decode_table_grow(&tables->merged,
+                        table.size - ((size_t)1 << DECODE_ROOT_BITS),
+                        &levels) != 0) {
+    decode_table_free(&table);
+    return DECODE_ERROR_MEMORY;
+  }
+  levels -= (size_t)1 << DECODE_ROOT_BITS;
+  if (table.max_length > tables->merged.max_length) {
+    tables->merged.max_length = table.max_length;
+  }
+
+  for (i = 0; i < table.size; i++) {
+    entry = table.entries[i];
+    position = i < (size_t)1 << DECODE_ROOT_BITS
+                   ? ((size_t)index << DECODE_ROOT_BITS) + i
+                   : levels + i;
+
+    if (entry & ENTRY_LINK) {
+      entry = (entry & ENTRY_LENGTH_MASK) | ENTRY_LINK |
+              (uint32_t)((entry >> ENTRY_VALUE_SHIFT) + levels)
+                  << ENTRY_VALUE_SHIFT;
+    } else if (entry != 0) {
+      symbol = (entry >> ENTRY_VALUE_SHIFT) & 0xFF;
+      length = entry & ENTRY_PAIR ? (int)(entry >> ENTRY_FIRST_LENGTH_SHIFT)
+                                  : (int)(entry & ENTRY_LENGTH_MASK);
+      entry = (uint32_t)length | (entry & ENTRY_SINGLE) |
+              symbol << ENTRY_VALUE_SHIFT |
+              (uint32_t)tables->map[symbol] << ENTRY_NEXT_SHIFT;
+    }
+
+    tables->merged.entries[position] = entry;
+  }
+
+  decode_table_free(&table);
+  return 0;
+}
+
+void context_tables_free(ContextTables *tables) {
+  decode_table_free(&tables->merged);
+}
+
+/* Decodes count symbols into out, each with the table of the symbol before
+ * it, *previous being the symbol before the first one, left at the last one.
+ * Every entry gives the table of the next symbol, so switching tables takes
+ * no load of its own. Returns -1 like bitreader_decode. */
+int bitreader_decode_context(BitReader *br, const ContextTables *tables,
+                             uint8_t *out, size_t count, uint8_t *previous) {
+  const uint32_t *entries = tables->merged.entries;
+  int refill_below = tables->merged.max_length > DECODE_ROOT_BITS
+                         ? tables->merged.max_length
+                         : DECODE_ROOT_BITS;
+  size_t root = (size_t)tables->map[*previous] << DECODE_ROOT_BITS;
+  uint64_t bits = br->bits;
+  int bit_count = br->bit_count;
+  uint32_t entry = 0;
+  int level_bits;
+  int length;
+  size_t i;
+
+  for (i = 0; i < count; i++) {
+    if (bit_count < refill_below) {
+      br->bits = bits;
+      br->bit_count = bit_count;
+      bitreader_refill(br);
+      bits = br->bits;
+      bit_count = br->bit_count;
+    }
+
+    entry = entries[root + (size_t)(bits >> (64 - DECODE_ROOT_BITS))];
+    level_bits = DECODE_ROOT_BITS;
+    while (entry & ENTRY_LINK) {
+      bits <<= level_bits;
+      bit_count -= level_bits;
+      level_bits = entry & ENTRY_LENGTH_MASK;
+      entry = entries[(entry >> ENTRY_VALUE_SHIFT) +
+                      (size_t)(bits >> (64 - level_bits))];
+    }
+
+    if (entry == 0) {
+      return -1;
+    }
+
+    length = entry & ENTRY_LENGTH_MASK;
+    bits <<= length;
+    bit_count -= length;
+    out[i] = (uint8_t)(entry >> ENTRY_VALUE_SHIFT);
+    root = (size_t)(entry >> ENTRY_NEXT_SHIFT) << DECODE_ROOT_BITS;
+  }
+
+  br->bits = bits;
+  br->bit_count = bit_count;
+  if (count > 0) {
+    *previous = out[count - 1];
+  }
+
+  return bit_count < 0 ? -1 : 0;
+}
+
+/* Tops bits up from br like bitreader_refill, for bit buffers kept in local
+ * variables by bitreader_decode_streams */
+#define REFILL_STREAM(br, stream_bits, stream_count)                           \
+  do {                                                                         \
+    if ((stream_count) >= 0 && (stream_count) <= DECODE_MAX_CODE_LENGTH &&     \
+        (br)->buffer_length - (br)->buffer_position >= sizeof(uint64_t)) {     \
+      next = (br)->input + (br)->buffer_position;                              \
+      word = (uint64_t)next[0] << 56 | (uint64_t)next[1] << 48 |               \
+             (uint64_t)next[2] << 40 | (uint64_t)next[3] << 32 |               \
+             (uint64_t)next[4] << 24 | (uint64_t)next[5] << 16 |               \
+             (uint64_t)next[6] << 8 | (uint64_t)next[7];                       \
+      (stream_bits) |= word >> (stream_count);                                 \
+      advance = (63 - (stream_count)) >> 3;                                    \
+      (br)->buffer_position += advance;                                        \
+      (stream_count) += advance * 8;                                           \
+    } else {                                                                   \
+      (br)->bits = (stream_bits);                                              \
+      (br)->bit_count = (stream_count);                                        \
+      bitreader_refill(br);                                                    \
+      (stream_bits) = (br)->bits;                                              \
+      (stream_count) = (br)->bit_count;                                        \
+    }                                                                          \
+  } while (0)
+
+/* Decodes the code at the top of bits into out, moving it past the one or two
+ * bytes decoded. Invalid codes clear valid. */
+#define DECODE_STREAM_ENTRY(bits, bit_count, out)                              \
+  do {                                                                         \
+    entry = entries[(bits) >> (64 - DECODE_ROOT_BITS)];                        \
+    if (entry & ENTRY_PAIR) {                                                  \
+      (out)[0] = (uint8_t)(entry >> ENTRY_VALUE_SHIFT);                        \
+      (out)[1] = (uint8_t)(entry >> ENTRY_SECOND_SHIFT);                       \
+      (out) += 2;                                                              \
+    } else {                                                                   \
+      level_bits = DECODE_ROOT_BITS;                                           \
+      while (entry & ENTRY_LINK) {                                             \
+        (bits) <<= level_bits;                                                 \
+        (bit_count) -= level_bits;                                             \
+        level_bits = entry & ENTRY_LENGTH_MASK;                                \
+        entry = entries[(entry >> ENTRY_VALUE_SHIFT) +                         \
+                        (size_t)((bits) >> (64 - level_bits))];                \
+      }                                                                        \
+      valid &= entry != 0;                                                     \
+      *(out)++ = (uint8_t)(entry >> ENTRY_VALUE_SHIFT);                        \
+    }                                                                          \
+    (bits) <<= entry & ENTRY_LENGTH_MASK;                                      \
+    (bit_count) -= entry & ENTRY_LENGTH_MASK;                                  \
+  } while (0)
+
+/* Decodes count[i] bytes into out[i] from each of the BITREADER_STREAMS
+ * readers. The streams do not depend on each other, so they are decoded side
+ * by side: every round refills each of them once, then decodes as many codes
+ * from each as the refill guarantees, interleaving their lookups. The ends of
+ * the streams are decoded one at a time. Returns -1 if a stream holds an
+ * invalid code or ends early. */
+int bitreader_decode_streams(BitReader readers[], const DecodeTable *table,
+                             uint8_t *out[], const size_t count[]) {
+  const uint32_t *entries = table->entries;
+  int per_refill =
+      DECODE_MAX_CODE_LENGTH / (table->max_length > DECODE_ROOT_BITS
+                                    ? table->max_length
+                                    : DECODE_ROOT_BITS);
+  uint64_t bits0 = readers[0].bits, bits1 = readers[1].bits;
+  uint64_t bits2 = readers[2].bits, bits3 = readers[3].bits;
+  int count0 = readers[0].bit_count, count1 = readers[1].bit_count;
+  int count2 = readers[2].bit_count, count3 = readers[3].bit_count;
+  uint8_t *out0 = out[0], *out1 = out[1], *out2 = out[2], *out3 = out[3];
+  size_t rounds = (size_t)-1;
+  size_t round;
+  const uint8_t *next;
+  uint64_t word;
+  uint32_t entry;
+  int level_bits;
+  int advance;
+  int valid = 1;
+  int i;
+
+  /* Pairs decode two bytes per code, so no round passes the end */
+  for (i = 0; i < BITREADER_STREAMS; i++) {
+    if (count[i] / (2 * per_refill) < rounds) {
+      rounds = count[i] / (2 * per_refill);
+    }
+  }
+
+  for (round = 0; round < rounds; round++) {
+    REFILL_STREAM(&readers[0], bits0, count0);
+    REFILL_STREAM(&readers[1], bits1, count1);
+    REFILL_STREAM(&readers[2], bits2, count2);
+    REFILL_STREAM(&readers[3], bits3, count3);
+
+    for (i = 0; i < per_refill; i++) {
+      DECODE_STREAM_ENTRY(bits0, count0, out0);
+      DECODE_STREAM_ENTRY(bits1, count1, out1);
+      DECODE_STREAM_ENTRY(bits2, count2, out2);
+      DECODE_STREAM_ENTRY(bits3, count3, out3);
+    }
+  }
+
+  readers[0].bits = bits0;
+  readers[0].bit_count = count0;
+  readers[1].bits = bits1;
+  readers[1].bit_count = count1;
+  readers[2].bits = bits2;
+  readers[2].bit_count = count2;
+  readers[3].bits = bits3;
+  readers[3].bit_count = count3;
+
+  if (!valid ||
+      bitreader_decode(&readers[0], table, out0, count[0] - (out0 - out[0])) ==
+          -1 ||
+      bitreader_decode(&readers[1], table, out1, count[1] - (out1 - out[1])) ==
+          -1 ||
+      bitreader_decode(&readers[2], table, out2, count[2] - (out2 - out[2])) ==
+          -1 ||
+      bitreader_decode(&readers[3], table, out3, count[3] - (out3 - out[3])) ==
+          -1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Decodes every byte of an interleaved frame into output, decoding its streams
+ * side by side. Returns -1 if a stream is invalid. */
+int decode_frame_streams(const Frame *frame, const DecodeTable *table,
+                         uint8_t *output) {
+  const uint8_t *stream = frame->payload + FRAME_JUMP_TABLE_SIZE;
+  uint8_t *out[FRAME_STREAMS];
+  size_t count[FRAME_STREAMS];
+  BitReader *readers;
+  int status;
+  int i;
+
+  if (!(readers = (BitReader *)malloc(sizeof(BitReader) * FRAME_STREAMS))) {
+    perror("failed malloc when decoding frame");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < FRAME_STREAMS; i++) {
+    bitreader_init_buffer(&readers[i], stream, frame->stream_sizes[i]);
+    stream += frame->stream_sizes[i];
+    out[i] = output + STREAM_START(frame->num_bytes, i);
+    count[i] = STREAM_START(frame->num_bytes, i + 1) -
+               STREAM_START(frame->num_bytes, i);
+  }
+
+  status = bitreader_decode_streams(readers, table, out, count);
+  free(readers);
+  return status;
+}
+
+/* Decodes count bytes of frame into output, starting with the code at
+ * bit_offset of the payload and skipping the first skip bytes decoded from
+ * there. output must have room for every byte of the frame, as interleaved
+ * frames are decoded whole. Returns -1 if the payload is invalid. */
+int decode_frame_bytes(const Frame *frame, unsigned long bit_offset,
+                       size_t skip, uint8_t *output, size_t count) {
+  DecodeTable table;
+  BitReader *br;
+  int status;
+
+  if (frame->num_codes == 1 && !frame->stored) {
+    memset(output, frame->single_char, count);
+    return 0;
+  }
+
+  /* The bit offsets of a stored frame are those of its bytes */
+  if (frame->stored) {
+    if (bit_offset % 8 != 0 ||
+        bit_offset / 8 + skip + count > frame->payload_length) {
+      return -1;
+    }
+    memcpy(output, frame->payload + bit_offset / 8 + skip, count);
+    return 0;
+  }
+
+  if (bit_offset > (unsigned long)frame->payload_length * 8) {
+    return -1;
+  }
+
+  if ((status = decode_table_build(&table, (HuffmanCode *)frame->codes)) ==
+      DECODE_ERROR_MEMORY) {
+    perror("failed malloc when decoding frame");
+    exit(EXIT_FAILURE);
+  }
+  if (status != 0) {
+    decode_table_free(&table);
+    return -1;
+  }
+
+  if (frame->interleaved) {
+    status = decode_frame_streams(frame, &table, output);
+    memmove(output, output + skip, count);
+    decode_table_free(&table);
+    return status;
+  }
+
+  if (!(br = (BitReader *)malloc(sizeof(BitReader)))) {
+    perror("failed malloc when decoding frame");
+    exit(EXIT_FAILURE);
+  }
+
+  bitreader_init_buffer(br, frame->payload + bit_offset / 8,
+                        frame->payload_length - bit_offset / 8);
+  bitreader_skip_bits(br, bit_offset % 8);
+  status = bitreader_decode(br, &table, output, skip);
+  if (status == 0) {
+    status = bitreader_decode(br, &table, output, count);
+  }
+
+  free(br);
+  decode_table_free(&table);
+  return status;
+}
@@ -0,0 +1,84 @@
+#ifndef BITREADER_H
+#define BITREADER_H
+
+#include "format.h"
+#include "huffman.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define BITREADER_BUFFER_SIZE 65536
+
+/* Streams decoded side by side by bitreader_decode_streams */
+#define BITREADER_STREAMS 4
+
+/* Bits looked up by the first table, and at most by every other table */
+#define DECODE_ROOT_BITS 11
+#define DECODE_SUB_BITS 8
+
+/* A refill leaves at least this many bits in the bit buffer */
+#define DECODE_MAX_CODE_LENGTH 56
+
+/* Returned when a decode table can not be allocated, where codes that can
+ * not be decoded return -1 */
+#define DECODE_ERROR_MEMORY -2
+
+/* Reads from a file descriptor like read(2) */
+typedef ssize_t (*ReadSource)(int fd, void *buffer, size_t count);
+
+/* Bytes are taken from input, which is either the buffer refilled from
+ * source_fd with read_source or a caller's buffer holding the whole input */
+typedef struct {
+  uint8_t buffer[BITREADER_BUFFER_SIZE];
+  const uint8_t *input;
+  size_t buffer_position;
+  size_t buffer_length;
+  int source_fd;
+  ReadSource read_source;
+  uint64_t bits;
+  int bit_count;
+  bool end_of_input;
+} BitReader;
+
+/* Every entry either resolves a symbol or links to a second level table */
+typedef struct {
+  uint32_t *entries;
+  size_t size;
+  size_t capacity;
+  int max_length;
+} DecodeTable;
+
+/* The tables of a context (version 6) file merged into one, the root table
+ * of table t at t << DECODE_ROOT_BITS followed by every second level table,
+ * and the table of the symbols after each byte */
+typedef struct {
+  DecodeTable merged;
+  uint8_t map[HUFFMAN_SYMBOLS];
+} ContextTables;
+
+void bitreader_init(BitReader *br, int source_fd, ReadSource read_source);
+void bitreader_init_buffer(BitReader *br, const uint8_t *input, size_t length);
+void bitreader_refill(BitReader *br);
+void bitreader_skip_bits(BitReader *br, int count);
+uint32_t bitreader_read_bits(BitReader *br, int count);
+size_t bitreader_peek(BitReader *br, const uint8_t **bytes, size_t count);
+void bitreader_consume(BitReader *br, size_t count);
+size_t bitreader_read_bytes(BitReader *br, uint8_t *out, size_t count);
+int decode_table_build(DecodeTable *table, HuffmanCode codes[]);
+void decode_table_free(DecodeTable *table);
+int bitreader_decode(BitReader *br, const DecodeTable *table, uint8_t *out,
+                     size_t count);
+int context_tables_init(ContextTables *tables, int num_tables,
+                        const uint8_t map[]);
+int context_tables_add(ContextTables *tables, int index, HuffmanCode codes[]);
+void context_tables_free(ContextTables *tables);
+int bitreader_decode_context(BitReader *br, const ContextTables *tables,
+                             uint8_t *out, size_t count, uint8_t *previous);
+int bitreader_decode_streams(BitReader readers[], const DecodeTable *table,
+                             uint8_t *out[], const size_t count[]);
+int decode_frame_streams(const Frame *frame, const DecodeTable *table,
+                         uint8_t *output);
+int decode_frame_bytes(const Frame *frame, unsigned long bit_offset,
+                       size_t skip, uint8_t *output, size_t count);
+#endif
@@ -6,6 +6,8 @@
  * in the struct.
  */
 #include "bitwriter.h"
+#include "format.h"
+#include "pipeline.h"
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <stdio.h>
@@ -13,7 +15,6 @@
 #include <string.h>
 #include <unistd.h>
 
-#define BUFFER_SIZE 4096
 #define HEADER_BUFFER_SIZE 2048
 
 /* Initialize the BitWriter structure */
@@ -21,13 +22,13 @@ void bitwriter_init(BitWriter *bw, int destination_fd) {
   bw->buffer_position = 0;
   bw->destination_fd = destination_fd;
   bw->bit_count = 0;
-  bw->byte = 0;
+  bw->accumulator = 0;
 }
 
 /* Write the buffer to the destination fd */
 void bitwriter_write_buffer(BitWriter *bw) {
   ssize_t write_ret =
-      write(bw->destination_fd, bw->buffer, bw->buffer_position);
+      pipeline_write(bw->destination_fd, bw->buffer, bw->buffer_position);
   if (write_ret != (ssize_t)bw->buffer_position) {
     perror("Error writing to file when endoder writing buffer.");
     exit(EXIT_FAILURE);
@@ -35,53 +36,119 @@ void bitwriter_write_buffer(BitWriter *bw) {
   bw->buffer_position = 0;
 }
 
-/* Write a Huffman code string. Will not write until buffer is full or write
- * buffer is called */
-void bitwriter_write_huffman_code(BitWriter *bw, const char *code) {
-  size_t code_len = strlen(code);
-  size_t i;
+/* Move the oldest whole word of the accumulator into the buffer, writing the
+ * buffer once it is full. Expects at least BITWRITER_WORD_BITS bits. */
+void bitwriter_write_word(BitWriter *bw) {
+  uint32_t word;
+  uint8_t *next = bw->buffer + bw->buffer_position;
 
-  for (i = 0; i < code_len; i++) {
-    bw->byte = (bw->byte << 1) | ((code[i] - '0') & 1);
-    bw->bit_count++;
+  bw->bit_count -= BITWRITER_WORD_BITS;
+  word = (uint32_t)(bw->accumulator >> bw->bit_count);
 
-    if (bw->bit_count == 8) {
-      bw->buffer[bw->buffer_position++] = bw->byte;
-      bw->byte = 0;
-      bw->bit_count = 0;
+  next[0] = word >> 24;
+  next[1] = word >> 16;
+  next[2] = word >> 8;
+  next[3] = word;
+  bw->buffer_position += BITWRITER_WORD_BITS / 8;
 
-      if (bw->buffer_position == BUFFER_SIZE) {
-        bitwriter_write_buffer(bw);
-      }
-    }
+  if (bw->buffer_position == BUFFER_SIZE) {
+    bitwriter_write_buffer(bw);
+  }
+}
+
+/* Write the low length bits of bits, most significant first. Will not write
+ * until buffer is full or write buffer is called */
+void bitwriter_write_bits(BitWriter *bw, uint64_t bits, int length) {
+  /* Keep the accumulator from overflowing with codes longer than a word */
+  if (length > BITWRITER_WORD_BITS) {
+    bitwriter_write_bits(bw, bits >> BITWRITER_WORD_BITS,
+                         length - BITWRITER_WORD_BITS);
+    bits &= 0xFFFFFFFFul;
+    length = BITWRITER_WORD_BITS;
+  }
+
+  bw->accumulator = (bw->accumulator << length) | bits;
+  bw->bit_count += length;
+
+  if (bw->bit_count >= BITWRITER_WORD_BITS) {
+    bitwriter_write_word(bw);
   }
 }
 
-/* Flush any remaining bits in the byte variable and pad with zeros if
- * necessary
+/* Flush any remaining bits in the accumulator and pad the last byte with
+ * zeros if necessary
  */
 void bitwriter_flush(BitWriter *bw) {
-  int padding_bits;
+  while (bw->bit_count >= 8) {
+    bw->bit_count -= 8;
+    bw->buffer[bw->buffer_position++] =
+        (uint8_t)(bw->accumulator >> bw->bit_count);
+  }
   if (bw->bit_count > 0) {
-    padding_bits = 8 - bw->bit_count;
-    bw->buffer[bw->buffer_position++] = (bw->byte << padding_bits) & 0xFF;
+    bw->buffer[bw->buffer_position++] =
+        (uint8_t)(bw->accumulator << (8 - bw->bit_count));
+    bw->bit_count = 0;
   }
   bitwriter_write_buffer(bw);
   bw->buffer_position = 0;
 }
 
-void bitwriter_translate_file(BitWriter *bw, int in_fd, char *codes[]) {
-  /* Fills the frequency table argument with the frequencies found in the
-   * provided file. */
+/* Writes the whole bytes held so far, keeping the bits of a partial byte, so
+ * the output keeps up with an input that comes slowly */
+void bitwriter_write_bytes(BitWriter *bw) {
+  while (bw->bit_count >= 8) {
+    bw->bit_count -= 8;
+    bw->buffer[bw->buffer_position++] =
+        (uint8_t)(bw->accumulator >> bw->bit_count);
+  }
+  if (bw->buffer_position > 0) {
+    bitwriter_write_buffer(bw);
+  }
+}
+
+void bitwriter_translate_file(BitWriter *bw, int in_fd, HuffmanCode codes[]) {
+  /* Writes the code of every byte of the provided file. The accumulator is
+   * kept in locals so the loop only branches once per byte, to move a whole
+   * word out when one is ready. */
   unsigned char buffer[BUFFER_SIZE];
   ssize_t bytes_read;
-  size_t i;
+  ssize_t i;
+  const HuffmanCode *code;
+  uint64_t accumulator = bw->accumulator;
+  int bit_count = bw->bit_count;
 
-  while ((bytes_read = read(in_fd, buffer, BUFFER_SIZE)) > 0) {
+  while ((bytes_read = pipeline_read(in_fd, buffer, BUFFER_SIZE)) > 0) {
     for (i = 0; i < bytes_read; i++) {
-      bitwriter_write_huffman_code(bw, codes[buffer[i]]);
+      code = &codes[buffer[i]];
+
+      if (code->length > BITWRITER_WORD_BITS) {
+        bw->accumulator = accumulator;
+        bw->bit_count = bit_count;
+        bitwriter_write_bits(bw, code->bits, code->length);
+        accumulator = bw->accumulator;
+        bit_count = bw->bit_count;
+        continue;
+      }
+
+      accumulator = (accumulator << code->length) | code->bits;
+      bit_count += code->length;
+
+      if (bit_count >= BITWRITER_WORD_BITS) {
+        bw->accumulator = accumulator;
+        bw->bit_count = bit_count;
+        bitwriter_write_word(bw);
+        bit_count = bw->bit_count;
+      }
     }
   }
+
+  if (bytes_read == -1) {
+    perror("Failed to read input file when encoding");
+    exit(EXIT_FAILURE);
+  }
+
+  bw->accumulator = accumulator;
+  bw->bit_count = bit_count;
   bitwriter_flush(bw);
 }
 
@@ -118,9 +185,103 @@ void bitwriter_write_header(BitWriter *bw, int num_codes,
     }
   }
 
-  write_ret = write(bw->destination_fd, buffer, buffer_offset);
+  write_ret = pipeline_write(bw->destination_fd, buffer, buffer_offset);
   if (write_ret != (ssize_t)buffer_offset) {
     perror("Error writing header to file.");
     exit(EXIT_FAILURE);
   }
 }
+
+/* Write the canonical (version 1) header described in format.h: the number of
+ * bytes in the file and the code length of every symbol */
+void bitwriter_write_canonical_header(BitWriter *bw, HuffmanCode codes[],
+                                      uint64_t num_bytes) {
+  uint8_t buffer[CANONICAL_HEADER_MAX];
+  size_t buffer_offset = 0;
+  int write_ret;
+
+  memcpy(buffer, HUFF_MAGIC, HUFF_MAGIC_LENGTH);
+  buffer_offset += HUFF_MAGIC_LENGTH;
+  buffer[buffer_offset++] = HUFF_VERSION_CANONICAL;
+
+  buffer_offset += put_size(buffer + buffer_offset, num_bytes);
+  buffer_offset += pack_code_lengths(buffer + buffer_offset, codes);
+
+  write_ret = pipeline_write(bw->destination_fd, buffer, buffer_offset);
+  if (write_ret != (ssize_t)buffer_offset) {
+    perror("Error writing header to file.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Write the context (version 6) header described in format.h: the number of
+ * bytes in the file, the table of every context and the code length of every
+ * symbol of each of the num_tables tables */
+void bitwriter_write_context_header(BitWriter *bw,
+                                    HuffmanCode codes[][HUFFMAN_SYMBOLS],
+                                    int num_tables, const uint8_t map[],
+                                    uint64_t num_bytes) {
+  uint8_t buffer[CONTEXT_HEADER_MAX];
+  size_t buffer_offset = 0;
+  int write_ret;
+  int i;
+
+  memcpy(buffer, HUFF_MAGIC, HUFF_MAGIC_LENGTH);
+  buffer_offset += HUFF_MAGIC_LENGTH;
+  buffer[buffer_offset++] = HUFF_VERSION_CONTEXT;
+
+  buffer_offset += put_size(buffer + buffer_offset, num_bytes);
+  buffer[buffer_offset++] = (uint8_t)(num_tables - 1);
+  memcpy(buffer + buffer_offset, map, HUFF_CONTEXTS);
+  buffer_offset += HUFF_CONTEXTS;
+
+  for (i = 0; i < num_tables; i++) {
+    buffer_offset += pack_code_lengths(buffer + buffer_offset, codes[i]);
+  }
+
+  write_ret = pipeline_write(bw->destination_fd, buffer, buffer_offset);
+  if (write_ret != (ssize_t)buffer_offset) {
+    perror("Error writing header to file.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Writes the code of every byte of the provided file from the codes of the
+ * byte before it, contexts[byte], like bitwriter_translate_file. The codes
+ * are canonical, so always fit in a word. */
+void bitwriter_translate_context_file(BitWriter *bw, int in_fd,
+                                      const HuffmanCode *contexts[]) {
+  unsigned char buffer[BUFFER_SIZE];
+  ssize_t bytes_read;
+  ssize_t i;
+  const HuffmanCode *code;
+  uint64_t accumulator = bw->accumulator;
+  int bit_count = bw->bit_count;
+  unsigned int previous = 0;
+
+  while ((bytes_read = pipeline_read(in_fd, buffer, BUFFER_SIZE)) > 0) {
+    for (i = 0; i < bytes_read; i++) {
+      code = &contexts[previous][buffer[i]];
+      previous = buffer[i];
+
+      accumulator = (accumulator << code->length) | code->bits;
+      bit_count += code->length;
+
+      if (bit_count >= BITWRITER_WORD_BITS) {
+        bw->accumulator = accumulator;
+        bw->bit_count = bit_count;
+        bitwriter_write_word(bw);
+        bit_count = bw->bit_count;
+      }
+    }
+  }
+
+  if (bytes_read == -1) {
+    perror("Failed to read input file when encoding");
+    exit(EXIT_FAILURE);
+  }
+
+  bw->accumulator = accumulator;
+  bw->bit_count = bit_count;
+  bitwriter_flush(bw);
+}
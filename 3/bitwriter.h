@@ -1,24 +1,37 @@
 #ifndef BITWRITER_H
 #define BITWRITER_H
 
+#include "huffman.h"
 #include <stdint.h>
 #include <stdlib.h>
 
-#define BUFFER_SIZE 4096
+#define BUFFER_SIZE 65536
+
+/* Whole words of this many bits are moved from the accumulator to the buffer */
+#define BITWRITER_WORD_BITS 32
 
 typedef struct {
   uint8_t buffer[BUFFER_SIZE];
   size_t buffer_position;
   int destination_fd;
   int bit_count;
-  uint8_t byte;
+  uint64_t accumulator;
 } BitWriter;
 
 void bitwriter_init(BitWriter *bw, int destination_fd);
 void bitwriter_write_buffer(BitWriter *bw);
-void bitwriter_write_huffman_code(BitWriter *bw, const char *code);
+void bitwriter_write_bits(BitWriter *bw, uint64_t bits, int length);
 void bitwriter_flush(BitWriter *bw);
+void bitwriter_write_bytes(BitWriter *bw);
 void bitwriter_write_header(BitWriter *bw, int num_codes,
                             unsigned int frequency_table[]);
-void bitwriter_translate_file(BitWriter *bw, int in_fd, char *codes[]);
+void bitwriter_write_canonical_header(BitWriter *bw, HuffmanCode codes[],
+                                      uint64_t num_bytes);
+void bitwriter_write_context_header(BitWriter *bw,
+                                    HuffmanCode codes[][HUFFMAN_SYMBOLS],
+                                    int num_tables, const uint8_t map[],
+                                    uint64_t num_bytes);
+void bitwriter_translate_file(BitWriter *bw, int in_fd, HuffmanCode codes[]);
+void bitwriter_translate_context_file(BitWriter *bw, int in_fd,
+                                      const HuffmanCode *contexts[]);
 #endif
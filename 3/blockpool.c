@@ -0,0 +1,156 @@
+/*
+ * blockpool.c
+ * An ordered pool of worker threads, used by hencode and hdecode to code the
+ * blocks of framed files in parallel. Workers take the next block number
+ * under a lock and process it into the slot of that number; the calling
+ * thread waits for the slots in order and writes them out, which frees the
+ * slot for the block one window later.
+ */
+#include "blockpool.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  BlockSlot *slots;
+  size_t num_slots;
+  size_t num_blocks;
+  size_t next_block;
+  size_t next_write;
+  bool failed;
+  BlockFunction work;
+  void *context;
+} BlockPool;
+
+/* Grows the buffers of slot to at least the given capacities */
+void block_slot_reserve(BlockSlot *slot, size_t input_capacity,
+                        size_t output_capacity) {
+  if (slot->input_capacity < input_capacity) {
+    free(slot->input);
+    slot->input = (uint8_t *)malloc(input_capacity);
+    slot->input_capacity = input_capacity;
+  }
+
+  if (slot->output_capacity < output_capacity) {
+    free(slot->output);
+    slot->output = (uint8_t *)malloc(output_capacity);
+    slot->output_capacity = output_capacity;
+  }
+
+  if ((input_capacity != 0 && slot->input == NULL) ||
+      (output_capacity != 0 && slot->output == NULL)) {
+    perror("failed malloc when reserving block buffers");
+    exit(EXIT_FAILURE);
+  }
+}
+
+void *block_worker(void *arg) {
+  BlockPool *pool = (BlockPool *)arg;
+  BlockSlot *slot;
+  size_t index;
+  int status;
+
+  pthread_mutex_lock(&pool->lock);
+
+  while (!pool->failed && pool->next_block < pool->num_blocks) {
+    /* Wait for the slot to be written out by its previous block */
+    if (pool->next_block >= pool->next_write + pool->num_slots) {
+      pthread_cond_wait(&pool->changed, &pool->lock);
+      continue;
+    }
+
+    index = pool->next_block++;
+    slot = &pool->slots[index % pool->num_slots];
+    pthread_mutex_unlock(&pool->lock);
+
+    status = pool->work(pool->context, index, slot);
+
+    pthread_mutex_lock(&pool->lock);
+    slot->done = true;
+    pool->failed = pool->failed || status == -1;
+    pthread_cond_broadcast(&pool->changed);
+  }
+
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+/* Calls work for every block on num_threads threads, and write_block for
+ * every block in order on the calling thread. Returns -1 if any call failed. */
+int run_block_pool(int num_threads, size_t num_blocks, BlockFunction work,
+                   BlockFunction write_block, void *context) {
+  BlockPool pool;
+  pthread_t *threads;
+  BlockSlot *slot;
+  size_t index;
+  bool failed;
+  int i;
+
+  pool.num_slots = (size_t)num_threads * BLOCKPOOL_WINDOW;
+  pool.slots = (BlockSlot *)calloc(pool.num_slots, sizeof(BlockSlot));
+  threads = (pthread_t *)malloc(sizeof(pthread_t) * num_threads);
+  if (pool.slots == NULL || threads == NULL) {
+    perror("failed malloc when creating block pool");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.changed, NULL);
+  pool.num_blocks = num_blocks;
+  pool.next_block = 0;
+  pool.next_write = 0;
+  pool.failed = false;
+  pool.work = work;
+  pool.context = context;
+
+  for (i = 0; i < num_threads; i++) {
+    if (pthread_create(&threads[i], NULL, block_worker, &pool) != 0) {
+      perror("failed to create thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  for (index = 0; index < num_blocks; index++) {
+    slot = &pool.slots[index % pool.num_slots];
+
+    pthread_mutex_lock(&pool.lock);
+    while (!slot->done && !pool.failed) {
+      pthread_cond_wait(&pool.changed, &pool.lock);
+    }
+    failed = pool.failed;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (failed || write_block(context, index, slot) == -1) {
+      break;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    slot->done = false;
+    pool.next_write++;
+    pthread_cond_broadcast(&pool.changed);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  /* Stop the workers if a block could not be written */
+  pthread_mutex_lock(&pool.lock);
+  pool.failed = pool.failed || index < num_blocks;
+  pthread_cond_broadcast(&pool.changed);
+  pthread_mutex_unlock(&pool.lock);
+
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (index = 0; index < pool.num_slots; index++) {
+    free(pool.slots[index].input);
+    free(pool.slots[index].output);
+  }
+
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.changed);
+  free(pool.slots);
+  free(threads);
+  return pool.failed ? -1 : 0;
+}
@@ -0,0 +1,38 @@
+#ifndef BLOCKPOOL_H
+#define BLOCKPOOL_H
+
+/*
+ * blockpool.h
+ * Runs a function over numbered blocks on a pool of threads, and hands the
+ * results to a second function on the calling thread in block order. At most
+ * BLOCKPOOL_WINDOW blocks per thread are in flight, so memory stays bounded
+ * however many blocks there are. Every slot keeps its buffers from one block
+ * to the next.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOCKPOOL_WINDOW 2
+
+typedef struct {
+  uint8_t *input;
+  size_t input_capacity;
+  size_t input_length;
+  uint8_t *output;
+  size_t output_capacity;
+  size_t output_length;
+  bool done;
+} BlockSlot;
+
+/* Processes (or writes) block index in slot. Returns -1 on failure, which
+ * stops the pool. */
+typedef int (*BlockFunction)(void *context, size_t index, BlockSlot *slot);
+
+int run_block_pool(int num_threads, size_t num_blocks, BlockFunction work,
+                   BlockFunction write_block, void *context);
+void block_slot_reserve(BlockSlot *slot, size_t input_capacity,
+                        size_t output_capacity);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * context.c
+ * Builds the tables of context (version 6) files. Every context starts with a
+ * table of its own, then the two tables whose merge saves the most bits are
+ * merged for as long as a merge saves any: a rare context costs more in code
+ * lengths than its own codes save, so it ends up sharing the table of the
+ * contexts it codes most alike. The bits of a table are estimated as the
+ * entropy of its counts (at least a bit per byte, as no Huffman code is
+ * shorter, unless it has a single code) plus the size of its code lengths.
+ */
+#include "context.h"
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Counts every byte of buffer in the context of the byte before it, the one
+ * before the first being *previous, which is left at the last byte */
+void count_contexts(uint64_t counts[][HUFFMAN_SYMBOLS], const uint8_t *buffer,
+                    size_t length, uint8_t *previous) {
+  unsigned int context = *previous;
+  size_t i;
+
+  for (i = 0; i < length; i++) {
+    counts[context][buffer[i]]++;
+    context = buffer[i];
+  }
+
+  *previous = (uint8_t)context;
+}
+
+/* Returns the estimated bits taken by a table coding the counts of first and
+ * of second (NULL for none) together */
+double table_cost(const unsigned int first[], const unsigned int second[]) {
+  double total = 0;
+  double bits = 0;
+  double count;
+  int first_symbol = -1;
+  int last_symbol = 0;
+  int num_codes = 0;
+  int i;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    count = (double)first[i] + (second != NULL ? (double)second[i] : 0);
+    if (count == 0) {
+      continue;
+    }
+
+    bits -= count * log(count);
+    total += count;
+    first_symbol = first_symbol == -1 ? i : first_symbol;
+    last_symbol = i;
+    num_codes++;
+  }
+
+  if (num_codes == 0) {
+    return 0;
+  }
+
+  bits = (bits + total * log(total)) / log(2.0);
+  if (num_codes > 1 && bits < total) {
+    bits = total;
+  }
+
+  return bits +
+         8.0 * (CODE_LENGTHS_FIXED + (last_symbol - first_symbol) / 2 + 1);
+}
+
+/* Clusters the counts of every context into tables. On return the first
+ * tables of counts hold the counts of each table, and map the table of each
+ * context (table 0 for contexts never seen). Returns the number of tables, 0
+ * if nothing was counted. */
+int cluster_contexts(unsigned int counts[][HUFFMAN_SYMBOLS], uint8_t map[]) {
+  double cost[HUFF_CONTEXTS];
+  double *savings; /* savings[a * HUFF_CONTEXTS + b] of merging b into a */
+  bool active[HUFF_CONTEXTS];
+  int owner[HUFF_CONTEXTS];
+  int table[HUFF_CONTEXTS];
+  double best;
+  int best_first = 0;
+  int best_second = 0;
+  int num_tables = 0;
+  int a;
+  int b;
+  int i;
+
+  savings = (double *)malloc(sizeof(double) * HUFF_CONTEXTS * HUFF_CONTEXTS);
+  if (savings == NULL) {
+    perror("failed malloc when clustering contexts");
+    exit(EXIT_FAILURE);
+  }
+
+  for (a = 0; a < HUFF_CONTEXTS; a++) {
+    cost[a] = table_cost(counts[a], NULL);
+    active[a] = cost[a] != 0;
+    owner[a] = active[a] ? a : -1;
+  }
+
+  for (a = 0; a < HUFF_CONTEXTS; a++) {
+    for (b = a + 1; b < HUFF_CONTEXTS && active[a]; b++) {
+      if (active[b]) {
+        savings[a * HUFF_CONTEXTS + b] =
+            cost[a] + cost[b] - table_cost(counts[a], counts[b]);
+      }
+    }
+  }
+
+  while (true) {
+    best = 0;
+    for (a = 0; a < HUFF_CONTEXTS; a++) {
+      for (b = a + 1; b < HUFF_CONTEXTS && active[a]; b++) {
+        if (active[b] && savings[a * HUFF_CONTEXTS + b] > best) {
+          best = savings[a * HUFF_CONTEXTS + b];
+          best_first = a;
+          best_second = b;
+        }
+      }
+    }
+
+    if (best == 0) {
+      break;
+    }
+
+    a = best_first;
+    b = best_second;
+    for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+      counts[a][i] += counts[b][i];
+    }
+    cost[a] = table_cost(counts[a], NULL);
+    active[b] = false;
+    for (i = 0; i < HUFF_CONTEXTS; i++) {
+      owner[i] = owner[i] == b ? a : owner[i];
+    }
+
+    /* Only the savings of the merged table change */
+    for (i = 0; i < HUFF_CONTEXTS; i++) {
+      if (i != a && active[i]) {
+        savings[i < a ? i * HUFF_CONTEXTS + a : a * HUFF_CONTEXTS + i] =
+            cost[a] + cost[i] - table_cost(counts[a], counts[i]);
+      }
+    }
+  }
+
+  /* Number the tables left in order, moving their counts down */
+  for (a = 0; a < HUFF_CONTEXTS; a++) {
+    if (active[a]) {
+      table[a] = num_tables;
+      if (num_tables != a) {
+        memcpy(counts[num_tables], counts[a], sizeof(counts[a]));
+      }
+      num_tables++;
+    }
+  }
+
+  for (a = 0; a < HUFF_CONTEXTS; a++) {
+    map[a] = owner[a] == -1 ? 0 : (uint8_t)table[owner[a]];
+  }
+
+  free(savings);
+  return num_tables;
+}
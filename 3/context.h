@@ -0,0 +1,19 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+/*
+ * context.h
+ * The order-1 model of context (version 6) files: bytes are counted by the
+ * byte before them, and the counts of the 256 contexts are clustered into the
+ * tables written to the header.
+ */
+
+#include "format.h"
+#include "huffman.h"
+#include <stddef.h>
+#include <stdint.h>
+
+void count_contexts(uint64_t counts[][HUFFMAN_SYMBOLS], const uint8_t *buffer,
+                    size_t length, uint8_t *previous);
+int cluster_contexts(unsigned int counts[][HUFFMAN_SYMBOLS], uint8_t map[]);
+#endif
@@ -0,0 +1,288 @@
+/*
+ * format.c
+ * Reads and writes the pieces shared by the hencode formats described in
+ * format.h. Everything works on memory buffers, so the same code serves
+ * hencode, hdecode and the decoder of fw.
+ */
+#include "format.h"
+#include <string.h>
+
+void put_u32(uint8_t *buffer, uint32_t value) {
+  buffer[0] = (uint8_t)(value >> 24);
+  buffer[1] = (uint8_t)(value >> 16);
+  buffer[2] = (uint8_t)(value >> 8);
+  buffer[3] = (uint8_t)value;
+}
+
+uint32_t get_u32(const uint8_t *buffer) {
+  return (uint32_t)buffer[0] << 24 | (uint32_t)buffer[1] << 16 |
+         (uint32_t)buffer[2] << 8 | (uint32_t)buffer[3];
+}
+
+void put_u64(uint8_t *buffer, uint64_t value) {
+  put_u32(buffer, (uint32_t)(value >> 32));
+  put_u32(buffer + 4, (uint32_t)value);
+}
+
+uint64_t get_u64(const uint8_t *buffer) {
+  return (uint64_t)get_u32(buffer) << 32 | get_u32(buffer + 4);
+}
+
+/* Writes the size of a version 1 or 6 header into buffer, escaped to 64 bits
+ * if it does not fit below HUFF_SIZE_ESCAPE. Returns the bytes written. */
+size_t put_size(uint8_t *buffer, uint64_t size) {
+  if (size < HUFF_SIZE_ESCAPE) {
+    put_u32(buffer, (uint32_t)size);
+    return 4;
+  }
+
+  put_u32(buffer, HUFF_SIZE_ESCAPE);
+  put_u64(buffer + 4, size);
+  return 4 + HUFF_SIZE_WIDE;
+}
+
+/* Reads the size of a version 1 or 6 header from the length bytes of buffer.
+ * Returns the bytes it takes, or -1 if it is truncated. */
+int get_size(const uint8_t *buffer, size_t length, uint64_t *size) {
+  if (length < 4) {
+    return -1;
+  }
+
+  *size = get_u32(buffer);
+  if (*size != HUFF_SIZE_ESCAPE) {
+    return 4;
+  }
+
+  if (length < 4 + HUFF_SIZE_WIDE) {
+    return -1;
+  }
+  *size = get_u64(buffer + 4);
+  return 4 + HUFF_SIZE_WIDE;
+}
+
+/* Writes the code lengths of codes (at least one present, at most
+ * CANONICAL_MAX_LENGTH bits) into buffer. Returns the bytes written. */
+size_t pack_code_lengths(uint8_t *buffer, HuffmanCode codes[]) {
+  size_t buffer_offset = 0;
+  int first_symbol = -1;
+  int last_symbol = 0;
+  int i;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (codes[i].length != 0) {
+      first_symbol = first_symbol == -1 ? i : first_symbol;
+      last_symbol = i;
+    }
+  }
+
+  buffer[buffer_offset++] = (uint8_t)first_symbol;
+  buffer[buffer_offset++] = (uint8_t)last_symbol;
+
+  /* Two lengths per byte, the first one in the high nibble */
+  for (i = first_symbol; i <= last_symbol; i += 2) {
+    buffer[buffer_offset++] =
+        (uint8_t)(codes[i].length << 4 |
+                  (i + 1 <= last_symbol ? codes[i + 1].length : 0));
+  }
+
+  return buffer_offset;
+}
+
+/* Writes the code lengths of a stored frame into buffer. Returns the bytes
+ * written. */
+size_t pack_stored_lengths(uint8_t *buffer) {
+  buffer[0] = STORED_FIRST_SYMBOL;
+  buffer[1] = STORED_LAST_SYMBOL;
+  return CODE_LENGTHS_FIXED;
+}
+
+/* Returns whether the code lengths starting at buffer, of which the first
+ * CODE_LENGTHS_FIXED bytes must be available, mark a stored frame */
+bool stored_lengths(const uint8_t *buffer) {
+  return buffer[0] == STORED_FIRST_SYMBOL && buffer[1] == STORED_LAST_SYMBOL;
+}
+
+/* Returns the size of the code lengths starting at buffer, of which the first
+ * CODE_LENGTHS_FIXED bytes must be available, or -1 if they are invalid. */
+int code_lengths_size(const uint8_t *buffer) {
+  if (buffer[1] < buffer[0]) {
+    return -1;
+  }
+
+  return CODE_LENGTHS_FIXED + (buffer[1] - buffer[0]) / 2 + 1;
+}
+
+/* Reads the code lengths at the start of buffer (length bytes available) and
+ * stores the canonical code of every symbol into codes. Returns the bytes
+ * read, or -1 if the lengths are truncated or are not a prefix code. */
+int unpack_code_lengths(const uint8_t *buffer, size_t length,
+                        HuffmanCode codes[]) {
+  unsigned long kraft_sum = 0;
+  int first_symbol;
+  int size;
+  int i;
+
+  if (length < CODE_LENGTHS_FIXED || (size = code_lengths_size(buffer)) == -1 ||
+      length < (size_t)size) {
+    return -1;
+  }
+
+  memset(codes, 0, sizeof(HuffmanCode) * HUFFMAN_SYMBOLS);
+  first_symbol = buffer[0];
+
+  for (i = 0; i <= buffer[1] - first_symbol; i++) {
+    codes[first_symbol + i].length =
+        i % 2 == 0 ? buffer[CODE_LENGTHS_FIXED + i / 2] >> 4
+                   : buffer[CODE_LENGTHS_FIXED + i / 2] & 0x0F;
+    if (codes[first_symbol + i].length != 0) {
+      kraft_sum +=
+          1UL << (CANONICAL_MAX_LENGTH - codes[first_symbol + i].length);
+    }
+  }
+
+  /* No code at all, or more codes than the lengths leave room for */
+  if (kraft_sum == 0 || kraft_sum > 1UL << CANONICAL_MAX_LENGTH) {
+    return -1;
+  }
+
+  assign_canonical_codes(codes);
+  return size;
+}
+
+/* Reads the header of a framed (version 2 to 4) file from the length bytes of
+ * buffer. Returns -1 if it is truncated or invalid. */
+int parse_framed_header(const uint8_t *buffer, size_t length,
+                        FramedHeader *header) {
+  if (length < FRAMED_HEADER_SIZE ||
+      memcmp(buffer, HUFF_MAGIC, HUFF_MAGIC_LENGTH) != 0) {
+    return -1;
+  }
+
+  header->block_size = get_u32(buffer + HUFF_MAGIC_LENGTH + 1);
+  header->checkpoint_interval = header->block_size;
+  header->header_size = FRAMED_HEADER_SIZE;
+  header->interleaved = buffer[HUFF_MAGIC_LENGTH] == HUFF_VERSION_INTERLEAVED;
+
+  if (buffer[HUFF_MAGIC_LENGTH] == HUFF_VERSION_SEEKABLE ||
+      header->interleaved) {
+    if (length < SEEKABLE_HEADER_SIZE) {
+      return -1;
+    }
+    header->checkpoint_interval = get_u32(buffer + FRAMED_HEADER_SIZE);
+    header->header_size = SEEKABLE_HEADER_SIZE;
+  } else if (buffer[HUFF_MAGIC_LENGTH] != HUFF_VERSION_FRAMED) {
+    return -1;
+  }
+
+  if (header->block_size == 0 || header->block_size > FRAMED_MAX_BLOCK_SIZE ||
+      header->checkpoint_interval == 0 ||
+      header->block_size % header->checkpoint_interval != 0 ||
+      (header->interleaved &&
+       header->checkpoint_interval != header->block_size)) {
+    return -1;
+  }
+
+  header->entry_size =
+      INDEX_OFFSET_SIZE +
+      CHECKPOINT_SIZE * (header->block_size / header->checkpoint_interval - 1);
+  return 0;
+}
+
+/* Checks the trailer at the end of a framed file of file_size bytes against
+ * its header. Stores the offset of the index, which ends the file, and
+ * returns the number of frames, or -1 if the trailer is invalid. */
+long check_index_trailer(const FramedHeader *header, const uint8_t *trailer,
+                         off_t file_size, off_t *index_offset) {
+  uint64_t num_frames = get_u64(trailer);
+
+  if (num_frames > (uint64_t)file_size / header->entry_size) {
+    return -1;
+  }
+
+  *index_offset = file_size - INDEX_TRAILER_SIZE -
+                  (off_t)num_frames * (off_t)header->entry_size;
+  if (*index_offset < (off_t)(header->header_size + FRAME_END_SIZE) ||
+      (uint64_t)*index_offset != get_u64(trailer + 8)) {
+    return -1;
+  }
+
+  return (long)num_frames;
+}
+
+/* Reads the jump table at the start of the payload_length bytes of the
+ * payload of an interleaved frame into the size of each of its FRAME_STREAMS
+ * streams. Returns -1 if the streams do not fit in the payload. */
+int unpack_stream_sizes(const uint8_t *payload, size_t payload_length,
+                        size_t sizes[]) {
+  size_t remaining;
+  int i;
+
+  if (payload_length < FRAME_JUMP_TABLE_SIZE) {
+    return -1;
+  }
+
+  remaining = payload_length - FRAME_JUMP_TABLE_SIZE;
+  for (i = 0; i < FRAME_STREAMS - 1; i++) {
+    sizes[i] = get_u32(payload + 4 * i);
+    if (sizes[i] > remaining) {
+      return -1;
+    }
+    remaining -= sizes[i];
+  }
+
+  sizes[FRAME_STREAMS - 1] = remaining;
+  return 0;
+}
+
+/* Reads the frame held in the length bytes of buffer, of a file with the given
+ * layout. Returns -1 if the frame is invalid. */
+int parse_frame(const uint8_t *buffer, size_t length,
+                const FramedHeader *layout, Frame *frame) {
+  int lengths_size;
+  int i;
+
+  if (length < FRAME_HEADER_FIXED) {
+    return -1;
+  }
+
+  frame->num_bytes = get_u32(buffer);
+  frame->payload_length = get_u32(buffer + 4);
+  frame->stored = length >= FRAME_HEADER_FIXED + CODE_LENGTHS_FIXED &&
+                  stored_lengths(buffer + FRAME_HEADER_FIXED);
+  lengths_size = frame->stored
+                     ? CODE_LENGTHS_FIXED
+                     : unpack_code_lengths(buffer + FRAME_HEADER_FIXED,
+                                           length - FRAME_HEADER_FIXED,
+                                           frame->codes);
+  if (frame->num_bytes == 0 || frame->num_bytes > layout->block_size ||
+      lengths_size == -1 ||
+      FRAME_HEADER_FIXED + lengths_size + frame->payload_length != length) {
+    return -1;
+  }
+
+  frame->payload = buffer + FRAME_HEADER_FIXED + lengths_size;
+  if (frame->stored) {
+    frame->interleaved = false;
+    return frame->payload_length != frame->num_bytes ? -1 : 0;
+  }
+
+  frame->num_codes = 0;
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (frame->codes[i].length != 0) {
+      frame->single_char = i;
+      frame->num_codes++;
+    }
+  }
+
+  /* A single byte is only described by the header */
+  if (frame->num_codes == 1) {
+    frame->interleaved = false;
+    return frame->payload_length != 0 ? -1 : 0;
+  }
+
+  frame->interleaved = layout->interleaved;
+  return frame->interleaved
+             ? unpack_stream_sizes(frame->payload, frame->payload_length,
+                                   frame->stream_sizes)
+             : 0;
+}
@@ -0,0 +1,223 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+/*
+ * format.h
+ * Describes the files written by hencode. The original (legacy) format starts
+ * with the number of symbols minus one, followed by a (symbol, 32-bit
+ * frequency) record per symbol. Newer formats start with HUFF_MAGIC and a
+ * version byte instead. A legacy file with all 256 symbols starts with 0xFF
+ * followed by its first symbol 0x00, so the magic can not be mistaken for it.
+ * Every number is big endian.
+ *
+ * Code lengths are stored as the first and last symbol present (1 byte each),
+ * then the code length of every symbol from the first to the last one, packed
+ * two per byte (high nibble first, 0 for absent symbols). The codes are the
+ * canonical codes of those lengths. A frame whose code lengths are instead
+ * STORED_FIRST_SYMBOL followed by STORED_LAST_SYMBOL (a first symbol past the
+ * last one) is stored: its payload is its input bytes as they are, so the bit
+ * offset of every byte is 8 times its position.
+ *
+ * Version 1 (canonical):
+ *   magic (3 bytes), version (1 byte), number of input bytes (32 bits, or
+ *   HUFF_SIZE_ESCAPE followed by the number in 64 bits for inputs of 4GB and
+ *   more), the code lengths, then the code of every input byte, most
+ *   significant bit first. An input made of a single distinct byte has a code
+ *   length of 1 and no payload.
+ *
+ * Version 2 (framed):
+ *   magic (3 bytes), version (1 byte), block size (32 bits), then one frame
+ *   per block of input. A frame holds the number of input bytes of the block
+ *   (32 bits, at most the block size), the size of its payload (32 bits), its
+ *   code lengths and its payload, coded like a version 1 payload and padded
+ *   to a whole byte. A frame of 0 input bytes ends the frames, and is followed
+ *   by the index: the offset of every frame in the file (64 bits each), then
+ *   the number of frames and the offset of the index (64 bits each), which
+ *   end the file. Every frame but the last holds a whole block.
+ *
+ * Version 3 (seekable):
+ *   like version 2, but the header also holds a checkpoint interval K (32
+ *   bits, dividing the block size), and the index entry of every frame
+ *   follows its offset with block size / K - 1 checkpoints: the bit offset in
+ *   the payload of the code of every K-th byte of the block after the first
+ *   (32 bits each, CHECKPOINT_NONE past the end of the last frame). Version 2
+ *   is version 3 with K equal to the block size.
+ *
+ * Version 4 (interleaved):
+ *   like version 3 with K equal to the block size, but the payload of every
+ *   frame with more than one code is split into FRAME_STREAMS streams, so they
+ *   can be decoded side by side. Stream i holds the codes of the bytes from
+ *   i * n / FRAME_STREAMS to (i + 1) * n / FRAME_STREAMS of the n bytes of
+ *   the block, padded to a whole byte. The payload starts with a jump table,
+ *   the size of every stream but the last (32 bits each), followed by the
+ *   streams. Stored frames are not split.
+ *
+ * Version 5 (adaptive):
+ *   magic (3 bytes), version (1 byte), then the code of every input byte and
+ *   of ADAPTIVE_END, padded to a whole byte. The codes come from an adaptive
+ *   Huffman tree of the bytes before them (see adaptive.h), so nothing
+ *   describes them up front and the size is not needed.
+ *
+ * Version 6 (context):
+ *   magic (3 bytes), version (1 byte), number of input bytes (like version
+ *   1), the number of tables minus one (1 byte), the table of every context
+ *   (1 byte for each of the HUFF_CONTEXTS byte values), then the code lengths
+ *   of every table. Every byte is coded with the table of the byte before it
+ *   (of byte 0 for the first byte), like a version 1 payload otherwise. The
+ *   symbol of a table with a single code takes no bits.
+ *
+ * Version 7 (LZ):
+ *   magic (3 bytes), version (1 byte), the log of the window size (1 byte),
+ *   then one frame per block of at most LZ_BLOCK_SIZE input bytes (see
+ *   lz.h). A frame holds the number of input bytes of the block (32 bits),
+ *   the size of the rest of the frame (32 bits), the code lengths of the
+ *   literal, length and distance tables, and its payload, padded to a whole
+ *   byte. A frame of 0 input bytes ends the file. The payload is a list of
+ *   sequences: the number of literals, the code of every literal, then,
+ *   unless the block is complete, the length of a match minus LZ_MIN_MATCH
+ *   and its distance, which is below the window size. Numbers are coded as
+ *   the symbol of their length table (distances of their distance table)
+ *   followed by their extra bits, most significant first. The symbol of a
+ *   table with a single code takes no bits, and a match may copy bytes of
+ *   the blocks before it and bytes it copies itself. A stored frame has no
+ *   other code lengths, and its block is still part of the window.
+ *
+ * Version 8 (preset):
+ *   magic (3 bytes), version (1 byte), the id of a preset table built into
+ *   the binaries (1 byte, see preset.h), the check of the code lengths of
+ *   that table (32 bits), the number of input bytes (like version 1), then a
+ *   version 1 payload coded with the codes of the preset.
+ */
+
+#include "huffman.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define HUFF_MAGIC "\xff" "HF"
+#define HUFF_MAGIC_LENGTH 3
+#define HUFF_VERSION_CANONICAL 1
+#define HUFF_VERSION_FRAMED 2
+#define HUFF_VERSION_SEEKABLE 3
+#define HUFF_VERSION_INTERLEAVED 4
+#define HUFF_VERSION_ADAPTIVE 5
+#define HUFF_VERSION_CONTEXT 6
+#define HUFF_VERSION_LZ 7
+#define HUFF_VERSION_PRESET 8
+
+/* The first and last symbols, and every length for all 256 symbols */
+#define CODE_LENGTHS_FIXED 2
+#define CODE_LENGTHS_MAX (CODE_LENGTHS_FIXED + HUFFMAN_SYMBOLS / 2)
+#define STORED_FIRST_SYMBOL 1
+#define STORED_LAST_SYMBOL 0
+
+/* The magic and the version */
+#define ADAPTIVE_HEADER_SIZE (HUFF_MAGIC_LENGTH + 1)
+
+/* A size of HUFF_SIZE_ESCAPE is followed by HUFF_SIZE_WIDE more bytes */
+#define HUFF_SIZE_ESCAPE 0xFFFFFFFFUL
+#define HUFF_SIZE_WIDE 8
+
+/* The magic, the version and the size (unless escaped) */
+#define CANONICAL_HEADER_FIXED (HUFF_MAGIC_LENGTH + 1 + 4)
+#define CANONICAL_HEADER_MAX                                                   \
+  (CANONICAL_HEADER_FIXED + HUFF_SIZE_WIDE + CODE_LENGTHS_MAX)
+
+/* The magic, the version, the preset id, its check and the size (unless
+ * escaped) */
+#define PRESET_HEADER_FIXED (HUFF_MAGIC_LENGTH + 1 + 1 + 4 + 4)
+#define PRESET_HEADER_MAX (PRESET_HEADER_FIXED + HUFF_SIZE_WIDE)
+
+/* The magic, the version and the window log */
+#define LZ_HEADER_SIZE (HUFF_MAGIC_LENGTH + 1 + 1)
+
+/* The canonical header fields, the number of tables and the context map */
+#define HUFF_CONTEXTS 256
+#define CONTEXT_HEADER_FIXED (CANONICAL_HEADER_FIXED + 1 + HUFF_CONTEXTS)
+#define CONTEXT_HEADER_MAX                                                     \
+  (CONTEXT_HEADER_FIXED + HUFF_SIZE_WIDE + HUFF_CONTEXTS * CODE_LENGTHS_MAX)
+
+/* The magic, the version and the block size (and the checkpoint interval) */
+#define FRAMED_HEADER_SIZE (HUFF_MAGIC_LENGTH + 1 + 4)
+#define SEEKABLE_HEADER_SIZE (FRAMED_HEADER_SIZE + 4)
+#define FRAME_HEADER_FIXED 8
+#define FRAME_HEADER_MAX (FRAME_HEADER_FIXED + CODE_LENGTHS_MAX)
+#define FRAME_END_SIZE 4
+#define INDEX_OFFSET_SIZE 8
+#define CHECKPOINT_SIZE 4
+#define INDEX_TRAILER_SIZE 16
+#define FRAME_STREAMS 4
+#define FRAME_JUMP_TABLE_SIZE (4 * (FRAME_STREAMS - 1))
+
+/* First byte of a block of length bytes coded by stream of an interleaved
+ * frame */
+#define STREAM_START(length, stream) ((length) * (stream) / FRAME_STREAMS)
+
+#define HUFF_BLOCK_SIZE (1 << 20)
+#define HUFF_CHECKPOINT_INTERVAL (1 << 16)
+#define CHECKPOINT_NONE 0xFFFFFFFFUL
+
+/* Where checkpoint i (from 1) of an index entry is */
+#define INDEX_CHECKPOINT(i) (INDEX_OFFSET_SIZE + ((i) - 1) * CHECKPOINT_SIZE)
+
+/* Keeps the bit offsets of a payload within 32 bits */
+#define FRAMED_MAX_BLOCK_SIZE (1 << 24)
+
+/* The layout of a framed (version 2 to 4) file, read from its header */
+typedef struct {
+  size_t header_size;
+  size_t block_size;
+  size_t checkpoint_interval;
+  size_t entry_size;
+  bool interleaved;
+} FramedHeader;
+
+/* A frame read into memory. The payload of an interleaved frame holds
+ * stream_sizes bytes per stream after its jump table, and the payload of a
+ * stored frame its bytes as they are. */
+typedef struct {
+  size_t num_bytes;
+  size_t payload_length;
+  const uint8_t *payload;
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  int num_codes;
+  int single_char;
+  bool stored;
+  bool interleaved;
+  size_t stream_sizes[FRAME_STREAMS];
+} Frame;
+
+/* Largest frame for a block of length bytes, with codes of at most
+ * CANONICAL_MAX_LENGTH bits, split into streams or not */
+#define FRAME_BOUND(length)                                                    \
+  (FRAME_HEADER_MAX + FRAME_JUMP_TABLE_SIZE + FRAME_STREAMS +                  \
+   ((length) * CANONICAL_MAX_LENGTH + 7) / 8)
+
+/* Largest frame of an LZ block of length bytes: no byte takes more than 24
+ * bits, counting its share of the sequence that codes it */
+#define LZ_FRAME_BOUND(length)                                                 \
+  (FRAME_HEADER_FIXED + 3 * CODE_LENGTHS_MAX + 3 * (length) + 16)
+
+void put_u32(uint8_t *buffer, uint32_t value);
+uint32_t get_u32(const uint8_t *buffer);
+void put_u64(uint8_t *buffer, uint64_t value);
+uint64_t get_u64(const uint8_t *buffer);
+size_t put_size(uint8_t *buffer, uint64_t size);
+int get_size(const uint8_t *buffer, size_t length, uint64_t *size);
+size_t pack_code_lengths(uint8_t *buffer, HuffmanCode codes[]);
+size_t pack_stored_lengths(uint8_t *buffer);
+bool stored_lengths(const uint8_t *buffer);
+int code_lengths_size(const uint8_t *buffer);
+int unpack_code_lengths(const uint8_t *buffer, size_t length,
+                        HuffmanCode codes[]);
+int parse_framed_header(const uint8_t *buffer, size_t length,
+                        FramedHeader *header);
+long check_index_trailer(const FramedHeader *header, const uint8_t *trailer,
+                         off_t file_size, off_t *index_offset);
+int unpack_stream_sizes(const uint8_t *payload, size_t payload_length,
+                        size_t sizes[]);
+int parse_frame(const uint8_t *buffer, size_t length,
+                const FramedHeader *layout, Frame *frame);
+
+#endif
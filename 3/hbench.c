@@ -0,0 +1,262 @@
+/*
+ * hbench.c
+ * Measures the encoding throughput of hencode. The bytes of the input file are
+ * counted repeat times, then the codes are built once and the file is
+ * translated repeat times into /dev/null, so only the counting and the
+ * BitWriter (and reading the file back from the page cache) are timed.
+ * Then the file is coded in memory with libhuff, whole and as messages of
+ * MESSAGE_SIZE bytes, each with codes of its own or all with a table built
+ * once, and decoded back: a mismatch fails, so make test runs it too.
+ * usage: hbench infile [repeat]
+ */
+
+#include "bitwriter.h"
+#include "huff.h"
+#include "huffman.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define BYTES_MAX 256
+#define BUF_SIZE 65536
+#define BYTES_PER_MEGABYTE (1024.0 * 1024.0)
+#define MESSAGE_SIZE 4096
+
+double now(void) {
+  struct timeval time;
+
+  gettimeofday(&time, NULL);
+  return time.tv_sec + time.tv_usec / 1e6;
+}
+
+/* Reads the whole file fd into a buffer, storing its size into *size */
+uint8_t *read_file(int fd, size_t *size) {
+  uint8_t *data = NULL;
+  size_t capacity = 0;
+  ssize_t bytes_read;
+
+  *size = 0;
+  do {
+    if (*size == capacity) {
+      capacity = capacity == 0 ? BUF_SIZE : capacity * 2;
+      if ((data = (uint8_t *)realloc(data, capacity)) == NULL) {
+        perror("failed realloc when reading input");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    bytes_read = read(fd, data + *size, capacity - *size);
+    if (bytes_read == -1) {
+      perror("Failed to read input file.");
+      exit(EXIT_FAILURE);
+    }
+    *size += bytes_read;
+  } while (bytes_read > 0);
+
+  return data;
+}
+
+/* Exits unless the length bytes decoded match the original ones */
+void check_round_trip(const uint8_t *original, const uint8_t *decoded,
+                      size_t length, long result) {
+  if (result < 0 || memcmp(original, decoded, length) != 0) {
+    fprintf(stderr, "hbench: libhuff round trip failed (%ld)\n", result);
+    exit(1);
+  }
+}
+
+/* Codes the size bytes of data with libhuff repeat times, whole then as
+ * messages, and checks every one decodes back */
+void bench_library(const uint8_t *data, size_t size, int repeat) {
+  size_t capacity = huff_encode_bound(size > 0 ? size : 1);
+  size_t *message_lengths;
+  size_t num_messages = (size + MESSAGE_SIZE - 1) / MESSAGE_SIZE;
+  size_t length;
+  size_t offset;
+  uint8_t *coded;
+  uint8_t *decoded;
+  HuffTable table;
+  double start;
+  double elapsed;
+  long result = 0;
+  size_t j;
+  int i;
+
+  coded = (uint8_t *)malloc(capacity);
+  decoded = (uint8_t *)malloc(size > 0 ? size : 1);
+  message_lengths = (size_t *)malloc(sizeof(size_t) * (num_messages + 1));
+  if (coded == NULL || decoded == NULL || message_lengths == NULL) {
+    perror("failed malloc when benchmarking libhuff");
+    exit(EXIT_FAILURE);
+  }
+
+  start = now();
+  for (i = 0; i < repeat; i++) {
+    result = huff_encode(data, size, coded, capacity);
+  }
+  elapsed = now() - start;
+  check_round_trip(data, decoded, size,
+                   result < 0 ? result
+                              : huff_decode(coded, result, decoded, size));
+
+  printf("libhuff coded %.1f MB whole in %.3f s: %.1f MB/s\n",
+         (double)size * repeat / BYTES_PER_MEGABYTE, elapsed,
+         (double)size * repeat / BYTES_PER_MEGABYTE / elapsed);
+
+  /* Every message with codes of its own, in a whole file */
+  start = now();
+  for (i = 0; i < repeat; i++) {
+    for (offset = 0; offset < size; offset += MESSAGE_SIZE) {
+      length = size - offset < MESSAGE_SIZE ? size - offset : MESSAGE_SIZE;
+      result = huff_encode(data + offset, length, coded, capacity);
+      if (result < 0) {
+        check_round_trip(data, decoded, 0, result);
+      }
+    }
+  }
+  elapsed = now() - start;
+
+  printf("libhuff coded %d-byte messages with their own codes in %.3f s: "
+         "%.1f MB/s\n",
+         MESSAGE_SIZE, elapsed,
+         (double)size * repeat / BYTES_PER_MEGABYTE / elapsed);
+
+  /* Every message with the table of the whole file, built once */
+  if ((result = huff_table_build(&table, data, size)) != HUFF_OK) {
+    check_round_trip(data, decoded, 0, result);
+  }
+
+  start = now();
+  for (i = 0; i < repeat; i++) {
+    message_lengths[0] = 0;
+    for (j = 0, offset = 0; offset < size; j++, offset += MESSAGE_SIZE) {
+      length = size - offset < MESSAGE_SIZE ? size - offset : MESSAGE_SIZE;
+      result = huff_encode_using(&table, data + offset, length,
+                                 coded + message_lengths[j],
+                                 capacity - message_lengths[j]);
+      if (result < 0) {
+        check_round_trip(data, decoded, 0, result);
+      }
+      message_lengths[j + 1] = message_lengths[j] + result;
+    }
+  }
+  elapsed = now() - start;
+
+  for (j = 0, offset = 0; offset < size; j++, offset += MESSAGE_SIZE) {
+    length = size - offset < MESSAGE_SIZE ? size - offset : MESSAGE_SIZE;
+    result = huff_decode_using(&table, coded + message_lengths[j],
+                               message_lengths[j + 1] - message_lengths[j],
+                               decoded + offset, length);
+    if (result < 0) {
+      check_round_trip(data, decoded, 0, result);
+    }
+  }
+  check_round_trip(data, decoded, size, 0);
+
+  printf("libhuff coded %d-byte messages with a shared table in %.3f s: "
+         "%.1f MB/s\n",
+         MESSAGE_SIZE, elapsed,
+         (double)size * repeat / BYTES_PER_MEGABYTE / elapsed);
+
+  huff_table_free(&table);
+  free(message_lengths);
+  free(decoded);
+  free(coded);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned int frequency_table[BYTES_MAX] = {0};
+  HuffmanCode codes[BYTES_MAX];
+  unsigned char buf[BUF_SIZE];
+  HuffmanTree tree;
+  HuffmanNode *root;
+  BitWriter bw;
+  uint8_t *data;
+  size_t size;
+  double total_bytes = 0;
+  double start;
+  double elapsed;
+  int bytes_read;
+  int input_fd;
+  int output_fd;
+  int repeat = 1;
+  int i;
+
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "usage: hbench infile [repeat]\n");
+    exit(1);
+  }
+
+  if (argc == 3 && (repeat = atoi(argv[2])) < 1) {
+    fprintf(stderr, "hbench: invalid repeat count %s\n", argv[2]);
+    exit(1);
+  }
+
+  input_fd = open(argv[1], O_RDONLY);
+  output_fd = open("/dev/null", O_WRONLY);
+  if (input_fd == -1 || output_fd == -1) {
+    fprintf(stderr, "Failed to open file: %s\n", argv[1]);
+    exit(1);
+  }
+
+  start = now();
+  for (i = 0; i < repeat; i++) {
+    if (lseek(input_fd, 0, SEEK_SET) == -1) {
+      perror("Failed to reset input file pointer.");
+      exit(EXIT_FAILURE);
+    }
+
+    memset(frequency_table, 0, sizeof(frequency_table));
+    total_bytes = 0;
+    while ((bytes_read = read(input_fd, buf, BUF_SIZE)) > 0) {
+      total_bytes += bytes_read;
+      count_frequencies(frequency_table, buf, bytes_read);
+    }
+  }
+  elapsed = now() - start;
+
+  printf("counted %.1f MB in %.3f s: %.1f MB/s\n",
+         total_bytes * repeat / BYTES_PER_MEGABYTE, elapsed,
+         total_bytes * repeat / BYTES_PER_MEGABYTE / elapsed);
+
+  root = build_huffman_tree(&tree, frequency_table);
+  if (root == NULL) {
+    fprintf(stderr, "hbench: empty input\n");
+    exit(1);
+  }
+
+  memset(codes, 0, sizeof(codes));
+  store_huffman_codes(codes, root, 0, 0);
+
+  start = now();
+  for (i = 0; i < repeat; i++) {
+    if (lseek(input_fd, 0, SEEK_SET) == -1) {
+      perror("Failed to reset input file pointer.");
+      exit(EXIT_FAILURE);
+    }
+
+    bitwriter_init(&bw, output_fd);
+    bitwriter_translate_file(&bw, input_fd, codes);
+  }
+  elapsed = now() - start;
+
+  printf("encoded %.1f MB in %.3f s: %.1f MB/s\n",
+         total_bytes * repeat / BYTES_PER_MEGABYTE, elapsed,
+         total_bytes * repeat / BYTES_PER_MEGABYTE / elapsed);
+
+  if (lseek(input_fd, 0, SEEK_SET) == -1) {
+    perror("Failed to reset input file pointer.");
+    exit(EXIT_FAILURE);
+  }
+
+  data = read_file(input_fd, &size);
+  bench_library(data, size, repeat);
+
+  free(data);
+  close(input_fd);
+  close(output_fd);
+  return 0;
+}
@@ -2,51 +2,95 @@
  * hdecode.c
  * It reads Huffman encoded data from an input file, decodes it, and writes the
  * decoded data to an output file.
- * The program reads the Huffman frequency table from the header of the input
- * file and uses it to build a Huffman tree. The encoded data is then read from
- * the file, decoded using the Huffman tree, and written to the output file.
+ * The program reads the code lengths (canonical files) or the Huffman
+ * frequency table (legacy files, used to rebuild the Huffman tree) from the
+ * header of the input file and derives the code of every byte from them. The
+ * encoded data is then read from the file, decoded using lookup tables built
+ * from those codes, and written to the output file. The frames of framed files
+ * each carry their own code lengths, and are decoded on a pool of threads
+ * (-j) found through the index at the end of the file. The index of seekable
+ * files also holds checkpoints inside every frame, so --range only decodes
+ * from the checkpoint before the first byte wanted. The payloads of
+ * interleaved files are split into streams, which are decoded side by side.
+ * Adaptive files carry no codes at all: the decoder updates the same adaptive
+ * tree as the encoder after every byte. Context files carry several tables,
+ * and every byte is decoded with the table of the byte before it. LZ files
+ * are read frame by frame, each rebuilding its block from literal bytes and
+ * matches copied from the window of bytes decoded before them. Preset files
+ * are decoded with the table, built into hdecode, that their header names.
+ * Stored frames are copied from the input to the output by the kernel where
+ * it can.
  * The program handles input and output file errors, and also allows data to be
- * read from standard input and written to standard output.
+ * read from standard input and written to standard output. The header is
+ * parsed from the input as it comes and the payload read straight after it,
+ * so any file decodes from a pipe; framed files are then decoded frame by
+ * frame instead of through their index. With -p the input is read ahead and
+ * the output written behind on threads of their own (see pipeline.h).
  */
 
+#include "adaptive.h"
+#include "bitreader.h"
+#include "blockpool.h"
+#include "format.h"
 #include "huffman.h"
+#include "lz.h"
+#include "pipeline.h"
+#include "preset.h"
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define FREQUENCY_TABLE_SIZE 256
-#define HEADER_BUFFER_SIZE 2048
-#define READ_BUFFER_SIZE 4096
-#define WRITE_BUFFER_SIZE 8192
+#define WRITE_BUFFER_SIZE 65536
 
-/* mutates frequency_table to contain the frequencency of each byte */
-int retrieve_table_from_header(unsigned int frequency_table[], int input_fd) {
+extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+extern ssize_t copy_file_range(int fd_in, off_t *off_in, int fd_out,
+                               off_t *off_out, size_t len, unsigned int flags);
+extern ssize_t splice(int fd_in, off_t *off_in, int fd_out, off_t *off_out,
+                      size_t len, unsigned int flags);
+
+/* State shared by the threads decoding a framed file. index holds the offset
+ * of every frame. */
+typedef struct {
+  int input_fd;
+  int output_fd;
+  FramedHeader layout;
+  long num_frames;
+  off_t index_offset;
+  off_t *index;
+} FramedDecoder;
+
+void usage(void) {
+  fprintf(stderr,
+          "usage: hdecode [-j threads] [-p] [--range start:length] "
+          "( infile | - ) [ outfile ]\n"
+          "  -j threads            decode the frames of framed files on "
+          "threads\n"
+          "  -p                    read and write on threads of their own\n"
+          "  --range start:length  decode only length bytes from start of "
+          "a framed file\n");
+  exit(1);
+}
+
+/* mutates frequency_table to contain the frequencency of each byte found in a
+ * legacy header */
+int retrieve_table_from_header(unsigned int frequency_table[],
+                               const unsigned char buffer[]) {
 
-  unsigned char buffer[HEADER_BUFFER_SIZE];
-  int bytes_read;
   int buffer_offset = 0;
-  int count;
+  int count = 0;
   unsigned char current_byte;
   unsigned int current_count;
   int i;
 
-  /* we know for certain a valid header wont be greater than HEADER_BUFFER */
-  bytes_read = read(input_fd, buffer, HEADER_BUFFER_SIZE);
-
-  if (bytes_read == -1) {
-    perror("Error reading from input file");
-    exit(EXIT_FAILURE);
-  }
-
-  if (bytes_read == 0) {
-    return 0;
-  }
-
   /* retrieve the number of unique bytes */
   memcpy(&count, buffer + buffer_offset, sizeof(unsigned char));
   buffer_offset += sizeof(unsigned char);
@@ -68,139 +112,831 @@ int retrieve_table_from_header(unsigned int frequency_table[], int input_fd) {
   return buffer_offset;
 }
 
-/* Returns false if not at leaf and true if at leaf. Mutates decoded_char to
- * contain the current byte if node is a leaf.*/
-bool decode_bit(HuffmanNode **node, uint8_t bit, unsigned char *decoded_char) {
-  if (node == NULL || *node == NULL) {
-    return false;
-  }
+/* mutates codes to contain the canonical code of each byte found in a version
+ * 1 header (see format.h) and num_bytes to the size of the decoded file.
+ * Returns the size of the header, or -1 if it is truncated. */
+int retrieve_lengths_from_header(HuffmanCode codes[], uint64_t *num_bytes,
+                                 const unsigned char buffer[], int bytes_read) {
+  int offset = HUFF_MAGIC_LENGTH + 1;
+  int size_length;
+  int lengths_size;
 
-  if (bit == 0) {
-    *node = (*node)->left;
-  } else {
-    *node = (*node)->right;
+  size_length = get_size(buffer + offset, bytes_read - offset, num_bytes);
+  if (size_length == -1) {
+    return -1;
   }
 
-  /* If node is a leaf */
-  if (*node != NULL && (*node)->left == NULL && (*node)->right == NULL) {
-    *decoded_char = (*node)->key;
-    return true;
-  }
+  offset += size_length;
+  lengths_size =
+      unpack_code_lengths(buffer + offset, bytes_read - offset, codes);
 
-  return false;
+  return lengths_size == -1 ? -1 : offset + lengths_size;
 }
 
-/* Parses the input file past the header, and converts every code back into its
- * corresponding byte and writes it to the output file. */
-void decode_and_write(HuffmanNode **tree, int input_fd, int output_fd,
-                      int header_offset, int num_bytes) {
+/* Writes num_bytes copies of a byte to the output file */
+void write_single_byte(int output_fd, unsigned char single_char,
+                       uint64_t num_bytes) {
+  unsigned char write_buffer[WRITE_BUFFER_SIZE];
+  uint64_t remaining_bytes = num_bytes;
+  size_t bytes_to_write;
+
+  while (remaining_bytes > 0) {
+    bytes_to_write = remaining_bytes > WRITE_BUFFER_SIZE ? WRITE_BUFFER_SIZE
+                                                         : remaining_bytes;
+    memset(write_buffer, single_char, bytes_to_write);
+    if (pipeline_write(output_fd, write_buffer, bytes_to_write) == -1) {
+      perror("Failed to write to output file when handling one character");
+      exit(EXIT_FAILURE);
+    };
+    remaining_bytes -= bytes_to_write;
+  }
+}
 
-  unsigned char buffer[READ_BUFFER_SIZE];
+/* Decodes num_bytes bytes from br with table and writes them to the output
+ * file */
+void decode_with_table(const DecodeTable *table, BitReader *br, int output_fd,
+                       uint64_t num_bytes) {
   unsigned char write_buffer[WRITE_BUFFER_SIZE];
+  uint64_t remaining_bytes = num_bytes;
+  size_t bytes_to_write;
 
-  int bytes_read;
-  int write_buffer_offset = 0;
-  int i;
+  /* Convert the codes in the input file into their corresponding bytes. */
+  while (remaining_bytes > 0) {
+    bytes_to_write = remaining_bytes > WRITE_BUFFER_SIZE ? WRITE_BUFFER_SIZE
+                                                         : remaining_bytes;
 
-  unsigned char byte;
-  HuffmanNode *current_node = *tree;
-  int j;
+    if (bitreader_decode(br, table, write_buffer, bytes_to_write) == -1) {
+      fprintf(stderr, "Corrupted or truncated input file\n");
+      exit(EXIT_FAILURE);
+    }
+
+    if (pipeline_write(output_fd, write_buffer, bytes_to_write) == -1) {
+      perror("failed to write with max buffer when decoding");
+      exit(EXIT_FAILURE);
+    }
+    remaining_bytes -= bytes_to_write;
+  }
+}
 
-  unsigned char bit;
-  unsigned char decoded_char;
+/* Reads the payload that follows the header from br, and converts every code
+ * back into its corresponding byte and writes it to the output file. The codes
+ * are decoded with lookup tables built from their bits and lengths, so any
+ * prefix code (from a tree or from canonical lengths) can be decoded. */
+void decode_and_write(HuffmanCode codes[], BitReader *br, int output_fd,
+                      uint64_t num_bytes) {
 
-  unsigned int processed_bytes = 0;
-  bool is_decoded;
+  DecodeTable table;
+  int num_codes = 0;
+  int single_char = 0;
+  int status;
+  int i;
 
-  if (tree == NULL || *tree == NULL) {
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (codes[i].length != 0) {
+      single_char = i;
+      num_codes++;
+    }
+  }
+
+  /* handle the edge case if there is one character: nothing follows the
+   * header */
+  if (num_codes == 1) {
+    write_single_byte(output_fd, (unsigned char)single_char, num_bytes);
     return;
   }
-  /* handle the edge case if there is one character */
-  if ((*tree)->left == NULL && (*tree)->right == NULL) {
-    unsigned char single_char = (*tree)->key;
-    int remaining_bytes = num_bytes;
-
-    while (remaining_bytes > 0) {
-      int bytes_to_write = remaining_bytes > WRITE_BUFFER_SIZE
-                               ? WRITE_BUFFER_SIZE
-                               : remaining_bytes;
-      memset(write_buffer, single_char, bytes_to_write);
-      if (write(output_fd, write_buffer, bytes_to_write) == -1) {
-        perror("Failed to write to output file when handling one character");
-        exit(EXIT_FAILURE);
-      };
-      remaining_bytes -= bytes_to_write;
-    }
+
+  if (num_bytes == 0) {
     return;
   }
-  /* Skip the header */
-  if (lseek(input_fd, header_offset, SEEK_SET) == -1) {
-    perror("Error seeking input file.");
+
+  status = decode_table_build(&table, codes);
+  if (status == DECODE_ERROR_MEMORY) {
+    perror("failed malloc when building decode table");
+    exit(EXIT_FAILURE);
+  }
+  if (status != 0) {
+    fprintf(stderr, "Invalid code table in header\n");
     exit(EXIT_FAILURE);
   }
 
-  /* Convert the codes in the input file into their corresponding bytes. */
-  while ((bytes_read = read(input_fd, buffer, READ_BUFFER_SIZE)) > 0) {
-    for (i = 0; i < bytes_read; i++) {
-      byte = buffer[i];
-
-      for (j = 7; j >= 0; j--) {
-
-        bit = (byte >> j) & 1;
-        is_decoded = decode_bit(&current_node, bit, &decoded_char);
-
-        if (is_decoded) {
-          memcpy(write_buffer + write_buffer_offset, &decoded_char,
-                 sizeof(char));
-          write_buffer_offset += sizeof(char);
-          processed_bytes += 1;
-
-          if (write_buffer_offset == WRITE_BUFFER_SIZE) {
-            if (write(output_fd, write_buffer,
-                      sizeof(char) * write_buffer_offset) == -1) {
-              perror("failed to write with max buffer when decoding");
-              exit(EXIT_FAILURE);
-            };
-            write_buffer_offset = 0;
-          }
-
-          if (processed_bytes == num_bytes) {
-            if (write(output_fd, write_buffer,
-                      sizeof(char) * write_buffer_offset) == -1) {
-              perror("Failed to write buffer when processing last byte.");
-              exit(EXIT_FAILURE);
-            }
-            return;
-          }
-          current_node = *tree;
-        }
+  decode_with_table(&table, br, output_fd, num_bytes);
+  decode_table_free(&table);
+}
+
+/* Returns the total amount of bytes in the frequency table */
+uint64_t get_number_of_bytes(unsigned int frequency_table[]) {
+  int i;
+  uint64_t count = 0;
+  for (i = 0; i < 256; i++) {
+    if (frequency_table[i] != 0) {
+      count += frequency_table[i];
+    }
+  }
+
+  return count;
+}
+
+/* Writes length bytes to fd, returning -1 on failure. */
+int write_all(int fd, const uint8_t *buffer, size_t length) {
+  ssize_t written;
+
+  while (length > 0) {
+    written = pipeline_write(fd, buffer, length);
+    if (written <= 0) {
+      return -1;
+    }
+
+    buffer += written;
+    length -= written;
+  }
+
+  return 0;
+}
+
+/* Reads length bytes at offset of fd, returning -1 on failure. */
+int read_at(int fd, uint8_t *buffer, size_t length, off_t offset) {
+  ssize_t bytes_read;
+
+  while (length > 0) {
+    bytes_read = pread(fd, buffer, length, offset);
+    if (bytes_read <= 0) {
+      return -1;
+    }
+
+    buffer += bytes_read;
+    length -= bytes_read;
+    offset += bytes_read;
+  }
+
+  return 0;
+}
+
+/* Returns the offset of the end of frame index, where the next frame (or the
+ * end of the frames) starts */
+off_t frame_end(const FramedDecoder *decoder, size_t index) {
+  return index + 1 < decoder->num_frames ? decoder->index[index + 1]
+                                         : decoder->index_offset -
+                                               FRAME_END_SIZE;
+}
+
+/* Reads frame index of the input into buffer, which grows as needed, and
+ * parses it into frame. Returns -1 if the frame is invalid. */
+int read_frame(const FramedDecoder *decoder, size_t index, off_t offset,
+               off_t end, uint8_t **buffer, size_t *capacity, Frame *frame) {
+  size_t length = end - offset;
+
+  if (end <= offset || length > FRAME_BOUND(decoder->layout.block_size)) {
+    return -1;
+  }
+
+  if (length > *capacity) {
+    free(*buffer);
+    if (!(*buffer = (uint8_t *)malloc(length))) {
+      perror("failed malloc when reading frame");
+      exit(EXIT_FAILURE);
+    }
+    *capacity = length;
+  }
+
+  if (read_at(decoder->input_fd, *buffer, length, offset) == -1 ||
+      parse_frame(*buffer, length, &decoder->layout, frame) == -1) {
+    return -1;
+  }
+
+  /* Only the last frame may hold part of a block */
+  if (index + 1 < decoder->num_frames &&
+      frame->num_bytes != decoder->layout.block_size) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Copies length bytes at offset of in_fd to out_fd, without reading them
+ * into memory where the system can: with copy_file_range between regular
+ * files, with splice into a pipe, and with read and write otherwise (and
+ * always when out_fd is written behind, to keep the bytes in order). Returns
+ * -1 on failure. */
+int copy_stored_bytes(int in_fd, off_t offset, int out_fd, size_t length) {
+  uint8_t buffer[WRITE_BUFFER_SIZE];
+  int method = pipeline_active(out_fd) ? 2 : 0;
+  ssize_t copied;
+
+  while (length > 0) {
+    if (method == 0) {
+      copied = copy_file_range(in_fd, &offset, out_fd, NULL, length, 0);
+    } else if (method == 1) {
+      copied = splice(in_fd, &offset, out_fd, NULL, length, 0);
+    } else {
+      copied = pread(in_fd, buffer,
+                     length > WRITE_BUFFER_SIZE ? WRITE_BUFFER_SIZE : length,
+                     offset);
+      if (copied > 0 && write_all(out_fd, buffer, copied) == -1) {
+        return -1;
       }
+      offset += copied > 0 ? copied : 0;
+    }
+
+    /* The system refusing these descriptors falls back to the next way */
+    if (copied == -1 && method < 2) {
+      method++;
+      continue;
+    }
+    if (copied <= 0) {
+      return -1;
     }
+    length -= copied;
   }
 
-  if (bytes_read == -1) {
-    perror("Failed to read input file when decoding");
-    exit(EXIT_FAILURE);
+  return 0;
+}
+
+/* Decodes block index of the input (see format.h). The bytes of a stored
+ * frame are left in the input, for write_decoded_frame to copy them from
+ * there: the slot then has no output, and an input_length of as many bytes. */
+int decode_frame(void *context, size_t index, BlockSlot *slot) {
+  FramedDecoder *decoder = (FramedDecoder *)context;
+  uint8_t header[FRAME_HEADER_FIXED + CODE_LENGTHS_FIXED];
+  off_t offset = decoder->index[index];
+  off_t end = frame_end(decoder, index);
+  Frame frame;
+
+  slot->input_length = 0;
+  if (end - offset > (off_t)sizeof(header) &&
+      read_at(decoder->input_fd, header, sizeof(header), offset) == 0 &&
+      stored_lengths(header + FRAME_HEADER_FIXED)) {
+    /* Only the last frame may hold part of a block */
+    if (get_u32(header) == 0 || get_u32(header + 4) != get_u32(header) ||
+        get_u32(header) > decoder->layout.block_size ||
+        (index + 1 < (size_t)decoder->num_frames &&
+         get_u32(header) != decoder->layout.block_size) ||
+        (off_t)sizeof(header) + get_u32(header) != end - offset) {
+      fprintf(stderr, "Corrupted or truncated input file\n");
+      return -1;
+    }
+
+    slot->input_length = get_u32(header);
+    slot->output_length = 0;
+    return 0;
+  }
+
+  block_slot_reserve(slot, 0, decoder->layout.block_size);
+  if (read_frame(decoder, index, decoder->index[index],
+                 frame_end(decoder, index), &slot->input,
+                 &slot->input_capacity, &frame) == -1 ||
+      decode_frame_bytes(&frame, 0, 0, slot->output, frame.num_bytes) == -1) {
+    fprintf(stderr, "Corrupted or truncated input file\n");
+    return -1;
+  }
+
+  slot->output_length = frame.num_bytes;
+  return 0;
+}
+
+int write_decoded_frame(void *context, size_t index, BlockSlot *slot) {
+  FramedDecoder *decoder = (FramedDecoder *)context;
+
+  if (slot->input_length != 0) {
+    if (copy_stored_bytes(decoder->input_fd,
+                          decoder->index[index] + FRAME_HEADER_FIXED +
+                              CODE_LENGTHS_FIXED,
+                          decoder->output_fd, slot->input_length) == -1) {
+      perror("failed to copy a stored frame when decoding");
+      return -1;
+    }
+    return 0;
   }
 
-  if (write(output_fd, write_buffer, sizeof(char) * write_buffer_offset) ==
+  if (write_all(decoder->output_fd, slot->output, slot->output_length) ==
       -1) {
-    perror("Failed to write when flushing decode write buffer");
+    perror("failed to write with max buffer when decoding");
+    return -1;
+  }
+
+  return 0;
+}
+
+/* Reads the trailer at the end of a framed file into decoder. Returns -1 if
+ * it is invalid. */
+int read_frame_trailer(FramedDecoder *decoder) {
+  uint8_t trailer[INDEX_TRAILER_SIZE];
+  struct stat file_stat;
+
+  if (fstat(decoder->input_fd, &file_stat) == -1 ||
+      file_stat.st_size < INDEX_TRAILER_SIZE ||
+      read_at(decoder->input_fd, trailer, INDEX_TRAILER_SIZE,
+              file_stat.st_size - INDEX_TRAILER_SIZE) == -1) {
+    return -1;
+  }
+
+  decoder->num_frames = check_index_trailer(
+      &decoder->layout, trailer, file_stat.st_size, &decoder->index_offset);
+  return decoder->num_frames == -1 ? -1 : 0;
+}
+
+/* Reads the offset of every frame from the index at the end of a framed file
+ * into decoder. Returns -1 if the index is invalid. */
+int read_frame_index(FramedDecoder *decoder) {
+  size_t entry_size = decoder->layout.entry_size;
+  uint8_t *entries;
+  long i;
+
+  entries = (uint8_t *)malloc(decoder->num_frames * entry_size + 1);
+  decoder->index =
+      (off_t *)malloc(sizeof(off_t) * (decoder->num_frames + 1));
+  if (entries == NULL || decoder->index == NULL) {
+    perror("failed malloc when reading block index");
+    exit(EXIT_FAILURE);
+  }
+
+  if (read_at(decoder->input_fd, entries, decoder->num_frames * entry_size,
+              decoder->index_offset) == -1) {
+    free(entries);
+    return -1;
+  }
+
+  for (i = 0; i < decoder->num_frames; i++) {
+    decoder->index[i] = (off_t)get_u64(entries + i * entry_size);
+  }
+  free(entries);
+
+  /* Frames follow each other from the end of the header */
+  for (i = 0; i < decoder->num_frames; i++) {
+    if (decoder->index[i] >= frame_end(decoder, i) ||
+        (i == 0 && decoder->index[i] != decoder->layout.header_size)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* Writes length bytes of the decoded file from offset start. Only the index
+ * entries of the frames holding them are read, each entry with the offset of
+ * the frame after it in one read, and each frame from the checkpoint before
+ * its first wanted byte, so the time to the first byte does not grow with the
+ * file. */
+int decode_range(FramedDecoder *decoder, unsigned long start,
+                 unsigned long length) {
+  size_t block_size = decoder->layout.block_size;
+  size_t interval = decoder->layout.checkpoint_interval;
+  size_t entry_size = decoder->layout.entry_size;
+  uint8_t *entry = (uint8_t *)malloc(entry_size + INDEX_OFFSET_SIZE);
+  uint8_t *output = (uint8_t *)malloc(block_size);
+  uint8_t *buffer = NULL;
+  size_t capacity = 0;
+  size_t index = start / block_size;
+  size_t frame_start;
+  size_t count;
+  size_t checkpoint;
+  unsigned long bit_offset;
+  bool last;
+  off_t offset;
+  off_t end;
+  int status = -1;
+  Frame frame;
+
+  if (entry == NULL || output == NULL) {
+    perror("failed malloc when decoding range");
+    exit(EXIT_FAILURE);
+  }
+
+  for (; length > 0 && index < (size_t)decoder->num_frames; index++) {
+    /* The checkpoints of the frame follow its offset, and the offset of the
+     * next frame follows them */
+    last = index + 1 == (size_t)decoder->num_frames;
+    if (read_at(decoder->input_fd, entry,
+                last ? entry_size : entry_size + INDEX_OFFSET_SIZE,
+                decoder->index_offset + (off_t)index * entry_size) == -1) {
+      goto done;
+    }
+    offset = (off_t)get_u64(entry);
+    end = last ? decoder->index_offset - FRAME_END_SIZE
+               : (off_t)get_u64(entry + entry_size);
+
+    /* Frames follow each other from the end of the header */
+    if (offset < (off_t)decoder->layout.header_size ||
+        (index == 0 && offset != (off_t)decoder->layout.header_size) ||
+        read_frame(decoder, index, offset, end, &buffer, &capacity, &frame) ==
+            -1) {
+      goto done;
+    }
+
+    frame_start = start > index * block_size ? start - index * block_size : 0;
+    if (frame_start >= frame.num_bytes) {
+      break;
+    }
+
+    count = frame.num_bytes - frame_start < length
+                ? frame.num_bytes - frame_start
+                : length;
+    checkpoint = frame_start / interval;
+    bit_offset =
+        checkpoint == 0 ? 0 : get_u32(entry + INDEX_CHECKPOINT(checkpoint));
+
+    if (bit_offset == CHECKPOINT_NONE ||
+        decode_frame_bytes(&frame, bit_offset,
+                           frame_start - checkpoint * interval, output,
+                           count) == -1) {
+      goto done;
+    }
+
+    if (write_all(decoder->output_fd, output, count) == -1) {
+      perror("failed to write with max buffer when decoding");
+      exit(EXIT_FAILURE);
+    }
+    length -= count;
+  }
+  status = 0;
+
+done:
+  free(buffer);
+  free(entry);
+  free(output);
+  return status;
+}
+
+/* Decodes a framed (version 2 to 4) file, whose header is in header, decoding
+ * its frames on num_threads threads. With a range, only the length bytes from
+ * start are decoded. */
+void decode_framed(int input_fd, int output_fd, const uint8_t *header,
+                   size_t bytes_read, int num_threads, bool range,
+                   unsigned long start, unsigned long length) {
+  FramedDecoder decoder;
+
+  decoder.input_fd = input_fd;
+  decoder.output_fd = output_fd;
+  decoder.index = NULL;
+
+  /* A range reads only the entries of the index it needs */
+  if (parse_framed_header(header, bytes_read, &decoder.layout) == -1 ||
+      read_frame_trailer(&decoder) == -1 ||
+      (!range && read_frame_index(&decoder) == -1)) {
+    fprintf(stderr, "Corrupted or truncated input file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (range) {
+    if (decode_range(&decoder, start, length) == -1) {
+      fprintf(stderr, "Corrupted or truncated input file\n");
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  if (run_block_pool(num_threads, decoder.num_frames, decode_frame,
+                     write_decoded_frame, &decoder) == -1) {
     exit(EXIT_FAILURE);
   }
+
+  free(decoder.index);
 }
 
-/* Returns the total amount of bytes in the frequency table */
-unsigned int get_number_of_bytes(unsigned int frequency_table[]) {
+/* Decodes the frames of a framed file from br as they come, for inputs that
+ * can not seek to the index. Returns -1 if the file is invalid. */
+int decode_frames_stream(BitReader *br, int output_fd) {
+  FramedHeader layout;
+  const uint8_t *bytes;
+  uint8_t *buffer;
+  uint8_t *output;
+  size_t available;
+  size_t length;
+  bool partial = false;
+  int lengths_size;
+  int status = -1;
+  Frame frame;
+
+  available = bitreader_peek(br, &bytes, SEEKABLE_HEADER_SIZE);
+  if (parse_framed_header(bytes, available, &layout) == -1) {
+    return -1;
+  }
+  bitreader_consume(br, layout.header_size);
+
+  buffer = (uint8_t *)malloc(FRAME_BOUND(layout.block_size));
+  output = (uint8_t *)malloc(layout.block_size);
+  if (buffer == NULL || output == NULL) {
+    perror("failed malloc when decoding frames");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    available =
+        bitreader_peek(br, &bytes, FRAME_HEADER_FIXED + CODE_LENGTHS_FIXED);
+    if (available < FRAME_END_SIZE) {
+      break;
+    }
+
+    /* The index after the last frame is only needed to seek */
+    if (get_u32(bytes) == 0) {
+      status = 0;
+      break;
+    }
+
+    /* Only the last frame may hold part of a block */
+    if (partial || available < FRAME_HEADER_FIXED + CODE_LENGTHS_FIXED) {
+      break;
+    }
+
+    lengths_size = stored_lengths(bytes + FRAME_HEADER_FIXED)
+                       ? CODE_LENGTHS_FIXED
+                       : code_lengths_size(bytes + FRAME_HEADER_FIXED);
+    if (lengths_size == -1) {
+      break;
+    }
+
+    length = FRAME_HEADER_FIXED + lengths_size + get_u32(bytes + 4);
+    if (length > FRAME_BOUND(layout.block_size) ||
+        bitreader_read_bytes(br, buffer, length) != length ||
+        parse_frame(buffer, length, &layout, &frame) == -1 ||
+        decode_frame_bytes(&frame, 0, 0, output, frame.num_bytes) == -1) {
+      break;
+    }
+
+    if (write_all(output_fd, output, frame.num_bytes) == -1) {
+      perror("failed to write with max buffer when decoding");
+      exit(EXIT_FAILURE);
+    }
+    partial = frame.num_bytes != layout.block_size;
+  }
+
+  free(buffer);
+  free(output);
+  return status;
+}
+
+/* Writes the length bytes decoded so far, and empties them */
+void write_pending(int output_fd, const uint8_t *pending, size_t *length) {
+  if (write_all(output_fd, pending, *length) == -1) {
+    perror("failed to write with max buffer when decoding");
+    exit(EXIT_FAILURE);
+  }
+  *length = 0;
+}
+
+/* Takes the next bit from br into *bit. Once less than a refill is buffered,
+ * the bits are taken a byte at a time, and the pending bytes are written
+ * before waiting for more input, so a live stream decodes as it comes.
+ * Returns -1 past the end of the input. */
+int read_adaptive_bit(BitReader *br, int output_fd, const uint8_t *pending,
+                      size_t *pending_length, int *bit) {
+  const uint8_t *next;
+
+  if (br->bit_count == 0) {
+    if (br->buffer_length - br->buffer_position >= sizeof(uint64_t)) {
+      bitreader_refill(br);
+    } else {
+      if (br->buffer_position == br->buffer_length) {
+        write_pending(output_fd, pending, pending_length);
+      }
+      if (bitreader_peek(br, &next, 1) == 0) {
+        return -1;
+      }
+      br->bits = (uint64_t)next[0] << 56;
+      br->bit_count = 8;
+      bitreader_consume(br, 1);
+    }
+  }
+
+  *bit = (int)(br->bits >> 63);
+  br->bits <<= 1;
+  br->bit_count--;
+  return 0;
+}
+
+/* Decodes the payload of an adaptive (version 5) file from br, updating the
+ * tree after every byte like the encoder did, up to the end symbol. Returns
+ * -1 if the payload is invalid. */
+int decode_adaptive(BitReader *br, int output_fd) {
+  uint8_t pending[WRITE_BUFFER_SIZE];
+  size_t pending_length = 0;
+  AdaptiveTree tree;
+  int position;
+  int symbol;
+  int bit;
   int i;
-  unsigned int count = 0;
-  for (i = 0; i < 256; i++) {
-    if (frequency_table[i] != 0) {
-      count += frequency_table[i];
+
+  adaptive_init(&tree);
+  for (;;) {
+    for (position = ADAPTIVE_ROOT;
+         tree.nodes[position].symbol == ADAPTIVE_INTERNAL;
+         position = tree.nodes[position].child[bit]) {
+      if (read_adaptive_bit(br, output_fd, pending, &pending_length, &bit) ==
+          -1) {
+        return -1;
+      }
+    }
+
+    /* The 0-node is followed by a symbol not seen yet */
+    symbol = tree.nodes[position].symbol;
+    if (symbol == ADAPTIVE_ZERO_NODE) {
+      for (i = 0, symbol = 0; i < ADAPTIVE_SYMBOL_BITS; i++) {
+        if (read_adaptive_bit(br, output_fd, pending, &pending_length,
+                              &bit) == -1) {
+          return -1;
+        }
+        symbol = symbol << 1 | bit;
+      }
+
+      if (symbol > ADAPTIVE_END || tree.leaf[symbol] != -1) {
+        return -1;
+      }
     }
+
+    if (symbol == ADAPTIVE_END) {
+      break;
+    }
+
+    pending[pending_length++] = (uint8_t)symbol;
+    if (pending_length == WRITE_BUFFER_SIZE) {
+      write_pending(output_fd, pending, &pending_length);
+    }
+    adaptive_update(&tree, symbol);
   }
 
-  return count;
+  write_pending(output_fd, pending, &pending_length);
+  return 0;
+}
+
+/* Decodes a context (version 6) file from br: the tables of its header into
+ * merged decode tables, then every byte with the table of the byte before
+ * it. Returns -1 if the file is invalid. */
+int decode_context(BitReader *br, int output_fd) {
+  uint8_t write_buffer[WRITE_BUFFER_SIZE];
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  ContextTables tables;
+  const uint8_t *header;
+  const uint8_t *map;
+  size_t available;
+  size_t offset = HUFF_MAGIC_LENGTH + 1;
+  uint64_t remaining;
+  size_t length;
+  uint8_t previous = 0;
+  int size_length;
+  int lengths_size;
+  int num_tables;
+  int status = 0;
+  int i;
+
+  available = bitreader_peek(br, &header, CONTEXT_HEADER_MAX);
+  size_length = get_size(header + offset, available - offset, &remaining);
+  if (size_length == -1 ||
+      available < CONTEXT_HEADER_FIXED - 4 + (size_t)size_length) {
+    return -1;
+  }
+
+  offset += size_length;
+  num_tables = header[offset] + 1;
+  map = header + offset + 1;
+  offset += 1 + HUFF_CONTEXTS;
+  for (i = 0; i < HUFF_CONTEXTS; i++) {
+    if (map[i] >= num_tables) {
+      return -1;
+    }
+  }
+
+  if (context_tables_init(&tables, num_tables, map) != 0) {
+    perror("failed malloc when building decode tables");
+    exit(EXIT_FAILURE);
+  }
+
+  for (i = 0; i < num_tables && status == 0; i++) {
+    lengths_size =
+        unpack_code_lengths(header + offset, available - offset, codes);
+    if (lengths_size == -1) {
+      status = -1;
+    } else if ((status = context_tables_add(&tables, i, codes)) ==
+               DECODE_ERROR_MEMORY) {
+      perror("failed malloc when building decode tables");
+      exit(EXIT_FAILURE);
+    }
+    offset += lengths_size;
+  }
+
+  if (status == 0) {
+    bitreader_consume(br, offset);
+  }
+
+  while (status == 0 && remaining > 0) {
+    length = remaining > WRITE_BUFFER_SIZE ? WRITE_BUFFER_SIZE : remaining;
+    if (bitreader_decode_context(br, &tables, write_buffer, length,
+                                 &previous) == -1) {
+      status = -1;
+      break;
+    }
+
+    if (write_all(output_fd, write_buffer, length) == -1) {
+      perror("failed to write with max buffer when decoding");
+      exit(EXIT_FAILURE);
+    }
+    remaining -= length;
+  }
+
+  context_tables_free(&tables);
+  return status;
+}
+
+/* Decodes the frames of an LZ (version 7) file from br as they come, every
+ * block from the window of blocks before it. Returns -1 if the file is
+ * invalid. */
+int decode_lz(BitReader *br, int output_fd) {
+  LzDecoder *decoder = (LzDecoder *)malloc(sizeof(LzDecoder));
+  const uint8_t *bytes;
+  const uint8_t *block;
+  uint8_t *frame = (uint8_t *)malloc(LZ_FRAME_BOUND(LZ_BLOCK_SIZE));
+  size_t available;
+  size_t length;
+  size_t frame_size;
+  int status = -1;
+
+  if (decoder == NULL || frame == NULL) {
+    perror("failed malloc when decoding frames");
+    exit(EXIT_FAILURE);
+  }
+
+  available = bitreader_peek(br, &bytes, LZ_HEADER_SIZE);
+  if (available < LZ_HEADER_SIZE ||
+      lz_decoder_init(decoder, bytes[HUFF_MAGIC_LENGTH + 1]) == -1) {
+    free(decoder);
+    free(frame);
+    return -1;
+  }
+  bitreader_consume(br, LZ_HEADER_SIZE);
+
+  for (;;) {
+    if (bitreader_read_bytes(br, frame, FRAME_HEADER_FIXED) !=
+        FRAME_HEADER_FIXED) {
+      break;
+    }
+
+    length = get_u32(frame);
+    frame_size = get_u32(frame + 4);
+    if (length == 0) {
+      status = 0;
+      break;
+    }
+
+    if (frame_size > LZ_FRAME_BOUND(LZ_BLOCK_SIZE) ||
+        bitreader_read_bytes(br, frame, frame_size) != frame_size ||
+        (block = lz_decode_frame(decoder, frame, frame_size, length)) ==
+            NULL) {
+      break;
+    }
+
+    if (write_all(output_fd, block, length) == -1) {
+      perror("failed to write with max buffer when decoding");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  lz_decoder_free(decoder);
+  free(decoder);
+  free(frame);
+  return status;
+}
+
+/* Decodes a preset (version 8) file from br with the table its header names.
+ * Returns -1 if the header is truncated. */
+int decode_preset(BitReader *br, int output_fd) {
+  const uint8_t *header;
+  size_t bytes_read = bitreader_peek(br, &header, PRESET_HEADER_MAX);
+  size_t offset = HUFF_MAGIC_LENGTH + 1 + 1 + 4;
+  uint64_t num_bytes;
+  int size_length;
+  int id;
+
+  if (bytes_read < PRESET_HEADER_FIXED ||
+      (size_length = get_size(header + offset, bytes_read - offset,
+                              &num_bytes)) == -1) {
+    return -1;
+  }
+
+  id = header[HUFF_MAGIC_LENGTH + 1];
+  if (id >= num_presets) {
+    fprintf(stderr, "Unknown preset table %d\n", id);
+    exit(EXIT_FAILURE);
+  }
+
+  /* A preset rebuilt from another sample decodes to garbage */
+  if (get_u32(header + HUFF_MAGIC_LENGTH + 2) != presets[id].check) {
+    fprintf(stderr, "Preset table %s differs from the one the input was "
+                    "coded with\n",
+            presets[id].name);
+    exit(EXIT_FAILURE);
+  }
+
+  bitreader_consume(br, offset + size_length);
+  decode_with_table(&presets[id].table.decode, br, output_fd, num_bytes);
+  return 0;
+}
+
+/* Waits for the output written behind the decoder to be written, returning
+ * the exit status */
+int finish_pipeline(void) {
+  if (pipeline_finish() == -1) {
+    perror("Error writing to output file.");
+    return EXIT_FAILURE;
+  }
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -208,41 +944,220 @@ int main(int argc, char *argv[]) {
   int input_fd = 0;
   int output_fd = 1;
   unsigned int frequency_table[FREQUENCY_TABLE_SIZE] = {0};
+  const uint8_t *header;
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  struct stat file_stat;
+  BitReader *br;
   int header_offset;
-  HuffmanNode *list = NULL;
-  HuffmanNode *tree = NULL;
-  unsigned int num_bytes;
+  size_t bytes_read;
+  bool seekable;
+  HuffmanTree tree;
+  HuffmanNode *root;
+  uint64_t num_bytes = 0;
+  int num_threads = 1;
+  bool pipelined = false;
+  bool framed;
+  bool range = false;
+  unsigned long range_start = 0;
+  unsigned long range_length = 0;
+  char *end;
+  int opt;
 
-  if (argc != 2 && argc != 3) {
-    fprintf(stderr, "usage: hdecode [ ( infile | - ) [ outfile ] ]");
-    exit(1);
+  static struct option long_options[] = {{"range", required_argument, 0, 'r'},
+                                         {0, 0, 0, 0}};
+
+  while ((opt = getopt_long(argc, argv, "j:p", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'j':
+      num_threads = (int)strtol(optarg, &end, 10);
+      if (*end != '\0' || num_threads < 1) {
+        usage();
+      }
+      break;
+    case 'p':
+      pipelined = true;
+      break;
+    case 'r':
+      range_start = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != ':') {
+        usage();
+      }
+      optarg = end + 1;
+      range_length = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != '\0') {
+        usage();
+      }
+      range = true;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (argc - optind != 1 && argc - optind != 2) {
+    usage();
   }
 
   /* Retrieve the input file. */
-  if (strcmp(argv[1], "-") != 0) {
-    input_fd = open(argv[1], O_RDONLY);
+  if (strcmp(argv[optind], "-") != 0) {
+    input_fd = open(argv[optind], O_RDONLY);
     if (input_fd == -1) {
-      fprintf(stderr, "Failed to open file: %s", argv[1]);
+      fprintf(stderr, "Failed to open file: %s", argv[optind]);
       exit(1);
     }
   }
 
   /* Retrieve the output file. */
-  if (argc == 3) {
-    output_fd = open(argv[2], O_WRONLY | O_TRUNC | O_CREAT, 0644);
+  if (argc - optind == 2) {
+    output_fd = open(argv[optind + 1], O_WRONLY | O_TRUNC | O_CREAT, 0644);
     if (output_fd == -1) {
-      fprintf(stderr, "Failed to open file: %s", argv[2]);
+      fprintf(stderr, "Failed to open file: %s", argv[optind + 1]);
       exit(1);
     }
   }
 
-  header_offset = retrieve_table_from_header(frequency_table, input_fd);
-  num_bytes = get_number_of_bytes(frequency_table);
-  populate_linked_list(&list, frequency_table);
-  populate_huffman_tree(&tree, &list);
-  decode_and_write(&tree, input_fd, output_fd, header_offset, num_bytes);
+  /* The header is parsed from the input as it comes, and the payload read
+   * straight after it, so pipes and sockets decode without seeking */
+  if (!(br = (BitReader *)malloc(sizeof(BitReader)))) {
+    perror("failed malloc when reading input");
+    exit(EXIT_FAILURE);
+  }
+  bitreader_init(br, input_fd, pipeline_read);
+  seekable = fstat(input_fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode);
+
+  bytes_read = bitreader_peek(br, &header, HUFF_MAGIC_LENGTH + 1);
+  if (bytes_read == 0) {
+    return 0;
+  }
+
+  memset(codes, 0, sizeof(codes));
 
-  free_tree(tree);
+  /* Only the index of framed files tells where a range starts */
+  if (range && (!seekable || bytes_read < HUFF_MAGIC_LENGTH + 1 ||
+                memcmp(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH) != 0 ||
+                header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_CANONICAL ||
+                header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_ADAPTIVE ||
+                header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_CONTEXT ||
+                header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_LZ ||
+                header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_PRESET)) {
+    fprintf(stderr, "hdecode: --range needs a framed file (hencode -j) that "
+                    "can seek\n");
+    exit(1);
+  }
 
-  return 0;
+  framed = bytes_read >= HUFF_MAGIC_LENGTH + 1 &&
+           memcmp(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH) == 0 &&
+           (header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_FRAMED ||
+            header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_SEEKABLE ||
+            header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_INTERLEAVED);
+
+  /* The rest of the input is read ahead from after the bytes peeked, except
+   * from framed files read through their index */
+  if (pipelined) {
+    pipeline_start_writer(output_fd);
+    if (!framed || !seekable) {
+      pipeline_start_reader(input_fd);
+    }
+  }
+
+  if (bytes_read >= HUFF_MAGIC_LENGTH + 1 &&
+      memcmp(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH) == 0) {
+    if (framed) {
+      /* The index at the end of the file spreads its frames over threads */
+      if (seekable) {
+        bytes_read = bitreader_peek(br, &header, SEEKABLE_HEADER_SIZE);
+        decode_framed(input_fd, output_fd, header, bytes_read, num_threads,
+                      range, range_start, range_length);
+      } else if (decode_frames_stream(br, output_fd) == -1) {
+        fprintf(stderr, "Corrupted or truncated input file\n");
+        exit(EXIT_FAILURE);
+      }
+
+      free(br);
+      return finish_pipeline();
+    }
+
+    if (header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_ADAPTIVE) {
+      bitreader_consume(br, ADAPTIVE_HEADER_SIZE);
+      if (decode_adaptive(br, output_fd) == -1) {
+        fprintf(stderr, "Corrupted or truncated input file\n");
+        exit(EXIT_FAILURE);
+      }
+
+      free(br);
+      return finish_pipeline();
+    }
+
+    if (header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_CONTEXT) {
+      if (decode_context(br, output_fd) == -1) {
+        fprintf(stderr, "Corrupted or truncated input file\n");
+        exit(EXIT_FAILURE);
+      }
+
+      free(br);
+      return finish_pipeline();
+    }
+
+    if (header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_LZ) {
+      if (decode_lz(br, output_fd) == -1) {
+        fprintf(stderr, "Corrupted or truncated input file\n");
+        exit(EXIT_FAILURE);
+      }
+
+      free(br);
+      return finish_pipeline();
+    }
+
+    if (header[HUFF_MAGIC_LENGTH] == HUFF_VERSION_PRESET) {
+      if (decode_preset(br, output_fd) == -1) {
+        fprintf(stderr, "Corrupted or truncated input file\n");
+        exit(EXIT_FAILURE);
+      }
+
+      free(br);
+      return finish_pipeline();
+    }
+
+    if (header[HUFF_MAGIC_LENGTH] != HUFF_VERSION_CANONICAL) {
+      fprintf(stderr, "Unsupported format version %d\n",
+              header[HUFF_MAGIC_LENGTH]);
+      exit(EXIT_FAILURE);
+    }
+
+    bytes_read = bitreader_peek(br, &header, CANONICAL_HEADER_MAX);
+    header_offset =
+        retrieve_lengths_from_header(codes, &num_bytes, header, bytes_read);
+    if (header_offset == -1) {
+      fprintf(stderr, "Corrupted or truncated input file\n");
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    /* A symbol count, then 5 bytes per symbol */
+    bytes_read = bitreader_peek(br, &header, 1 + 5 * (header[0] + 1));
+    if (bytes_read < 1 + 5 * ((size_t)header[0] + 1)) {
+      fprintf(stderr, "Corrupted or truncated input file\n");
+      exit(EXIT_FAILURE);
+    }
+    header_offset = retrieve_table_from_header(frequency_table, header);
+    num_bytes = get_number_of_bytes(frequency_table);
+
+    /* The tree sums the counts in an int, so hencode never writes more */
+    if (num_bytes > INT_MAX) {
+      fprintf(stderr, "Corrupted or truncated input file\n");
+      exit(EXIT_FAILURE);
+    }
+    root = build_huffman_tree(&tree, frequency_table);
+    store_huffman_codes(codes, root, 0, 0);
+
+    /* A lone byte has an empty code, mark it as present */
+    if (root != NULL && root->left == NULL && root->right == NULL) {
+      codes[root->key].length = 1;
+    }
+  }
+
+  bitreader_consume(br, header_offset);
+  decode_and_write(codes, br, output_fd, num_bytes);
+
+  free(br);
+  return finish_pipeline();
 }
@@ -6,37 +6,172 @@
  * in the file. It then creates a linked list of Huffman nodes for each byte
  * with a non-zero frequency, sorts the list by frequency, and creates a Huffman
  * tree from the list of nodes. The program then recursively traverses the
- * Huffman tree to generate Huffman codes for each byte and stores the codes in
- * an array. Finally, the program prints the generated Huffman codes for each
- * byte.*/
+ * Huffman tree to generate the Huffman code (its bits and length) of each byte
+ * and stores the codes in an array. Finally, the program writes the header and
+ * the code of every byte of the file.
+ * By default the codes are canonical (see format.h). The options listed in
+ * usage() select the other formats, each written by an encode_* function
+ * below that describes it.*/
 
+#include "adaptive.h"
+#include "bitbuffer.h"
 #include "bitwriter.h"
+#include "blockpool.h"
+#include "context.h"
+#include "format.h"
+#include "huff.h"
+#include "huff_internal.h"
 #include "huffman.h"
+#include "lz.h"
+#include "pipeline.h"
+#include "preset.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
+
 #define BYTES_MAX 256
 #define HEX_MAX 16
-#define BUF_SIZE 4096
+#define COUNT_BUFFER_SIZE 65536
+#define COUNT_MAX_THREADS 8
+/* Files from this size are counted on several threads */
+#define COUNT_SPLIT_MIN (16 << 20)
+#define CHECKPOINTS_PER_BLOCK (HUFF_BLOCK_SIZE / HUFF_CHECKPOINT_INTERVAL)
+/* The index entry of a frame holds its offset, followed in seekable (version
+ * 3) files by its checkpoints after the first */
+#define ENTRY_SIZE(interleaved)                                                \
+  ((interleaved) ? INDEX_OFFSET_SIZE : INDEX_CHECKPOINT(CHECKPOINTS_PER_BLOCK))
+/* Blocks are stored unless coding saves at least this fraction of them */
+#define STORED_MIN_SAVING 64
+
+/* State shared by the threads coding a framed file */
+typedef struct {
+  int input_fd;
+  int output_fd;
+  int max_length;
+  bool interleaved;
+  off_t input_size;
+  uint8_t *index; /* the index entry of every frame (see format.h) */
+  size_t entry_size;
+  uint64_t offset;
+} FramedEncoder;
 
-extern char *strdup(const char *);
+/* State shared by the threads coding a batch of files */
+typedef struct {
+  char **files;
+  const char *output_dir; /* NULL to write next to every file */
+  int *errors;            /* errno of every file, 0 once it is coded */
+  uint64_t total_bytes;
+  size_t num_failed;
+} BatchEncoder;
 
-void populate_frequency_table(unsigned int *frequency_table, int fd) {
-  /* Fills the frequency table argument with the frequencies found in the
-   * provided file. */
-  unsigned char buf[BUF_SIZE];
-  int bytes_read;
+/* A part of the input counted by one thread */
+typedef struct {
+  int fd;
+  off_t start;
+  off_t end;
+  uint64_t counts[BYTES_MAX];
+  bool failed;
+} CountJob;
+
+/* Counts the bytes of the part of the input given by arg (a CountJob) */
+void *count_part(void *arg) {
+  CountJob *job = (CountJob *)arg;
+  uint8_t *buffer = (uint8_t *)malloc(COUNT_BUFFER_SIZE);
+  off_t offset = job->start;
+  ssize_t bytes_read;
+
+  if (buffer == NULL) {
+    perror("failed malloc when counting input");
+    exit(EXIT_FAILURE);
+  }
+
+  while (offset < job->end) {
+    bytes_read = pread(job->fd, buffer,
+                       job->end - offset < COUNT_BUFFER_SIZE
+                           ? (size_t)(job->end - offset)
+                           : COUNT_BUFFER_SIZE,
+                       offset);
+    if (bytes_read <= 0) {
+      job->failed = true;
+      break;
+    }
+
+    huff_add_counts(job->counts, buffer, bytes_read);
+    offset += bytes_read;
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+/* Counts a regular file of size bytes in num_threads equal parts at once */
+void count_file_parts(uint64_t *counts, int fd, off_t size,
+                      int num_threads) {
+  pthread_t threads[COUNT_MAX_THREADS];
+  CountJob jobs[COUNT_MAX_THREADS];
+  bool failed = false;
   int i;
+  int j;
 
-  while ((bytes_read = read(fd, buf, BUF_SIZE)) > 0) {
-    for (i = 0; i < bytes_read; i++) {
-      frequency_table[(unsigned int)buf[i]]++;
+  for (i = 0; i < num_threads; i++) {
+    memset(&jobs[i], 0, sizeof(CountJob));
+    jobs[i].fd = fd;
+    jobs[i].start = size / num_threads * i;
+    jobs[i].end = i == num_threads - 1 ? size : size / num_threads * (i + 1);
+    if (pthread_create(&threads[i], NULL, count_part, &jobs[i]) != 0) {
+      perror("failed to create thread");
+      exit(EXIT_FAILURE);
     }
   }
 
+  for (i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+    failed = failed || jobs[i].failed;
+    for (j = 0; j < BYTES_MAX; j++) {
+      counts[j] += jobs[i].counts[j];
+    }
+  }
+
+  if (failed) {
+    fprintf(stderr, "Failed to read from input file");
+    close(fd);
+    exit(1);
+  }
+}
+
+void populate_frequency_table(uint64_t *counts, int fd) {
+  /* Fills the counts argument with the frequencies found in the provided
+   * file. Large files are split between the processors, unless
+   * they are read ahead by the pipeline. */
+  unsigned char buf[COUNT_BUFFER_SIZE];
+  struct stat file_stat;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int bytes_read;
+
+  if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) &&
+      file_stat.st_size >= COUNT_SPLIT_MIN && num_threads > 1 &&
+      !pipeline_active(fd)) {
+    if (num_threads > COUNT_MAX_THREADS) {
+      num_threads = COUNT_MAX_THREADS;
+    }
+    count_file_parts(counts, fd, file_stat.st_size, (int)num_threads);
+    return;
+  }
+
+  while ((bytes_read = pipeline_read(fd, buf, COUNT_BUFFER_SIZE)) > 0) {
+    huff_add_counts(counts, buf, bytes_read);
+  }
+
   if (bytes_read == -1) {
     fprintf(stderr, "Failed to read from input file");
     close(fd);
@@ -44,127 +179,1318 @@ void populate_frequency_table(unsigned int *frequency_table, int fd) {
   }
 }
 
-void store_codes(char *codes[], HuffmanNode *node, char *code, int depth) {
-  /* Stores the codes generated by the huffman tree into the codes array. */
+int get_num_codes(unsigned int frequency_table[]) {
+  int i;
+  int count = 0;
+  for (i = 0; i < 256; i++) {
+    if (frequency_table[i] != 0) {
+      count += 1;
+    }
+  }
+  return count;
+}
+
+void display_codes(HuffmanCode codes[]) {
+  /* for debugging, should be removed from fin */
+  int i;
+  int j;
+  for (i = 0; i < 256; i++) {
+    if (codes[i].length != 0) {
+      printf("0x%s%x: ", i < HEX_MAX ? "0" : "", i);
+      for (j = codes[i].length - 1; j >= 0; j--) {
+        putchar('0' + (int)((codes[i].bits >> j) & 1));
+      }
+      putchar('\n');
+    }
+  }
+}
 
-  /* Guard statement to handle NULL nodes */
-  char *copied_code;
+void usage(void) {
+  int i;
 
-  if (node == NULL) {
-    return;
+  fprintf(stderr,
+          "usage: hencode [-l | -a | -c [-L length] | -z level [-w bits] "
+          "[-L length] | [-L length] [-i] [-j threads | -s]] [-p] "
+          "( infile | - ) [outfile]\n"
+          "       hencode -P preset [-p] ( infile | - ) [outfile]\n"
+          "       hencode -b [-j threads] [-o dir] file...\n"
+          "  -l          write the legacy frequency table header\n"
+          "  -a          write adaptive codes, coding bytes as they come\n"
+          "  -c          code bytes by the codes of the byte before them\n");
+  fprintf(stderr,
+          "  -z level    code repeats as matches, searching harder from 1 "
+          "to %d\n"
+          "  -w bits     search matches up to 2^bits bytes back (%d to %d, "
+          "default %d)\n",
+          LZ_MAX_LEVEL, LZ_MIN_WINDOW_LOG, LZ_MAX_WINDOW_LOG,
+          LZ_DEFAULT_WINDOW_LOG);
+  fprintf(stderr,
+          "  -L length   limit codes to length bits (1 to %d, default %d)\n"
+          "  -i          write a framed file of interleaved streams\n"
+          "  -j threads  write a framed file, coding its blocks on threads\n"
+          "  -s          write a framed file, reading the input once (as "
+          "for pipes)\n"
+          "  -p          read and write on threads of their own\n"
+          "  -b          code every file into file.huff, on -j threads\n"
+          "  -o dir      write the files of -b into dir\n",
+          CANONICAL_MAX_LENGTH, CANONICAL_MAX_LENGTH);
+  fprintf(stderr, "  -P preset   code with a built-in table:");
+  for (i = 0; i < num_presets; i++) {
+    fprintf(stderr, " %s", presets[i].name);
+  }
+  fprintf(stderr, "\n");
+  exit(1);
+}
+
+/* Returns the total amount of bytes in the counts */
+uint64_t get_number_of_bytes(const uint64_t counts[]) {
+  uint64_t count = 0;
+  int i;
+
+  for (i = 0; i < BYTES_MAX; i++) {
+    count += counts[i];
   }
 
-  /* Guard statement to handle leaf nodes */
-  if (node->left == NULL && node->right == NULL) {
-    code[depth] = '\0';
+  return count;
+}
 
-    copied_code = strdup(code);
-    codes[node->key] = copied_code;
-    return;
+/* Builds the canonical codes of the bytes of frequency_table (at least one),
+ * no longer than max_length bits (see huff_build_codes). Returns -1 if the
+ * bytes do not fit in max_length bits. */
+int build_canonical_codes(unsigned int frequency_table[], HuffmanCode codes[],
+                          int max_length) {
+  int result = huff_build_codes(frequency_table, codes, max_length);
+
+  if (result == HUFF_ERROR_MEMORY) {
+    perror("failed malloc when limiting code lengths");
+    exit(EXIT_FAILURE);
+  }
+
+  if (result != HUFF_OK) {
+    fprintf(stderr, "hencode: %d bytes do not fit in %d-bit codes\n",
+            get_num_codes(frequency_table), max_length);
+    return -1;
   }
 
-  /* traverse left */
-  code[depth] = '0';
-  store_codes(codes, node->left, code, depth + 1);
+  return 0;
+}
+
+/* Writes length bytes to fd, returning -1 on failure. */
+int write_all(int fd, const uint8_t *buffer, size_t length) {
+  ssize_t written;
+
+  while (length > 0) {
+    written = pipeline_write(fd, buffer, length);
+    if (written <= 0) {
+      return -1;
+    }
 
-  /* traverse right */
-  code[depth] = '1';
-  store_codes(codes, node->right, code, depth + 1);
+    buffer += written;
+    length -= written;
+  }
+
+  return 0;
 }
 
-void free_codes(char *codes[]) {
+/* Reads length bytes at offset of fd, returning -1 on failure. */
+int read_at(int fd, uint8_t *buffer, size_t length, off_t offset) {
+  ssize_t bytes_read;
+
+  while (length > 0) {
+    bytes_read = pread(fd, buffer, length, offset);
+    if (bytes_read <= 0) {
+      return -1;
+    }
+
+    buffer += bytes_read;
+    length -= bytes_read;
+    offset += bytes_read;
+  }
+
+  return 0;
+}
 
+/* Stores the bit offset of the code of every HUFF_CHECKPOINT_INTERVAL-th byte
+ * of the length bytes of input into the checkpoints of entry, after the first
+ * one */
+void record_checkpoints(uint8_t *entry, const uint8_t *input, size_t length,
+                        HuffmanCode codes[], bool single) {
+  uint32_t bit_offset = 0;
+  size_t i;
+  int j;
+
+  for (j = 1; j < CHECKPOINTS_PER_BLOCK; j++) {
+    if ((size_t)j * HUFF_CHECKPOINT_INTERVAL >= length) {
+      put_u32(entry + INDEX_CHECKPOINT(j), CHECKPOINT_NONE);
+      continue;
+    }
+
+    /* A single byte has no payload to point into */
+    for (i = (size_t)(j - 1) * HUFF_CHECKPOINT_INTERVAL;
+         i < (size_t)j * HUFF_CHECKPOINT_INTERVAL; i++) {
+      bit_offset += single ? 0 : codes[input[i]].length;
+    }
+    put_u32(entry + INDEX_CHECKPOINT(j), bit_offset);
+  }
+}
+
+/* Codes the length bytes of input into FRAME_STREAMS streams after the jump
+ * table at output (see format.h). Returns the size of the payload. */
+size_t encode_streams(const uint8_t *input, size_t length, HuffmanCode codes[],
+                      uint8_t *output) {
+  size_t payload_length = FRAME_JUMP_TABLE_SIZE;
+  size_t stream_length;
+  size_t start;
+  size_t end;
   int i;
 
-  for (i = 0; i < 256; i++) {
-    if (codes[i] != NULL) {
-      free(codes[i]);
+  for (i = 0; i < FRAME_STREAMS; i++) {
+    start = STREAM_START(length, i);
+    end = STREAM_START(length, i + 1);
+    stream_length = bitbuffer_encode(input + start, end - start, codes,
+                                     output + payload_length);
+    if (i < FRAME_STREAMS - 1) {
+      put_u32(output + 4 * i, (uint32_t)stream_length);
     }
+    payload_length += stream_length;
   }
+
+  return payload_length;
 }
 
-int get_num_codes(char *codes[]) {
+/* Returns the size the payload of a block with the given frequencies would
+ * have when coded with codes, split into streams or not */
+size_t coded_payload_size(unsigned int frequency_table[], HuffmanCode codes[],
+                          bool interleaved) {
+  unsigned long bits = 0;
   int i;
-  int count = 0;
-  for (i = 0; i < 256; i++) {
-    if (codes[i] != NULL) {
-      count += 1;
+
+  for (i = 0; i < BYTES_MAX; i++) {
+    bits += (unsigned long)frequency_table[i] * codes[i].length;
+  }
+
+  /* Each stream is padded on its own */
+  return interleaved
+             ? FRAME_JUMP_TABLE_SIZE + (bits + 7) / 8 + FRAME_STREAMS - 1
+             : (bits + 7) / 8;
+}
+
+/* Writes the length bytes of input as a stored frame at output and records
+ * the checkpoints of entry, the bit offsets of the bytes themselves. Returns
+ * the size of the frame. */
+long store_block(const uint8_t *input, size_t length, bool interleaved,
+                 uint8_t *output, uint8_t *entry) {
+  size_t header_length = FRAME_HEADER_FIXED +
+                         pack_stored_lengths(output + FRAME_HEADER_FIXED);
+  int j;
+
+  memcpy(output + header_length, input, length);
+  for (j = 1; j < CHECKPOINTS_PER_BLOCK && !interleaved; j++) {
+    put_u32(entry + INDEX_CHECKPOINT(j),
+            (size_t)j * HUFF_CHECKPOINT_INTERVAL < length
+                ? (uint32_t)(j * HUFF_CHECKPOINT_INTERVAL * 8)
+                : CHECKPOINT_NONE);
+  }
+
+  put_u32(output, (uint32_t)length);
+  put_u32(output + 4, (uint32_t)length);
+  return (long)(header_length + length);
+}
+
+/* Codes the length bytes of input into a frame at output, which must hold
+ * FRAME_BOUND(length) bytes, and records its checkpoints in its index entry,
+ * or splits its payload into streams if interleaved. A block that coding
+ * would barely shrink (compressed or encrypted data) is stored as it is
+ * instead. Returns the size of the frame, or -1 if the codes do not fit in
+ * max_length bits. */
+long encode_block(const uint8_t *input, size_t length, int max_length,
+                  bool interleaved, uint8_t *output, uint8_t *entry) {
+  unsigned int frequency_table[BYTES_MAX] = {0};
+  HuffmanCode codes[BYTES_MAX];
+  bool single;
+  size_t header_length;
+  size_t payload_length = 0;
+
+  count_frequencies(frequency_table, input, length);
+  if (build_canonical_codes(frequency_table, codes, max_length) == -1) {
+    return -1;
+  }
+
+  header_length = FRAME_HEADER_FIXED +
+                  pack_code_lengths(output + FRAME_HEADER_FIXED, codes);
+
+  /* A single byte is only described by the header */
+  single = get_num_codes(frequency_table) == 1;
+
+  /* Incompressible blocks (such as compressed or encrypted data) are not
+   * worth coding */
+  if (!single &&
+      header_length + coded_payload_size(frequency_table, codes, interleaved) +
+              length / STORED_MIN_SAVING >
+          length) {
+    return store_block(input, length, interleaved, output, entry);
+  }
+
+  if (!single && interleaved) {
+    payload_length =
+        encode_streams(input, length, codes, output + header_length);
+  } else if (!single) {
+    payload_length =
+        bitbuffer_encode(input, length, codes, output + header_length);
+  }
+
+  if (!interleaved) {
+    record_checkpoints(entry, input, length, codes, single);
+  }
+  put_u32(output, (uint32_t)length);
+  put_u32(output + 4, (uint32_t)payload_length);
+  return (long)(header_length + payload_length);
+}
+
+/* Codes block index of the input into a frame (see format.h) */
+int encode_frame(void *context, size_t index, BlockSlot *slot) {
+  FramedEncoder *encoder = (FramedEncoder *)context;
+  off_t start = (off_t)index * HUFF_BLOCK_SIZE;
+  size_t length = encoder->input_size - start < HUFF_BLOCK_SIZE
+                      ? (size_t)(encoder->input_size - start)
+                      : HUFF_BLOCK_SIZE;
+  long frame_length;
+
+  block_slot_reserve(slot, HUFF_BLOCK_SIZE, FRAME_BOUND(HUFF_BLOCK_SIZE));
+  if (read_at(encoder->input_fd, slot->input, length, start) == -1) {
+    perror("Failed to read from input file");
+    return -1;
+  }
+
+  frame_length = encode_block(slot->input, length, encoder->max_length,
+                              encoder->interleaved, slot->output,
+                              encoder->index + index * encoder->entry_size);
+  if (frame_length == -1) {
+    return -1;
+  }
+
+  slot->output_length = (size_t)frame_length;
+  return 0;
+}
+
+/* Writes the frame of block index and records its offset in the index */
+int write_frame(void *context, size_t index, BlockSlot *slot) {
+  FramedEncoder *encoder = (FramedEncoder *)context;
+
+  if (write_all(encoder->output_fd, slot->output, slot->output_length) ==
+      -1) {
+    perror("Error writing frame to file.");
+    return -1;
+  }
+
+  put_u64(encoder->index + index * encoder->entry_size, encoder->offset);
+  encoder->offset += slot->output_length;
+  return 0;
+}
+
+/* Writes the header of a seekable (version 3) or interleaved (version 4)
+ * file */
+void write_seekable_header(int output_fd, bool interleaved) {
+  uint8_t header[SEEKABLE_HEADER_SIZE];
+
+  memcpy(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH);
+  header[HUFF_MAGIC_LENGTH] =
+      interleaved ? HUFF_VERSION_INTERLEAVED : HUFF_VERSION_SEEKABLE;
+  put_u32(header + HUFF_MAGIC_LENGTH + 1, HUFF_BLOCK_SIZE);
+  put_u32(header + FRAMED_HEADER_SIZE,
+          interleaved ? HUFF_BLOCK_SIZE : HUFF_CHECKPOINT_INTERVAL);
+  if (write_all(output_fd, header, SEEKABLE_HEADER_SIZE) == -1) {
+    perror("Error writing header to file.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Writes the end of the frames, which the index entries follow */
+void write_frame_end(int output_fd) {
+  uint8_t end[FRAME_END_SIZE];
+
+  put_u32(end, 0);
+  if (write_all(output_fd, end, FRAME_END_SIZE) == -1) {
+    perror("Error writing block index to file.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Writes the trailer after the index entries of num_blocks frames: their
+ * number and the offset of the index, for frames ending at offset */
+void write_index_trailer(int output_fd, size_t num_blocks, uint64_t offset) {
+  uint8_t trailer[INDEX_TRAILER_SIZE];
+
+  put_u64(trailer, num_blocks);
+  put_u64(trailer + 8, offset + FRAME_END_SIZE);
+  if (write_all(output_fd, trailer, INDEX_TRAILER_SIZE) == -1) {
+    perror("Error writing block index to file.");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Writes the input as a seekable (version 3, -j) or interleaved (version 4,
+ * -i) file, coding its blocks, each with codes of its own, on num_threads
+ * threads. The index of a seekable file also records where the code of every
+ * HUFF_CHECKPOINT_INTERVAL-th byte starts, so hdecode --range can start
+ * decoding there. An interleaved file instead splits the payload of every
+ * frame into streams that hdecode decodes side by side. */
+void encode_framed(int input_fd, int output_fd, int max_length,
+                   bool interleaved, int num_threads) {
+  FramedEncoder encoder;
+  struct stat file_stat;
+  size_t num_blocks;
+
+  if (fstat(input_fd, &file_stat) == -1) {
+    perror("Failed to stat input file");
+    exit(EXIT_FAILURE);
+  }
+
+  num_blocks = (file_stat.st_size + HUFF_BLOCK_SIZE - 1) / HUFF_BLOCK_SIZE;
+  encoder.input_fd = input_fd;
+  encoder.output_fd = output_fd;
+  encoder.max_length = max_length;
+  encoder.interleaved = interleaved;
+  encoder.input_size = file_stat.st_size;
+  encoder.offset = SEEKABLE_HEADER_SIZE;
+  encoder.entry_size = ENTRY_SIZE(interleaved);
+  encoder.index = (uint8_t *)malloc((num_blocks + 1) * encoder.entry_size);
+  if (encoder.index == NULL) {
+    perror("failed malloc when creating block index");
+    exit(EXIT_FAILURE);
+  }
+
+  write_seekable_header(output_fd, interleaved);
+  if (run_block_pool(num_threads, num_blocks, encode_frame, write_frame,
+                     &encoder) == -1) {
+    exit(EXIT_FAILURE);
+  }
+
+  write_frame_end(output_fd);
+  if (write_all(output_fd, encoder.index, num_blocks * encoder.entry_size) ==
+      -1) {
+    perror("Error writing block index to file.");
+    exit(EXIT_FAILURE);
+  }
+  write_index_trailer(output_fd, num_blocks, encoder.offset);
+  free(encoder.index);
+}
+
+/* Reads up to length bytes from fd, stopping early only at the end of the
+ * input. Returns the bytes read, or -1 on failure. */
+long read_block(int fd, uint8_t *buffer, size_t length) {
+  size_t total = 0;
+  ssize_t bytes_read;
+
+  while (total < length) {
+    bytes_read = pipeline_read(fd, buffer + total, length - total);
+    if (bytes_read == -1) {
+      return -1;
+    }
+    if (bytes_read == 0) {
+      break;
     }
+    total += bytes_read;
   }
-  return count;
+
+  return (long)total;
 }
 
-void display_codes(char *codes[]) {
-  /* for debugging, should be removed from fin */
+/* Copies the index entries spilled to entries after the frames, using
+ * buffer (of size bytes) to move them */
+void write_spilled_index(int output_fd, FILE *entries, uint8_t *buffer,
+                         size_t size) {
+  size_t length;
+
+  rewind(entries);
+  while ((length = fread(buffer, 1, size, entries)) > 0) {
+    if (write_all(output_fd, buffer, length) == -1) {
+      perror("Error writing block index to file.");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (ferror(entries)) {
+    perror("Failed to read spilled block index");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Writes the input as a seekable (version 3) or interleaved (version 4) file
+ * in a single pass (-s, or any input that is not a regular file, such as a
+ * pipe given as -), coding and writing every block before reading the next
+ * one, so it works on pipes and only holds one block (and its frame) in
+ * memory. The index entries are spilled to a temporary file until the last
+ * frame is written, so memory does not grow with the input either. */
+void encode_stream(int input_fd, int output_fd, int max_length,
+                   bool interleaved) {
+  uint8_t *input = (uint8_t *)malloc(HUFF_BLOCK_SIZE);
+  uint8_t *frame = (uint8_t *)malloc(FRAME_BOUND(HUFF_BLOCK_SIZE));
+  uint8_t entry[ENTRY_SIZE(false)];
+  size_t entry_size = ENTRY_SIZE(interleaved);
+  size_t num_blocks = 0;
+  uint64_t offset = SEEKABLE_HEADER_SIZE;
+  FILE *entries;
+  long frame_length;
+  long length;
+
+  if (input == NULL || frame == NULL) {
+    perror("failed malloc when streaming input");
+    exit(EXIT_FAILURE);
+  }
+
+  if ((entries = tmpfile()) == NULL) {
+    perror("Failed to create temporary block index");
+    exit(EXIT_FAILURE);
+  }
+
+  write_seekable_header(output_fd, interleaved);
+  while ((length = read_block(input_fd, input, HUFF_BLOCK_SIZE)) > 0) {
+    frame_length = encode_block(input, length, max_length, interleaved, frame,
+                                entry);
+    if (frame_length == -1) {
+      exit(EXIT_FAILURE);
+    }
+
+    if (write_all(output_fd, frame, frame_length) == -1) {
+      perror("Error writing frame to file.");
+      exit(EXIT_FAILURE);
+    }
+
+    put_u64(entry, offset);
+    if (fwrite(entry, entry_size, 1, entries) != 1) {
+      perror("Failed to spill block index");
+      exit(EXIT_FAILURE);
+    }
+
+    num_blocks++;
+    offset += frame_length;
+    if (length < HUFF_BLOCK_SIZE) {
+      break;
+    }
+  }
+
+  if (length == -1) {
+    perror("Failed to read from input file");
+    exit(EXIT_FAILURE);
+  }
+
+  write_frame_end(output_fd);
+  write_spilled_index(output_fd, entries, frame, FRAME_BOUND(HUFF_BLOCK_SIZE));
+  write_index_trailer(output_fd, num_blocks, offset);
+  fclose(entries);
+  free(input);
+  free(frame);
+}
+
+/* Writes the code of symbol in tree */
+void write_adaptive_code(BitWriter *bw, const AdaptiveTree *tree, int symbol) {
+  uint64_t code[ADAPTIVE_CODE_WORDS];
+  int length = adaptive_code(tree, symbol, code);
+  int word = (length - 1) / 64;
+
+  bitwriter_write_bits(bw, code[word], length - word * 64);
+  while (word-- > 0) {
+    bitwriter_write_bits(bw, code[word], 64);
+  }
+}
+
+/* Writes the input as an adaptive (version 5, -a) file in a single pass, with
+ * codes that adapt to the bytes as they come (see adaptive.h) and no header
+ * describing them. The codes of every read are written before the next one,
+ * so the output of a live stream follows it. */
+void encode_adaptive(int input_fd, int output_fd) {
+  uint8_t header[ADAPTIVE_HEADER_SIZE];
+  uint8_t buffer[COUNT_BUFFER_SIZE];
+  AdaptiveTree tree;
+  BitWriter bw;
+  ssize_t bytes_read;
+  ssize_t i;
+
+  memcpy(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH);
+  header[HUFF_MAGIC_LENGTH] = HUFF_VERSION_ADAPTIVE;
+  if (write_all(output_fd, header, ADAPTIVE_HEADER_SIZE) == -1) {
+    perror("Error writing header to file.");
+    exit(EXIT_FAILURE);
+  }
+
+  adaptive_init(&tree);
+  bitwriter_init(&bw, output_fd);
+  while ((bytes_read = pipeline_read(input_fd, buffer, COUNT_BUFFER_SIZE)) >
+         0) {
+    for (i = 0; i < bytes_read; i++) {
+      write_adaptive_code(&bw, &tree, buffer[i]);
+      adaptive_update(&tree, buffer[i]);
+    }
+    bitwriter_write_bytes(&bw);
+  }
+
+  if (bytes_read == -1) {
+    perror("Failed to read from input file");
+    exit(EXIT_FAILURE);
+  }
+
+  write_adaptive_code(&bw, &tree, ADAPTIVE_END);
+  bitwriter_flush(&bw);
+}
+
+/* Writes a regular input file as a context (version 6, -c) file: the bytes
+ * are counted by the byte before them, the contexts clustered into tables
+ * (see context.h), and the file read again to code every byte with the table
+ * of its context. */
+void encode_context(int input_fd, int output_fd, int max_length) {
+  uint64_t(*wide_counts)[HUFFMAN_SYMBOLS];
+  unsigned int(*counts)[HUFFMAN_SYMBOLS];
+  HuffmanCode(*codes)[HUFFMAN_SYMBOLS];
+  const HuffmanCode *contexts[HUFF_CONTEXTS];
+  uint8_t map[HUFF_CONTEXTS];
+  uint8_t buffer[COUNT_BUFFER_SIZE];
+  uint8_t previous = 0;
+  uint64_t num_bytes = 0;
+  ssize_t bytes_read;
+  int num_tables;
+  BitWriter bw;
   int i;
-  for (i = 0; i < 256; i++) {
-    if (codes[i] != NULL) {
-      printf("0x%s%x: %s\n", i < HEX_MAX ? "0" : "", i, codes[i]);
+  int j;
+
+  wide_counts = (uint64_t(*)[HUFFMAN_SYMBOLS])calloc(
+      HUFF_CONTEXTS, sizeof(uint64_t) * HUFFMAN_SYMBOLS);
+  counts = (unsigned int(*)[HUFFMAN_SYMBOLS])malloc(
+      HUFF_CONTEXTS * sizeof(unsigned int) * HUFFMAN_SYMBOLS);
+  codes = (HuffmanCode(*)[HUFFMAN_SYMBOLS])malloc(
+      HUFF_CONTEXTS * sizeof(HuffmanCode) * HUFFMAN_SYMBOLS);
+  if (wide_counts == NULL || counts == NULL || codes == NULL) {
+    perror("failed malloc when counting contexts");
+    exit(EXIT_FAILURE);
+  }
+
+  while ((bytes_read = pipeline_read(input_fd, buffer, COUNT_BUFFER_SIZE)) >
+         0) {
+    count_contexts(wide_counts, buffer, bytes_read, &previous);
+    num_bytes += bytes_read;
+  }
+
+  if (bytes_read == -1) {
+    perror("Failed to read from input file");
+    exit(EXIT_FAILURE);
+  }
+
+  /* The tables are clustered and built from counts small enough to merge */
+  huff_scale_counts(wide_counts[0], counts[0],
+                    HUFF_CONTEXTS * HUFFMAN_SYMBOLS);
+  free(wide_counts);
+
+  /* An empty file is written as nothing, like the default mode */
+  if ((num_tables = cluster_contexts(counts, map)) == 0) {
+    free(counts);
+    free(codes);
+    return;
+  }
+
+  for (i = 0; i < num_tables; i++) {
+    if (build_canonical_codes(counts[i], codes[i], max_length) == -1) {
+      exit(1);
     }
   }
+
+  bitwriter_init(&bw, output_fd);
+  bitwriter_write_context_header(&bw, codes, num_tables, map, num_bytes);
+
+  /* The header records a lone code, which takes no bits in the payload */
+  for (i = 0; i < num_tables; i++) {
+    if (get_num_codes(counts[i]) == 1) {
+      for (j = 0; j < HUFFMAN_SYMBOLS; j++) {
+        codes[i][j].length = 0;
+      }
+    }
+  }
+
+  for (i = 0; i < HUFF_CONTEXTS; i++) {
+    contexts[i] = codes[map[i]];
+  }
+
+  if (pipeline_rewind(input_fd) == -1) {
+    perror("Failed to reset input file pointer.");
+    exit(EXIT_FAILURE);
+  }
+  bitwriter_translate_context_file(&bw, input_fd, contexts);
+
+  free(counts);
+  free(codes);
+}
+
+/* Writes value coded with codes and its extra bits */
+void write_lz_value(BitBuffer *bb, const HuffmanCode codes[], uint32_t value) {
+  int extra_bits;
+  int symbol = lz_symbol(value, &extra_bits);
+
+  bitbuffer_write_bits(bb, codes[symbol].bits, codes[symbol].length);
+  if (extra_bits > 0) {
+    bitbuffer_write_bits(bb, value & (((uint32_t)1 << extra_bits) - 1),
+                         extra_bits);
+  }
+}
+
+/* Codes the sequences of the length bytes of block into an LZ frame at
+ * output, which must hold LZ_FRAME_BOUND(length) bytes. Returns the size of
+ * the frame, or -1 if the codes do not fit in max_length bits. */
+long encode_lz_frame(const uint8_t *block, size_t length,
+                     const LzSequence sequences[], size_t num_sequences,
+                     int max_length, uint8_t *output) {
+  unsigned int counts[LZ_TABLES][BYTES_MAX];
+  HuffmanCode codes[LZ_TABLES][BYTES_MAX];
+  const LzSequence *sequence;
+  BitBuffer bb;
+  size_t header_length = FRAME_HEADER_FIXED;
+  size_t position = 0;
+  unsigned long bits = 0;
+  int extra_bits;
+  size_t i;
+  uint32_t j;
+  int k;
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < num_sequences; i++) {
+    sequence = &sequences[i];
+    count_frequencies(counts[LZ_LITERALS], block + position,
+                      sequence->literals);
+    counts[LZ_LENGTHS][lz_symbol(sequence->literals, &extra_bits)]++;
+    bits += extra_bits;
+    if (sequence->match_length != 0) {
+      counts[LZ_LENGTHS][lz_symbol(sequence->match_length - LZ_MIN_MATCH,
+                                   &extra_bits)]++;
+      bits += extra_bits;
+      counts[LZ_DISTANCES][lz_symbol(sequence->distance, &extra_bits)]++;
+      bits += extra_bits;
+    }
+    position += sequence->literals + sequence->match_length;
+  }
+
+  for (k = 0; k < LZ_TABLES; k++) {
+    /* A table with nothing to code still needs a code for its header */
+    if (get_num_codes(counts[k]) == 0) {
+      counts[k][0] = 1;
+    }
+    if (build_canonical_codes(counts[k], codes[k], max_length) == -1) {
+      return -1;
+    }
+    header_length += pack_code_lengths(output + header_length, codes[k]);
+
+    /* The header records a lone code, which takes no bits in the payload */
+    if (get_num_codes(counts[k]) == 1) {
+      for (j = 0; j < BYTES_MAX; j++) {
+        codes[k][j].length = 0;
+      }
+    }
+
+    for (j = 0; j < BYTES_MAX; j++) {
+      bits += (unsigned long)counts[k][j] * codes[k][j].length;
+    }
+  }
+
+  /* Blocks that coding would barely shrink are stored as they are, staying
+   * part of the window */
+  if (header_length + (bits + 7) / 8 + length / STORED_MIN_SAVING > length) {
+    header_length = FRAME_HEADER_FIXED +
+                    pack_stored_lengths(output + FRAME_HEADER_FIXED);
+    memcpy(output + header_length, block, length);
+    put_u32(output, (uint32_t)length);
+    put_u32(output + 4,
+            (uint32_t)(header_length + length - FRAME_HEADER_FIXED));
+    return (long)(header_length + length);
+  }
+
+  bitbuffer_init(&bb, output + header_length);
+  for (i = 0; i < num_sequences; i++) {
+    sequence = &sequences[i];
+    write_lz_value(&bb, codes[LZ_LENGTHS], sequence->literals);
+    for (j = 0; j < sequence->literals; j++) {
+      bitbuffer_write_bits(&bb, codes[LZ_LITERALS][*block].bits,
+                           codes[LZ_LITERALS][*block].length);
+      block++;
+    }
+
+    if (sequence->match_length != 0) {
+      write_lz_value(&bb, codes[LZ_LENGTHS],
+                     sequence->match_length - LZ_MIN_MATCH);
+      write_lz_value(&bb, codes[LZ_DISTANCES], sequence->distance);
+      block += sequence->match_length;
+    }
+  }
+
+  put_u32(output, (uint32_t)length);
+  put_u32(output + 4, (uint32_t)(bitbuffer_flush(&bb) - output -
+                                 FRAME_HEADER_FIXED));
+  return (long)(bb.out - output);
+}
+
+/* Writes the input as an LZ (version 7, -z) file in a single pass. Every
+ * block is split into runs of literal bytes and matches, copies of bytes up
+ * to 2^window_log (-w) before, found with an effort given by level (see
+ * lz.h). The frame of every block is written before the next one is read,
+ * so it works on pipes, and blocks that would barely shrink are stored. */
+void encode_lz(int input_fd, int output_fd, int window_log, int level,
+               int max_length) {
+  uint8_t header[LZ_HEADER_SIZE];
+  uint8_t end[FRAME_HEADER_FIXED] = {0};
+  uint8_t *frame = (uint8_t *)malloc(LZ_FRAME_BOUND(LZ_BLOCK_SIZE));
+  LzSequence *sequences =
+      (LzSequence *)malloc(sizeof(LzSequence) * LZ_MAX_SEQUENCES);
+  LzEncoder encoder;
+  uint8_t *block;
+  size_t num_sequences;
+  long frame_length;
+  long length;
+
+  if (frame == NULL || sequences == NULL) {
+    perror("failed malloc when starting LZ encoder");
+    exit(EXIT_FAILURE);
+  }
+
+  memcpy(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH);
+  header[HUFF_MAGIC_LENGTH] = HUFF_VERSION_LZ;
+  header[HUFF_MAGIC_LENGTH + 1] = (uint8_t)window_log;
+  if (write_all(output_fd, header, LZ_HEADER_SIZE) == -1) {
+    perror("Error writing header to file.");
+    exit(EXIT_FAILURE);
+  }
+
+  lz_encoder_init(&encoder, window_log, level);
+  while ((length = read_block(input_fd, block = lz_next_block(&encoder),
+                              LZ_BLOCK_SIZE)) > 0) {
+    num_sequences = lz_find_sequences(&encoder, length, sequences);
+    frame_length = encode_lz_frame(block, length, sequences, num_sequences,
+                                   max_length, frame);
+    if (frame_length == -1) {
+      exit(EXIT_FAILURE);
+    }
+
+    if (write_all(output_fd, frame, frame_length) == -1) {
+      perror("Error writing frame to file.");
+      exit(EXIT_FAILURE);
+    }
+
+    if (length < LZ_BLOCK_SIZE) {
+      break;
+    }
+  }
+
+  if (length == -1) {
+    perror("Failed to read from input file");
+    exit(EXIT_FAILURE);
+  }
+
+  if (write_all(output_fd, end, sizeof(end)) == -1) {
+    perror("Error writing frame to file.");
+    exit(EXIT_FAILURE);
+  }
+
+  lz_encoder_free(&encoder);
+  free(sequences);
+  free(frame);
+}
+
+/* Reads the whole of fd into a buffer (to be freed), storing its size into
+ * *length */
+uint8_t *read_input(int fd, size_t *length) {
+  uint8_t *input = NULL;
+  size_t capacity = 0;
+  ssize_t bytes_read;
+
+  *length = 0;
+  do {
+    if (*length == capacity) {
+      capacity = capacity == 0 ? COUNT_BUFFER_SIZE : capacity * 2;
+      if ((input = (uint8_t *)realloc(input, capacity)) == NULL) {
+        perror("failed realloc when reading input");
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    bytes_read = pipeline_read(fd, input + *length, capacity - *length);
+    if (bytes_read == -1) {
+      perror("Failed to read input file when encoding");
+      exit(EXIT_FAILURE);
+    }
+    *length += bytes_read;
+  } while (bytes_read > 0);
+
+  return input;
+}
+
+/* Writes the input as a preset (version 8, -P) file, coded with the table of
+ * preset id built into hencode (see preset.h) in a single pass, behind a
+ * header that only names the preset, which suits small inputs of a known
+ * kind. The header holds the size of the input, so an input that is not a
+ * regular file is read into memory first. */
+void encode_preset(int input_fd, int output_fd, int id,
+                   const struct stat *file_stat) {
+  const HuffTable *table = &presets[id].table;
+  uint8_t header[PRESET_HEADER_MAX];
+  size_t header_length = 0;
+  uint8_t *input = NULL;
+  uint8_t *coded;
+  size_t length = 0;
+  long coded_length;
+  BitWriter bw;
+
+  if (!S_ISREG(file_stat->st_mode)) {
+    input = read_input(input_fd, &length);
+  }
+
+  memcpy(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH);
+  header_length += HUFF_MAGIC_LENGTH;
+  header[header_length++] = HUFF_VERSION_PRESET;
+  header[header_length++] = (uint8_t)id;
+  put_u32(header + header_length, presets[id].check);
+  header_length += 4;
+  header_length += put_size(header + header_length,
+                            input != NULL ? (uint64_t)length
+                                          : (uint64_t)file_stat->st_size);
+  if (write_all(output_fd, header, header_length) == -1) {
+    perror("Error writing header to file.");
+    exit(EXIT_FAILURE);
+  }
+
+  if (input == NULL) {
+    bitwriter_init(&bw, output_fd);
+    bitwriter_translate_file(&bw, input_fd, (HuffmanCode *)table->codes);
+    return;
+  }
+
+  /* Every byte has a code, of at most max_length bits */
+  coded = (uint8_t *)malloc((length * table->decode.max_length + 7) / 8 + 1);
+  if (coded == NULL) {
+    perror("failed malloc when coding input");
+    exit(EXIT_FAILURE);
+  }
+
+  coded_length =
+      huff_encode_using(table, input, length, coded,
+                        (length * table->decode.max_length + 7) / 8 + 1);
+  if (coded_length < 0 ||
+      write_all(output_fd, coded, (size_t)coded_length) == -1) {
+    perror("Error writing codes to file.");
+    exit(EXIT_FAILURE);
+  }
+
+  free(coded);
+  free(input);
+}
+
+double now(void) {
+  struct timeval time;
+
+  gettimeofday(&time, NULL);
+  return time.tv_sec + time.tv_usec / 1e6;
+}
+
+/* Returns the name of the coded file of path (to be freed): path.huff, or
+ * its last component followed by .huff in output_dir */
+char *batch_output_name(const char *path, const char *output_dir) {
+  const char *base = strrchr(path, '/');
+  char *name;
+
+  base = base != NULL ? base + 1 : path;
+  name = (char *)malloc(
+      (output_dir != NULL ? strlen(output_dir) + 1 + strlen(base)
+                          : strlen(path)) +
+      sizeof(".huff"));
+  if (name == NULL) {
+    perror("failed malloc when naming output file");
+    exit(EXIT_FAILURE);
+  }
+
+  if (output_dir != NULL) {
+    sprintf(name, "%s/%s.huff", output_dir, base);
+  } else {
+    sprintf(name, "%s.huff", path);
+  }
+  return name;
+}
+
+/* Codes the file at path into its own canonical file through the buffers of
+ * slot, leaving its size in the input length of slot. Returns -1, with
+ * errno set, on failure. */
+int encode_batch_file(const BatchEncoder *batch, const char *path,
+                      BlockSlot *slot) {
+  struct stat file_stat;
+  char *output_name;
+  size_t length;
+  long coded_length;
+  int status;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    return -1;
+  }
+
+  /* Only a regular file tells its size up front */
+  status = fstat(fd, &file_stat);
+  if (status == 0 && !S_ISREG(file_stat.st_mode)) {
+    errno = EINVAL;
+    status = -1;
+  }
+  if (status == -1) {
+    close(fd);
+    return -1;
+  }
+
+  length = (size_t)file_stat.st_size;
+  block_slot_reserve(slot, length, huff_encode_bound(length));
+  errno = 0;
+  status = read_at(fd, slot->input, length, 0);
+  close(fd);
+  if (status == -1) {
+    errno = errno != 0 ? errno : EIO;
+    return -1;
+  }
+
+  coded_length =
+      huff_encode(slot->input, length, slot->output, slot->output_capacity);
+  if (coded_length < 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  output_name = batch_output_name(path, batch->output_dir);
+  fd = open(output_name, O_WRONLY | O_TRUNC | O_CREAT, 0644);
+  free(output_name);
+  if (fd == -1) {
+    return -1;
+  }
+
+  errno = 0;
+  status = write_all(fd, slot->output, (size_t)coded_length);
+  if (close(fd) == -1 || status == -1) {
+    errno = errno != 0 ? errno : EIO;
+    return -1;
+  }
+
+  slot->input_length = length;
+  return 0;
+}
+
+/* Codes file index of the batch. A failure is recorded for the file rather
+ * than stopping the batch. */
+int encode_batch_slot(void *context, size_t index, BlockSlot *slot) {
+  BatchEncoder *batch = (BatchEncoder *)context;
+
+  slot->input_length = 0;
+  batch->errors[index] =
+      encode_batch_file(batch, batch->files[index], slot) == -1 ? errno : 0;
+  return 0;
+}
+
+/* Reports file index of the batch if it failed, and counts its bytes */
+int report_batch_slot(void *context, size_t index, BlockSlot *slot) {
+  BatchEncoder *batch = (BatchEncoder *)context;
+
+  if (batch->errors[index] != 0) {
+    fprintf(stderr, "hencode: %s: %s\n", batch->files[index],
+            strerror(batch->errors[index]));
+    batch->num_failed++;
+  }
+
+  batch->total_bytes += slot->input_length;
+  return 0;
+}
+
+/* Codes each of the num_files files into a canonical file of its own (-b),
+ * file.huff or the same name in output_dir (-o), on num_threads threads that
+ * take the files one after the other and keep their buffers from one to the
+ * next, then reports the throughput. Returns the exit status, 1 if any file
+ * failed. */
+int encode_batch(char *files[], size_t num_files, const char *output_dir,
+                 int num_threads) {
+  BatchEncoder batch;
+  double start = now();
+  double elapsed;
+
+  batch.files = files;
+  batch.output_dir = output_dir;
+  batch.total_bytes = 0;
+  batch.num_failed = 0;
+  if ((batch.errors = (int *)calloc(num_files, sizeof(int))) == NULL) {
+    perror("failed malloc when starting batch");
+    exit(EXIT_FAILURE);
+  }
+
+  run_block_pool(num_threads, num_files, encode_batch_slot, report_batch_slot,
+                 &batch);
+
+  elapsed = now() - start;
+  elapsed = elapsed > 0 ? elapsed : 1e-6;
+  fprintf(stderr,
+          "hencode: coded %lu files, %.1f MB in %.3f s: %.1f MB/s, "
+          "%.0f files/s\n",
+          (unsigned long)(num_files - batch.num_failed),
+          batch.total_bytes / 1048576.0, elapsed,
+          batch.total_bytes / 1048576.0 / elapsed, num_files / elapsed);
+
+  free(batch.errors);
+  return batch.num_failed > 0 ? 1 : 0;
+}
+
+/* Waits for the output written behind the coder to be written, returning
+ * the exit status */
+int finish_pipeline(void) {
+  if (pipeline_finish() == -1) {
+    perror("Error writing to output file.");
+    return EXIT_FAILURE;
+  }
+  return 0;
 }
 
 int main(int argc, char *argv[]) {
   char *in_file_name;
-  unsigned int frequency_table[BYTES_MAX] = {0};
-  char *codes[BYTES_MAX] = {NULL};
-  char code_buffer[BYTES_MAX];
+  uint64_t counts[BYTES_MAX] = {0};
+  unsigned int frequency_table[BYTES_MAX];
+  uint64_t num_bytes;
+  HuffmanCode codes[BYTES_MAX];
   int output_fd = 1;
   int input_fd;
   int num_codes;
+  bool legacy = false;
+  bool adaptive = false;
+  bool context = false;
+  int level = 0;
+  int window_log = LZ_DEFAULT_WINDOW_LOG;
+  bool windowed = false;
+  int max_length = CANONICAL_MAX_LENGTH;
+  bool limited = false;
+  bool stream = false;
+  bool interleaved = false;
+  bool pipelined = false;
+  int num_threads = 0;
+  bool batch = false;
+  int preset = -1;
+  const char *output_dir = NULL;
+  struct stat file_stat;
+  char *end;
+  int opt;
 
-  HuffmanNode *list = NULL;
-  HuffmanNode *tree = NULL;
+  HuffmanTree tree;
   BitWriter bw;
 
-  if (argc != 2 && argc != 3) {
-    fprintf(stderr, "usage: hencode infile [outfile]\n");
-    exit(1);
+  while ((opt = getopt(argc, argv, "lacz:w:L:ij:spbo:P:")) != -1) {
+    switch (opt) {
+    case 'l':
+      legacy = true;
+      break;
+    case 'a':
+      adaptive = true;
+      break;
+    case 'c':
+      context = true;
+      break;
+    case 'z':
+      level = (int)strtol(optarg, &end, 10);
+      if (*end != '\0' || level < LZ_MIN_LEVEL || level > LZ_MAX_LEVEL) {
+        usage();
+      }
+      break;
+    case 'w':
+      window_log = (int)strtol(optarg, &end, 10);
+      if (*end != '\0' || window_log < LZ_MIN_WINDOW_LOG ||
+          window_log > LZ_MAX_WINDOW_LOG) {
+        usage();
+      }
+      windowed = true;
+      break;
+    case 'L':
+      max_length = (int)strtol(optarg, &end, 10);
+      if (*end != '\0' || max_length < 1 ||
+          max_length > CANONICAL_MAX_LENGTH) {
+        usage();
+      }
+      limited = true;
+      break;
+    case 'j':
+      num_threads = (int)strtol(optarg, &end, 10);
+      if (*end != '\0' || num_threads < 1) {
+        usage();
+      }
+      break;
+    case 's':
+      stream = true;
+      break;
+    case 'i':
+      interleaved = true;
+      break;
+    case 'p':
+      pipelined = true;
+      break;
+    case 'b':
+      batch = true;
+      break;
+    case 'o':
+      output_dir = optarg;
+      break;
+    case 'P':
+      if ((preset = find_preset(optarg)) == -1) {
+        fprintf(stderr, "hencode: no preset table %s\n", optarg);
+        usage();
+      }
+      break;
+    default:
+      usage();
+    }
+  }
+
+  /* A batch codes every file given in the default format */
+  if (batch) {
+    if (argc - optind < 1 || legacy || adaptive || context || level > 0 ||
+        windowed || limited || interleaved || stream || pipelined ||
+        preset != -1) {
+      usage();
+    }
+
+    return encode_batch(argv + optind, (size_t)(argc - optind), output_dir,
+                        num_threads > 0 ? num_threads : 1);
+  }
+
+  if ((argc - optind != 1 && argc - optind != 2) || output_dir != NULL) {
+    usage();
+  }
+
+  /* The legacy header rebuilds the unlimited tree of the whole file,
+   * adaptive codes are neither limited nor framed, context and LZ files
+   * are not framed either, and only LZ files have a window */
+  if (((legacy || adaptive) &&
+       (limited || interleaved || num_threads > 0 || stream)) ||
+      ((context || level > 0) && (interleaved || num_threads > 0 || stream)) ||
+      legacy + adaptive + context + (level > 0) > 1 ||
+      (windowed && level == 0) || (stream && num_threads > 0) ||
+      (preset != -1 && (legacy || adaptive || context || level > 0 ||
+                        limited || interleaved || num_threads > 0 || stream))) {
+    usage();
   }
 
   /* retrieve input and output file descriptos, defaults to standard in and out
    */
-  in_file_name = argv[1];
+  in_file_name = argv[optind];
 
-  input_fd = open(in_file_name, O_RDONLY);
-  if (input_fd == -1) {
+  if (strcmp(in_file_name, "-") == 0) {
+    input_fd = 0;
+  } else if ((input_fd = open(in_file_name, O_RDONLY)) == -1) {
     fprintf(stderr, "Failed to open file: %s", in_file_name);
     exit(1);
   }
 
-  if (argv[2] != NULL) {
-    output_fd = open(argv[2], O_WRONLY | O_TRUNC | O_CREAT, 0644);
+  /* Anything but a regular file can only be read once, as it comes */
+  if (fstat(input_fd, &file_stat) == -1) {
+    perror("Failed to stat input file");
+    exit(EXIT_FAILURE);
+  }
+
+  /* Presets need no counting, so they code anything in a single pass */
+  if (!S_ISREG(file_stat.st_mode) && preset == -1) {
+    if (legacy || context) {
+      fprintf(stderr, "hencode: -%c needs a regular input file\n",
+              legacy ? 'l' : 'c');
+      exit(1);
+    }
+    stream = true;
+  }
+
+  if (argv[optind + 1] != NULL) {
+    output_fd = open(argv[optind + 1], O_WRONLY | O_TRUNC | O_CREAT, 0644);
     if (output_fd == -1) {
-      fprintf(stderr, "Failed to open file: %s", argv[2]);
+      fprintf(stderr, "Failed to open file: %s", argv[optind + 1]);
       exit(1);
     }
   }
 
-  populate_frequency_table(frequency_table, input_fd);
-  populate_linked_list(&list, frequency_table);
+  /* With -p the input is read ahead and the output written behind on threads
+   * of their own (see pipeline.h), so waiting on slow files overlaps the
+   * coding. The blocks of framed files are read where they start, on the
+   * pool. */
+  if (pipelined) {
+    pipeline_start_writer(output_fd);
+    if (stream || (num_threads == 0 && !interleaved)) {
+      pipeline_start_reader(input_fd);
+    }
+  }
+
+  if (preset != -1) {
+    encode_preset(input_fd, output_fd, preset, &file_stat);
+    return finish_pipeline();
+  }
+
+  if (adaptive) {
+    encode_adaptive(input_fd, output_fd);
+    return finish_pipeline();
+  }
+
+  if (context) {
+    encode_context(input_fd, output_fd, max_length);
+    return finish_pipeline();
+  }
+
+  if (level > 0) {
+    encode_lz(input_fd, output_fd, window_log, level, max_length);
+    return finish_pipeline();
+  }
+
+  if (stream) {
+    encode_stream(input_fd, output_fd, max_length, interleaved);
+    return finish_pipeline();
+  }
+
+  /* Interleaved frames are always framed, on one thread by default */
+  if (num_threads > 0 || interleaved) {
+    encode_framed(input_fd, output_fd, max_length, interleaved,
+                  num_threads > 0 ? num_threads : 1);
+    return finish_pipeline();
+  }
+
+  /* The whole file gets canonical codes of at most max_length bits (-L),
+   * which bounds the decode tables of hdecode, behind a header of their
+   * lengths, or with -l the original header of the count of every byte */
+  populate_frequency_table(counts, input_fd);
+  num_bytes = get_number_of_bytes(counts);
+  huff_scale_counts(counts, frequency_table, BYTES_MAX);
+  num_codes = get_num_codes(frequency_table);
 
-  if (list == NULL) {
+  /* The legacy header holds the counts themselves, unscaled */
+  if (legacy && num_bytes > COUNT_MAX_TOTAL) {
+    fprintf(stderr, "hencode: -l codes at most %d bytes\n", COUNT_MAX_TOTAL);
+    exit(1);
+  }
+
+  if (num_codes == 0) {
     exit(0);
     close(input_fd);
     close(output_fd);
   }
-  populate_huffman_tree(&tree, &list);
-  store_codes(codes, tree, code_buffer, 0);
 
   bitwriter_init(&bw, output_fd);
 
-  num_codes = get_num_codes(codes);
-  bitwriter_write_header(&bw, num_codes, frequency_table);
+  if (legacy) {
+    HuffmanNode *root = build_huffman_tree(&tree, frequency_table);
 
-  /* reset the input file pointer */
-  if (lseek(input_fd, 0, SEEK_SET) == -1) {
-    perror("Failed to reset input file pointer.");
-    exit(EXIT_FAILURE);
+    memset(codes, 0, sizeof(codes));
+    store_huffman_codes(codes, root, 0, 0);
+
+    bitwriter_write_header(&bw, num_codes, frequency_table);
+  } else {
+    if (build_canonical_codes(frequency_table, codes, max_length) == -1) {
+      exit(1);
+    }
+
+    bitwriter_write_canonical_header(&bw, codes, num_bytes);
   }
-  bitwriter_translate_file(&bw, input_fd, codes);
 
-  free_codes(codes);
-  free_tree(tree);
+  /* A single byte is only described by the header */
+  if (num_codes > 1) {
+    /* reset the input file pointer */
+    if (pipeline_rewind(input_fd) == -1) {
+      perror("Failed to reset input file pointer.");
+      exit(EXIT_FAILURE);
+    }
+    bitwriter_translate_file(&bw, input_fd, codes);
+  }
 
-  return 0;
+  return finish_pipeline();
 }
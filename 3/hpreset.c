@@ -0,0 +1,144 @@
+/*
+ * hpreset.c
+ * Generates preset_tables.c (see preset.h): the table of every sample given,
+ * in order, built like huff_table_build builds one, as static arrays of its
+ * codes and of its decode table. The name of a preset is the name of its
+ * sample without directory or extension.
+ * usage: hpreset sample... > preset_tables.c
+ */
+
+#include "huff.h"
+#include "preset.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SAMPLE_MAX (1 << 20)
+#define NAME_MAX_LENGTH 32
+#define ENTRIES_PER_LINE 6
+#define CODES_PER_LINE 3
+
+/* Stores the name of the preset of the sample at path into name */
+void preset_name(const char *path, char *name) {
+  const char *base = strrchr(path, '/');
+  size_t length;
+
+  base = base != NULL ? base + 1 : path;
+  length = strcspn(base, ".");
+  if (length == 0 || length >= NAME_MAX_LENGTH) {
+    fprintf(stderr, "hpreset: invalid preset name in %s\n", path);
+    exit(1);
+  }
+
+  memcpy(name, base, length);
+  name[length] = '\0';
+}
+
+/* Builds table from the sample at path */
+void build_preset(const char *path, HuffTable *table) {
+  static uint8_t sample[SAMPLE_MAX];
+  size_t length = 0;
+  ssize_t bytes_read;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) == -1) {
+    fprintf(stderr, "Failed to open file: %s\n", path);
+    exit(1);
+  }
+
+  while (length < SAMPLE_MAX &&
+         (bytes_read = read(fd, sample + length, SAMPLE_MAX - length)) > 0) {
+    length += bytes_read;
+  }
+  close(fd);
+
+  if (huff_table_build(table, sample, length) != HUFF_OK) {
+    fprintf(stderr, "hpreset: failed to build the table of %s\n", path);
+    exit(1);
+  }
+}
+
+/* Returns the check of the code lengths of table (see preset.h) */
+uint32_t length_check(const HuffTable *table) {
+  uint32_t check = 2166136261UL;
+  int i;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    check = (check ^ table->codes[i].length) * 16777619UL;
+  }
+
+  return check;
+}
+
+/* Prints the decode table entries of preset name */
+void print_entries(const char *name, const HuffTable *table) {
+  size_t i;
+
+  printf("uint32_t preset_%s_entries[] = {", name);
+  for (i = 0; i < table->decode.size; i++) {
+    printf(i % ENTRIES_PER_LINE == 0 ? "\n    " : " ");
+    printf("0x%08lx%s", (unsigned long)table->decode.entries[i],
+           i + 1 < table->decode.size ? "," : "");
+  }
+  printf("};\n\n");
+}
+
+/* Prints the entry of presets for preset name */
+void print_preset(const char *name, const HuffTable *table) {
+  int i;
+
+  printf("    {\"%s\",\n     0x%08lxUL,\n     {{", name,
+         (unsigned long)length_check(table));
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    printf(i == 0 ? "" : i % CODES_PER_LINE == 0 ? ",\n       " : ", ");
+    printf("{0x%04lxUL, %d}", (unsigned long)table->codes[i].bits,
+           table->codes[i].length);
+  }
+  printf("},\n      {preset_%s_entries, %lu, %lu, %d},\n      %d,\n      %s}}",
+         name, (unsigned long)table->decode.size,
+         (unsigned long)table->decode.size, table->decode.max_length,
+         table->single, table->complete ? "true" : "false");
+}
+
+int main(int argc, char *argv[]) {
+  char names[PRESET_MAX][NAME_MAX_LENGTH];
+  HuffTable *tables;
+  int i;
+
+  if (argc < 2 || argc - 1 > PRESET_MAX) {
+    fprintf(stderr, "usage: hpreset sample... > preset_tables.c\n");
+    exit(1);
+  }
+
+  if ((tables = (HuffTable *)malloc(sizeof(HuffTable) * (argc - 1))) ==
+      NULL) {
+    perror("failed malloc when building presets");
+    exit(EXIT_FAILURE);
+  }
+
+  printf("/*\n * preset_tables.c\n * Generated by hpreset, do not edit. The "
+         "samples of the presets:\n");
+  for (i = 1; i < argc; i++) {
+    printf(" *   %s\n", argv[i]);
+  }
+  printf(" */\n#include \"preset.h\"\n\n");
+
+  for (i = 1; i < argc; i++) {
+    preset_name(argv[i], names[i - 1]);
+    build_preset(argv[i], &tables[i - 1]);
+    print_entries(names[i - 1], &tables[i - 1]);
+  }
+
+  printf("const Preset presets[] = {\n");
+  for (i = 1; i < argc; i++) {
+    print_preset(names[i - 1], &tables[i - 1]);
+    printf(i + 1 < argc ? ",\n" : "};\n\n");
+    huff_table_free(&tables[i - 1]);
+  }
+  printf("const int num_presets = %d;\n", argc - 1);
+
+  free(tables);
+  return 0;
+}
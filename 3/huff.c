@@ -0,0 +1,385 @@
+/*
+ * huff.c
+ * The in-memory coder of libhuff. Whole messages are counted in 64 bits and
+ * scaled down to what a Huffman tree can sum, then coded with the canonical
+ * codes of their counts straight into the caller's buffer. The exact size of
+ * the output is known from the counts before anything is written, so a
+ * destination too small is reported instead of overrun.
+ */
+#include "huff.h"
+#include "huff_internal.h"
+#include "bitbuffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Bytes counted at a time into a table of unsigned int */
+#define COUNT_CHUNK_SIZE (1 << 30)
+
+/* Adds the bytes of the length bytes of buffer to counts, which hold the
+ * counts of a whole file */
+void huff_add_counts(uint64_t counts[], const uint8_t *buffer,
+                     size_t length) {
+  unsigned int frequency_table[HUFFMAN_SYMBOLS];
+  size_t chunk;
+  int i;
+
+  while (length > 0) {
+    chunk = length < COUNT_CHUNK_SIZE ? length : COUNT_CHUNK_SIZE;
+    memset(frequency_table, 0, sizeof(frequency_table));
+    count_frequencies(frequency_table, buffer, chunk);
+    for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+      counts[i] += frequency_table[i];
+    }
+
+    buffer += chunk;
+    length -= chunk;
+  }
+}
+
+/* Scales the n counts of a whole file down into table, by the smallest power
+ * of two that brings their total down to COUNT_MAX_TOTAL. Every count rounds
+ * up, so no byte present gets a count of 0. */
+void huff_scale_counts(const uint64_t counts[], unsigned int table[],
+                       size_t n) {
+  uint64_t total;
+  int shift = -1;
+  size_t i;
+
+  do {
+    shift++;
+    total = 0;
+    for (i = 0; i < n; i++) {
+      total += counts[i] == 0 ? 0 : ((counts[i] - 1) >> shift) + 1;
+    }
+  } while (total > COUNT_MAX_TOTAL);
+
+  for (i = 0; i < n; i++) {
+    table[i] =
+        counts[i] == 0 ? 0 : (unsigned int)(((counts[i] - 1) >> shift) + 1);
+  }
+}
+
+/* Builds the canonical codes of the bytes of frequency_table (at least one),
+ * no longer than max_length bits. A single byte gets a 1-bit code so the
+ * header records it. Returns HUFF_ERROR_LENGTH if the bytes do not fit in
+ * max_length bits, or HUFF_ERROR_MEMORY. */
+int huff_build_codes(unsigned int frequency_table[], HuffmanCode codes[],
+                     int max_length) {
+  HuffmanTree tree;
+  HuffmanNode *root = build_huffman_tree(&tree, frequency_table);
+  int result;
+
+  memset(codes, 0, sizeof(HuffmanCode) * HUFFMAN_SYMBOLS);
+  store_huffman_codes(codes, root, 0, 0);
+
+  if (root->left == NULL && root->right == NULL) {
+    codes[root->key].length = 1;
+  }
+
+  /* Codes deeper than the limit are rebuilt with limited lengths */
+  if (max_code_length(codes) > max_length) {
+    result = limit_code_lengths(codes, frequency_table, max_length);
+    if (result != 0) {
+      return result == HUFFMAN_ERROR_MEMORY ? HUFF_ERROR_MEMORY
+                                            : HUFF_ERROR_LENGTH;
+    }
+  }
+
+  assign_canonical_codes(codes);
+  return HUFF_OK;
+}
+
+/* Stores the bits codes take for counts into *bits. Returns
+ * HUFF_ERROR_SYMBOL if a byte counted has no code. */
+static int payload_bits(const uint64_t counts[], const HuffmanCode codes[],
+                        uint64_t *bits) {
+  int i;
+
+  *bits = 0;
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (counts[i] != 0 && codes[i].length == 0) {
+      return HUFF_ERROR_SYMBOL;
+    }
+    *bits += counts[i] * codes[i].length;
+  }
+
+  return HUFF_OK;
+}
+
+/* Fills in everything of table but its codes. Returns HUFF_ERROR_CORRUPT if
+ * the codes can not be decoded, or HUFF_ERROR_MEMORY. */
+static int prepare_table(HuffTable *table) {
+  int num_codes = 0;
+  int status;
+  int i;
+
+  table->single = -1;
+  table->decode.entries = NULL;
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (table->codes[i].length != 0) {
+      table->single = i;
+      num_codes++;
+    }
+  }
+
+  table->complete = num_codes == HUFFMAN_SYMBOLS;
+  if (num_codes != 1) {
+    table->single = -1;
+    if ((status = decode_table_build(&table->decode, table->codes)) != 0) {
+      decode_table_free(&table->decode);
+      return status == DECODE_ERROR_MEMORY ? HUFF_ERROR_MEMORY
+                                           : HUFF_ERROR_CORRUPT;
+    }
+  }
+
+  return HUFF_OK;
+}
+
+/* Returns the most bytes huff_encode writes for length bytes */
+size_t huff_encode_bound(size_t length) {
+  return CANONICAL_HEADER_MAX + (length * CANONICAL_MAX_LENGTH + 7) / 8;
+}
+
+/* Codes the length bytes of source into a canonical file at destination.
+ * Returns the size of the file (0 for no bytes), or HUFF_ERROR_SPACE if it
+ * does not fit in capacity bytes, which huff_encode_bound(length) always
+ * does. */
+long huff_encode(const uint8_t *source, size_t length, uint8_t *destination,
+                 size_t capacity) {
+  uint64_t counts[HUFFMAN_SYMBOLS] = {0};
+  unsigned int frequency_table[HUFFMAN_SYMBOLS];
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  uint8_t header[CANONICAL_HEADER_MAX];
+  size_t header_length = 0;
+  uint64_t payload_length = 0;
+  uint64_t bits;
+  int result;
+  int num_codes = 0;
+  int i;
+
+  if (length == 0) {
+    return 0;
+  }
+
+  huff_add_counts(counts, source, length);
+  huff_scale_counts(counts, frequency_table, HUFFMAN_SYMBOLS);
+  result = huff_build_codes(frequency_table, codes, CANONICAL_MAX_LENGTH);
+  if (result != HUFF_OK) {
+    return result;
+  }
+
+  memcpy(header, HUFF_MAGIC, HUFF_MAGIC_LENGTH);
+  header_length += HUFF_MAGIC_LENGTH;
+  header[header_length++] = HUFF_VERSION_CANONICAL;
+  header_length += put_size(header + header_length, length);
+  header_length += pack_code_lengths(header + header_length, codes);
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    num_codes += codes[i].length != 0;
+  }
+
+  /* A single byte is only described by the header */
+  if (num_codes > 1) {
+    payload_bits(counts, codes, &bits);
+    payload_length = (bits + 7) / 8;
+  }
+
+  if (header_length + payload_length > capacity) {
+    return HUFF_ERROR_SPACE;
+  }
+
+  memcpy(destination, header, header_length);
+  if (num_codes > 1) {
+    bitbuffer_encode(source, length, codes, destination + header_length);
+  }
+  return (long)(header_length + payload_length);
+}
+
+/* Reads the header of the canonical file of length bytes at source into
+ * table and *size. Returns the size of the header, or HUFF_ERROR_CORRUPT. */
+static long read_canonical_header(const uint8_t *source, size_t length,
+                                  HuffTable *table, uint64_t *size) {
+  size_t offset = HUFF_MAGIC_LENGTH + 1;
+  int size_length;
+  int lengths_size;
+
+  if (length < offset || memcmp(source, HUFF_MAGIC, HUFF_MAGIC_LENGTH) != 0 ||
+      source[HUFF_MAGIC_LENGTH] != HUFF_VERSION_CANONICAL ||
+      (size_length = get_size(source + offset, length - offset, size)) == -1) {
+    return HUFF_ERROR_CORRUPT;
+  }
+
+  offset += size_length;
+  if (table == NULL) {
+    return (long)offset;
+  }
+
+  lengths_size =
+      unpack_code_lengths(source + offset, length - offset, table->codes);
+  if (lengths_size == -1) {
+    return HUFF_ERROR_CORRUPT;
+  }
+  return (long)(offset + lengths_size);
+}
+
+/* Stores the number of bytes the file of length bytes at source decodes to
+ * into *size. Returns HUFF_ERROR_CORRUPT if it is not a canonical file. */
+int huff_decoded_size(const uint8_t *source, size_t length, uint64_t *size) {
+  *size = 0;
+  if (length == 0) {
+    return HUFF_OK;
+  }
+
+  return read_canonical_header(source, length, NULL, size) < 0
+             ? HUFF_ERROR_CORRUPT
+             : HUFF_OK;
+}
+
+/* Decodes the canonical file of length bytes at source into destination.
+ * Returns the number of bytes decoded, HUFF_ERROR_SPACE if they do not fit
+ * in capacity bytes (see huff_decoded_size), or another error. */
+long huff_decode(const uint8_t *source, size_t length, uint8_t *destination,
+                 size_t capacity) {
+  HuffTable table;
+  uint64_t size;
+  long header_length;
+  int result;
+
+  if (length == 0) {
+    return 0;
+  }
+
+  header_length = read_canonical_header(source, length, &table, &size);
+  if (header_length < 0) {
+    return header_length;
+  }
+
+  if (size > capacity) {
+    return HUFF_ERROR_SPACE;
+  }
+
+  if ((result = prepare_table(&table)) != HUFF_OK) {
+    return result;
+  }
+
+  result = huff_decode_using(&table, source + header_length,
+                             length - header_length, destination, size);
+  huff_table_free(&table);
+  return result == HUFF_OK ? (long)size : result;
+}
+
+/* Builds table from the length bytes of sample. Every byte gets a code, the
+ * ones missing from the sample the longest, so any message can be coded. */
+int huff_table_build(HuffTable *table, const uint8_t *sample, size_t length) {
+  uint64_t counts[HUFFMAN_SYMBOLS];
+  unsigned int frequency_table[HUFFMAN_SYMBOLS];
+  int result;
+  int i;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    counts[i] = 1;
+  }
+
+  huff_add_counts(counts, sample, length);
+  huff_scale_counts(counts, frequency_table, HUFFMAN_SYMBOLS);
+  result =
+      huff_build_codes(frequency_table, table->codes, CANONICAL_MAX_LENGTH);
+
+  return result == HUFF_OK ? prepare_table(table) : result;
+}
+
+/* Writes the code lengths of table at destination. Returns the bytes
+ * written, at most HUFF_TABLE_SAVE_MAX, or HUFF_ERROR_SPACE. */
+long huff_table_save(const HuffTable *table, uint8_t *destination,
+                     size_t capacity) {
+  uint8_t lengths[HUFF_TABLE_SAVE_MAX];
+  size_t size = pack_code_lengths(lengths, (HuffmanCode *)table->codes);
+
+  if (size > capacity) {
+    return HUFF_ERROR_SPACE;
+  }
+
+  memcpy(destination, lengths, size);
+  return (long)size;
+}
+
+/* Builds table from the code lengths huff_table_save wrote at source (length
+ * bytes available). Returns the bytes read, or HUFF_ERROR_CORRUPT. */
+long huff_table_load(HuffTable *table, const uint8_t *source, size_t length) {
+  int size = unpack_code_lengths(source, length, table->codes);
+  int result;
+
+  if (size == -1) {
+    return HUFF_ERROR_CORRUPT;
+  }
+
+  result = prepare_table(table);
+  return result == HUFF_OK ? size : result;
+}
+
+void huff_table_free(HuffTable *table) { decode_table_free(&table->decode); }
+
+/* Codes the length bytes of source with table into destination, only the
+ * codes themselves. Returns the bytes written, HUFF_ERROR_SPACE if they do
+ * not fit in capacity bytes, or HUFF_ERROR_SYMBOL. */
+long huff_encode_using(const HuffTable *table, const uint8_t *source,
+                       size_t length, uint8_t *destination, size_t capacity) {
+  uint64_t counts[HUFFMAN_SYMBOLS] = {0};
+  uint64_t bits;
+  size_t i;
+
+  /* The only code takes no bits */
+  if (table->single != -1) {
+    for (i = 0; i < length; i++) {
+      if (source[i] != table->single) {
+        return HUFF_ERROR_SYMBOL;
+      }
+    }
+    return 0;
+  }
+
+  /* Unless every byte is known to fit, the message is counted first */
+  if (!table->complete ||
+      (length * table->decode.max_length + 7) / 8 > capacity) {
+    huff_add_counts(counts, source, length);
+    if (payload_bits(counts, table->codes, &bits) != HUFF_OK) {
+      return HUFF_ERROR_SYMBOL;
+    }
+    if ((bits + 7) / 8 > capacity) {
+      return HUFF_ERROR_SPACE;
+    }
+  }
+
+  return (long)bitbuffer_encode(source, length, (HuffmanCode *)table->codes,
+                                destination);
+}
+
+/* Decodes count bytes from the codes huff_encode_using wrote (length bytes
+ * at source) with table into destination. Returns HUFF_ERROR_CORRUPT if the
+ * codes are invalid or end before count bytes. */
+int huff_decode_using(const HuffTable *table, const uint8_t *source,
+                      size_t length, uint8_t *destination, size_t count) {
+  BitReader *br;
+  int result;
+
+  if (table->single != -1) {
+    memset(destination, table->single, count);
+    return HUFF_OK;
+  }
+
+  if (count == 0) {
+    return HUFF_OK;
+  }
+
+  /* Too large for the stack of a thread */
+  if ((br = (BitReader *)malloc(sizeof(BitReader))) == NULL) {
+    return HUFF_ERROR_MEMORY;
+  }
+
+  bitreader_init_buffer(br, source, length);
+  result = bitreader_decode(br, &table->decode, destination, count) == -1
+               ? HUFF_ERROR_CORRUPT
+               : HUFF_OK;
+  free(br);
+  return result;
+}
@@ -0,0 +1,72 @@
+#ifndef HUFF_H
+#define HUFF_H
+
+/*
+ * huff.h
+ * libhuff: codes buffers in memory, for programs that compress messages of
+ * their own rather than files. huff_encode writes a whole canonical (version
+ * 1) file, like hencode does by default, which huff_decode and hdecode read
+ * back. A HuffTable holds codes built once, from sample bytes or from the
+ * code lengths huff_table_save wrote, and codes any number of messages with
+ * huff_encode_using and huff_decode_using without counting or building
+ * anything: their output is only the payload, as both ends already know the
+ * table and the size of every message.
+ * Nothing exits or prints: failures, running out of memory included, return
+ * one of the negative HUFF_ERROR_* codes, and libhuff.a links neither
+ * bitwriter.c nor pipeline.c. The functions keep no state of their own and
+ * only read a table, so threads may share one.
+ * hencode and hdecode do not wrap these functions: they stay drivers of file
+ * descriptors of their own, streaming frames through pipes and threads with
+ * bitwriter.c and pipeline.c, which a buffer in memory cannot do. Both share
+ * the code building and decoding tables with libhuff, so the formats agree.
+ */
+
+#include "bitreader.h"
+#include "format.h"
+#include "huffman.h"
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define HUFF_OK 0
+#define HUFF_ERROR_SPACE -1   /* the destination is too small */
+#define HUFF_ERROR_CORRUPT -2 /* the input was not written by libhuff */
+#define HUFF_ERROR_SYMBOL -3  /* a byte the table has no code for */
+#define HUFF_ERROR_LENGTH -4  /* the bytes do not fit in codes that short */
+#define HUFF_ERROR_MEMORY -5  /* malloc failed */
+
+/* Most bytes huff_table_save writes */
+#define HUFF_TABLE_SAVE_MAX CODE_LENGTHS_MAX
+
+/* Huffman trees sum the counts of their nodes in an int */
+#define COUNT_MAX_TOTAL INT_MAX
+
+/* Codes of at most CANONICAL_MAX_LENGTH bits, with the table decoding them.
+ * single is the only byte with a code (which takes no bits), -1 if there
+ * are several, and complete tells whether every byte has a code. */
+typedef struct {
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  DecodeTable decode;
+  int single;
+  bool complete;
+} HuffTable;
+
+int huff_build_codes(unsigned int frequency_table[], HuffmanCode codes[],
+                     int max_length);
+size_t huff_encode_bound(size_t length);
+long huff_encode(const uint8_t *source, size_t length, uint8_t *destination,
+                 size_t capacity);
+int huff_decoded_size(const uint8_t *source, size_t length, uint64_t *size);
+long huff_decode(const uint8_t *source, size_t length, uint8_t *destination,
+                 size_t capacity);
+int huff_table_build(HuffTable *table, const uint8_t *sample, size_t length);
+long huff_table_save(const HuffTable *table, uint8_t *destination,
+                     size_t capacity);
+long huff_table_load(HuffTable *table, const uint8_t *source, size_t length);
+void huff_table_free(HuffTable *table);
+long huff_encode_using(const HuffTable *table, const uint8_t *source,
+                       size_t length, uint8_t *destination, size_t capacity);
+int huff_decode_using(const HuffTable *table, const uint8_t *source,
+                      size_t length, uint8_t *destination, size_t count);
+#endif
@@ -0,0 +1,17 @@
+#ifndef HUFF_INTERNAL_H
+#define HUFF_INTERNAL_H
+
+/*
+ * huff_internal.h
+ * Helpers of huff.c that hencode shares to count whole files, which are not
+ * part of the libhuff interface in huff.h.
+ */
+
+#include "huff.h"
+#include <stddef.h>
+#include <stdint.h>
+
+void huff_add_counts(uint64_t counts[], const uint8_t *buffer, size_t length);
+void huff_scale_counts(const uint64_t counts[], unsigned int table[],
+                       size_t n);
+#endif
@@ -2,11 +2,13 @@
  * This file is used in the construction of a huffman tree.
  * It defines functions to create an ordered link list of HuffmanNodes.
  * Also contains  functions which form a huffman tree based on an ordered linked
- * list of HuffmanNodes.
+ * list of HuffmanNodes, and build_huffman_tree, which forms the same tree
+ * from two queues in a fixed array of nodes, without allocating.
  */
 #include "huffman.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* Creates a huffman tree given an ordered list of huffman nodes.
  * Will empty list and populate tree.
@@ -50,6 +52,121 @@ void populate_huffman_tree(HuffmanNode **tree, HuffmanNode **list) {
   *tree = pop_linked_list(list);
 }
 
+/* Sorts the num_leaves leaves (byte in the low 8 bits, frequency above) by
+ * frequency, a byte of it at a time. Every pass is stable, so leaves of equal
+ * frequency keep their order. */
+void sort_leaves(uint64_t leaves[], int num_leaves) {
+  uint64_t sorted[HUFFMAN_SYMBOLS];
+  uint64_t max_key = 0;
+  int counts[256];
+  int position;
+  int count;
+  int shift;
+  int i;
+
+  for (i = 0; i < num_leaves; i++) {
+    max_key = leaves[i] > max_key ? leaves[i] : max_key;
+  }
+
+  for (shift = 8; max_key >> shift != 0; shift += 8) {
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < num_leaves; i++) {
+      counts[(leaves[i] >> shift) & 0xFF]++;
+    }
+
+    /* Every count becomes the position of the first leaf with that byte */
+    for (i = 0, position = 0; i < 256; i++) {
+      count = counts[i];
+      counts[i] = position;
+      position += count;
+    }
+
+    for (i = 0; i < num_leaves; i++) {
+      sorted[counts[(leaves[i] >> shift) & 0xFF]++] = leaves[i];
+    }
+    memcpy(leaves, sorted, sizeof(uint64_t) * num_leaves);
+  }
+}
+
+/* Builds the tree of the bytes of frequency_table into the nodes of tree and
+ * returns its root, or NULL if no byte occurs. The tree is the one built by
+ * populate_linked_list and populate_huffman_tree, but the sorted leaves and
+ * the merged nodes are kept in two queues instead of one sorted list. Merged
+ * nodes are made in order of frequency, so each merge only compares the heads
+ * of the queues. The list puts a merged node before every node of the same
+ * frequency, so merged nodes of equal frequency are taken newest first, and
+ * before leaves of that frequency. */
+HuffmanNode *build_huffman_tree(HuffmanTree *tree,
+                                unsigned int frequency_table[]) {
+  HuffmanNode *nodes = tree->nodes;
+  HuffmanNode *pair[2];
+  uint64_t leaves[HUFFMAN_SYMBOLS];
+  int num_leaves = 0;
+  int next_leaf = 0;
+  int num_nodes;
+  int head;
+  int run_top = -1;
+  int run_last = -1;
+  int i;
+
+  /* Leaves sort by frequency, then by byte */
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (frequency_table[i] != 0) {
+      leaves[num_leaves++] = (uint64_t)frequency_table[i] << 8 | i;
+    }
+  }
+
+  if (num_leaves == 0) {
+    return NULL;
+  }
+
+  sort_leaves(leaves, num_leaves);
+  for (i = 0; i < num_leaves; i++) {
+    nodes[i].key = (int)(leaves[i] & 0xFF);
+    nodes[i].frequency = (int)(leaves[i] >> 8);
+    nodes[i].next = NULL;
+    nodes[i].left = NULL;
+    nodes[i].right = NULL;
+  }
+
+  num_nodes = num_leaves;
+  head = num_leaves;
+
+  while (num_nodes < 2 * num_leaves - 1) {
+    for (i = 0; i < 2; i++) {
+      if (head < num_nodes &&
+          (next_leaf == num_leaves ||
+           nodes[head].frequency <= nodes[next_leaf].frequency)) {
+        /* Start on the run of merged nodes of the frequency at the head */
+        if (run_top < head) {
+          run_last = head;
+          while (run_last + 1 < num_nodes &&
+                 nodes[run_last + 1].frequency == nodes[head].frequency) {
+            run_last++;
+          }
+          run_top = run_last;
+        }
+
+        pair[i] = &nodes[run_top--];
+        if (run_top < head) {
+          head = run_last + 1;
+        }
+      } else {
+        pair[i] = &nodes[next_leaf++];
+      }
+    }
+
+    nodes[num_nodes].key = -1;
+    nodes[num_nodes].frequency = pair[0]->frequency + pair[1]->frequency;
+    nodes[num_nodes].next = NULL;
+    nodes[num_nodes].left = pair[0];
+    nodes[num_nodes].right = pair[1];
+    num_nodes++;
+  }
+
+  return &nodes[num_nodes - 1];
+}
+
 /* Populates a linked list passed as argument list using the provided
  * frequency_table. */
 void populate_linked_list(HuffmanNode **list, unsigned int *frequency_table) {
@@ -62,6 +179,58 @@ void populate_linked_list(HuffmanNode **list, unsigned int *frequency_table) {
   }
 }
 
+/* Counts one byte of word (shifted by shift bits) in table */
+#define COUNT_BYTE(table, word, shift) ((table)[((word) >> (shift)) & 0xFF]++)
+
+/* Adds the number of occurrences of every byte of the length bytes of input
+ * to frequency_table. Neighbouring bytes are counted in different tables, so
+ * a run of one byte does not wait for the previous increment of the same
+ * counter to be stored, and 16 bytes are loaded per iteration. The tables are
+ * summed at the end. */
+void count_frequencies(unsigned int frequency_table[], const uint8_t *input,
+                       size_t length) {
+  uint32_t tables[COUNT_TABLES][HUFFMAN_SYMBOLS];
+  uint64_t first;
+  uint64_t second;
+  size_t i = 0;
+  int j;
+  int k;
+
+  memset(tables, 0, sizeof(tables));
+
+  for (; i + 2 * sizeof(uint64_t) <= length; i += 2 * sizeof(uint64_t)) {
+    memcpy(&first, input + i, sizeof(uint64_t));
+    memcpy(&second, input + i + sizeof(uint64_t), sizeof(uint64_t));
+
+    COUNT_BYTE(tables[0], first, 0);
+    COUNT_BYTE(tables[1], first, 8);
+    COUNT_BYTE(tables[2], first, 16);
+    COUNT_BYTE(tables[3], first, 24);
+    COUNT_BYTE(tables[4], first, 32);
+    COUNT_BYTE(tables[5], first, 40);
+    COUNT_BYTE(tables[6], first, 48);
+    COUNT_BYTE(tables[7], first, 56);
+    COUNT_BYTE(tables[0], second, 0);
+    COUNT_BYTE(tables[1], second, 8);
+    COUNT_BYTE(tables[2], second, 16);
+    COUNT_BYTE(tables[3], second, 24);
+    COUNT_BYTE(tables[4], second, 32);
+    COUNT_BYTE(tables[5], second, 40);
+    COUNT_BYTE(tables[6], second, 48);
+    COUNT_BYTE(tables[7], second, 56);
+  }
+
+  for (; i < length; i++) {
+    tables[0][input[i]]++;
+  }
+
+  for (j = 0; j < HUFFMAN_SYMBOLS; j++) {
+    for (k = 0; k < COUNT_TABLES; k++) {
+      frequency_table[j] += tables[k][j];
+    }
+  }
+}
+
 /* Removes and returns the head of the linked list. */
 HuffmanNode *pop_linked_list(HuffmanNode **head) {
 
@@ -121,6 +290,183 @@ HuffmanNode *insert_linked_list(HuffmanNode **head, int key, int frequency) {
   return to_insert;
 }
 
+/* Stores the code of every leaf below node into codes, indexed by key. A tree
+ * made of a single leaf gives it a code of length 0. */
+void store_huffman_codes(HuffmanCode codes[], HuffmanNode *node, uint64_t bits,
+                         int depth) {
+  if (node == NULL) {
+    return;
+  }
+
+  if (node->left == NULL && node->right == NULL) {
+    codes[node->key].bits = bits;
+    codes[node->key].length = depth;
+    return;
+  }
+
+  store_huffman_codes(codes, node->left, bits << 1, depth + 1);
+  store_huffman_codes(codes, node->right, (bits << 1) | 1, depth + 1);
+}
+
+/* Returns the length of the longest code */
+int max_code_length(HuffmanCode codes[]) {
+  int max_length = 0;
+  int i;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (codes[i].length > max_length) {
+      max_length = codes[i].length;
+    }
+  }
+
+  return max_length;
+}
+
+/* Replaces the bits of every code with its canonical code: codes are ordered
+ * by length, then by symbol, and each one is the previous one plus one
+ * (shifted left when the length grows). Only the lengths are read, which must
+ * be at most CANONICAL_MAX_LENGTH. */
+void assign_canonical_codes(HuffmanCode codes[]) {
+  int length_count[CANONICAL_MAX_LENGTH + 1] = {0};
+  uint64_t next_code[CANONICAL_MAX_LENGTH + 1];
+  uint64_t code = 0;
+  int length;
+  int i;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    length_count[codes[i].length]++;
+  }
+  length_count[0] = 0;
+
+  for (length = 1; length <= CANONICAL_MAX_LENGTH; length++) {
+    code = (code + length_count[length - 1]) << 1;
+    next_code[length] = code;
+  }
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    if (codes[i].length != 0) {
+      codes[i].bits = next_code[codes[i].length]++;
+    }
+  }
+}
+
+/* An item of a package-merge list: a leaf (a symbol) or a package of two
+ * items of the previous list */
+typedef struct {
+  uint64_t weight;
+  int package;
+} MergeItem;
+
+int compare_leaves(const void *a, const void *b) {
+  const MergeItem *first = (const MergeItem *)a;
+  const MergeItem *second = (const MergeItem *)b;
+
+  if (first->weight != second->weight) {
+    return first->weight < second->weight ? -1 : 1;
+  }
+  return first->package - second->package;
+}
+
+/* Sets the length of every code to the optimal length for frequency_table
+ * among the prefix codes no longer than max_length, with the package-merge
+ * algorithm. Returns -1 if the symbols do not fit in max_length bits, and
+ * HUFFMAN_ERROR_MEMORY if its lists can not be allocated. */
+int limit_code_lengths(HuffmanCode codes[], unsigned int frequency_table[],
+                       int max_length) {
+  MergeItem leaves[HUFFMAN_SYMBOLS];
+  MergeItem *lists;
+  int list_length[CANONICAL_MAX_LENGTH];
+  int num_leaves = 0;
+  int active;
+  int level;
+  int i;
+  int j;
+  int k;
+
+  for (i = 0; i < HUFFMAN_SYMBOLS; i++) {
+    codes[i].length = 0;
+    if (frequency_table[i] != 0) {
+      /* Leaves remember their symbol, sorting keeps ties in symbol order */
+      leaves[num_leaves].weight = frequency_table[i];
+      leaves[num_leaves].package = i;
+      num_leaves++;
+    }
+  }
+
+  if (num_leaves == 0) {
+    return 0;
+  }
+  if (num_leaves == 1) {
+    codes[leaves[0].package].length = 1;
+    return 0;
+  }
+  if (max_length < 1 || max_length > CANONICAL_MAX_LENGTH ||
+      num_leaves > 1 << max_length) {
+    return -1;
+  }
+
+  qsort(leaves, num_leaves, sizeof(MergeItem), compare_leaves);
+
+  lists = (MergeItem *)malloc(sizeof(MergeItem) * 2 * HUFFMAN_SYMBOLS *
+                              max_length);
+  if (lists == NULL) {
+    return HUFFMAN_ERROR_MEMORY;
+  }
+
+  /* The list of the deepest level holds the leaves, every other list merges
+   * the leaves with the pairs of the list below it. Packages are marked with
+   * -1 and go after leaves of the same weight. */
+  for (i = 0; i < num_leaves; i++) {
+    lists[i] = leaves[i];
+  }
+  list_length[0] = num_leaves;
+
+  for (level = 1; level < max_length; level++) {
+    MergeItem *below = lists + (level - 1) * 2 * HUFFMAN_SYMBOLS;
+    MergeItem *list = lists + level * 2 * HUFFMAN_SYMBOLS;
+    MergeItem package;
+
+    i = 0;
+    j = 0;
+    k = 0;
+    while (i < num_leaves || j + 1 < list_length[level - 1]) {
+      package.package = -1;
+      package.weight = j + 1 < list_length[level - 1]
+                           ? below[j].weight + below[j + 1].weight
+                           : 0;
+
+      if (j + 1 >= list_length[level - 1] ||
+          (i < num_leaves && leaves[i].weight <= package.weight)) {
+        list[k++] = leaves[i++];
+      } else {
+        list[k++] = package;
+        j += 2;
+      }
+    }
+    list_length[level] = k;
+  }
+
+  /* The 2n - 2 lightest items of the top list make the code. Each one adds a
+   * bit to its leaf, or to every leaf of the items it packages. */
+  active = 2 * num_leaves - 2;
+  for (level = max_length - 1; level >= 0 && active > 0; level--) {
+    MergeItem *list = lists + level * 2 * HUFFMAN_SYMBOLS;
+    int packages = 0;
+
+    for (i = 0; i < active; i++) {
+      if (list[i].package == -1) {
+        packages++;
+      } else {
+        codes[list[i].package].length++;
+      }
+    }
+    active = 2 * packages;
+  }
+
+  free(lists);
+  return 0;
+}
+
 /* Frees a HuffmanTree */
 void free_tree(HuffmanNode *node) {
   if (node == NULL) {
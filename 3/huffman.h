@@ -1,7 +1,20 @@
 #ifndef LINKED_LIST
 #define LINKED_LIST
 
+#include <stdint.h>
 #include <stdlib.h>
+
+#define HUFFMAN_SYMBOLS 256
+
+/* Separate tables used when counting bytes */
+#define COUNT_TABLES 8
+
+/* Longest code a canonical header (4 bits per length) can describe */
+#define CANONICAL_MAX_LENGTH 15
+
+/* Returned by limit_code_lengths when memory runs out */
+#define HUFFMAN_ERROR_MEMORY -2
+
 typedef struct HuffmanNode {
   int key;
   int frequency;
@@ -10,12 +23,36 @@ typedef struct HuffmanNode {
   struct HuffmanNode *right;
 } HuffmanNode;
 
+/* Room for the leaves and merged nodes of a tree of every symbol */
+#define HUFFMAN_MAX_NODES (2 * HUFFMAN_SYMBOLS - 1)
+
+typedef struct {
+  HuffmanNode nodes[HUFFMAN_MAX_NODES];
+} HuffmanTree;
+
+/* A code stored as its bits (right aligned, first bit most significant) and
+ * its length. A length of 0 means the symbol does not occur. */
+typedef struct {
+  uint64_t bits;
+  int length;
+} HuffmanCode;
+
 void insert_node(HuffmanNode *prev, HuffmanNode *to_insert,
                  HuffmanNode **current);
 HuffmanNode *insert_linked_list(HuffmanNode **head, int key, int frequency);
 HuffmanNode *pop_linked_list(HuffmanNode **head);
 void print_linked_list(HuffmanNode *head);
 void populate_linked_list(HuffmanNode **list, unsigned int *frequency_table);
+void count_frequencies(unsigned int frequency_table[], const uint8_t *input,
+                       size_t length);
 void populate_huffman_tree(HuffmanNode **tree, HuffmanNode **list);
+HuffmanNode *build_huffman_tree(HuffmanTree *tree,
+                                unsigned int frequency_table[]);
 void free_tree(HuffmanNode *node);
+void store_huffman_codes(HuffmanCode codes[], HuffmanNode *node, uint64_t bits,
+                         int depth);
+int max_code_length(HuffmanCode codes[]);
+void assign_canonical_codes(HuffmanCode codes[]);
+int limit_code_lengths(HuffmanCode codes[], unsigned int frequency_table[],
+                       int max_length);
 #endif
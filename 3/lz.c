@@ -0,0 +1,387 @@
+/*
+ * lz.c
+ * Finds the sequences of LZ (version 7) blocks and decodes their frames.
+ * The encoder keeps the window before the block in its buffer, and a hash
+ * chain through every position of the window: head gives the last position
+ * of each hash of LZ_MIN_MATCH bytes, and chain the position before each one
+ * with the same hash. The longest match at a position is searched along its
+ * chain, for as many links as the effort level allows, and from level 4 a
+ * short match is dropped for a literal when the next position has a longer
+ * one (lazy matching). The buffer slides down by a multiple of the window once
+ * full, so the chain of a position stays at the same index.
+ */
+#include "lz.h"
+#include "format.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ_HASH(bytes, hash_log)                                               \
+  (((uint32_t)(bytes)[0] | (uint32_t)(bytes)[1] << 8 |                         \
+    (uint32_t)(bytes)[2] << 16 | (uint32_t)(bytes)[3] << 24) *                 \
+       2654435761U >>                                                          \
+   (32 - (hash_log)))
+
+/* The chain links searched, the match length from which a quarter of them
+ * are, the length below which the next position is searched too (0 for
+ * never), and the length that ends a search, at every effort level (after
+ * the levels of zlib) */
+const struct {
+  int max_chain;
+  size_t good_length;
+  size_t lazy_length;
+  size_t nice_length;
+} lz_levels[LZ_MAX_LEVEL] = {
+    {4, 4, 0, 8},       {8, 4, 0, 16},      {32, 4, 0, 32},
+    {16, 4, 4, 16},     {32, 8, 16, 32},    {128, 8, 16, 128},
+    {256, 8, 32, 128},  {512, 32, 128, 258}, {1024, 32, 258, 258}};
+
+/* Returns the symbol of value and stores the number of its extra bits */
+int lz_symbol(uint32_t value, int *extra_bits) {
+  int bits = LZ_DIRECT_BITS;
+
+  if (value < LZ_DIRECT_VALUES) {
+    *extra_bits = 0;
+    return (int)value;
+  }
+
+  while (value >> (bits + 1) != 0) {
+    bits++;
+  }
+
+  *extra_bits = bits - 1;
+  return LZ_DIRECT_VALUES + (bits - LZ_DIRECT_BITS) * 2 +
+         (int)((value >> (bits - 1)) & 1);
+}
+
+void lz_encoder_init(LzEncoder *encoder, int window_log, int level) {
+  encoder->window_size = (size_t)1 << window_log;
+  encoder->capacity = 2 * encoder->window_size + LZ_BLOCK_SIZE;
+  encoder->hash_log =
+      window_log < LZ_MAX_HASH_LOG ? window_log : LZ_MAX_HASH_LOG;
+  encoder->buffer = (uint8_t *)malloc(encoder->capacity);
+  encoder->head =
+      (uint32_t *)calloc((size_t)1 << encoder->hash_log, sizeof(uint32_t));
+  encoder->chain = (uint32_t *)calloc(encoder->window_size, sizeof(uint32_t));
+  if (encoder->buffer == NULL || encoder->head == NULL ||
+      encoder->chain == NULL) {
+    perror("failed malloc when starting LZ encoder");
+    exit(EXIT_FAILURE);
+  }
+
+  encoder->end = 0;
+  encoder->inserted = 0;
+  encoder->max_chain = lz_levels[level - 1].max_chain;
+  encoder->good_length = lz_levels[level - 1].good_length;
+  encoder->lazy_length = lz_levels[level - 1].lazy_length;
+  encoder->nice_length = lz_levels[level - 1].nice_length;
+}
+
+void lz_encoder_free(LzEncoder *encoder) {
+  free(encoder->buffer);
+  free(encoder->head);
+  free(encoder->chain);
+}
+
+/* Returns where the next block of at most LZ_BLOCK_SIZE bytes goes, after
+ * sliding the buffer down if it has no room left for it */
+uint8_t *lz_next_block(LzEncoder *encoder) {
+  size_t slide;
+  size_t i;
+
+  if (encoder->end + LZ_BLOCK_SIZE > encoder->capacity) {
+    slide = (encoder->end - encoder->window_size) / encoder->window_size *
+            encoder->window_size;
+    memmove(encoder->buffer, encoder->buffer + slide, encoder->end - slide);
+    encoder->end -= slide;
+    encoder->inserted -= slide;
+
+    for (i = 0; i < (size_t)1 << encoder->hash_log; i++) {
+      encoder->head[i] =
+          encoder->head[i] > slide ? encoder->head[i] - slide : 0;
+    }
+    for (i = 0; i < encoder->window_size; i++) {
+      encoder->chain[i] =
+          encoder->chain[i] > slide ? encoder->chain[i] - slide : 0;
+    }
+  }
+
+  return encoder->buffer + encoder->end;
+}
+
+/* Adds every position before until to the hash chains */
+void lz_insert(LzEncoder *encoder, size_t until) {
+  uint32_t hash;
+
+  for (; encoder->inserted < until; encoder->inserted++) {
+    hash = LZ_HASH(encoder->buffer + encoder->inserted, encoder->hash_log);
+    encoder->chain[encoder->inserted & (encoder->window_size - 1)] =
+        encoder->head[hash];
+    encoder->head[hash] = (uint32_t)encoder->inserted + 1;
+  }
+}
+
+/* Returns the length of the longest match of the bytes from position up to
+ * end (at least LZ_MIN_MATCH of them) longer than shorter, or 0 if there is
+ * none, and stores its distance */
+size_t lz_longest_match(const LzEncoder *encoder, size_t position, size_t end,
+                        size_t shorter, uint32_t *distance) {
+  const uint8_t *current = encoder->buffer + position;
+  const uint8_t *match;
+  size_t limit = end - position;
+  size_t best = shorter < LZ_MIN_MATCH ? LZ_MIN_MATCH - 1 : shorter;
+  size_t length;
+  uint32_t candidate = encoder->head[LZ_HASH(current, encoder->hash_log)];
+  int links = shorter >= encoder->good_length ? encoder->max_chain / 4
+                                              : encoder->max_chain;
+
+  if (best >= limit) {
+    return 0;
+  }
+
+  while (candidate != 0 && position - (candidate - 1) < encoder->window_size &&
+         links-- > 0) {
+    match = encoder->buffer + candidate - 1;
+
+    /* The byte that would make the match longer is the likeliest to differ */
+    if (match[best] == current[best] &&
+        memcmp(match, current, LZ_MIN_MATCH) == 0) {
+      for (length = LZ_MIN_MATCH;
+           length < limit && match[length] == current[length]; length++) {
+      }
+
+      if (length > best) {
+        best = length;
+        *distance = (uint32_t)(position - (candidate - 1));
+        if (length >= encoder->nice_length || length == limit) {
+          break;
+        }
+      }
+    }
+
+    candidate = encoder->chain[(candidate - 1) & (encoder->window_size - 1)];
+  }
+
+  return best > shorter && best >= LZ_MIN_MATCH ? best : 0;
+}
+
+/* Splits the length bytes written at lz_next_block into sequences. Matches
+ * stay within the block, so it decodes on its own given the window before
+ * it. Returns the number of sequences. */
+size_t lz_find_sequences(LzEncoder *encoder, size_t length,
+                         LzSequence sequences[]) {
+  size_t position = encoder->end;
+  size_t anchor = position;
+  size_t end = encoder->end + length;
+  size_t num_sequences = 0;
+  size_t match_length;
+  size_t next_length;
+  uint32_t distance = 0;
+  uint32_t next_distance = 0;
+
+  while (position + LZ_MIN_MATCH <= end) {
+    lz_insert(encoder, position);
+    match_length = lz_longest_match(encoder, position, end, 0, &distance);
+    if (match_length == 0) {
+      position++;
+      continue;
+    }
+
+    while (match_length < encoder->lazy_length &&
+           position + 1 + LZ_MIN_MATCH <= end) {
+      lz_insert(encoder, position + 1);
+      next_length = lz_longest_match(encoder, position + 1, end, match_length,
+                                     &next_distance);
+      if (next_length == 0) {
+        break;
+      }
+
+      position++;
+      match_length = next_length;
+      distance = next_distance;
+    }
+
+    sequences[num_sequences].literals = (uint32_t)(position - anchor);
+    sequences[num_sequences].match_length = (uint32_t)match_length;
+    sequences[num_sequences].distance = distance;
+    num_sequences++;
+
+    position += match_length;
+    anchor = position;
+  }
+
+  if (anchor < end) {
+    sequences[num_sequences].literals = (uint32_t)(end - anchor);
+    sequences[num_sequences].match_length = 0;
+    sequences[num_sequences].distance = 0;
+    num_sequences++;
+  }
+
+  encoder->end = end;
+  return num_sequences;
+}
+
+/* Returns -1 if window_log is out of range */
+int lz_decoder_init(LzDecoder *decoder, int window_log) {
+  int i;
+
+  if (window_log < LZ_MIN_WINDOW_LOG || window_log > LZ_MAX_WINDOW_LOG) {
+    return -1;
+  }
+
+  decoder->window_size = (size_t)1 << window_log;
+  decoder->capacity = 2 * decoder->window_size + LZ_BLOCK_SIZE;
+  decoder->buffer = (uint8_t *)malloc(decoder->capacity);
+  if (decoder->buffer == NULL) {
+    perror("failed malloc when starting LZ decoder");
+    exit(EXIT_FAILURE);
+  }
+
+  decoder->end = 0;
+  for (i = 0; i < LZ_TABLES; i++) {
+    decoder->tables[i].entries = NULL;
+  }
+  return 0;
+}
+
+void lz_decoder_free(LzDecoder *decoder) {
+  int i;
+
+  for (i = 0; i < LZ_TABLES; i++) {
+    decode_table_free(&decoder->tables[i]);
+  }
+  free(decoder->buffer);
+}
+
+/* Decodes the next value coded with table into *value. Returns -1 for an
+ * invalid symbol. */
+int lz_read_value(BitReader *br, const DecodeTable *table, uint32_t *value) {
+  uint8_t symbol;
+  int bits;
+
+  if (bitreader_decode(br, table, &symbol, 1) == -1) {
+    return -1;
+  }
+
+  if (symbol < LZ_DIRECT_VALUES) {
+    *value = symbol;
+    return 0;
+  }
+
+  bits = (symbol - LZ_DIRECT_VALUES) / 2 + LZ_DIRECT_BITS;
+  if (bits >= LZ_MAX_VALUE_BITS) {
+    return -1;
+  }
+
+  *value = (uint32_t)1 << bits |
+           (uint32_t)((symbol - LZ_DIRECT_VALUES) & 1) << (bits - 1) |
+           bitreader_read_bits(br, bits - 1);
+  return 0;
+}
+
+/* Decodes a frame (its code lengths and payload, frame_size bytes) into the
+ * length bytes of its block. Returns them, or NULL if the frame is invalid.
+ * They stay valid until the next frame. */
+const uint8_t *lz_decode_frame(LzDecoder *decoder, const uint8_t *frame,
+                               size_t frame_size, size_t length) {
+  HuffmanCode codes[HUFFMAN_SYMBOLS];
+  BitReader *br = &decoder->reader;
+  uint8_t *out;
+  size_t offset = 0;
+  size_t produced = 0;
+  size_t keep;
+  uint32_t literals;
+  uint32_t match_length;
+  uint32_t distance;
+  int lengths_size;
+  int status;
+  uint32_t i;
+  int j;
+
+  if (length > LZ_BLOCK_SIZE || frame_size < CODE_LENGTHS_FIXED) {
+    return NULL;
+  }
+
+  /* Keep the window before the block */
+  if (decoder->end + length > decoder->capacity) {
+    keep = decoder->window_size;
+    memmove(decoder->buffer, decoder->buffer + decoder->end - keep, keep);
+    decoder->end = keep;
+  }
+  out = decoder->buffer + decoder->end;
+
+  if (stored_lengths(frame)) {
+    if (frame_size != CODE_LENGTHS_FIXED + length) {
+      return NULL;
+    }
+
+    memcpy(out, frame + CODE_LENGTHS_FIXED, length);
+    decoder->end += length;
+    return out;
+  }
+
+  for (j = 0; j < LZ_TABLES; j++) {
+    decode_table_free(&decoder->tables[j]);
+    lengths_size =
+        unpack_code_lengths(frame + offset, frame_size - offset, codes);
+    if (lengths_size == -1) {
+      return NULL;
+    }
+
+    status = decode_table_build(&decoder->tables[j], codes);
+    if (status == DECODE_ERROR_MEMORY) {
+      perror("failed malloc when building LZ tables");
+      exit(EXIT_FAILURE);
+    }
+    if (status != 0) {
+      return NULL;
+    }
+    offset += lengths_size;
+  }
+
+  bitreader_init_buffer(br, frame + offset, frame_size - offset);
+
+  while (produced < length) {
+    if (lz_read_value(br, &decoder->tables[LZ_LENGTHS], &literals) == -1 ||
+        literals > length - produced ||
+        bitreader_decode(br, &decoder->tables[LZ_LITERALS], out + produced,
+                         literals) == -1) {
+      return NULL;
+    }
+
+    produced += literals;
+    if (produced == length) {
+      break;
+    }
+
+    if (lz_read_value(br, &decoder->tables[LZ_LENGTHS], &match_length) ==
+            -1 ||
+        lz_read_value(br, &decoder->tables[LZ_DISTANCES], &distance) == -1) {
+      return NULL;
+    }
+
+    match_length += LZ_MIN_MATCH;
+    if (match_length > length - produced || distance == 0 ||
+        distance >= decoder->window_size ||
+        distance > decoder->end + produced) {
+      return NULL;
+    }
+
+    /* Overlapping matches repeat the bytes they copy */
+    if (distance >= match_length) {
+      memcpy(out + produced, out + produced - distance, match_length);
+    } else {
+      for (i = 0; i < match_length; i++) {
+        out[produced + i] = out[produced + i - distance];
+      }
+    }
+    produced += match_length;
+  }
+
+  if (br->bit_count < 0) {
+    return NULL;
+  }
+
+  decoder->end += length;
+  return out;
+}
@@ -0,0 +1,93 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+ * lz.h
+ * The LZ77 stage of LZ (version 7) files. The encoder splits every block of
+ * input into sequences, each a run of literal bytes followed by a match: a
+ * copy of earlier bytes, at most a window before, found through hash chains.
+ * The decoder rebuilds the blocks from frames whose literals, lengths and
+ * distances are coded with three tables (see format.h).
+ */
+
+#include "bitreader.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes of input per frame */
+#define LZ_BLOCK_SIZE (1 << 18)
+#define LZ_MIN_MATCH 4
+
+#define LZ_MIN_WINDOW_LOG 10
+#define LZ_MAX_WINDOW_LOG 24
+#define LZ_DEFAULT_WINDOW_LOG 20
+#define LZ_MIN_LEVEL 1
+#define LZ_MAX_LEVEL 9
+#define LZ_DEFAULT_LEVEL 6
+
+/* The tables of a frame, in the order of their code lengths */
+#define LZ_LITERALS 0
+#define LZ_LENGTHS 1
+#define LZ_DISTANCES 2
+#define LZ_TABLES 3
+
+/* Values below LZ_DIRECT_VALUES are their own symbol. Larger values of b + 1
+ * bits are coded as one of two symbols for b, chosen by the bit after the
+ * top one, followed by their b - 1 low bits. */
+#define LZ_DIRECT_VALUES 16
+#define LZ_DIRECT_BITS 4
+#define LZ_MAX_VALUE_BITS 31
+
+/* Bits of the hash of a position, at most the window log */
+#define LZ_MAX_HASH_LOG 20
+
+/* Most sequences in a block: every one but the last holds a match */
+#define LZ_MAX_SEQUENCES (LZ_BLOCK_SIZE / LZ_MIN_MATCH + 1)
+
+/* A run of literals followed by a match, of length 0 at the end of a block */
+typedef struct {
+  uint32_t literals;
+  uint32_t match_length;
+  uint32_t distance;
+} LzSequence;
+
+/* The buffer holds the window before the block being coded, and head and
+ * chain the last position (plus one, 0 for none) of every hash and the one
+ * before every position with the same hash. */
+typedef struct {
+  uint8_t *buffer;
+  size_t capacity;
+  size_t end;
+  size_t inserted;
+  size_t window_size;
+  int hash_log;
+  uint32_t *head;
+  uint32_t *chain;
+  int max_chain;
+  size_t good_length;
+  size_t lazy_length;
+  size_t nice_length;
+} LzEncoder;
+
+/* The buffer holds the window before the block being decoded */
+typedef struct {
+  uint8_t *buffer;
+  size_t capacity;
+  size_t end;
+  size_t window_size;
+  DecodeTable tables[LZ_TABLES];
+  BitReader reader;
+} LzDecoder;
+
+int lz_symbol(uint32_t value, int *extra_bits);
+void lz_encoder_init(LzEncoder *encoder, int window_log, int level);
+void lz_encoder_free(LzEncoder *encoder);
+uint8_t *lz_next_block(LzEncoder *encoder);
+size_t lz_find_sequences(LzEncoder *encoder, size_t length,
+                         LzSequence sequences[]);
+int lz_decoder_init(LzDecoder *decoder, int window_log);
+void lz_decoder_free(LzDecoder *decoder);
+const uint8_t *lz_decode_frame(LzDecoder *decoder, const uint8_t *frame,
+                               size_t frame_size, size_t length);
+#endif
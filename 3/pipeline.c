@@ -0,0 +1,319 @@
+/*
+ * pipeline.c
+ * The reader and writer threads of pipelined input and output. A ring counts
+ * the buffers handed to its consumer (filled) and back to its producer
+ * (emptied). While the ring is not full the buffer at filled belongs to the
+ * producer, and while it is not empty the buffer at emptied belongs to the
+ * consumer, so the buffers themselves are used without holding the lock.
+ */
+#include "pipeline.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t thread;
+  bool running;
+  int fd;
+  uint8_t *buffers[PIPELINE_BUFFERS];
+  size_t lengths[PIPELINE_BUFFERS];
+  size_t filled;
+  size_t emptied;
+  size_t position; /* bytes taken from, or put into, the caller's buffer */
+  bool finished;   /* no buffer will be filled after the last one */
+  bool stopping;   /* the reader stops before the end of the input */
+  int error;       /* errno of a failed read or write, 0 if none */
+} Ring;
+
+Ring pipeline_input;
+Ring pipeline_output;
+
+/* Reads the input into every buffer the ring gives back, until the end of
+ * the input (arg is the Ring) */
+void *read_ahead(void *arg) {
+  Ring *ring = (Ring *)arg;
+  uint8_t *buffer;
+  ssize_t bytes_read;
+
+  pthread_mutex_lock(&ring->lock);
+  while (!ring->stopping) {
+    if (ring->filled - ring->emptied == PIPELINE_BUFFERS) {
+      pthread_cond_wait(&ring->changed, &ring->lock);
+      continue;
+    }
+
+    buffer = ring->buffers[ring->filled % PIPELINE_BUFFERS];
+    pthread_mutex_unlock(&ring->lock);
+
+    /* A single read, so a pipe hands over what it has as it comes */
+    bytes_read = read(ring->fd, buffer, PIPELINE_BUFFER_SIZE);
+
+    pthread_mutex_lock(&ring->lock);
+    if (bytes_read <= 0) {
+      ring->error = bytes_read == -1 ? errno : 0;
+      break;
+    }
+    ring->lengths[ring->filled % PIPELINE_BUFFERS] = (size_t)bytes_read;
+    ring->filled++;
+    pthread_cond_broadcast(&ring->changed);
+  }
+
+  ring->finished = true;
+  pthread_cond_broadcast(&ring->changed);
+  pthread_mutex_unlock(&ring->lock);
+  return NULL;
+}
+
+/* Writes every buffer handed over to the output, until the ring is finished
+ * and empty or a write fails (arg is the Ring) */
+void *write_behind(void *arg) {
+  Ring *ring = (Ring *)arg;
+  const uint8_t *buffer;
+  size_t length;
+  ssize_t written = 0;
+
+  pthread_mutex_lock(&ring->lock);
+  for (;;) {
+    if (ring->filled == ring->emptied) {
+      if (ring->finished) {
+        break;
+      }
+      pthread_cond_wait(&ring->changed, &ring->lock);
+      continue;
+    }
+
+    buffer = ring->buffers[ring->emptied % PIPELINE_BUFFERS];
+    length = ring->lengths[ring->emptied % PIPELINE_BUFFERS];
+    pthread_mutex_unlock(&ring->lock);
+
+    while (length > 0 && (written = write(ring->fd, buffer, length)) > 0) {
+      buffer += written;
+      length -= written;
+    }
+
+    pthread_mutex_lock(&ring->lock);
+    if (length > 0) {
+      ring->error = written == -1 ? errno : EIO;
+      break;
+    }
+    ring->emptied++;
+    pthread_cond_broadcast(&ring->changed);
+  }
+
+  pthread_cond_broadcast(&ring->changed);
+  pthread_mutex_unlock(&ring->lock);
+  return NULL;
+}
+
+/* Allocates the buffers of ring and starts its thread on fd */
+void ring_start(Ring *ring, int fd, void *(*run)(void *)) {
+  int i;
+
+  memset(ring, 0, sizeof(Ring));
+  for (i = 0; i < PIPELINE_BUFFERS; i++) {
+    if ((ring->buffers[i] = (uint8_t *)malloc(PIPELINE_BUFFER_SIZE)) == NULL) {
+      perror("failed malloc when starting pipeline");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  pthread_mutex_init(&ring->lock, NULL);
+  pthread_cond_init(&ring->changed, NULL);
+  ring->fd = fd;
+  ring->running = true;
+  if (pthread_create(&ring->thread, NULL, run, ring) != 0) {
+    perror("failed to create thread");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Finishes the ring, waits for its thread and frees its buffers. A reader
+ * stops after the read it is in. */
+void ring_stop(Ring *ring) {
+  int i;
+
+  pthread_mutex_lock(&ring->lock);
+  ring->stopping = true;
+  ring->finished = true;
+  pthread_cond_broadcast(&ring->changed);
+  pthread_mutex_unlock(&ring->lock);
+  pthread_join(ring->thread, NULL);
+
+  pthread_mutex_destroy(&ring->lock);
+  pthread_cond_destroy(&ring->changed);
+  for (i = 0; i < PIPELINE_BUFFERS; i++) {
+    free(ring->buffers[i]);
+  }
+  ring->running = false;
+}
+
+/* Waits for the buffer at filled to be given back to the producer. Returns
+ * -1, with errno set, if the writer failed. */
+int ring_wait_for_space(Ring *ring) {
+  int error;
+
+  pthread_mutex_lock(&ring->lock);
+  while (ring->filled - ring->emptied == PIPELINE_BUFFERS &&
+         ring->error == 0) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+  }
+  error = ring->error;
+  pthread_mutex_unlock(&ring->lock);
+
+  if (error != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+/* Hands the bytes put into the buffer at filled over to the writer */
+void ring_hand_over(Ring *ring) {
+  pthread_mutex_lock(&ring->lock);
+  ring->lengths[ring->filled % PIPELINE_BUFFERS] = ring->position;
+  ring->filled++;
+  ring->position = 0;
+  pthread_cond_broadcast(&ring->changed);
+  pthread_mutex_unlock(&ring->lock);
+}
+
+/* Reads fd ahead, from where it is, on a thread of its own */
+void pipeline_start_reader(int fd) {
+  ring_start(&pipeline_input, fd, read_ahead);
+}
+
+/* Writes to fd behind the caller, on a thread of its own */
+void pipeline_start_writer(int fd) {
+  ring_start(&pipeline_output, fd, write_behind);
+}
+
+/* Returns whether fd is read or written by a thread */
+bool pipeline_active(int fd) {
+  return (pipeline_input.running && pipeline_input.fd == fd) ||
+         (pipeline_output.running && pipeline_output.fd == fd);
+}
+
+/* Reads up to count bytes like read, from the buffers read ahead if fd has a
+ * reader */
+ssize_t pipeline_read(int fd, void *buffer, size_t count) {
+  Ring *ring = &pipeline_input;
+  size_t slot;
+  size_t length;
+  int error;
+
+  if (!ring->running || ring->fd != fd) {
+    return read(fd, buffer, count);
+  }
+
+  pthread_mutex_lock(&ring->lock);
+  while (ring->filled == ring->emptied && !ring->finished) {
+    pthread_cond_wait(&ring->changed, &ring->lock);
+  }
+  error = ring->error;
+  if (ring->filled == ring->emptied) {
+    pthread_mutex_unlock(&ring->lock);
+    errno = error;
+    return error != 0 ? -1 : 0;
+  }
+  pthread_mutex_unlock(&ring->lock);
+
+  slot = ring->emptied % PIPELINE_BUFFERS;
+  length = ring->lengths[slot] - ring->position;
+  length = length < count ? length : count;
+  memcpy(buffer, ring->buffers[slot] + ring->position, length);
+  ring->position += length;
+
+  if (ring->position == ring->lengths[slot]) {
+    pthread_mutex_lock(&ring->lock);
+    ring->emptied++;
+    ring->position = 0;
+    pthread_cond_broadcast(&ring->changed);
+    pthread_mutex_unlock(&ring->lock);
+  }
+
+  return (ssize_t)length;
+}
+
+/* Writes count bytes like write, into the buffers written behind if fd has
+ * a writer. Returns -1 if an earlier write failed. */
+ssize_t pipeline_write(int fd, const void *buffer, size_t count) {
+  Ring *ring = &pipeline_output;
+  const uint8_t *bytes = (const uint8_t *)buffer;
+  size_t remaining = count;
+  size_t length;
+
+  if (!ring->running || ring->fd != fd) {
+    return write(fd, buffer, count);
+  }
+
+  while (remaining > 0) {
+    if (ring->position == 0 && ring_wait_for_space(ring) == -1) {
+      return -1;
+    }
+
+    length = PIPELINE_BUFFER_SIZE - ring->position;
+    length = length < remaining ? length : remaining;
+    memcpy(ring->buffers[ring->filled % PIPELINE_BUFFERS] + ring->position,
+           bytes, length);
+    ring->position += length;
+    bytes += length;
+    remaining -= length;
+
+    if (ring->position == PIPELINE_BUFFER_SIZE) {
+      ring_hand_over(ring);
+    }
+  }
+
+  return (ssize_t)count;
+}
+
+/* Moves fd back to its start, reading it ahead again from there if it has a
+ * reader. Returns -1 on failure. */
+int pipeline_rewind(int fd) {
+  bool reading = pipeline_input.running && pipeline_input.fd == fd;
+
+  if (reading) {
+    ring_stop(&pipeline_input);
+  }
+
+  if (lseek(fd, 0, SEEK_SET) == -1) {
+    return -1;
+  }
+
+  if (reading) {
+    pipeline_start_reader(fd);
+  }
+  return 0;
+}
+
+/* Stops the reader, and waits for the writer to write everything handed to
+ * it. Returns -1, with errno set, if a write failed. */
+int pipeline_finish(void) {
+  Ring *ring = &pipeline_output;
+  int error;
+
+  if (pipeline_input.running) {
+    ring_stop(&pipeline_input);
+  }
+
+  if (!ring->running) {
+    return 0;
+  }
+
+  if (ring->position > 0 && ring_wait_for_space(ring) == 0) {
+    ring_hand_over(ring);
+  }
+
+  ring_stop(ring);
+  if ((error = ring->error) != 0) {
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
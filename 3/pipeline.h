@@ -0,0 +1,29 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+/*
+ * pipeline.h
+ * Moves the reads of the input and the writes of the output onto threads of
+ * their own, so they overlap the coding in between: a reader thread reads
+ * ahead into a ring of PIPELINE_BUFFERS buffers, and a writer thread drains
+ * a second ring behind the coder. Every ring has a single producer and a
+ * single consumer, which only meet to hand over a whole buffer.
+ * pipeline_read and pipeline_write stand in for read and write, going
+ * straight to the system for descriptors without a thread.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define PIPELINE_BUFFER_SIZE (1 << 20)
+#define PIPELINE_BUFFERS 4
+
+void pipeline_start_reader(int fd);
+void pipeline_start_writer(int fd);
+bool pipeline_active(int fd);
+ssize_t pipeline_read(int fd, void *buffer, size_t count);
+ssize_t pipeline_write(int fd, const void *buffer, size_t count);
+int pipeline_rewind(int fd);
+int pipeline_finish(void);
+#endif
@@ -0,0 +1,19 @@
+/*
+ * preset.c
+ * Looks up the preset tables generated into preset_tables.c.
+ */
+#include "preset.h"
+#include <string.h>
+
+/* Returns the id of the preset called name, or -1 if there is none */
+int find_preset(const char *name) {
+  int i;
+
+  for (i = 0; i < num_presets; i++) {
+    if (strcmp(presets[i].name, name) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
@@ -0,0 +1,34 @@
+#ifndef PRESET_H
+#define PRESET_H
+
+/*
+ * preset.h
+ * Preset tables: codes built into the binaries for small inputs of a known
+ * kind, whose own code lengths (and the pass counting their bytes) would cost
+ * more than their codes save. Every preset is built by hpreset from a sample
+ * of its kind (presets/name.txt) into the static tables of preset_tables.c,
+ * generated when the binaries are built. Every byte has a code, so any input
+ * can be coded with any preset. A preset (version 8) file names its preset
+ * by id, the position of the preset in PRESETS of the Makefile, so presets
+ * are only ever added at the end. As a sample that changes changes its
+ * table, the file also holds the check of the code lengths it was coded
+ * with, and hdecode refuses a file whose check is not that of its preset.
+ */
+
+#include "huff.h"
+
+/* Ids take one byte */
+#define PRESET_MAX 256
+
+/* check is the FNV-1a hash of the code length of every byte, in order */
+typedef struct {
+  const char *name;
+  uint32_t check;
+  HuffTable table;
+} Preset;
+
+extern const Preset presets[];
+extern const int num_presets;
+
+int find_preset(const char *name);
+#endif